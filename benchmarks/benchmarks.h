@@ -0,0 +1,79 @@
+#include "nanomodbus.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNUSED_PARAM(x) ((x) = (x))
+
+
+uint64_t now_us(void) {
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) (ts.tv_sec) * 1000000 + (uint64_t) (ts.tv_nsec) / 1000;
+}
+
+
+// Platform functions operating on the file descriptor pointed by arg
+int32_t read_fd(uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    int fd = *(int*) arg;
+    uint16_t total = 0;
+    while (total != count) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+
+        struct timeval* tv_p = NULL;
+        struct timeval tv;
+        if (timeout_ms >= 0) {
+            tv_p = &tv;
+            tv.tv_sec = timeout_ms / 1000;
+            tv.tv_usec = (timeout_ms % 1000) * 1000;
+        }
+
+        int ret = select(fd + 1, &rfds, NULL, NULL, tv_p);
+        if (ret == 0)
+            return total;
+
+        if (ret != 1)
+            return -1;
+
+        ssize_t r = read(fd, buf + total, count - total);
+        if (r <= 0)
+            return -1;
+
+        total += r;
+    }
+
+    return total;
+}
+
+
+int32_t write_fd(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    UNUSED_PARAM(timeout_ms);
+    int fd = *(int*) arg;
+    uint16_t total = 0;
+    while (total != count) {
+        ssize_t w = write(fd, buf + total, count - total);
+        if (w <= 0)
+            return -1;
+
+        total += w;
+    }
+
+    return total;
+}
+
+
+void platform_conf_fd(nmbs_platform_conf* conf, nmbs_transport transport, int* fd) {
+    nmbs_platform_conf_create(conf);
+    conf->transport = transport;
+    conf->read = read_fd;
+    conf->write = write_fd;
+    conf->arg = fd;
+}
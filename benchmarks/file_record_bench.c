@@ -0,0 +1,166 @@
+/*
+ * Recipe download benchmark: a Modbus RTU master writes a 16 KB recipe, made of many small records scattered over a
+ * few files, to a server with FC 21 Write File Record requests.
+ *
+ * It compares one request per record with nmbs_write_file_record() and batched requests with
+ * nmbs_write_file_records(). The frames are exchanged on a socketpair, and their duration on a simulated serial link is
+ * computed from their size: 11 bits per character, plus a 3.5 characters silent interval after each frame, plus the
+ * turnaround time of the server for each request.
+ *
+ * Usage: file_record_bench [record registers] [baud rate] [turnaround ms]
+ */
+
+#include "benchmarks.h"
+
+#define RECIPE_REGISTERS 8192
+#define FILES_COUNT 4
+#define BITS_PER_CHAR 11
+
+typedef enum mode {
+    MODE_SINGLE,
+    MODE_BATCHED,
+} mode;
+
+const char* mode_names[] = {"single", "batched"};
+
+volatile bool stopped = false;
+int fds[2] = {-1, -1};
+uint16_t files[FILES_COUNT][RECIPE_REGISTERS / FILES_COUNT];
+uint64_t frames = 0;
+uint64_t chars = 0;
+
+
+int32_t write_link(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    int32_t ret = write_fd(buf, count, timeout_ms, arg);
+    if (ret > 0) {
+        __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&chars, (uint64_t) ret, __ATOMIC_RELAXED);
+    }
+
+    return ret;
+}
+
+
+nmbs_error write_file_record(uint16_t file_number, uint16_t record_number, const uint16_t* registers, uint16_t count,
+                             uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (file_number < 1 || file_number > FILES_COUNT || record_number + count > RECIPE_REGISTERS / FILES_COUNT)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    memcpy(&files[file_number - 1][record_number], registers, count * 2);
+    return NMBS_ERROR_NONE;
+}
+
+
+void* server_thread(void* arg) {
+    nmbs_t* server = arg;
+    while (!stopped)
+        nmbs_server_poll(server);
+
+    return NULL;
+}
+
+
+void run(mode m, uint16_t record_registers, uint32_t baud, double turnaround_ms) {
+    static uint16_t recipe[RECIPE_REGISTERS];
+    static nmbs_file_record records[RECIPE_REGISTERS];
+    nmbs_t server;
+    nmbs_t client;
+    pthread_t server_th;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // Consecutive records go to different files, so that no two of them are contiguous
+    uint16_t records_count = 0;
+    for (uint32_t i = 0; i < RECIPE_REGISTERS; i += record_registers) {
+        nmbs_file_record* record = &records[records_count];
+        record->file_number = (uint16_t) (1 + records_count % FILES_COUNT);
+        record->record_number = (uint16_t) (records_count / FILES_COUNT * record_registers);
+        record->registers = &recipe[i];
+        record->count = (uint16_t) (RECIPE_REGISTERS - i < record_registers ? RECIPE_REGISTERS - i : record_registers);
+        records_count++;
+    }
+
+    for (uint32_t i = 0; i < RECIPE_REGISTERS; i++)
+        recipe[i] = (uint16_t) (i * 2654435761u >> 16);
+
+    memset(files, 0, sizeof(files));
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.write_file_record = write_file_record;
+
+    nmbs_platform_conf conf;
+    platform_conf_fd(&conf, NMBS_TRANSPORT_RTU, &fds[0]);
+    conf.write = write_link;
+    nmbs_server_create(&server, 1, &conf, &callbacks);
+    nmbs_set_read_timeout(&server, 100);
+    nmbs_set_byte_timeout(&server, 100);
+
+    platform_conf_fd(&conf, NMBS_TRANSPORT_RTU, &fds[1]);
+    conf.write = write_link;
+    nmbs_client_create(&client, &conf);
+    nmbs_set_destination_rtu_address(&client, 1);
+    nmbs_set_read_timeout(&client, 1000);
+    nmbs_set_byte_timeout(&client, 100);
+
+    stopped = false;
+    frames = 0;
+    chars = 0;
+    pthread_create(&server_th, NULL, server_thread, &server);
+
+    nmbs_error err = NMBS_ERROR_NONE;
+    if (m == MODE_SINGLE) {
+        for (uint16_t i = 0; i < records_count && err == NMBS_ERROR_NONE; i++)
+            err = nmbs_write_file_record(&client, records[i].file_number, records[i].record_number,
+                                         records[i].registers, records[i].count);
+    }
+    else {
+        err = nmbs_write_file_records(&client, records, records_count);
+    }
+
+    stopped = true;
+    pthread_join(server_th, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (err != NMBS_ERROR_NONE) {
+        fprintf(stderr, "%s download failed: %s\n", mode_names[m], nmbs_strerror(err));
+        exit(1);
+    }
+
+    for (uint16_t i = 0; i < records_count; i++) {
+        if (memcmp(&files[records[i].file_number - 1][records[i].record_number], records[i].registers,
+                   records[i].count * 2) != 0) {
+            fprintf(stderr, "%s download corrupted record %d\n", mode_names[m], i);
+            exit(1);
+        }
+    }
+
+    double seconds = (double) (chars * 2 + frames * 7) * BITS_PER_CHAR / 2 / baud;
+    seconds += (double) (frames / 2) * turnaround_ms / 1000;
+    printf("%-8s records %4d\trequests %4llu\tbytes %6llu\tdownload time %7.2f s\n", mode_names[m], records_count,
+           (unsigned long long) frames / 2, (unsigned long long) chars, seconds);
+}
+
+
+int main(int argc, char* argv[]) {
+    int record_registers = argc > 1 ? atoi(argv[1]) : 8;
+    long baud = argc > 2 ? atol(argv[2]) : 19200;
+    double turnaround_ms = argc > 3 ? atof(argv[3]) : 5;
+
+    if (record_registers < 1 || record_registers > 122 || baud < 1 || turnaround_ms < 0) {
+        fprintf(stderr, "Usage: file_record_bench [record registers (1-122)] [baud rate] [turnaround ms]\n");
+        return 1;
+    }
+
+    for (int m = MODE_SINGLE; m <= MODE_BATCHED; m++)
+        run((mode) m, (uint16_t) record_registers, (uint32_t) baud, turnaround_ms);
+
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Prints the memory footprint of a nmbs_t instance in the build configuration this file is compiled with.
+ * The footprint target in CMakeLists.txt builds and runs it for each configuration.
+ *
+ * Usage: footprint [instances]
+ */
+
+#include "nanomodbus.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+int main(int argc, char* argv[]) {
+    long instances = argc > 1 ? atol(argv[1]) : 20000;
+
+    const char* config = "default";
+#if defined(NMBS_COMPACT) && defined(NMBS_CLIENT_DISABLED)
+    config = "compact, client disabled";
+#elif defined(NMBS_COMPACT)
+    config = "compact";
+#elif defined(NMBS_SERVER_DISABLED)
+    config = "server disabled";
+#elif defined(NMBS_CLIENT_DISABLED)
+    config = "client disabled";
+#elif defined(NMBS_PIPELINING_DISABLED) && defined(NMBS_SERVER_DEFERRED_DISABLED) &&                                  \
+        defined(NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED) && defined(NMBS_SERVER_DATA_STORES_DISABLED)
+    config = "pipelining, deferred responses, adaptive timeouts and data stores disabled";
+#endif
+
+    size_t instance_size = sizeof(nmbs_t);
+    size_t shared_size = 0;
+    const char* buffer = "embedded";
+#ifdef NMBS_COMPACT
+    // Message buffers are provided separately, and can be shared or pooled
+    shared_size = sizeof(nmbs_platform_conf) + sizeof(nmbs_callbacks);
+    buffer = "external";
+#endif
+
+    printf("%s\n", config);
+    printf("\tsizeof(nmbs_t)\t\t%zu\n", instance_size);
+    printf("\talignment\t\t%zu\n", offsetof(struct { char c; nmbs_t n; }, n));
+    printf("\tsizeof(msg)\t\t%zu\n", sizeof(((nmbs_t*) NULL)->msg));
+    printf("\tmessage buffer\t\t%s\n", buffer);
+    printf("\tshared tables\t\t%zu\n", shared_size);
+    printf("\t%ld instances\t%zu KiB\n", instances, (instances * instance_size + shared_size) / 1024);
+
+    return 0;
+}
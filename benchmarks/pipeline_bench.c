@@ -0,0 +1,162 @@
+/*
+ * Pipelining benchmark: a Modbus TCP master sends bursts of FC 03 requests back-to-back on a loopback TCP connection,
+ * then waits for all their responses.
+ *
+ * It compares a server handling one request per nmbs_server_poll() call, a server reading ahead into a receive buffer,
+ * and a server also processing the pipelined requests and coalescing their responses into a transmit buffer.
+ *
+ * Usage: pipeline_bench [depth] [seconds]
+ */
+
+#include "benchmarks.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define REGS_COUNT 10
+#define DEPTH_MAX 64
+#define REQ_LEN 12
+#define RES_LEN (9 + REGS_COUNT * 2)
+
+typedef enum mode {
+    MODE_SINGLE,
+    MODE_READ_AHEAD,
+    MODE_COALESCING,
+} mode;
+
+const char* mode_names[] = {"single", "read-ahead", "coalescing"};
+
+volatile bool stopped = false;
+int server_fd = -1;
+int client_fd = -1;
+int depth = 8;
+uint64_t requests = 0;
+
+
+void connect_loopback(void) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, 1) != 0 ||
+        getsockname(listen_fd, (struct sockaddr*) &addr, &addr_len) != 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_fd < 0 || connect(client_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    server_fd = accept(listen_fd, NULL, NULL);
+    if (server_fd < 0) {
+        perror("accept");
+        exit(1);
+    }
+
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    close(listen_fd);
+}
+
+
+void* server_thread(void* arg) {
+    nmbs_t* server = arg;
+    while (!stopped)
+        nmbs_server_poll(server);
+
+    return NULL;
+}
+
+
+void* client_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint8_t reqs[DEPTH_MAX * REQ_LEN];
+    uint8_t res[DEPTH_MAX * RES_LEN];
+    uint16_t tid = 0;
+
+    while (!stopped) {
+        for (int r = 0; r < depth; r++) {
+            uint8_t* req = reqs + r * REQ_LEN;
+            tid++;
+            const uint8_t adu[REQ_LEN] = {(uint8_t) (tid >> 8), (uint8_t) tid, 0, 0, 0, 6, 1, 3, 0, 0, 0, REGS_COUNT};
+            memcpy(req, adu, REQ_LEN);
+        }
+
+        if (write_fd(reqs, (uint16_t) (depth * REQ_LEN), -1, &client_fd) != depth * REQ_LEN)
+            break;
+
+        if (read_fd(res, (uint16_t) (depth * RES_LEN), 1000, &client_fd) != depth * RES_LEN)
+            break;
+
+        requests += (uint64_t) depth;
+    }
+
+    return NULL;
+}
+
+
+void run(mode m, int seconds) {
+    static uint16_t registers[REGS_COUNT];
+    static uint8_t rx_buf[DEPTH_MAX * REQ_LEN];
+    static uint8_t tx_buf[4096];
+    nmbs_register_store store;
+    nmbs_t server;
+    pthread_t server_th;
+    pthread_t client_th;
+
+    connect_loopback();
+    nmbs_register_store_create(&store, registers, 0, REGS_COUNT);
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+
+    nmbs_platform_conf conf;
+    platform_conf_fd(&conf, NMBS_TRANSPORT_TCP, &server_fd);
+    nmbs_server_create(&server, 0, &conf, &callbacks);
+    nmbs_set_read_timeout(&server, 100);
+    nmbs_set_byte_timeout(&server, 100);
+    nmbs_set_holding_registers_store(&server, &store);
+    if (m != MODE_SINGLE)
+        nmbs_set_rx_buffer(&server, rx_buf, sizeof(rx_buf));
+    if (m == MODE_COALESCING)
+        nmbs_set_tx_buffer(&server, tx_buf, sizeof(tx_buf));
+
+    stopped = false;
+    requests = 0;
+    pthread_create(&server_th, NULL, server_thread, &server);
+    pthread_create(&client_th, NULL, client_thread, NULL);
+
+    sleep(seconds);
+    stopped = true;
+
+    pthread_join(client_th, NULL);
+    pthread_join(server_th, NULL);
+    close(client_fd);
+    close(server_fd);
+
+    printf("%-10s depth %2d\treq/s %10.0f\n", mode_names[m], depth, (double) requests / seconds);
+}
+
+
+int main(int argc, char* argv[]) {
+    depth = argc > 1 ? atoi(argv[1]) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+    if (depth < 1 || depth > DEPTH_MAX || seconds < 1) {
+        fprintf(stderr, "Usage: pipeline_bench [depth (1-%d)] [seconds]\n", DEPTH_MAX);
+        return 1;
+    }
+
+    for (int m = MODE_SINGLE; m <= MODE_COALESCING; m++)
+        run((mode) m, seconds);
+
+    return 0;
+}
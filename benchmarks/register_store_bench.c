@@ -0,0 +1,202 @@
+/*
+ * Contention benchmark: 1 writer thread continuously updates a block of holding registers while N server threads
+ * serve FC 03 reads of the whole block to N clients.
+ *
+ * It compares the server reading through callbacks protected by a mutex with the server reading from a
+ * nmbs_register_store and from a nmbs_snapshot_store. Every register of a write has the same value, so a read returning
+ * different values is torn.
+ *
+ * Usage: register_store_bench [servers] [seconds]
+ */
+
+#include "benchmarks.h"
+
+#define REGS_COUNT 125
+#define SERVERS_MAX 64
+
+typedef struct connection {
+    int fds[2];
+    nmbs_t server;
+    nmbs_t client;
+    uint64_t reads;
+    uint64_t torn;
+} connection;
+
+typedef enum mode {
+    MODE_MUTEX,
+    MODE_STORE,
+    MODE_SNAPSHOT,
+} mode;
+
+const char* mode_names[] = {"mutex", "store", "snapshot"};
+
+mode current_mode = MODE_MUTEX;
+volatile bool stopped = false;
+
+uint16_t registers[REGS_COUNT];
+pthread_mutex_t registers_m = PTHREAD_MUTEX_INITIALIZER;
+nmbs_register_store store;
+uint32_t snapshot_memory[NMBS_SNAPSHOT_STORE_MEMORY(REGS_COUNT, 4, SERVERS_MAX)];
+nmbs_snapshot_store snapshot_store;
+uint64_t writes = 0;
+
+
+nmbs_error read_registers_mutex(uint16_t address, uint16_t quantity, uint16_t* registers_out, uint8_t unit_id,
+                                void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (address + quantity > REGS_COUNT)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    pthread_mutex_lock(&registers_m);
+    memcpy(registers_out, &registers[address], quantity * 2);
+    pthread_mutex_unlock(&registers_m);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void* writer_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint16_t values[REGS_COUNT];
+    uint16_t generation = 0;
+
+    while (!stopped) {
+        generation++;
+        for (int i = 0; i < REGS_COUNT; i++)
+            values[i] = generation;
+
+        switch (current_mode) {
+            case MODE_MUTEX:
+                pthread_mutex_lock(&registers_m);
+                memcpy(registers, values, sizeof(values));
+                pthread_mutex_unlock(&registers_m);
+                break;
+            case MODE_STORE:
+                nmbs_register_store_write(&store, 0, REGS_COUNT, values);
+                break;
+            case MODE_SNAPSHOT:
+                nmbs_snapshot_store_write(&snapshot_store, 0, REGS_COUNT, values);
+                break;
+        }
+
+        writes++;
+    }
+
+    return NULL;
+}
+
+
+void* server_thread(void* arg) {
+    connection* c = arg;
+    while (!stopped)
+        nmbs_server_poll(&c->server);
+
+    return NULL;
+}
+
+
+void* client_thread(void* arg) {
+    connection* c = arg;
+    uint16_t regs[REGS_COUNT];
+
+    while (!stopped) {
+        if (nmbs_read_holding_registers(&c->client, 0, REGS_COUNT, regs) != NMBS_ERROR_NONE)
+            continue;
+
+        c->reads++;
+        for (int i = 1; i < REGS_COUNT; i++) {
+            if (regs[i] != regs[0]) {
+                c->torn++;
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void run(int servers, int seconds) {
+    static connection conns[SERVERS_MAX];
+    pthread_t server_threads[SERVERS_MAX];
+    pthread_t client_threads[SERVERS_MAX];
+    pthread_t writer;
+
+    memset(registers, 0, sizeof(registers));
+    nmbs_register_store_create(&store, registers, 0, REGS_COUNT);
+    nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, REGS_COUNT, 4,
+                               SERVERS_MAX);
+    stopped = false;
+    writes = 0;
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    if (current_mode == MODE_MUTEX)
+        callbacks.read_holding_registers = read_registers_mutex;
+
+    for (int i = 0; i < servers; i++) {
+        connection* c = &conns[i];
+        memset(c, 0, sizeof(connection));
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, c->fds) != 0) {
+            perror("socketpair");
+            exit(1);
+        }
+
+        nmbs_platform_conf conf;
+        platform_conf_fd(&conf, NMBS_TRANSPORT_TCP, &c->fds[0]);
+        nmbs_server_create(&c->server, 0, &conf, &callbacks);
+        nmbs_set_read_timeout(&c->server, 100);
+        if (current_mode == MODE_STORE)
+            nmbs_set_holding_registers_store(&c->server, &store);
+        else if (current_mode == MODE_SNAPSHOT)
+            nmbs_set_holding_registers_snapshot_store(&c->server, &snapshot_store);
+
+        platform_conf_fd(&conf, NMBS_TRANSPORT_TCP, &c->fds[1]);
+        nmbs_client_create(&c->client, &conf);
+        nmbs_set_read_timeout(&c->client, 1000);
+    }
+
+    pthread_create(&writer, NULL, writer_thread, NULL);
+    for (int i = 0; i < servers; i++) {
+        pthread_create(&server_threads[i], NULL, server_thread, &conns[i]);
+        pthread_create(&client_threads[i], NULL, client_thread, &conns[i]);
+    }
+
+    sleep(seconds);
+    stopped = true;
+
+    pthread_join(writer, NULL);
+    uint64_t reads = 0;
+    uint64_t torn = 0;
+    for (int i = 0; i < servers; i++) {
+        pthread_join(client_threads[i], NULL);
+        pthread_join(server_threads[i], NULL);
+        close(conns[i].fds[0]);
+        close(conns[i].fds[1]);
+        reads += conns[i].reads;
+        torn += conns[i].torn;
+    }
+
+    printf("%-10s servers %2d\treads/s %10.0f\twrites/s %12.0f\ttorn reads %llu\n", mode_names[current_mode],
+           servers, (double) reads / seconds, (double) writes / seconds, (unsigned long long) torn);
+}
+
+
+int main(int argc, char* argv[]) {
+    int servers = argc > 1 ? atoi(argv[1]) : 4;
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+    if (servers < 1 || servers > SERVERS_MAX || seconds < 1) {
+        fprintf(stderr, "Usage: register_store_bench [servers (1-%d)] [seconds]\n", SERVERS_MAX);
+        return 1;
+    }
+
+    for (int m = MODE_MUTEX; m <= MODE_SNAPSHOT; m++) {
+        current_mode = (mode) m;
+        run(servers, seconds);
+    }
+
+    return 0;
+}
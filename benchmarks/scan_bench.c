@@ -0,0 +1,215 @@
+/*
+ * Scan list benchmark: a Modbus RTU master polls a SCADA-like list of points from a server. Points are 16-bit and
+ * 32-bit registers and single coils, clustered in blocks with small gaps between them, as in a typical device map.
+ *
+ * It compares one request per point with a plan made by nmbs_scan_plan_create() merging only adjacent points, and with
+ * a plan also reading through the gaps cheaper than a request. The frames are exchanged on a socketpair, and their
+ * duration on a simulated serial link is computed from their size: 11 bits per character, plus a 3.5 characters
+ * silent interval after each frame, plus the turnaround time of the server for each request.
+ *
+ * Usage: scan_bench [points] [baud rate] [turnaround ms]
+ */
+
+#include "benchmarks.h"
+
+#define POINTS_MAX 8192
+#define BITS_PER_CHAR 11
+
+typedef enum mode {
+    MODE_NAIVE,
+    MODE_ADJACENT,
+    MODE_PLANNED,
+} mode;
+
+const char* mode_names[] = {"naive", "adjacent", "planned"};
+
+volatile bool stopped = false;
+int fds[2] = {-1, -1};
+uint16_t registers[0x10000];
+nmbs_bitfield_65536 coils;
+uint64_t frames = 0;
+uint64_t chars = 0;
+
+
+int32_t write_link(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    int32_t ret = write_fd(buf, count, timeout_ms, arg);
+    if (ret > 0) {
+        __atomic_add_fetch(&frames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&chars, (uint64_t) ret, __ATOMIC_RELAXED);
+    }
+
+    return ret;
+}
+
+
+void* server_thread(void* arg) {
+    nmbs_t* server = arg;
+    while (!stopped)
+        nmbs_server_poll(server);
+
+    return NULL;
+}
+
+
+// Blocks of 4 to 19 points, with gaps of 0 to 3 addresses between points and of hundreds between blocks
+uint16_t generate_points(nmbs_scan_point* points, uint16_t count, uint16_t (*values)[2]) {
+    uint32_t seed = 12345;
+    uint32_t address[5] = {0, 0, 0, 0, 0};
+
+    for (uint16_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t r = seed >> 8;
+
+        uint8_t fc = r % 10 < 6 ? 3 : (r % 10 < 8 ? 4 : 1);
+        uint16_t quantity = fc != 1 && r % 3 == 0 ? 2 : 1;
+        if (r % 16 == 0)
+            address[fc] += 200 + r % 300;
+        else
+            address[fc] += r % 4;
+
+        if (address[fc] + quantity > 0x10000)
+            return i;
+
+        points[i].values = values[i];
+        points[i].address = (uint16_t) address[fc];
+        points[i].quantity = quantity;
+        points[i].unit_id = 1;
+        points[i].fc = fc;
+        address[fc] += quantity;
+    }
+
+    return count;
+}
+
+
+nmbs_error read_point(nmbs_t* client, const nmbs_scan_point* point) {
+    if (point->fc == 1) {
+        nmbs_bitfield bits = {0};
+        nmbs_error err = nmbs_read_coils(client, point->address, point->quantity, bits);
+        point->values[0] = nmbs_bitfield_read(bits, 0);
+        return err;
+    }
+
+    if (point->fc == 3)
+        return nmbs_read_holding_registers(client, point->address, point->quantity, point->values);
+
+    return nmbs_read_input_registers(client, point->address, point->quantity, point->values);
+}
+
+
+void run(mode m, uint16_t points_count, uint32_t baud, double turnaround_ms) {
+    static nmbs_scan_point points[POINTS_MAX];
+    static uint16_t values[POINTS_MAX][2];
+    static nmbs_scan_request requests[POINTS_MAX];
+    nmbs_register_store store;
+    nmbs_t server;
+    nmbs_t client;
+    pthread_t server_th;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    points_count = generate_points(points, points_count, values);
+    memset(values, 0, sizeof(values));
+
+    nmbs_scan_options options;
+    nmbs_scan_options_create(&options, NMBS_TRANSPORT_RTU);
+    options.frame_cost = (uint16_t) (options.frame_cost + turnaround_ms * baud / (BITS_PER_CHAR * 1000));
+    if (m == MODE_ADJACENT)
+        options.frame_cost = 0;
+
+    nmbs_scan_plan plan;
+    if (m != MODE_NAIVE && nmbs_scan_plan_create(&plan, points, points_count, requests, POINTS_MAX, &options) !=
+                                   NMBS_ERROR_NONE) {
+        fprintf(stderr, "%s plan failed\n", mode_names[m]);
+        exit(1);
+    }
+
+    nmbs_register_store_create(&store, registers, 0, 0xFFFF);
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+
+    nmbs_platform_conf conf;
+    platform_conf_fd(&conf, NMBS_TRANSPORT_RTU, &fds[0]);
+    conf.write = write_link;
+    nmbs_server_create(&server, 1, &conf, &callbacks);
+    nmbs_set_read_timeout(&server, 100);
+    nmbs_set_byte_timeout(&server, 100);
+    nmbs_set_holding_registers_store(&server, &store);
+    nmbs_set_input_registers_store(&server, &store);
+    nmbs_set_coils_bitfield(&server, coils);
+
+    platform_conf_fd(&conf, NMBS_TRANSPORT_RTU, &fds[1]);
+    conf.write = write_link;
+    nmbs_client_create(&client, &conf);
+    nmbs_set_destination_rtu_address(&client, 1);
+    nmbs_set_read_timeout(&client, 1000);
+    nmbs_set_byte_timeout(&client, 100);
+
+    stopped = false;
+    frames = 0;
+    chars = 0;
+    pthread_create(&server_th, NULL, server_thread, &server);
+
+    nmbs_error err = NMBS_ERROR_NONE;
+    if (m == MODE_NAIVE) {
+        for (uint16_t i = 0; i < points_count && err == NMBS_ERROR_NONE; i++)
+            err = read_point(&client, &points[i]);
+    }
+    else {
+        err = nmbs_scan(&client, &plan);
+    }
+
+    stopped = true;
+    pthread_join(server_th, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (err != NMBS_ERROR_NONE) {
+        fprintf(stderr, "%s scan failed: %s\n", mode_names[m], nmbs_strerror(err));
+        exit(1);
+    }
+
+    for (uint16_t i = 0; i < points_count; i++) {
+        const nmbs_scan_point* point = &points[i];
+        for (uint16_t v = 0; v < point->quantity; v++) {
+            uint16_t expected = point->fc == 1 ? nmbs_bitfield_read(coils, point->address + v)
+                                               : registers[point->address + v];
+            if (point->values[v] != expected) {
+                fprintf(stderr, "%s scan read a wrong value for point %d\n", mode_names[m], i);
+                exit(1);
+            }
+        }
+    }
+
+    double seconds = (double) (chars * 2 + frames * 7) * BITS_PER_CHAR / 2 / baud;
+    seconds += (double) (frames / 2) * turnaround_ms / 1000;
+    printf("%-8s points %4d\trequests %4llu\tbytes %6llu\tscan time %7.3f s\n", mode_names[m], points_count,
+           (unsigned long long) frames / 2, (unsigned long long) chars, seconds);
+}
+
+
+int main(int argc, char* argv[]) {
+    int points_count = argc > 1 ? atoi(argv[1]) : 2000;
+    long baud = argc > 2 ? atol(argv[2]) : 19200;
+    double turnaround_ms = argc > 3 ? atof(argv[3]) : 5;
+
+    if (points_count < 1 || points_count > POINTS_MAX || baud < 1 || turnaround_ms < 0) {
+        fprintf(stderr, "Usage: scan_bench [points (1-%d)] [baud rate] [turnaround ms]\n", POINTS_MAX);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        registers[i] = (uint16_t) (i * 2654435761u >> 16);
+        if (i % 3 == 0)
+            nmbs_bitfield_set(coils, i);
+    }
+
+    for (int m = MODE_NAIVE; m <= MODE_PLANNED; m++)
+        run((mode) m, (uint16_t) points_count, (uint32_t) baud, turnaround_ms);
+
+    return 0;
+}
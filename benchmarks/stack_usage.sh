@@ -0,0 +1,7 @@
+#!/bin/sh
+# Prints the stack usage of the functions in the .su files passed as arguments, largest first.
+# The files are generated by compiling with -fstack-usage, see the stack_usage target in CMakeLists.txt
+#
+# Usage: stack_usage.sh [file.su...]
+
+cat "$@" | awk -F '\t' '{ n = split($1, loc, ":"); printf "%8d  %-16s %s\n", $2, $3, loc[n] }' | sort -n -r
@@ -0,0 +1,86 @@
+/*
+ * This example application attaches to the register image of server-image.c and, once a second, updates its input
+ * registers and discrete inputs as a single consistent block, then prints the first holding registers written by
+ * the modbus clients.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nanomodbus.h"
+#include "platform.h"
+
+#define INPUT_REGISTERS_UPDATED 10
+
+bool terminate = false;
+
+
+void sighandler(int s) {
+    UNUSED_PARAM(s);
+    terminate = true;
+}
+
+
+int main(int argc, char* argv[]) {
+    signal(SIGTERM, sighandler);
+    signal(SIGINT, sighandler);
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: image-producer [image file]\n");
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening the image - %s\n", strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error reading the image size - %s\n", strerror(errno));
+        return 1;
+    }
+
+    void* memory = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error mapping the image - %s\n", strerror(errno));
+        return 1;
+    }
+
+    nmbs_image image;
+    if (nmbs_image_attach(&image, memory, (uint32_t) st.st_size) != NMBS_ERROR_NONE) {
+        fprintf(stderr, "Invalid image\n");
+        return 1;
+    }
+
+    if (image.header->input_registers_count < INPUT_REGISTERS_UPDATED || image.header->holding_registers_count < 4) {
+        fprintf(stderr, "Image too small\n");
+        return 1;
+    }
+
+    uint16_t counter = 0;
+    while (!terminate) {
+        counter++;
+
+        // Input registers and discrete inputs are updated together: clients never see them half-written
+        nmbs_image_write_begin(&image);
+        for (int i = 0; i < INPUT_REGISTERS_UPDATED; i++)
+            image.input_registers.registers[i] = counter;
+        nmbs_bitfield_write(image.discrete_inputs, 0, counter % 2);
+        nmbs_image_write_end(&image);
+
+        uint16_t regs[4];
+        nmbs_register_store_read(&image.holding_registers, 0, 4, regs);
+        printf("Counter %d\tholding registers 0-3: %d %d %d %d\n", counter, regs[0], regs[1], regs[2], regs[3]);
+
+        sleep(1);
+    }
+
+    munmap(memory, st.st_size);
+    close(fd);
+
+    return 0;
+}
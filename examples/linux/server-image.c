@@ -0,0 +1,132 @@
+/*
+ * This example application sets up a TCP server serving coils, discrete inputs, holding and input registers from a
+ * register image placed in a shared memory region, so that other processes can produce and consume the data with no
+ * copies and no IPC round-trips (see image-producer.c).
+ *
+ * If an image file is specified, the image is mapped from it and survives restarts. Otherwise, it is placed in an
+ * anonymous memfd, which other processes can open through /proc/<pid>/fd/<fd>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "nanomodbus.h"
+#include "platform.h"
+
+#define HOLDING_REGISTERS_COUNT 1000
+#define INPUT_REGISTERS_COUNT 1000
+
+bool terminate = false;
+
+
+void sighandler(int s) {
+    UNUSED_PARAM(s);
+    terminate = true;
+}
+
+
+int main(int argc, char* argv[]) {
+    signal(SIGTERM, sighandler);
+    signal(SIGSTOP, sighandler);
+    signal(SIGINT, sighandler);
+    signal(SIGQUIT, sighandler);
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: server-image [address] [port] [image file (optional)]\n");
+        return 1;
+    }
+
+    // Open the memory region backing the image
+    int fd;
+    if (argc > 3)
+        fd = open(argv[3], O_RDWR | O_CREAT, 0644);
+    else
+        fd = memfd_create("nanomodbus-image", 0);
+
+    if (fd < 0) {
+        fprintf(stderr, "Error opening the image - %s\n", strerror(errno));
+        return 1;
+    }
+
+    uint32_t size = nmbs_image_size(HOLDING_REGISTERS_COUNT, INPUT_REGISTERS_COUNT);
+    if (ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Error resizing the image - %s\n", strerror(errno));
+        return 1;
+    }
+
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(stderr, "Error mapping the image - %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Keep the data of an existing image, and release its lock in case a writer terminated while writing
+    nmbs_image image;
+    if (nmbs_image_attach(&image, memory, size) == NMBS_ERROR_NONE) {
+        nmbs_image_recover(&image);
+        printf("Attached to existing image\n");
+    }
+    else {
+        nmbs_image_format(memory, size, HOLDING_REGISTERS_COUNT, INPUT_REGISTERS_COUNT);
+        nmbs_image_attach(&image, memory, size);
+        printf("Formatted new image\n");
+    }
+
+    if (argc > 3)
+        printf("Image file: %s\n", argv[3]);
+    else
+        printf("Image file: /proc/%d/fd/%d\n", getpid(), fd);
+
+    // Set up the TCP server
+    int ret = create_tcp_server(argv[1], argv[2]);
+    if (ret != 0) {
+        fprintf(stderr, "Error creating TCP server - %s\n", strerror(ret));
+        return 1;
+    }
+
+    nmbs_platform_conf platform_conf;
+    nmbs_platform_conf_create(&platform_conf);
+    platform_conf.transport = NMBS_TRANSPORT_TCP;
+    platform_conf.read = read_fd_linux;
+    platform_conf.write = write_fd_linux;
+    platform_conf.arg = NULL;    // We will set the arg (socket fd) later
+
+    // No callbacks: all the requests are served from the image
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+
+    nmbs_t nmbs;
+    nmbs_error err = nmbs_server_create(&nmbs, 0, &platform_conf, &callbacks);
+    if (err != NMBS_ERROR_NONE) {
+        fprintf(stderr, "Error creating modbus server\n");
+        return 1;
+    }
+
+    nmbs_set_image(&nmbs, &image);
+    nmbs_set_read_timeout(&nmbs, 1000);
+
+    printf("Modbus TCP server started\n");
+
+    while (!terminate) {
+        void* conn = server_poll();
+        if (conn) {
+            nmbs_set_platform_arg(&nmbs, conn);
+            err = nmbs_server_poll(&nmbs);
+            if (err != NMBS_ERROR_NONE) {
+                printf("Error on modbus connection - %s\n", nmbs_strerror(err));
+            }
+        }
+    }
+
+    close_tcp_server();
+
+    // Changes to a file-backed image are written back by the kernel, msync() makes sure they are on disk
+    msync(memory, size, MS_SYNC);
+    munmap(memory, size);
+    close(fd);
+
+    return 0;
+}
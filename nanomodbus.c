@@ -39,16 +39,118 @@
 #define NMBS_DEBUG_PRINT(...) (void) (0)
 #endif
 
+// With NMBS_COMPACT the platform configuration and the callbacks are shared, their args are kept per instance
+#ifdef NMBS_COMPACT
+#define NMBS_PLATFORM(nmbs) ((nmbs)->platform)
+#define NMBS_CALLBACKS(nmbs) ((nmbs)->callbacks)
+#define NMBS_PLATFORM_ARG(nmbs) ((nmbs)->platform_arg)
+#define NMBS_CALLBACKS_ARG(nmbs) ((nmbs)->callbacks_arg)
+#else
+#define NMBS_PLATFORM(nmbs) (&(nmbs)->platform)
+#define NMBS_CALLBACKS(nmbs) (&(nmbs)->callbacks)
+#define NMBS_PLATFORM_ARG(nmbs) ((nmbs)->platform.arg)
+#define NMBS_CALLBACKS_ARG(nmbs) ((nmbs)->callbacks.arg)
+#endif
+
+// Data stores the server answers requests from, there are none with NMBS_SERVER_DATA_STORES_DISABLED
+#ifndef NMBS_SERVER_DISABLED
+#ifndef NMBS_SERVER_DATA_STORES_DISABLED
+#define NMBS_DATA(nmbs) (&(nmbs)->data)
+#else
+static const nmbs_server_data no_server_data;
+#define NMBS_DATA(nmbs) ((void) (nmbs), &no_server_data)
+#endif
+#endif
+
+// Server communication counters, read by FC 08 Diagnostics requests
+#if !defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_DIAGNOSTICS_DISABLED)
+#define NMBS_DIAGNOSTICS_COUNT(nmbs, counter) ((nmbs)->diagnostics.counter++)
+#else
+#define NMBS_DIAGNOSTICS_COUNT(nmbs, counter) (void) (0)
+#endif
+
+// Server communication events, read by FC 11 Get Comm Event Counter and FC 12 Get Comm Event Log requests
+#if !defined(NMBS_SERVER_DISABLED) &&                                                                                  \
+        (!defined(NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED) || !defined(NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED))
+#define NMBS_COMM_EVENT_LOG_ENABLED
+#define NMBS_COMM_EVENT(nmbs, event) comm_event((nmbs), (uint8_t) (event))
+#else
+#define NMBS_COMM_EVENT(nmbs, event) (void) (0)
+#endif
+
+// Memory ordering primitives used by the structures shared between threads. They can be overridden by defining them
+// before compiling this file, and have to be defined for compilers other than GCC, Clang, MSVC and C11 ones.
+#if defined(__GNUC__) || defined(__clang__)
+#ifndef NMBS_ATOMIC_LOAD
+#define NMBS_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+#ifndef NMBS_ATOMIC_CAS
+#define NMBS_ATOMIC_CAS(p, expected, desired)                                                                          \
+    __atomic_compare_exchange_n((p), &(expected), (desired), false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)
+#endif
+#ifndef NMBS_FENCE_ACQUIRE
+#define NMBS_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#endif
+#ifndef NMBS_FENCE_RELEASE
+#define NMBS_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+#ifndef NMBS_FENCE_FULL
+#define NMBS_FENCE_FULL() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#ifndef NMBS_ATOMIC_LOAD
+#define NMBS_ATOMIC_LOAD(p) (*(p))
+#endif
+#ifndef NMBS_ATOMIC_CAS
+#define NMBS_ATOMIC_CAS(p, expected, desired)                                                                          \
+    ((uint32_t) _InterlockedCompareExchange((volatile long*) (p), (long) (desired), (long) (expected)) == (expected))
+#endif
+#ifndef NMBS_FENCE_ACQUIRE
+#define NMBS_FENCE_ACQUIRE() _ReadWriteBarrier()
+#endif
+#ifndef NMBS_FENCE_RELEASE
+#define NMBS_FENCE_RELEASE() _ReadWriteBarrier()
+#endif
+#ifndef NMBS_FENCE_FULL
+#define NMBS_FENCE_FULL() _mm_mfence()
+#endif
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+// The shared fields are volatile uint32_t, accessed as the _Atomic uint32_t of the same size
+#ifndef NMBS_ATOMIC_LOAD
+#define NMBS_ATOMIC_LOAD(p) atomic_load_explicit((volatile _Atomic uint32_t*) (p), memory_order_acquire)
+#endif
+#ifndef NMBS_ATOMIC_CAS
+#define NMBS_ATOMIC_CAS(p, expected, desired)                                                                          \
+    atomic_compare_exchange_strong_explicit((volatile _Atomic uint32_t*) (p), &(expected), (desired),                  \
+                                            memory_order_acquire, memory_order_relaxed)
+#endif
+#ifndef NMBS_FENCE_ACQUIRE
+#define NMBS_FENCE_ACQUIRE() atomic_thread_fence(memory_order_acquire)
+#endif
+#ifndef NMBS_FENCE_RELEASE
+#define NMBS_FENCE_RELEASE() atomic_thread_fence(memory_order_release)
+#endif
+#ifndef NMBS_FENCE_FULL
+#define NMBS_FENCE_FULL() atomic_thread_fence(memory_order_seq_cst)
+#endif
+#elif !defined(NMBS_ATOMIC_LOAD) || !defined(NMBS_ATOMIC_CAS) || !defined(NMBS_FENCE_ACQUIRE) ||                       \
+        !defined(NMBS_FENCE_RELEASE) || !defined(NMBS_FENCE_FULL)
+// A plain compare-then-store would race with interrupts and preemption even on a single core
+#error "No atomic operations for this compiler: define NMBS_ATOMIC_LOAD, NMBS_ATOMIC_CAS and the NMBS_FENCE_* macros"
+#endif
+
 
 static uint8_t get_1(nmbs_t* nmbs) {
-    uint8_t result = nmbs->msg.buf[nmbs->msg.buf_idx];
+    uint8_t result = nmbs->msg_buf[nmbs->msg.buf_idx];
     nmbs->msg.buf_idx++;
     return result;
 }
 
 
 static void put_1(nmbs_t* nmbs, uint8_t data) {
-    nmbs->msg.buf[nmbs->msg.buf_idx] = data;
+    nmbs->msg_buf[nmbs->msg.buf_idx] = data;
     nmbs->msg.buf_idx++;
 }
 
@@ -59,7 +161,9 @@ static void discard_1(nmbs_t* nmbs) {
 
 
 #ifndef NMBS_SERVER_DISABLED
-#if !defined(NMBS_SERVER_READ_FILE_RECORD_DISABLED) || !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED)
+#if !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_FILE_RECORD_DISABLED) ||      \
+    !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED) || !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED) ||         \
+    !defined(NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED)
 static void discard_n(nmbs_t* nmbs, uint16_t n) {
     nmbs->msg.buf_idx += n;
 }
@@ -69,15 +173,15 @@ static void discard_n(nmbs_t* nmbs, uint16_t n) {
 
 static uint16_t get_2(nmbs_t* nmbs) {
     uint16_t result =
-            ((uint16_t) nmbs->msg.buf[nmbs->msg.buf_idx]) << 8 | (uint16_t) nmbs->msg.buf[nmbs->msg.buf_idx + 1];
+            ((uint16_t) nmbs->msg_buf[nmbs->msg.buf_idx]) << 8 | (uint16_t) nmbs->msg_buf[nmbs->msg.buf_idx + 1];
     nmbs->msg.buf_idx += 2;
     return result;
 }
 
 
 static void put_2(nmbs_t* nmbs, uint16_t data) {
-    nmbs->msg.buf[nmbs->msg.buf_idx] = (uint8_t) ((data >> 8) & 0xFFU);
-    nmbs->msg.buf[nmbs->msg.buf_idx + 1] = (uint8_t) data;
+    nmbs->msg_buf[nmbs->msg.buf_idx] = (uint8_t) ((data >> 8) & 0xFFU);
+    nmbs->msg_buf[nmbs->msg.buf_idx + 1] = (uint8_t) data;
     nmbs->msg.buf_idx += 2;
 }
 
@@ -85,20 +189,20 @@ static void put_2(nmbs_t* nmbs, uint16_t data) {
 #ifndef NMBS_SERVER_DISABLED
 #if !defined(NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED)
 static void set_1(nmbs_t* nmbs, uint8_t data, uint8_t index) {
-    nmbs->msg.buf[index] = data;
+    nmbs->msg_buf[index] = data;
 }
 
 
 static void set_2(nmbs_t* nmbs, uint16_t data, uint8_t index) {
-    nmbs->msg.buf[index] = (uint8_t) ((data >> 8) & 0xFFU);
-    nmbs->msg.buf[index + 1] = (uint8_t) data;
+    nmbs->msg_buf[index] = (uint8_t) ((data >> 8) & 0xFFU);
+    nmbs->msg_buf[index + 1] = (uint8_t) data;
 }
 #endif
 #endif
 
 
 static uint8_t* get_n(nmbs_t* nmbs, uint16_t n) {
-    uint8_t* msg_buf_ptr = nmbs->msg.buf + nmbs->msg.buf_idx;
+    uint8_t* msg_buf_ptr = nmbs->msg_buf + nmbs->msg.buf_idx;
     nmbs->msg.buf_idx += n;
     return msg_buf_ptr;
 }
@@ -107,41 +211,76 @@ static uint8_t* get_n(nmbs_t* nmbs, uint16_t n) {
 #ifndef NMBS_SERVER_DISABLED
 #if !defined(NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED)
 static void put_n(nmbs_t* nmbs, const uint8_t* data, uint8_t size) {
-    memcpy(&nmbs->msg.buf[nmbs->msg.buf_idx], data, size);
+    memcpy(&nmbs->msg_buf[nmbs->msg.buf_idx], data, size);
     nmbs->msg.buf_idx += size;
 }
 #endif
 
 
-#if !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED)
+#if !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED) || !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED) ||     \
+    !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED)
+// Registers are converted in place to host byte order, at a 2-byte aligned address for the callbacks: their position,
+// or one byte before it, over the last byte of the request fields already parsed
 static uint16_t* get_regs(nmbs_t* nmbs, uint16_t n) {
-    uint16_t* msg_buf_ptr = (uint16_t*) (nmbs->msg.buf + nmbs->msg.buf_idx);
+    const uint8_t* data = nmbs->msg_buf + nmbs->msg.buf_idx;
+    uint16_t* regs = (uint16_t*) (nmbs->msg_buf + nmbs->msg.buf_idx - ((uintptr_t) data & 1));
     nmbs->msg.buf_idx += n * 2;
-    while (n--) {
-        msg_buf_ptr[n] = (msg_buf_ptr[n] << 8) | ((msg_buf_ptr[n] >> 8) & 0xFF);
-    }
-    return msg_buf_ptr;
+    for (uint16_t i = 0; i < n; i++)
+        regs[i] = (uint16_t) (data[i * 2] << 8 | data[i * 2 + 1]);
+
+    return regs;
 }
 #endif
+
+
+#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED) ||    \
+    !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_FILE_RECORD_DISABLED) ||          \
+    !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED)
+// Converts registers to network byte order and moves them back to the data position. The copy goes in the direction
+// that never overwrites a register before it has been read.
+static void put_regs_at(uint8_t* data, const uint16_t* regs, uint16_t n) {
+    if ((const uint8_t*) regs >= data) {
+        for (uint16_t i = 0; i < n; i++) {
+            uint16_t reg = regs[i];
+            data[i * 2] = (uint8_t) (reg >> 8);
+            data[i * 2 + 1] = (uint8_t) reg;
+        }
+    }
+    else {
+        while (n--) {
+            uint16_t reg = regs[n];
+            data[n * 2] = (uint8_t) (reg >> 8);
+            data[n * 2 + 1] = (uint8_t) reg;
+        }
+    }
+}
 #endif
 
 
-#ifndef NMBS_CLIENT_DISABLED
-static void put_regs(nmbs_t* nmbs, const uint16_t* data, uint16_t n) {
-    uint16_t* msg_buf_ptr = (uint16_t*) (nmbs->msg.buf + nmbs->msg.buf_idx);
+#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED) ||    \
+    !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_FILE_RECORD_DISABLED)
+// Registers are read straight into the message buffer, at a 2-byte aligned address for the callbacks: the current
+// position, or one byte after it. A response always leaves a spare byte after its registers in the buffer.
+static uint16_t* regs_in_place(nmbs_t* nmbs) {
+    uint8_t* data = nmbs->msg_buf + nmbs->msg.buf_idx;
+    return (uint16_t*) (data + ((uintptr_t) data & 1));
+}
+
+
+static void put_regs_in_place(nmbs_t* nmbs, uint16_t n) {
+    put_regs_at(nmbs->msg_buf + nmbs->msg.buf_idx, regs_in_place(nmbs), n);
     nmbs->msg.buf_idx += n * 2;
-    while (n--) {
-        msg_buf_ptr[n] = (data[n] << 8) | ((data[n] >> 8) & 0xFF);
-    }
 }
 #endif
+#endif
 
 
-static void swap_regs(uint16_t* data, uint16_t n) {
-    while (n--) {
-        data[n] = (data[n] << 8) | ((data[n] >> 8) & 0xFF);
-    }
+#ifndef NMBS_CLIENT_DISABLED
+static void put_regs(nmbs_t* nmbs, const uint16_t* data, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++)
+        put_2(nmbs, data[i]);
 }
+#endif
 
 
 static void msg_buf_reset(nmbs_t* nmbs) {
@@ -160,22 +299,32 @@ static void msg_state_reset(nmbs_t* nmbs) {
 
 
 #ifndef NMBS_CLIENT_DISABLED
-static void msg_state_req(nmbs_t* nmbs, uint8_t fc) {
+// Starts a request without flushing the line, where the responses to the requests in flight may be arriving
+static void msg_state_req_pipelined(nmbs_t* nmbs, uint8_t fc) {
     if (nmbs->current_tid == UINT16_MAX)
         nmbs->current_tid = 1;
     else
         nmbs->current_tid++;
 
-    // Flush the remaining data on the line before sending the request
-    nmbs->platform.read(nmbs->msg.buf, sizeof(nmbs->msg.buf), 0, nmbs->platform.arg);
-
     msg_state_reset(nmbs);
     nmbs->msg.unit_id = nmbs->dest_address_rtu;
     nmbs->msg.fc = fc;
     nmbs->msg.transaction_id = nmbs->current_tid;
-    if (nmbs->msg.unit_id == 0 && nmbs->platform.transport == NMBS_TRANSPORT_RTU)
+    if (nmbs->msg.unit_id == 0 && nmbs->transport == NMBS_TRANSPORT_RTU)
         nmbs->msg.broadcast = true;
 }
+
+
+static void msg_state_req(nmbs_t* nmbs, uint8_t fc) {
+    // Flush the remaining data on the line before sending the request
+    NMBS_PLATFORM(nmbs)->read(nmbs->msg_buf, NMBS_MSG_BUF_SIZE, 0, NMBS_PLATFORM_ARG(nmbs));
+#ifndef NMBS_PIPELINING_DISABLED
+    nmbs->rx_start = 0;
+    nmbs->rx_end = 0;
+#endif
+
+    msg_state_req_pipelined(nmbs, fc);
+}
 #endif
 
 
@@ -197,7 +346,13 @@ nmbs_error nmbs_create(nmbs_t* nmbs, const nmbs_platform_conf* platform_conf) {
     if (!platform_conf->read || !platform_conf->write)
         return NMBS_ERROR_INVALID_ARGUMENT;
 
+#ifdef NMBS_COMPACT
+    nmbs->platform = platform_conf;
+#else
     nmbs->platform = *platform_conf;
+#endif
+    nmbs->transport = (uint8_t) platform_conf->transport;
+    NMBS_PLATFORM_ARG(nmbs) = platform_conf->arg;
 
     return NMBS_ERROR_NONE;
 }
@@ -226,8 +381,31 @@ void nmbs_set_destination_rtu_address(nmbs_t* nmbs, uint8_t address) {
 }
 
 
+#ifdef NMBS_COMPACT
+void nmbs_set_buffer(nmbs_t* nmbs, uint8_t* buf) {
+    nmbs->msg_buf = buf;
+}
+#endif
+
+
+#ifndef NMBS_PIPELINING_DISABLED
+void nmbs_set_rx_buffer(nmbs_t* nmbs, uint8_t* buf, uint16_t size) {
+    nmbs->rx_buf = size ? buf : NULL;
+    nmbs->rx_size = size;
+    nmbs->rx_start = 0;
+    nmbs->rx_end = 0;
+}
+#endif
+
+
 void nmbs_set_platform_arg(nmbs_t* nmbs, void* arg) {
-    nmbs->platform.arg = arg;
+    NMBS_PLATFORM_ARG(nmbs) = arg;
+
+#ifndef NMBS_PIPELINING_DISABLED
+    // The bytes read ahead belong to the previous connection
+    nmbs->rx_start = 0;
+    nmbs->rx_end = 0;
+#endif
 }
 
 
@@ -250,1899 +428,5602 @@ uint16_t nmbs_crc_calc(const uint8_t* data, uint32_t length, void* arg) {
 }
 
 
-static nmbs_error recv(nmbs_t* nmbs, uint16_t count) {
-    int32_t ret =
-            nmbs->platform.read(nmbs->msg.buf + nmbs->msg.buf_idx, count, nmbs->byte_timeout_ms, nmbs->platform.arg);
+nmbs_error nmbs_bitfield_65536_read_range(const nmbs_bitfield_65536 bf, uint16_t address, uint16_t quantity,
+                                          nmbs_bitfield bits_out) {
+    if (quantity < 1 || quantity > 2000)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (ret == count)
-        return NMBS_ERROR_NONE;
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (ret < count) {
-        if (ret < 0)
-            return NMBS_ERROR_TRANSPORT;
+    uint16_t first = address / 8;
+    uint16_t last = (uint16_t) (((uint32_t) address + quantity - 1) / 8);
+    uint8_t shift = address % 8;
+    uint16_t bytes = (quantity + 7) / 8;
 
-        return NMBS_ERROR_TIMEOUT;
+    // Every output byte is extracted from a 16-bit window spanning two source bytes
+    for (uint16_t i = 0; i < bytes; i++) {
+        uint16_t window = bf[first + i];
+        if (first + i + 1 <= last)
+            window |= (uint16_t) (bf[first + i + 1] << 8);
+
+        bits_out[i] = (uint8_t) (window >> shift);
     }
 
-    return NMBS_ERROR_TRANSPORT;
+    if (quantity % 8)
+        bits_out[bytes - 1] &= (uint8_t) ((1U << (quantity % 8)) - 1);
+
+    return NMBS_ERROR_NONE;
 }
 
 
-static nmbs_error send(nmbs_t* nmbs, uint16_t count) {
-    int32_t ret = nmbs->platform.write(nmbs->msg.buf, count, nmbs->byte_timeout_ms, nmbs->platform.arg);
+nmbs_error nmbs_bitfield_65536_write_range(nmbs_bitfield_65536 bf, uint16_t address, uint16_t quantity,
+                                           const nmbs_bitfield bits) {
+    if (quantity < 1 || quantity > 2000)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (ret == count)
-        return NMBS_ERROR_NONE;
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (ret < count) {
-        if (ret < 0)
-            return NMBS_ERROR_TRANSPORT;
+    uint16_t first = address / 8;
+    uint8_t shift = address % 8;
+    uint16_t bytes = (quantity + 7) / 8;
 
-        return NMBS_ERROR_TIMEOUT;
+    // Every input byte is shifted into a 16-bit window spanning two destination bytes
+    for (uint16_t i = 0; i < bytes; i++) {
+        uint8_t n = 8;
+        if (i == bytes - 1 && quantity % 8)
+            n = quantity % 8;
+
+        uint16_t mask = (uint16_t) (((1U << n) - 1) << shift);
+        uint16_t value = (uint16_t) ((bits[i] << shift) & mask);
+
+        bf[first + i] = (uint8_t) ((bf[first + i] & ~mask) | value);
+        if (mask >> 8)
+            bf[first + i + 1] = (uint8_t) ((bf[first + i + 1] & ~(mask >> 8)) | (value >> 8));
     }
 
-    return NMBS_ERROR_TRANSPORT;
+    return NMBS_ERROR_NONE;
 }
 
 
-static nmbs_error recv_msg_footer(nmbs_t* nmbs) {
-    NMBS_DEBUG_PRINT("\n");
+static uint32_t popcount_32(uint32_t v) {
+    v = v - ((v >> 1) & 0x55555555U);
+    v = (v & 0x33333333U) + ((v >> 2) & 0x33333333U);
+    return (((v + (v >> 4)) & 0x0F0F0F0FU) * 0x01010101U) >> 24;
+}
 
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        uint16_t crc = nmbs->platform.crc_calc(nmbs->msg.buf, nmbs->msg.buf_idx, nmbs->platform.arg);
 
-        nmbs_error err = recv(nmbs, 2);
-        if (err != NMBS_ERROR_NONE)
-            return err;
+uint32_t nmbs_bitfield_65536_count(const nmbs_bitfield_65536 bf, uint16_t address, uint32_t quantity) {
+    uint32_t bit = address;
+    uint32_t end = bit + quantity;
+    if (end > ((uint32_t) 0xFFFF) + 1)
+        end = ((uint32_t) 0xFFFF) + 1;
 
-        uint16_t recv_crc = get_2(nmbs);
+    uint32_t count = 0;
 
-        if (recv_crc != crc)
-            return NMBS_ERROR_CRC;
+    // Leading bits up to the first byte boundary
+    if (bit % 8 && bit < end) {
+        uint32_t n = 8 - (bit % 8);
+        if (n > end - bit)
+            n = end - bit;
+
+        count += popcount_32((uint32_t) (bf[bit / 8] >> (bit % 8)) & ((1U << n) - 1));
+        bit += n;
     }
 
-    return NMBS_ERROR_NONE;
-}
+    // 32 bits at a time
+    while (bit + 32 <= end) {
+        uint32_t i = bit / 8;
+        count += popcount_32((uint32_t) bf[i] | (uint32_t) bf[i + 1] << 8 | (uint32_t) bf[i + 2] << 16 |
+                             (uint32_t) bf[i + 3] << 24);
+        bit += 32;
+    }
 
+    while (bit + 8 <= end) {
+        count += popcount_32(bf[bit / 8]);
+        bit += 8;
+    }
 
-static nmbs_error recv_msg_header(nmbs_t* nmbs, bool* first_byte_received) {
-    // We wait for the read timeout here, just for the first message byte
-    int32_t old_byte_timeout = nmbs->byte_timeout_ms;
-    nmbs->byte_timeout_ms = nmbs->read_timeout_ms;
+    // Trailing bits
+    if (bit < end)
+        count += popcount_32(bf[bit / 8] & ((1U << (end - bit)) - 1));
 
-    msg_state_reset(nmbs);
+    return count;
+}
 
-    *first_byte_received = false;
 
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        nmbs_error err = recv(nmbs, 1);
+static uint8_t lowest_bit_index(uint8_t b) {
+    uint8_t i = 0;
+    while (!(b & 0x1)) {
+        b >>= 1;
+        i++;
+    }
 
-        nmbs->byte_timeout_ms = old_byte_timeout;
+    return i;
+}
 
-        if (err != NMBS_ERROR_NONE)
-            return err;
 
-        *first_byte_received = true;
+bool nmbs_bitfield_65536_next_changed(const nmbs_bitfield_65536 bf, const nmbs_bitfield_65536 previous, uint32_t from,
+                                      uint16_t* address_out, uint32_t* quantity_out) {
+    const uint32_t bits_count = ((uint32_t) 0xFFFF) + 1;
+    uint32_t bit = from;
 
-        nmbs->msg.unit_id = get_1(nmbs);
+    // Search the first changed bit, skipping unchanged 32-bit words
+    while (bit < bits_count) {
+        if (bit % 32 == 0 && memcmp(&bf[bit / 8], &previous[bit / 8], 4) == 0) {
+            bit += 32;
+            continue;
+        }
 
-        err = recv(nmbs, 1);
-        if (err != NMBS_ERROR_NONE)
-            return err;
+        uint8_t diff = (uint8_t) ((bf[bit / 8] ^ previous[bit / 8]) >> (bit % 8));
+        if (diff) {
+            bit += lowest_bit_index(diff);
+            break;
+        }
 
-        nmbs->msg.fc = get_1(nmbs);
+        bit = (bit / 8 + 1) * 8;
     }
-    else if (nmbs->platform.transport == NMBS_TRANSPORT_TCP) {
-        nmbs_error err = recv(nmbs, 1);
-
-        nmbs->byte_timeout_ms = old_byte_timeout;
 
-        if (err != NMBS_ERROR_NONE)
-            return err;
-
-        *first_byte_received = true;
+    if (bit >= bits_count)
+        return false;
 
-        // Advance buf_idx
-        discard_1(nmbs);
+    uint32_t start = bit;
 
-        err = recv(nmbs, 7);
-        if (err != NMBS_ERROR_NONE)
-            return err;
+    // Search the first unchanged bit after it
+    while (bit < bits_count) {
+        uint8_t same = (uint8_t) ((uint8_t) ~(bf[bit / 8] ^ previous[bit / 8]) >> (bit % 8));
+        if (same) {
+            bit += lowest_bit_index(same);
+            break;
+        }
 
-        // Starting over
-        msg_buf_reset(nmbs);
+        bit = (bit / 8 + 1) * 8;
+    }
 
-        nmbs->msg.transaction_id = get_2(nmbs);
-        uint16_t protocol_id = get_2(nmbs);
-        uint16_t length = get_2(nmbs);    // We should actually check the length of the request against this value
-        nmbs->msg.unit_id = get_1(nmbs);
-        nmbs->msg.fc = get_1(nmbs);
+    if (bit > bits_count)
+        bit = bits_count;
 
-        if (protocol_id != 0)
-            return NMBS_ERROR_INVALID_TCP_MBAP;
+    if (address_out)
+        *address_out = (uint16_t) start;
 
-        if (length > 255)
-            return NMBS_ERROR_INVALID_TCP_MBAP;
-    }
+    if (quantity_out)
+        *quantity_out = bit - start;
 
-    return NMBS_ERROR_NONE;
+    return true;
 }
 
 
-static void put_msg_header(nmbs_t* nmbs, uint16_t data_length) {
-    msg_buf_reset(nmbs);
-
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        put_1(nmbs, nmbs->msg.unit_id);
-    }
-    else if (nmbs->platform.transport == NMBS_TRANSPORT_TCP) {
-        put_2(nmbs, nmbs->msg.transaction_id);
-        put_2(nmbs, 0);
-        put_2(nmbs, (uint16_t) (1 + 1 + data_length));
-        put_1(nmbs, nmbs->msg.unit_id);
+// Sequence lock: an odd sequence number marks a write in progress. Writers take turns by atomically making it odd,
+// readers retry until they read the data between two equal even sequence numbers.
+static void seqlock_write_begin(volatile uint32_t* sequence) {
+    while (true) {
+        uint32_t current = *sequence;
+        if (!(current & 0x1) && NMBS_ATOMIC_CAS(sequence, current, current + 1))
+            break;
     }
 
-    put_1(nmbs, nmbs->msg.fc);
+    NMBS_FENCE_RELEASE();
 }
 
 
-#ifndef NMBS_SERVER_DISABLED
-#if !defined(NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED)
-static void set_msg_header_size(nmbs_t* nmbs, uint16_t data_length) {
-    if (nmbs->platform.transport == NMBS_TRANSPORT_TCP) {
-        data_length += 2;
-        set_2(nmbs, data_length, 4);
-    }
+static void seqlock_write_end(volatile uint32_t* sequence) {
+    NMBS_FENCE_RELEASE();
+    *sequence = *sequence + 1;
 }
-#endif
-#endif
 
 
-static nmbs_error send_msg(nmbs_t* nmbs) {
-    NMBS_DEBUG_PRINT("\n");
-
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        uint16_t crc = nmbs->platform.crc_calc(nmbs->msg.buf, nmbs->msg.buf_idx, nmbs->platform.arg);
-        put_2(nmbs, crc);
+static uint32_t seqlock_read_begin(const volatile uint32_t* sequence) {
+    while (true) {
+        uint32_t current = NMBS_ATOMIC_LOAD(sequence);
+        if (!(current & 0x1))
+            return current;
     }
+}
 
-    nmbs_error err = send(nmbs, nmbs->msg.buf_idx);
 
-    return err;
+static bool seqlock_read_retry(const volatile uint32_t* sequence, uint32_t begin) {
+    NMBS_FENCE_ACQUIRE();
+    return *sequence != begin;
 }
 
 
-#ifndef NMBS_SERVER_DISABLED
-static nmbs_error recv_req_header(nmbs_t* nmbs, bool* first_byte_received) {
-    nmbs_error err = recv_msg_header(nmbs, first_byte_received);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_register_store_create(nmbs_register_store* store, uint16_t* registers, uint16_t address,
+                                      uint32_t count) {
+    if (!store || !registers)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        // Check if request is for us
-        if (nmbs->msg.unit_id == NMBS_BROADCAST_ADDRESS)
-            nmbs->msg.broadcast = true;
-        else if (nmbs->msg.unit_id != nmbs->address_rtu)
-            nmbs->msg.ignored = true;
-        else
-            nmbs->msg.ignored = false;
-    }
+    if (count < 1 || (uint32_t) address + count > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    store->registers = registers;
+    store->address = address;
+    store->count = count;
+    store->sequence = 0;
+    store->shared_sequence = NULL;
 
     return NMBS_ERROR_NONE;
 }
 
 
-static void put_res_header(nmbs_t* nmbs, uint16_t data_length) {
-    put_msg_header(nmbs, data_length);
-    NMBS_DEBUG_PRINT("%d NMBS res -> address_rtu %d\tfc %d\t", nmbs->address_rtu, nmbs->address_rtu, nmbs->msg.fc);
+static const volatile uint32_t* register_store_sequence(const nmbs_register_store* store) {
+    return store->shared_sequence ? store->shared_sequence : &store->sequence;
 }
 
 
-static nmbs_error send_exception_msg(nmbs_t* nmbs, uint8_t exception) {
-    nmbs->msg.fc += 0x80;
-    put_msg_header(nmbs, 1);
-    put_1(nmbs, exception);
+static bool register_store_contains(const nmbs_register_store* store, uint16_t address, uint16_t quantity) {
+    return address >= store->address && (uint32_t) address + quantity <= (uint32_t) store->address + store->count;
+}
 
-    NMBS_DEBUG_PRINT("%d NMBS res -> address_rtu %d\texception %d", nmbs->address_rtu, nmbs->address_rtu, exception);
 
-    return send_msg(nmbs);
+nmbs_error nmbs_register_store_read(const nmbs_register_store* store, uint16_t address, uint16_t quantity,
+                                    uint16_t* registers_out) {
+    if (!register_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    const uint16_t* src = store->registers + (address - store->address);
+    const volatile uint32_t* sequence = register_store_sequence(store);
+
+    uint32_t begin;
+    do {
+        begin = seqlock_read_begin(sequence);
+        memcpy(registers_out, src, (size_t) quantity * 2);
+    } while (seqlock_read_retry(sequence, begin));
+
+    return NMBS_ERROR_NONE;
 }
-#endif
 
 
-static nmbs_error recv_res_header(nmbs_t* nmbs) {
-    uint16_t req_transaction_id = nmbs->msg.transaction_id;
-    uint8_t req_unit_id = nmbs->msg.unit_id;
-    uint8_t req_fc = nmbs->msg.fc;
+uint16_t* nmbs_register_store_write_begin(nmbs_register_store* store) {
+    seqlock_write_begin(store->shared_sequence ? store->shared_sequence : &store->sequence);
+    return store->registers;
+}
 
-    bool first_byte_received = false;
-    nmbs_error err = recv_msg_header(nmbs, &first_byte_received);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (nmbs->platform.transport == NMBS_TRANSPORT_TCP) {
-        if (nmbs->msg.transaction_id != req_transaction_id)
-            return NMBS_ERROR_INVALID_TCP_MBAP;
-    }
+void nmbs_register_store_write_end(nmbs_register_store* store) {
+    seqlock_write_end(store->shared_sequence ? store->shared_sequence : &store->sequence);
+}
 
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU && nmbs->msg.unit_id != req_unit_id)
-        return NMBS_ERROR_INVALID_UNIT_ID;
 
-    if (nmbs->msg.fc != req_fc) {
-        if (nmbs->msg.fc - 0x80 == req_fc) {
-            err = recv(nmbs, 1);
-            if (err != NMBS_ERROR_NONE)
-                return err;
+nmbs_error nmbs_register_store_write(nmbs_register_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers) {
+    if (!register_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 
-            uint8_t exception = get_1(nmbs);
-            err = recv_msg_footer(nmbs);
-            if (err != NMBS_ERROR_NONE)
-                return err;
+    uint16_t* dst = nmbs_register_store_write_begin(store);
+    memcpy(dst + (address - store->address), registers, (size_t) quantity * 2);
+    nmbs_register_store_write_end(store);
 
-            if (exception < 1 || exception > 4)
-                return NMBS_ERROR_INVALID_RESPONSE;
+    return NMBS_ERROR_NONE;
+}
 
-            NMBS_DEBUG_PRINT("%d NMBS res <- address_rtu %d\texception %d\n", nmbs->address_rtu, nmbs->msg.unit_id,
-                             exception);
-            return (nmbs_error) exception;
-        }
 
-        return NMBS_ERROR_INVALID_RESPONSE;
-    }
+// Epochs of a nmbs_snapshot_store are even numbers, so they can be told apart from the odd states below.
+// A reader slot holds 0 when free, or the pinned epoch | 1.
+// A page state holds one of these values, or the epoch of the first version that no longer references the page.
+#define SNAPSHOT_PAGE_LIVE 1
+#define SNAPSHOT_PAGE_FREE 3
 
-    NMBS_DEBUG_PRINT("%d NMBS res <- address_rtu %d\tfc %d\t", nmbs->address_rtu, nmbs->msg.unit_id, nmbs->msg.fc);
 
-    return NMBS_ERROR_NONE;
+static uint16_t* snapshot_table(const nmbs_snapshot_store* store, uint32_t epoch) {
+    return store->tables + ((epoch / 2) & (uint32_t) (store->versions - 1)) * store->table_size;
 }
 
 
-#ifndef NMBS_CLIENT_DISABLED
-static void put_req_header(nmbs_t* nmbs, uint16_t data_length) {
-    put_msg_header(nmbs, data_length);
-#ifdef NMBS_DEBUG
-    printf("%d ", nmbs->address_rtu);
-    printf("NMBS req -> ");
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        if (nmbs->msg.broadcast)
-            printf("broadcast\t");
-        else
-            printf("address_rtu %d\t", nmbs->dest_address_rtu);
-    }
-
-    printf("fc %d\t", nmbs->msg.fc);
-#endif
+static bool snapshot_store_contains(const nmbs_snapshot_store* store, uint16_t address, uint16_t quantity) {
+    return address >= store->address && (uint32_t) address + quantity <= (uint32_t) store->address + store->count;
 }
-#endif
 
 
-#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
-        (!defined(NMBS_SERVER_DISABLED) &&                                                                             \
-         (!defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED)))
-static nmbs_error recv_read_discrete_res(nmbs_t* nmbs, nmbs_bitfield values) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_snapshot_store_create(nmbs_snapshot_store* store, uint32_t* memory, uint32_t memory_size,
+                                      uint16_t address, uint32_t count, uint8_t versions, uint8_t readers) {
+    if (!store || !memory)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    err = recv(nmbs, 1);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    if (count < 1 || (uint32_t) address + count > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t coils_bytes = get_1(nmbs);
-    NMBS_DEBUG_PRINT("b %d\t", coils_bytes);
+    if (versions < 2 || (versions & (versions - 1)) || readers < 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (coils_bytes > 250) {
-        return NMBS_ERROR_INVALID_RESPONSE;
-    }
+    uint32_t table_size = NMBS_SNAPSHOT_PAGES(count);
+    if (table_size * versions > 0xFFFF)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    err = recv(nmbs, coils_bytes);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    if (memory_size < NMBS_SNAPSHOT_STORE_MEMORY(count, (uint32_t) versions, (uint32_t) readers) * sizeof(uint32_t))
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    NMBS_DEBUG_PRINT("coils ");
-    for (int i = 0; i < coils_bytes; i++) {
-        uint8_t coil = get_1(nmbs);
-        if (values)
-            values[i] = coil;
-        NMBS_DEBUG_PRINT("%d ", coil);
+    // The pages of (versions) versions: enough to copy every page of each version that can be published while the
+    // oldest one is pinned
+    store->readers = memory;
+    store->page_states = memory + readers;
+    store->tables = (uint16_t*) (store->page_states + table_size * versions);
+    store->pages = store->tables + versions * table_size;
+    store->address = address;
+    store->count = count;
+    store->table_size = (uint16_t) table_size;
+    store->page_count = (uint16_t) (table_size * versions);
+    store->versions = versions;
+    store->readers_count = readers;
+    store->writer = 0;
+    store->epoch = 2;
+
+    for (uint8_t r = 0; r < readers; r++)
+        store->readers[r] = 0;
+
+    uint16_t* table = snapshot_table(store, store->epoch);
+    for (uint16_t p = 0; p < store->page_count; p++) {
+        if (p < table_size) {
+            table[p] = p;
+            store->page_states[p] = SNAPSHOT_PAGE_LIVE;
+        }
+        else {
+            store->page_states[p] = SNAPSHOT_PAGE_FREE;
+        }
     }
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    memset(store->pages, 0, (size_t) table_size * NMBS_SNAPSHOT_PAGE_SIZE * 2);
 
     return NMBS_ERROR_NONE;
 }
-#endif
-
-
-#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
-        (!defined(NMBS_SERVER_DISABLED) && (!defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) ||                   \
-                                            !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED)))
-static nmbs_error recv_read_registers_res(nmbs_t* nmbs, uint16_t quantity, uint16_t* registers) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
-
-    err = recv(nmbs, 1);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    uint8_t registers_bytes = get_1(nmbs);
-    NMBS_DEBUG_PRINT("b %d\t", registers_bytes);
 
-    if (registers_bytes > 250)
-        return NMBS_ERROR_INVALID_RESPONSE;
+void nmbs_snapshot_store_pin(nmbs_snapshot_store* store, nmbs_snapshot* snapshot) {
+    uint32_t epoch = NMBS_ATOMIC_LOAD(&store->epoch);
 
-    err = recv(nmbs, registers_bytes);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    uint8_t reader = 0;
+    while (true) {
+        uint32_t free_slot = 0;
+        if (NMBS_ATOMIC_CAS(&store->readers[reader], free_slot, epoch | 0x1))
+            break;
 
-    NMBS_DEBUG_PRINT("regs ");
-    for (int i = 0; i < registers_bytes / 2; i++) {
-        uint16_t reg = get_2(nmbs);
-        if (registers)
-            registers[i] = reg;
-        NMBS_DEBUG_PRINT("%d ", reg);
+        reader = (uint8_t) ((reader + 1) % store->readers_count);
     }
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    // The writer may have published a newer version before seeing our slot: in that case, pin the newer one
+    while (true) {
+        NMBS_FENCE_FULL();
+        uint32_t current = NMBS_ATOMIC_LOAD(&store->epoch);
+        if (current == epoch)
+            break;
 
-    if (registers_bytes != quantity * 2)
-        return NMBS_ERROR_INVALID_RESPONSE;
+        epoch = current;
+        store->readers[reader] = epoch | 0x1;
+    }
 
-    return NMBS_ERROR_NONE;
+    snapshot->store = store;
+    snapshot->table = snapshot_table(store, epoch);
+    snapshot->reader = reader;
 }
-#endif
-
 
-nmbs_error recv_write_single_coil_res(nmbs_t* nmbs, uint16_t address, uint16_t value_req) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+void nmbs_snapshot_store_unpin(nmbs_snapshot* snapshot) {
+    NMBS_FENCE_RELEASE();
+    snapshot->store->readers[snapshot->reader] = 0;
+}
 
-    uint16_t address_res = get_2(nmbs);
-    uint16_t value_res = get_2(nmbs);
 
-    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value_res);
+nmbs_error nmbs_snapshot_read(const nmbs_snapshot* snapshot, uint16_t address, uint16_t quantity,
+                              uint16_t* registers_out) {
+    const nmbs_snapshot_store* store = snapshot->store;
+    if (!snapshot_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    uint32_t offset = address - store->address;
+    uint32_t end = offset + quantity;
+    while (offset < end) {
+        uint32_t page_offset = offset % NMBS_SNAPSHOT_PAGE_SIZE;
+        uint32_t n = NMBS_SNAPSHOT_PAGE_SIZE - page_offset;
+        if (n > end - offset)
+            n = end - offset;
 
-    if (address_res != address)
-        return NMBS_ERROR_INVALID_RESPONSE;
+        const uint16_t* page = store->pages + (uint32_t) snapshot->table[offset / NMBS_SNAPSHOT_PAGE_SIZE] *
+                                                      NMBS_SNAPSHOT_PAGE_SIZE;
+        memcpy(registers_out, page + page_offset, n * 2);
 
-    if (value_res != value_req)
-        return NMBS_ERROR_INVALID_RESPONSE;
+        registers_out += n;
+        offset += n;
+    }
 
     return NMBS_ERROR_NONE;
 }
 
 
-nmbs_error recv_write_single_register_res(nmbs_t* nmbs, uint16_t address, uint16_t value_req) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_snapshot_store_read(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                    uint16_t* registers_out) {
+    if (!snapshot_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 
-    err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    nmbs_snapshot snapshot;
+    nmbs_snapshot_store_pin(store, &snapshot);
+    nmbs_error err = nmbs_snapshot_read(&snapshot, address, quantity, registers_out);
+    nmbs_snapshot_store_unpin(&snapshot);
 
-    uint16_t address_res = get_2(nmbs);
-    uint16_t value_res = get_2(nmbs);
-    NMBS_DEBUG_PRINT("a %d\tvalue %d ", address, value_res);
+    return err;
+}
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (address_res != address)
-        return NMBS_ERROR_INVALID_RESPONSE;
+static uint32_t snapshot_oldest_pinned(const nmbs_snapshot_store* store) {
+    NMBS_FENCE_FULL();
 
-    if (value_res != value_req)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    uint32_t oldest = store->epoch;
+    for (uint8_t r = 0; r < store->readers_count; r++) {
+        uint32_t pinned = NMBS_ATOMIC_LOAD(&store->readers[r]);
+        if (pinned && (int32_t) ((pinned & ~(uint32_t) 0x1) - oldest) < 0)
+            oldest = pinned & ~(uint32_t) 0x1;
+    }
 
-    return NMBS_ERROR_NONE;
+    return oldest;
 }
 
 
-nmbs_error recv_write_multiple_coils_res(nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+static uint16_t snapshot_alloc_page(nmbs_snapshot_store* store) {
+    // The pool always has enough pages. It only waits for a reader still moving its pin to the latest version.
+    while (true) {
+        uint32_t oldest = snapshot_oldest_pinned(store);
+        for (uint16_t p = 0; p < store->page_count; p++) {
+            uint32_t state = store->page_states[p];
+            if (state == SNAPSHOT_PAGE_FREE || (!(state & 0x1) && (int32_t) (oldest - state) >= 0)) {
+                store->page_states[p] = SNAPSHOT_PAGE_LIVE;
+                return p;
+            }
+        }
+    }
+}
 
-    err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    uint16_t address_res = get_2(nmbs);
-    uint16_t quantity_res = get_2(nmbs);
-    NMBS_DEBUG_PRINT("a %d\tq %d", address_res, quantity_res);
+// The table of the next version was last used (versions) publications ago, its readers must have left it
+static bool snapshot_next_table_free(const nmbs_snapshot_store* store) {
+    uint32_t reused = store->epoch + 2 - 2 * (uint32_t) store->versions;
+    return (int32_t) (snapshot_oldest_pinned(store) - reused) > 0;
+}
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (address_res != address)
-        return NMBS_ERROR_INVALID_RESPONSE;
+static bool snapshot_writer_lock(nmbs_snapshot_store* store) {
+    uint32_t unlocked = 0;
+    return NMBS_ATOMIC_CAS(&store->writer, unlocked, 1);
+}
 
-    if (quantity_res != quantity)
-        return NMBS_ERROR_INVALID_RESPONSE;
 
-    return NMBS_ERROR_NONE;
+static void snapshot_next_table_init(nmbs_snapshot_store* store) {
+    uint32_t epoch = store->epoch;
+    memcpy(snapshot_table(store, epoch + 2), snapshot_table(store, epoch), (size_t) store->table_size * 2);
 }
 
 
-nmbs_error recv_write_multiple_registers_res(nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+void nmbs_snapshot_store_begin(nmbs_snapshot_store* store) {
+    while (!snapshot_writer_lock(store))
+        ;
 
-    err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    while (!snapshot_next_table_free(store))
+        ;
 
-    uint16_t address_res = get_2(nmbs);
-    uint16_t quantity_res = get_2(nmbs);
-    NMBS_DEBUG_PRINT("a %d\tq %d", address_res, quantity_res);
+    snapshot_next_table_init(store);
+}
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (address_res != address)
-        return NMBS_ERROR_INVALID_RESPONSE;
+nmbs_error nmbs_snapshot_store_try_begin(nmbs_snapshot_store* store) {
+    if (!snapshot_writer_lock(store))
+        return NMBS_ERROR_WOULD_BLOCK;
 
-    if (quantity_res != quantity)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    if (!snapshot_next_table_free(store)) {
+        NMBS_FENCE_RELEASE();
+        store->writer = 0;
+        return NMBS_ERROR_WOULD_BLOCK;
+    }
 
+    snapshot_next_table_init(store);
     return NMBS_ERROR_NONE;
 }
 
 
-nmbs_error recv_read_file_record_res(nmbs_t* nmbs, uint16_t* registers, uint16_t count) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_snapshot_store_stage(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers) {
+    if (!snapshot_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    uint32_t next = store->epoch + 2;
+    const uint16_t* current = snapshot_table(store, store->epoch);
+    uint16_t* table = snapshot_table(store, next);
+
+    uint32_t offset = address - store->address;
+    uint32_t end = offset + quantity;
+    while (offset < end) {
+        uint32_t p = offset / NMBS_SNAPSHOT_PAGE_SIZE;
+        uint32_t page_offset = offset % NMBS_SNAPSHOT_PAGE_SIZE;
+        uint32_t n = NMBS_SNAPSHOT_PAGE_SIZE - page_offset;
+        if (n > end - offset)
+            n = end - offset;
+
+        // Copy the page on its first write in this version, and retire the old one
+        if (table[p] == current[p]) {
+            uint16_t page = snapshot_alloc_page(store);
+            memcpy(store->pages + (uint32_t) page * NMBS_SNAPSHOT_PAGE_SIZE,
+                   store->pages + (uint32_t) current[p] * NMBS_SNAPSHOT_PAGE_SIZE, NMBS_SNAPSHOT_PAGE_SIZE * 2);
+            store->page_states[current[p]] = next;
+            table[p] = page;
+        }
 
-    err = recv(nmbs, 1);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+        memcpy(store->pages + (uint32_t) table[p] * NMBS_SNAPSHOT_PAGE_SIZE + page_offset, registers, n * 2);
 
-    uint8_t response_size = get_1(nmbs);
-    if (response_size > 250) {
-        return NMBS_ERROR_INVALID_RESPONSE;
+        registers += n;
+        offset += n;
     }
 
-    err = recv(nmbs, response_size);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    return NMBS_ERROR_NONE;
+}
 
-    uint8_t subreq_data_size = get_1(nmbs) - 1;
-    uint8_t subreq_reference_type = get_1(nmbs);
-    uint16_t* subreq_record_data = (uint16_t*) get_n(nmbs, subreq_data_size);
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+void nmbs_snapshot_store_publish(nmbs_snapshot_store* store) {
+    NMBS_FENCE_RELEASE();
+    store->epoch = store->epoch + 2;
+    NMBS_FENCE_RELEASE();
+    store->writer = 0;
+}
 
-    if (registers) {
-        if (subreq_reference_type != 6)
-            return NMBS_ERROR_INVALID_RESPONSE;
 
-        if (count != (subreq_data_size / 2))
-            return NMBS_ERROR_INVALID_RESPONSE;
+nmbs_error nmbs_snapshot_store_write(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers) {
+    if (!snapshot_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 
-        swap_regs(subreq_record_data, subreq_data_size / 2);
-        memcpy(registers, subreq_record_data, subreq_data_size);
-    }
+    nmbs_snapshot_store_begin(store);
+    nmbs_error err = nmbs_snapshot_store_stage(store, address, quantity, registers);
+    nmbs_snapshot_store_publish(store);
 
-    return NMBS_ERROR_NONE;
+    return err;
 }
 
 
-nmbs_error recv_write_file_record_res(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number,
-                                      const uint16_t* registers, uint16_t count) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_snapshot_store_try_write(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                         const uint16_t* registers) {
+    if (!snapshot_store_contains(store, address, quantity))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 
-    err = recv(nmbs, 1);
+    nmbs_error err = nmbs_snapshot_store_try_begin(store);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    uint8_t response_size = get_1(nmbs);
-    if (response_size > 251)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    err = nmbs_snapshot_store_stage(store, address, quantity, registers);
+    nmbs_snapshot_store_publish(store);
 
-    err = recv(nmbs, response_size);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    return err;
+}
 
-    uint8_t subreq_reference_type = get_1(nmbs);
-    uint16_t subreq_file_number = get_2(nmbs);
-    uint16_t subreq_record_number = get_2(nmbs);
-    uint16_t subreq_record_length = get_2(nmbs);
-    NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", subreq_file_number, subreq_record_number, subreq_record_length);
 
-    uint16_t subreq_data_size = subreq_record_length * 2;
-    uint16_t* subreq_record_data = (uint16_t*) get_n(nmbs, subreq_data_size);
+uint32_t nmbs_image_size(uint32_t holding_registers_count, uint32_t input_registers_count) {
+    uint32_t holding_registers_size = (holding_registers_count * 2 + 3) & ~(uint32_t) 0x3;
+    return NMBS_IMAGE_HEADER_SIZE + 2 * sizeof(nmbs_bitfield_65536) + holding_registers_size +
+           input_registers_count * 2;
+}
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (registers) {
-        if (subreq_reference_type != 6)
-            return NMBS_ERROR_INVALID_RESPONSE;
+nmbs_error nmbs_image_format(void* memory, uint32_t size, uint32_t holding_registers_count,
+                             uint32_t input_registers_count) {
+    if (!memory || ((uintptr_t) memory & 0x3))
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-        if (subreq_file_number != file_number)
-            return NMBS_ERROR_INVALID_RESPONSE;
+    if (holding_registers_count > 0x10000 || input_registers_count > 0x10000)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-        if (subreq_record_number != record_number)
-            return NMBS_ERROR_INVALID_RESPONSE;
+    uint32_t image_size = nmbs_image_size(holding_registers_count, input_registers_count);
+    if (size < image_size)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-        if (subreq_record_length != count)
-            return NMBS_ERROR_INVALID_RESPONSE;
+    memset(memory, 0, image_size);
 
-        swap_regs(subreq_record_data, subreq_record_length);
-        if (memcmp(registers, subreq_record_data, subreq_data_size) != 0)
-            return NMBS_ERROR_INVALID_RESPONSE;
-    }
+    nmbs_image_header* header = (nmbs_image_header*) memory;
+    header->version = NMBS_IMAGE_VERSION;
+    header->size = image_size;
+    header->sequence = 0;
+    header->holding_registers_count = holding_registers_count;
+    header->input_registers_count = input_registers_count;
+    header->coils_offset = NMBS_IMAGE_HEADER_SIZE;
+    header->discrete_inputs_offset = header->coils_offset + sizeof(nmbs_bitfield_65536);
+    header->holding_registers_offset = header->discrete_inputs_offset + sizeof(nmbs_bitfield_65536);
+    header->input_registers_offset = header->holding_registers_offset + ((holding_registers_count * 2 + 3) & ~0x3);
+
+    // Written last, so a partially formatted image is never attached
+    NMBS_FENCE_RELEASE();
+    header->magic = NMBS_IMAGE_MAGIC;
 
     return NMBS_ERROR_NONE;
 }
 
-nmbs_error recv_read_device_identification_res(nmbs_t* nmbs, uint8_t buffers_count, char** buffers_out,
-                                               uint8_t buffers_length, const uint8_t* order, uint8_t* ids_out,
-                                               uint8_t* next_object_id_out, uint8_t* objects_count_out) {
-    nmbs_error err = recv_res_header(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    err = recv(nmbs, 6);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_image_attach(nmbs_image* image, void* memory, uint32_t size) {
+    if (!image || !memory || ((uintptr_t) memory & 0x3) || size < NMBS_IMAGE_HEADER_SIZE)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t mei_type = get_1(nmbs);
-    if (mei_type != 0x0E)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    nmbs_image_header* header = (nmbs_image_header*) memory;
+    if (header->magic != NMBS_IMAGE_MAGIC || header->version != NMBS_IMAGE_VERSION)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t read_device_id_code = get_1(nmbs);
-    if (read_device_id_code < 1 || read_device_id_code > 4)
-        return NMBS_ERROR_INVALID_RESPONSE;
-
-    uint8_t conformity_level = get_1(nmbs);
-    if (conformity_level < 1 || (conformity_level > 3 && conformity_level < 0x81) || conformity_level > 0x83)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    if (header->holding_registers_count > 0x10000 || header->input_registers_count > 0x10000)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t more_follows = get_1(nmbs);
-    if (more_follows != 0 && more_follows != 0xFF)
-        return NMBS_ERROR_INVALID_RESPONSE;
+    uint32_t image_size = nmbs_image_size(header->holding_registers_count, header->input_registers_count);
+    if (header->size != image_size || size < image_size)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t next_object_id = get_1(nmbs);
+    if (header->coils_offset != NMBS_IMAGE_HEADER_SIZE ||
+        header->discrete_inputs_offset != header->coils_offset + sizeof(nmbs_bitfield_65536) ||
+        header->holding_registers_offset != header->discrete_inputs_offset + sizeof(nmbs_bitfield_65536) ||
+        header->input_registers_offset !=
+                header->holding_registers_offset + ((header->holding_registers_count * 2 + 3) & ~(uint32_t) 0x3))
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t objects_count = get_1(nmbs);
-    if (objects_count_out)
-        *objects_count_out = objects_count;
+    uint8_t* base = (uint8_t*) memory;
+    image->header = header;
+    image->coils = base + header->coils_offset;
+    image->discrete_inputs = base + header->discrete_inputs_offset;
 
-    if (buffers_count == 0) {
-        buffers_out = NULL;
+    memset(&image->holding_registers, 0, sizeof(nmbs_register_store));
+    if (header->holding_registers_count) {
+        nmbs_register_store_create(&image->holding_registers, (uint16_t*) (base + header->holding_registers_offset), 0,
+                                   header->holding_registers_count);
+        image->holding_registers.shared_sequence = &header->sequence;
     }
-    else if (objects_count > buffers_count)
-        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (more_follows == 0)
-        next_object_id = 0x7F;    // This value is reserved in the spec, we use it to signal stream is finished
+    memset(&image->input_registers, 0, sizeof(nmbs_register_store));
+    if (header->input_registers_count) {
+        nmbs_register_store_create(&image->input_registers, (uint16_t*) (base + header->input_registers_offset), 0,
+                                   header->input_registers_count);
+        image->input_registers.shared_sequence = &header->sequence;
+    }
 
-    if (next_object_id_out)
-        *next_object_id_out = next_object_id;
+    return NMBS_ERROR_NONE;
+}
 
-    uint8_t res_size_left = 253 - 7;
-    for (int i = 0; i < objects_count; i++) {
-        err = recv(nmbs, 2);
-        if (err != NMBS_ERROR_NONE)
-            return err;
 
-        uint8_t object_id = get_1(nmbs);
-        uint8_t object_length = get_1(nmbs);
-        res_size_left -= 2;
+void nmbs_image_recover(nmbs_image* image) {
+    if (image->header->sequence & 0x1)
+        image->header->sequence = image->header->sequence + 1;
+}
 
-        if (object_length > res_size_left)
-            return NMBS_ERROR_INVALID_RESPONSE;
 
-        err = recv(nmbs, object_length);
-        if (err != NMBS_ERROR_NONE)
-            return err;
+void nmbs_image_write_begin(nmbs_image* image) {
+    seqlock_write_begin(&image->header->sequence);
+}
 
-        const char* str = (const char*) get_n(nmbs, object_length);
 
-        if (ids_out)
-            ids_out[i] = object_id;
+void nmbs_image_write_end(nmbs_image* image) {
+    seqlock_write_end(&image->header->sequence);
+}
 
-        uint8_t buf_index = i;
-        if (order)
-            buf_index = order[object_id];
-        if (buffers_out) {
-            strncpy(buffers_out[buf_index], str, buffers_length);
-            buffers_out[buf_index][object_length] = 0;
-        }
-    }
 
-    return recv_msg_footer(nmbs);
+uint32_t nmbs_image_read_begin(const nmbs_image* image) {
+    return seqlock_read_begin(&image->header->sequence);
 }
 
 
-#ifndef NMBS_SERVER_DISABLED
-#if !defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED)
-static nmbs_error handle_read_discrete(nmbs_t* nmbs,
-                                       nmbs_error (*callback)(uint16_t, uint16_t, nmbs_bitfield, uint8_t, void*)) {
-    nmbs_error err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+bool nmbs_image_read_retry(const nmbs_image* image, uint32_t begin) {
+    return seqlock_read_retry(&image->header->sequence, begin);
+}
 
-    uint16_t address = get_2(nmbs);
-    uint16_t quantity = get_2(nmbs);
 
-    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+nmbs_error nmbs_response_cache_create(nmbs_response_cache* cache, nmbs_response_cache_entry* entries, uint16_t size) {
+    if (!cache || !entries || size < 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    cache->entries = entries;
+    cache->size = size;
+    cache->count = 0;
 
-    if (!nmbs->msg.ignored) {
-        if (quantity < 1 || quantity > 2000)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    return NMBS_ERROR_NONE;
+}
 
-        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
 
-        if (callback) {
-            nmbs_bitfield bitfield = {0};
-            err = callback(address, quantity, bitfield, nmbs->msg.unit_id, nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+nmbs_error nmbs_response_cache_add(nmbs_response_cache* cache, uint8_t unit_id, uint8_t fc, uint16_t address,
+                                   uint16_t quantity) {
+    if (cache->count == cache->size)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+    if (fc < 1 || fc > 4 || quantity < 1 || (uint32_t) address + quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-            if (!nmbs->msg.broadcast) {
-                uint8_t discrete_bytes = (quantity + 7) / 8;
-                put_res_header(nmbs, 1 + discrete_bytes);
+    if ((fc <= 2 && quantity > 2000) || (fc >= 3 && quantity > 125))
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-                put_1(nmbs, discrete_bytes);
+    nmbs_response_cache_entry* entry = &cache->entries[cache->count];
+    entry->invalidations = 1;
+    entry->filled_at = 0;
+    entry->unit_id = unit_id;
+    entry->fc = fc;
+    entry->address = address;
+    entry->quantity = quantity;
+    entry->data_length = 0;
 
-                NMBS_DEBUG_PRINT("b %d\t", discrete_bytes);
+    cache->count++;
 
-                NMBS_DEBUG_PRINT("coils ");
-                for (int i = 0; i < discrete_bytes; i++) {
-                    put_1(nmbs, bitfield[i]);
-                    NMBS_DEBUG_PRINT("%d ", bitfield[i]);
-                }
+    return NMBS_ERROR_NONE;
+}
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
-            }
-        }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
-    }
-    else {
-        return recv_read_discrete_res(nmbs, NULL);
+
+void nmbs_response_cache_invalidate(nmbs_response_cache* cache, uint8_t fc, uint16_t address, uint16_t quantity) {
+    for (uint16_t i = 0; i < cache->count; i++) {
+        nmbs_response_cache_entry* entry = &cache->entries[i];
+        if (entry->fc == fc && (uint32_t) address + quantity > entry->address &&
+            (uint32_t) entry->address + entry->quantity > address)
+            entry->invalidations = entry->invalidations + 1;
     }
 
-    return NMBS_ERROR_NONE;
+    NMBS_FENCE_RELEASE();
 }
-#endif
 
 
-#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED)
-static nmbs_error handle_read_registers(nmbs_t* nmbs,
-                                        nmbs_error (*callback)(uint16_t, uint16_t, uint16_t*, uint8_t, void*)) {
-    nmbs_error err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+void nmbs_response_cache_invalidate_all(nmbs_response_cache* cache) {
+    for (uint16_t i = 0; i < cache->count; i++)
+        cache->entries[i].invalidations = cache->entries[i].invalidations + 1;
 
-    uint16_t address = get_2(nmbs);
-    uint16_t quantity = get_2(nmbs);
+    NMBS_FENCE_RELEASE();
+}
 
-    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_change_log_create(nmbs_change_log* log, nmbs_change* entries, uint32_t size,
+                                  void (*notify)(void* arg), void* notify_arg) {
+    if (!log || !entries || size < 2)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (!nmbs->msg.ignored) {
-        if (quantity < 1 || quantity > 125)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    log->entries = entries;
+    log->size = size;
+    log->head = 0;
+    log->tail = 0;
+    log->dropped = 0;
+    log->dropped_reported = 0;
+    log->notify = notify;
+    log->notify_arg = notify_arg;
 
-        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    return NMBS_ERROR_NONE;
+}
 
-        if (callback) {
-            uint16_t regs[125] = {0};
-            err = callback(address, quantity, regs, nmbs->msg.unit_id, nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+static bool change_merge(nmbs_change* last, const nmbs_change* change) {
+    if (last->type != change->type || last->unit_id != change->unit_id || last->file_number != change->file_number)
+        return false;
 
-            // TODO check all these read request broadcast use cases
-            if (!nmbs->msg.broadcast) {
-                uint8_t regs_bytes = quantity * 2;
-                put_res_header(nmbs, 1 + regs_bytes);
+    uint32_t last_end = (uint32_t) last->address + last->quantity;
+    uint32_t change_end = (uint32_t) change->address + change->quantity;
+    if (change->address > last_end || last->address > change_end)
+        return false;
 
-                put_1(nmbs, regs_bytes);
+    uint32_t start = last->address < change->address ? last->address : change->address;
+    uint32_t end = last_end > change_end ? last_end : change_end;
+    if (end - start > 0xFFFF)
+        return false;
 
-                NMBS_DEBUG_PRINT("b %d\t", regs_bytes);
+    last->address = (uint16_t) start;
+    last->quantity = (uint16_t) (end - start);
 
-                NMBS_DEBUG_PRINT("regs ");
-                for (int i = 0; i < quantity; i++) {
-                    put_2(nmbs, regs[i]);
-                    NMBS_DEBUG_PRINT("%d ", regs[i]);
-                }
+    return true;
+}
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
-            }
+
+uint32_t nmbs_change_log_drain(nmbs_change_log* log, nmbs_change* changes_out, uint32_t changes_count,
+                               bool* overflow_out) {
+    uint32_t head = NMBS_ATOMIC_LOAD(&log->head);
+    uint32_t tail = log->tail;
+    uint32_t count = 0;
+
+    while (tail != head) {
+        const nmbs_change* change = &log->entries[tail];
+        if (count > 0 && change_merge(&changes_out[count - 1], change)) {
+            // Merged into the previous change
+        }
+        else if (count < changes_count) {
+            changes_out[count] = *change;
+            count++;
         }
         else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+            break;
         }
+
+        tail = (tail + 1) % log->size;
     }
-    else {
-        return recv_read_registers_res(nmbs, quantity, NULL);
+
+    NMBS_FENCE_RELEASE();
+    log->tail = tail;
+
+    if (overflow_out) {
+        uint32_t dropped = NMBS_ATOMIC_LOAD(&log->dropped);
+        *overflow_out = dropped != log->dropped_reported;
+        log->dropped_reported = dropped;
     }
 
-    return NMBS_ERROR_NONE;
+    return count;
 }
-#endif
 
 
-#ifndef NMBS_SERVER_READ_COILS_DISABLED
-static nmbs_error handle_read_coils(nmbs_t* nmbs) {
-    return handle_read_discrete(nmbs, nmbs->callbacks.read_coils);
+#ifdef NMBS_COMM_EVENT_LOG_ENABLED
+void nmbs_comm_event_log_create(nmbs_comm_event_log* log) {
+    memset(log, 0, sizeof(nmbs_comm_event_log));
 }
-#endif
 
 
-#ifndef NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED
-static nmbs_error handle_read_discrete_inputs(nmbs_t* nmbs) {
-    return handle_read_discrete(nmbs, nmbs->callbacks.read_discrete_inputs);
-}
-#endif
+static void comm_event(nmbs_t* nmbs, uint8_t event) {
+    nmbs_comm_event_log* log = nmbs->comm_event_log;
+    if (!log)
+        return;
 
+    if ((event & NMBS_COMM_EVENT_RECEIVE) && !(event & NMBS_COMM_EVENT_RECEIVE_ERROR))
+        log->message_count++;
 
-#ifndef NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED
-static nmbs_error handle_read_holding_registers(nmbs_t* nmbs) {
-    return handle_read_registers(nmbs, nmbs->callbacks.read_holding_registers);
+    // The oldest event is overwritten when the log is full
+    log->events[log->head] = event;
+    log->head = (uint8_t) ((log->head + 1) % NMBS_COMM_EVENT_LOG_SIZE);
+    if (log->count < NMBS_COMM_EVENT_LOG_SIZE)
+        log->count++;
 }
-#endif
 
 
-#ifndef NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED
-static nmbs_error handle_read_input_registers(nmbs_t* nmbs) {
-    return handle_read_registers(nmbs, nmbs->callbacks.read_input_registers);
+static uint8_t comm_event_exception(uint8_t exception) {
+    if (exception == 4)
+        return NMBS_COMM_EVENT_SEND_ABORT_EXCEPTION;
+
+    if (exception == 5 || exception == 6)
+        return NMBS_COMM_EVENT_SEND_BUSY_EXCEPTION;
+
+    if (exception == 7)
+        return NMBS_COMM_EVENT_SEND_NAK_EXCEPTION;
+
+    return NMBS_COMM_EVENT_SEND_READ_EXCEPTION;
 }
 #endif
 
 
-#ifndef NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED
-static nmbs_error handle_write_single_coil(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+nmbs_error nmbs_fifo_queue_create(nmbs_fifo_queue* queue, uint16_t* values, uint32_t size) {
+    if (!queue || !values || size < 2)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint16_t address = get_2(nmbs);
-    uint16_t value = get_2(nmbs);
+    queue->values = values;
+    queue->size = size;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->dropped = 0;
 
-    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+    return NMBS_ERROR_NONE;
+}
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    if (!nmbs->msg.ignored) {
-        if (nmbs->callbacks.write_single_coil) {
-            if (value != 0 && value != 0xFF00)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+bool nmbs_fifo_queue_push(nmbs_fifo_queue* queue, uint16_t value) {
+    uint32_t head = queue->head;
+    uint32_t next = (head + 1) % queue->size;
+    if (next == NMBS_ATOMIC_LOAD(&queue->tail)) {
+        queue->dropped = queue->dropped + 1;
+        return false;
+    }
 
-            err = nmbs->callbacks.write_single_coil(address, value == 0 ? false : true, nmbs->msg.unit_id,
-                                                    nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+    queue->values[head] = value;
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+    NMBS_FENCE_RELEASE();
+    queue->head = next;
 
-            if (!nmbs->msg.broadcast) {
-                put_res_header(nmbs, 4);
+    return true;
+}
 
-                put_2(nmbs, address);
-                put_2(nmbs, value);
-                NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
-            }
-        }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
-    }
-    else {
-        return recv_write_single_coil_res(nmbs, address, value);
+uint32_t nmbs_fifo_queue_pop(nmbs_fifo_queue* queue, uint16_t* values_out, uint32_t count) {
+    uint32_t head = NMBS_ATOMIC_LOAD(&queue->head);
+    uint32_t tail = queue->tail;
+    uint32_t popped = 0;
+
+    while (tail != head && popped < count) {
+        values_out[popped++] = queue->values[tail];
+        tail = (tail + 1) % queue->size;
     }
 
-    return NMBS_ERROR_NONE;
+    NMBS_FENCE_RELEASE();
+    queue->tail = tail;
+
+    return popped;
 }
-#endif
 
 
-#ifndef NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED
-static nmbs_error handle_write_single_register(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 4);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+uint32_t nmbs_fifo_queue_count(const nmbs_fifo_queue* queue) {
+    uint32_t head = NMBS_ATOMIC_LOAD(&queue->head);
+    uint32_t tail = NMBS_ATOMIC_LOAD(&queue->tail);
 
-    uint16_t address = get_2(nmbs);
-    uint16_t value = get_2(nmbs);
+    return (head + queue->size - tail) % queue->size;
+}
 
-    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+uint32_t nmbs_fifo_queue_dropped(const nmbs_fifo_queue* queue) {
+    return NMBS_ATOMIC_LOAD(&queue->dropped);
+}
 
-    if (!nmbs->msg.ignored) {
-        if (nmbs->callbacks.write_single_register) {
-            err = nmbs->callbacks.write_single_register(address, value, nmbs->msg.unit_id, nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+static void atomic_add(volatile uint32_t* counter, uint32_t value) {
+    while (true) {
+        uint32_t current = NMBS_ATOMIC_LOAD(counter);
+        if (NMBS_ATOMIC_CAS(counter, current, current + value))
+            return;
+    }
+}
 
-            if (!nmbs->msg.broadcast) {
-                put_res_header(nmbs, 4);
 
-                put_2(nmbs, address);
-                put_2(nmbs, value);
-                NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+nmbs_error nmbs_buffer_pool_create(nmbs_buffer_pool* pool, nmbs_pool_buffer* buffers, uint16_t count) {
+    if (!pool || !buffers || count == 0 || count == 0xFFFF)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
-            }
-        }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
-    }
-    else {
-        return recv_write_single_register_res(nmbs, address, value);
-    }
+    memset(pool, 0, sizeof(nmbs_buffer_pool));
+    pool->buffers = buffers;
+    pool->count = count;
+
+    // Free buffers are linked by index + 1, 0 terminates the list
+    for (uint16_t i = 0; i < count; i++)
+        buffers[i].next = (uint16_t) (i + 1 < count ? i + 2 : 0);
+
+    // Lower 16 bits are the index + 1 of the top buffer, upper 16 bits are the ABA tag
+    NMBS_FENCE_RELEASE();
+    pool->head = 1;
 
     return NMBS_ERROR_NONE;
 }
-#endif
 
 
-#ifndef NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED
-static nmbs_error handle_write_multiple_coils(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 5);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+uint8_t* nmbs_buffer_pool_acquire(nmbs_buffer_pool* pool) {
+    uint16_t index;
+    while (true) {
+        uint32_t head = NMBS_ATOMIC_LOAD(&pool->head);
+        index = (uint16_t) (head & 0xFFFF);
+        if (index == 0) {
+            atomic_add(&pool->exhausted, 1);
+            return NULL;
+        }
 
-    uint16_t address = get_2(nmbs);
-    uint16_t quantity = get_2(nmbs);
-    uint8_t coils_bytes = get_1(nmbs);
+        uint16_t next = pool->buffers[index - 1].next;
+        uint32_t desired = ((head + 0x10000) & 0xFFFF0000) | next;
+        if (NMBS_ATOMIC_CAS(&pool->head, head, desired))
+            break;
+    }
 
-    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\tcoils ", address, quantity, coils_bytes);
+    atomic_add(&pool->acquired, 1);
+    atomic_add(&pool->in_use, 1);
 
-    if (coils_bytes > 246)
-        return NMBS_ERROR_INVALID_REQUEST;
+    uint32_t in_use = NMBS_ATOMIC_LOAD(&pool->in_use);
+    while (true) {
+        uint32_t peak = NMBS_ATOMIC_LOAD(&pool->peak_in_use);
+        if (in_use <= peak || NMBS_ATOMIC_CAS(&pool->peak_in_use, peak, in_use))
+            break;
+    }
 
-    err = recv(nmbs, coils_bytes);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    return pool->buffers[index - 1].buf;
+}
 
-    nmbs_bitfield coils = {0};
-    for (int i = 0; i < coils_bytes; i++) {
-        coils[i] = get_1(nmbs);
-        NMBS_DEBUG_PRINT("%d ", coils[i]);
+
+void nmbs_buffer_pool_release(nmbs_buffer_pool* pool, uint8_t* buf) {
+    uint16_t index = (uint16_t) ((nmbs_pool_buffer*) buf - pool->buffers);
+
+    while (true) {
+        uint32_t head = NMBS_ATOMIC_LOAD(&pool->head);
+        pool->buffers[index].next = (uint16_t) (head & 0xFFFF);
+        uint32_t desired = ((head + 0x10000) & 0xFFFF0000) | (uint32_t) (index + 1);
+        NMBS_FENCE_RELEASE();
+        if (NMBS_ATOMIC_CAS(&pool->head, head, desired))
+            break;
     }
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    atomic_add(&pool->in_use, (uint32_t) -1);
+}
 
-    if (!nmbs->msg.ignored) {
-        if (quantity < 1 || quantity > 0x07B0)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+void nmbs_buffer_pool_get_stats(const nmbs_buffer_pool* pool, nmbs_buffer_pool_stats* stats_out) {
+    stats_out->acquired = NMBS_ATOMIC_LOAD(&pool->acquired);
+    stats_out->exhausted = NMBS_ATOMIC_LOAD(&pool->exhausted);
+    stats_out->in_use = NMBS_ATOMIC_LOAD(&pool->in_use);
+    stats_out->peak_in_use = NMBS_ATOMIC_LOAD(&pool->peak_in_use);
+}
 
-        if (coils_bytes == 0)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        if ((quantity + 7) / 8 != coils_bytes)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+static nmbs_error transfer_result(int32_t ret, uint16_t count) {
+    if (ret == count)
+        return NMBS_ERROR_NONE;
 
-        if (nmbs->callbacks.write_multiple_coils) {
-            err = nmbs->callbacks.write_multiple_coils(address, quantity, coils, nmbs->msg.unit_id,
-                                                       nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+    if (ret < count) {
+        if (ret < 0)
+            return NMBS_ERROR_TRANSPORT;
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+        return NMBS_ERROR_TIMEOUT;
+    }
 
-            if (!nmbs->msg.broadcast) {
-                put_res_header(nmbs, 4);
+    return NMBS_ERROR_TRANSPORT;
+}
 
-                put_2(nmbs, address);
-                put_2(nmbs, quantity);
-                NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
+#ifndef NMBS_PIPELINING_DISABLED
+// Serves the read from the read-ahead buffer, refilling it with whatever the transport already has
+static nmbs_error recv_buffered(nmbs_t* nmbs, uint8_t* buf, uint16_t count) {
+    uint16_t buffered = (uint16_t) (nmbs->rx_end - nmbs->rx_start);
+    if (buffered < count) {
+        memmove(nmbs->rx_buf, nmbs->rx_buf + nmbs->rx_start, buffered);
+        nmbs->rx_start = 0;
+        nmbs->rx_end = buffered;
+
+        // Read ahead whatever the transport already has, without waiting
+        uint16_t space = (uint16_t) (nmbs->rx_size - nmbs->rx_end);
+        if (space > 0) {
+            int32_t ret = NMBS_PLATFORM(nmbs)->read(nmbs->rx_buf + nmbs->rx_end, space, 0, NMBS_PLATFORM_ARG(nmbs));
+            if (ret < 0 || ret > space) {
+                nmbs->rx_end = 0;
+                return NMBS_ERROR_TRANSPORT;
             }
+
+            nmbs->rx_end = (uint16_t) (nmbs->rx_end + ret);
+            buffered = nmbs->rx_end;
         }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
-    }
-    else {
-        return recv_write_multiple_coils_res(nmbs, address, quantity);
     }
 
-    return NMBS_ERROR_NONE;
-}
-#endif
-
+    uint16_t from_rx = buffered < count ? buffered : count;
+    memcpy(buf, nmbs->rx_buf + nmbs->rx_start, from_rx);
+    nmbs->rx_start = (uint16_t) (nmbs->rx_start + from_rx);
 
-#ifndef NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED
-static nmbs_error handle_write_multiple_registers(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 5);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    if (from_rx == count)
+        return NMBS_ERROR_NONE;
 
-    uint16_t address = get_2(nmbs);
-    uint16_t quantity = get_2(nmbs);
-    uint8_t registers_bytes = get_1(nmbs);
+    // Wait for the rest of the message
+    uint16_t missing = (uint16_t) (count - from_rx);
+    int32_t ret = NMBS_PLATFORM(nmbs)->read(buf + from_rx, missing, nmbs->byte_timeout_ms, NMBS_PLATFORM_ARG(nmbs));
+    return transfer_result(ret, missing);
+}
+#endif
 
-    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\tregs ", address, quantity, registers_bytes);
 
-    err = recv(nmbs, registers_bytes);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+static nmbs_error recv_into(nmbs_t* nmbs, uint8_t* buf, uint16_t count) {
+#ifndef NMBS_PIPELINING_DISABLED
+    if (nmbs->rx_buf && nmbs->transport == NMBS_TRANSPORT_TCP)
+        return recv_buffered(nmbs, buf, count);
+#endif
 
-    if (registers_bytes > 246)
-        return NMBS_ERROR_INVALID_REQUEST;
+    int32_t ret = NMBS_PLATFORM(nmbs)->read(buf, count, nmbs->byte_timeout_ms, NMBS_PLATFORM_ARG(nmbs));
+    return transfer_result(ret, count);
+}
 
-    uint16_t registers[0x007B];
-    for (int i = 0; i < registers_bytes / 2; i++) {
-        registers[i] = get_2(nmbs);
-        NMBS_DEBUG_PRINT("%d ", registers[i]);
-    }
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+static nmbs_error recv(nmbs_t* nmbs, uint16_t count) {
+    return recv_into(nmbs, nmbs->msg_buf + nmbs->msg.buf_idx, count);
+}
 
-    if (!nmbs->msg.ignored) {
-        if (quantity < 1 || quantity > 0x007B)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+#if !defined(NMBS_SERVER_DISABLED) && !defined(NMBS_PIPELINING_DISABLED)
+static nmbs_error tx_flush(nmbs_t* nmbs) {
+    uint16_t count = nmbs->tx_len;
+    if (count == 0)
+        return NMBS_ERROR_NONE;
 
-        if (registers_bytes == 0)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    nmbs->tx_len = 0;
+    int32_t ret = NMBS_PLATFORM(nmbs)->write(nmbs->tx_buf, count, nmbs->byte_timeout_ms, NMBS_PLATFORM_ARG(nmbs));
+    return transfer_result(ret, count);
+}
+#endif
 
-        if (registers_bytes != quantity * 2)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        if (nmbs->callbacks.write_multiple_registers) {
-            err = nmbs->callbacks.write_multiple_registers(address, quantity, registers, nmbs->msg.unit_id,
-                                                           nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+static nmbs_error send(nmbs_t* nmbs, uint16_t count) {
+#if !defined(NMBS_SERVER_DISABLED) && !defined(NMBS_PIPELINING_DISABLED)
+    // Server responses are coalesced, nmbs_server_poll() sends them after handling all the pipelined requests
+    if (nmbs->tx_buf && nmbs->transport == NMBS_TRANSPORT_TCP && nmbs->rx_buf) {
+        if (nmbs->tx_len + count > nmbs->tx_size) {
+            nmbs_error err = tx_flush(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+        memcpy(nmbs->tx_buf + nmbs->tx_len, nmbs->msg_buf, count);
+        nmbs->tx_len = (uint16_t) (nmbs->tx_len + count);
+        return NMBS_ERROR_NONE;
+    }
+#endif
 
-            if (!nmbs->msg.broadcast) {
-                put_res_header(nmbs, 4);
+    int32_t ret = NMBS_PLATFORM(nmbs)->write(nmbs->msg_buf, count, nmbs->byte_timeout_ms, NMBS_PLATFORM_ARG(nmbs));
+    return transfer_result(ret, count);
+}
 
-                put_2(nmbs, address);
-                put_2(nmbs, quantity);
-                NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
 
-                err = send_msg(nmbs);
-                if (err != NMBS_ERROR_NONE)
-                    return err;
-            }
-        }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
+// Counts a received message, or a bus error if its CRC did not match
+static nmbs_error count_msg(nmbs_t* nmbs, bool crc_valid) {
+    if (!crc_valid) {
+        NMBS_DIAGNOSTICS_COUNT(nmbs, bus_errors);
+        NMBS_COMM_EVENT(nmbs, NMBS_COMM_EVENT_RECEIVE | NMBS_COMM_EVENT_RECEIVE_ERROR);
+        return NMBS_ERROR_CRC;
     }
-    else {
-        return recv_write_multiple_registers_res(nmbs, address, quantity);
+
+    NMBS_DIAGNOSTICS_COUNT(nmbs, bus_messages);
+    if (!nmbs->msg.ignored) {
+        NMBS_DIAGNOSTICS_COUNT(nmbs, server_messages);
+        NMBS_COMM_EVENT(nmbs, NMBS_COMM_EVENT_RECEIVE | (nmbs->msg.broadcast ? NMBS_COMM_EVENT_RECEIVE_BROADCAST : 0));
     }
 
     return NMBS_ERROR_NONE;
 }
-#endif
 
-#ifndef NMBS_SERVER_READ_FILE_RECORD_DISABLED
-static nmbs_error handle_read_file_record(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 1);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    uint8_t request_size = get_1(nmbs);
-    if (request_size > 245)
-        return NMBS_ERROR_INVALID_REQUEST;
+static nmbs_error recv_msg_footer(nmbs_t* nmbs) {
+    NMBS_DEBUG_PRINT("\n");
 
-    err = recv(nmbs, request_size);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    bool crc_valid = true;
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        uint16_t crc = NMBS_PLATFORM(nmbs)->crc_calc(nmbs->msg_buf, nmbs->msg.buf_idx, NMBS_PLATFORM_ARG(nmbs));
 
-    const uint8_t subreq_header_size = 7;
-    const uint8_t subreq_count = request_size / subreq_header_size;
+        nmbs_error err = recv(nmbs, 2);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-    struct {
-        uint8_t reference_type;
-        uint16_t file_number;
-        uint16_t record_number;
-        uint16_t record_length;
+        uint16_t recv_crc = get_2(nmbs);
+        crc_valid = recv_crc == crc;
     }
-#ifdef __STDC_NO_VLA__
-    subreq[35];    // 245 / subreq_header_size
-#else
-    subreq[subreq_count];
-#endif
 
-    uint8_t response_data_size = 0;
+    return count_msg(nmbs, crc_valid);
+}
 
-    for (uint8_t i = 0; i < subreq_count; i++) {
-        subreq[i].reference_type = get_1(nmbs);
-        subreq[i].file_number = get_2(nmbs);
-        subreq[i].record_number = get_2(nmbs);
-        subreq[i].record_length = get_2(nmbs);
 
-        response_data_size += 2 + subreq[i].record_length * 2;
-    }
+// Receives the first byte of a message. A server using a buffer pool takes its message buffer at this point.
+static nmbs_error recv_first_byte(nmbs_t* nmbs) {
+#if defined(NMBS_COMPACT) && !defined(NMBS_SERVER_DISABLED)
+    if (nmbs->buffer_pool && !nmbs->msg_buf) {
+        if (!nmbs->first_byte_pending) {
+            nmbs_error err = recv_into(nmbs, &nmbs->first_byte, 1);
+            if (err != NMBS_ERROR_NONE)
+                return err;
 
-    discard_n(nmbs, request_size % subreq_header_size);
+            nmbs->first_byte_pending = true;
+        }
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+        // Backpressure: the rest of the message stays in the transport until a buffer is available
+        nmbs->msg_buf = nmbs_buffer_pool_acquire(nmbs->buffer_pool);
+        if (!nmbs->msg_buf)
+            return NMBS_ERROR_BUFFER_POOL_EXHAUSTED;
 
-    if (!nmbs->msg.ignored) {
-        if (request_size % subreq_header_size)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+        nmbs->msg_buf[nmbs->msg.buf_idx] = nmbs->first_byte;
+        nmbs->first_byte_pending = false;
+        return NMBS_ERROR_NONE;
+    }
+#endif
 
-        if (request_size < 0x07 || request_size > 0xF5)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    return recv(nmbs, 1);
+}
 
-        for (uint8_t i = 0; i < subreq_count; i++) {
-            if (subreq[i].reference_type != 0x06)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
 
-            if (subreq[i].file_number == 0x0000)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+static nmbs_error recv_msg_header(nmbs_t* nmbs, bool* first_byte_received) {
+    // We wait for the read timeout here, just for the first message byte
+    int32_t old_byte_timeout = nmbs->byte_timeout_ms;
+    nmbs->byte_timeout_ms = nmbs->read_timeout_ms;
 
-            if (subreq[i].record_number > 0x270F)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    msg_state_reset(nmbs);
 
-            if (subreq[i].record_length > 124)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    *first_byte_received = false;
 
-            NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fread ", subreq[i].file_number, subreq[i].record_number,
-                             subreq[i].record_length);
-        }
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        nmbs_error err = recv_first_byte(nmbs);
 
-        put_res_header(nmbs, response_data_size);
-        put_1(nmbs, response_data_size);
+        nmbs->byte_timeout_ms = old_byte_timeout;
 
-        if (nmbs->callbacks.read_file_record) {
-            for (uint8_t i = 0; i < subreq_count; i++) {
-                uint16_t subreq_data_size = subreq[i].record_length * 2;
-                put_1(nmbs, subreq_data_size + 1);
-                put_1(nmbs, 0x06);    // add Reference Type const
-                uint16_t* subreq_data = (uint16_t*) get_n(nmbs, subreq_data_size);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-                err = nmbs->callbacks.read_file_record(subreq[i].file_number, subreq[i].record_number, subreq_data,
-                                                       subreq[i].record_length, nmbs->msg.unit_id, nmbs->callbacks.arg);
-                if (err != NMBS_ERROR_NONE) {
-                    if (nmbs_error_is_exception(err))
-                        return send_exception_msg(nmbs, err);
+        *first_byte_received = true;
 
-                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-                }
+        nmbs->msg.unit_id = get_1(nmbs);
 
-                swap_regs(subreq_data, subreq[i].record_length);
-            }
-        }
-        else {
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-        }
+        err = recv(nmbs, 1);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-        if (!nmbs->msg.broadcast) {
-            err = send_msg(nmbs);
-            if (err != NMBS_ERROR_NONE)
-                return err;
-        }
-    }
-    else {
-        return recv_read_file_record_res(nmbs, NULL, 0);
+        nmbs->msg.fc = get_1(nmbs);
     }
+    else if (nmbs->transport == NMBS_TRANSPORT_TCP) {
+        nmbs_error err = recv_first_byte(nmbs);
 
-    return NMBS_ERROR_NONE;
-}
-#endif
+        nmbs->byte_timeout_ms = old_byte_timeout;
 
-#ifndef NMBS_SERVER_WRITE_FILE_RECORD_DISABLED
-static nmbs_error handle_write_file_record(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 1);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-    uint8_t request_size = get_1(nmbs);
-    if (request_size > 251) {
-        return NMBS_ERROR_INVALID_REQUEST;
-    }
+        *first_byte_received = true;
+
+        // Advance buf_idx
+        discard_1(nmbs);
+
+        err = recv(nmbs, 7);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        // Starting over
+        msg_buf_reset(nmbs);
+
+        nmbs->msg.transaction_id = get_2(nmbs);
+        uint16_t protocol_id = get_2(nmbs);
+        uint16_t length = get_2(nmbs);    // We should actually check the length of the request against this value
+        nmbs->msg.unit_id = get_1(nmbs);
+        nmbs->msg.fc = get_1(nmbs);
+
+        if (protocol_id != 0)
+            return NMBS_ERROR_INVALID_TCP_MBAP;
+
+        if (length > 255)
+            return NMBS_ERROR_INVALID_TCP_MBAP;
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static void put_msg_header(nmbs_t* nmbs, uint16_t data_length) {
+    msg_buf_reset(nmbs);
+
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        put_1(nmbs, nmbs->msg.unit_id);
+    }
+    else if (nmbs->transport == NMBS_TRANSPORT_TCP) {
+        put_2(nmbs, nmbs->msg.transaction_id);
+        put_2(nmbs, 0);
+        put_2(nmbs, (uint16_t) (1 + 1 + data_length));
+        put_1(nmbs, nmbs->msg.unit_id);
+    }
+
+    put_1(nmbs, nmbs->msg.fc);
+}
+
+
+#ifndef NMBS_SERVER_DISABLED
+#if !defined(NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED)
+static void set_msg_header_size(nmbs_t* nmbs, uint16_t data_length) {
+    if (nmbs->transport == NMBS_TRANSPORT_TCP) {
+        data_length += 2;
+        set_2(nmbs, data_length, 4);
+    }
+}
+#endif
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) && !defined(NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED)
+// Timing of the destination of the current request, if tracked by the adaptive timeouts of the instance
+static nmbs_device_timing* adaptive_device(const nmbs_t* nmbs) {
+    const nmbs_adaptive_timeouts* at = nmbs->adaptive_timeouts;
+    if (!at || nmbs->msg.broadcast || nmbs->msg.unit_id >= at->devices_count)
+        return NULL;
+
+    return &at->devices[nmbs->msg.unit_id];
+}
+
+
+// Fails the requests to a device while its breaker is open, then lets a single probe through
+static nmbs_error adaptive_before_send(const nmbs_t* nmbs) {
+    nmbs_device_timing* device = adaptive_device(nmbs);
+    if (!device || !device->open)
+        return NMBS_ERROR_NONE;
+
+    const nmbs_adaptive_timeouts* at = nmbs->adaptive_timeouts;
+    uint32_t now = at->clock_ms(at->arg);
+    if ((int32_t) (now - device->open_until_ms) < 0)
+        return NMBS_ERROR_CIRCUIT_OPEN;
+
+    // The probe is let through, the breaker opens again if it times out
+    device->open_until_ms = now + at->open_ms;
+    return NMBS_ERROR_NONE;
+}
+
+
+static int32_t adaptive_clamp(const nmbs_adaptive_timeouts* at, int32_t timeout_ms) {
+    if (timeout_ms < at->min_timeout_ms)
+        return at->min_timeout_ms;
+
+    if (timeout_ms > at->max_timeout_ms)
+        return at->max_timeout_ms;
+
+    return timeout_ms;
+}
+
+
+// Updates the timing of a device after waiting for a response. A response time sample is taken only when a single
+// request was in flight.
+static void adaptive_after_recv(const nmbs_t* nmbs, nmbs_device_timing* device, bool responded, bool sample) {
+    const nmbs_adaptive_timeouts* at = nmbs->adaptive_timeouts;
+
+    if (!responded) {
+        device->timeout_ms = adaptive_clamp(at, device->timeout_ms * 2);
+        if (device->failures < UINT8_MAX)
+            device->failures++;
+
+        if (at->failures_to_open && device->failures >= at->failures_to_open && !device->open) {
+            device->open = true;
+            device->open_until_ms = at->clock_ms(at->arg) + at->open_ms;
+        }
+
+        return;
+    }
+
+    device->failures = 0;
+    device->open = false;
+
+    if (sample) {
+        int32_t rtt = (int32_t) (at->clock_ms(at->arg) - at->sent_ms);
+        if (!device->measured) {
+            device->srtt = rtt << 3;
+            device->rttvar = rtt << 1;
+            device->measured = true;
+        }
+        else {
+            int32_t delta = rtt - (device->srtt >> 3);
+            device->srtt += delta;
+            device->rttvar += (delta < 0 ? -delta : delta) - (device->rttvar >> 2);
+        }
+    }
+
+    if (device->measured)
+        device->timeout_ms = adaptive_clamp(at, (device->srtt >> 3) + (device->rttvar > 4 ? device->rttvar : 4));
+}
+#endif
+
+
+static nmbs_error send_msg(nmbs_t* nmbs) {
+    NMBS_DEBUG_PRINT("\n");
+
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        uint16_t crc = NMBS_PLATFORM(nmbs)->crc_calc(nmbs->msg_buf, nmbs->msg.buf_idx, NMBS_PLATFORM_ARG(nmbs));
+        put_2(nmbs, crc);
+    }
+
+    return send(nmbs, nmbs->msg.buf_idx);
+}
+
+
+#ifndef NMBS_CLIENT_DISABLED
+// Sends a request, unless the breaker of its destination is open, and records its send time for the adaptive timeouts
+static nmbs_error send_req(nmbs_t* nmbs) {
+#ifndef NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED
+    nmbs_error err = adaptive_before_send(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = send_msg(nmbs);
+
+    if (nmbs->adaptive_timeouts)
+        nmbs->adaptive_timeouts->sent_ms = nmbs->adaptive_timeouts->clock_ms(nmbs->adaptive_timeouts->arg);
+
+    return err;
+#else
+    return send_msg(nmbs);
+#endif
+}
+#endif
+
+
+#ifndef NMBS_SERVER_DISABLED
+static nmbs_error recv_req_header(nmbs_t* nmbs, bool* first_byte_received) {
+    nmbs_error err = recv_msg_header(nmbs, first_byte_received);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        // Check if request is for us
+        if (nmbs->msg.unit_id == NMBS_BROADCAST_ADDRESS)
+            nmbs->msg.broadcast = true;
+        else if (nmbs->msg.unit_id != nmbs->address_rtu)
+            nmbs->msg.ignored = true;
+        else
+            nmbs->msg.ignored = false;
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static void put_res_header(nmbs_t* nmbs, uint16_t data_length) {
+    put_msg_header(nmbs, data_length);
+    NMBS_DEBUG_PRINT("%d NMBS res -> address_rtu %d\tfc %d\t", nmbs->address_rtu, nmbs->address_rtu, nmbs->msg.fc);
+}
+
+
+static nmbs_error send_exception_msg(nmbs_t* nmbs, uint8_t exception) {
+    NMBS_DIAGNOSTICS_COUNT(nmbs, exceptions);
+    NMBS_COMM_EVENT(nmbs, NMBS_COMM_EVENT_SEND | comm_event_exception(exception));
+
+    nmbs->msg.fc += 0x80;
+    put_msg_header(nmbs, 1);
+    put_1(nmbs, exception);
+
+    NMBS_DEBUG_PRINT("%d NMBS res -> address_rtu %d\texception %d", nmbs->address_rtu, nmbs->address_rtu, exception);
+
+    return send_msg(nmbs);
+}
+
+
+#if !defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED) ||                \
+    !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED) ||    \
+    !defined(NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED) || !defined(NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED) ||        \
+    !defined(NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED) || !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED)
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+// Saves the request in the token passed to nmbs_server_defer() by the callback, the response is sent on completion.
+// quantity is the value of the request for FC 05 and 06.
+static nmbs_error defer_response(nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
+    nmbs_deferred* token = nmbs->deferred;
+    if (!token)
+        return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+
+    // nmbs->deferred is kept, so that nmbs_server_poll() does not log a response that has not been sent yet
+    token->transaction_id = nmbs->msg.transaction_id;
+    token->address = address;
+    token->quantity = quantity;
+    token->unit_id = nmbs->msg.unit_id;
+    token->fc = nmbs->msg.fc;
+    token->broadcast = nmbs->msg.broadcast;
+    token->pending = true;
+
+    NMBS_DEBUG_PRINT("deferred");
+
+    return NMBS_ERROR_NONE;
+}
+#else
+// Callbacks cannot defer their response
+#define defer_response(nmbs, address, quantity) send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE)
+#endif
+#endif
+#endif
+
+
+// Count of requests sent after the one with transaction ID tid, up to the one with last_tid. IDs wrap from 65535 to 1.
+static uint16_t tid_distance(uint16_t tid, uint16_t last_tid) {
+    if (last_tid >= tid)
+        return (uint16_t) (last_tid - tid);
+
+    return (uint16_t) (last_tid + 0xFFFF - tid);
+}
+
+
+// Receives the header of the response to any of the last tids requests sent, identified by its transaction ID on TCP
+static nmbs_error recv_res_header_tids(nmbs_t* nmbs, uint16_t tids) {
+    uint16_t req_transaction_id = nmbs->msg.transaction_id;
+    uint8_t req_unit_id = nmbs->msg.unit_id;
+    uint8_t req_fc = nmbs->msg.fc;
+    bool req_ignored = nmbs->msg.ignored;
+
+    bool first_byte_received = false;
+#if !defined(NMBS_CLIENT_DISABLED) && !defined(NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED)
+    nmbs_device_timing* device = adaptive_device(nmbs);
+    int32_t read_timeout = nmbs->read_timeout_ms;
+    if (device) {
+        // A poll group timeout caps the timeout of the device, that keeps backing off beyond it
+        int32_t cap_ms = nmbs->adaptive_timeouts->cap_ms;
+        nmbs->read_timeout_ms = cap_ms > 0 && cap_ms < device->timeout_ms ? cap_ms : device->timeout_ms;
+    }
+
+    nmbs_error err = recv_msg_header(nmbs, &first_byte_received);
+
+    nmbs->read_timeout_ms = read_timeout;
+    if (device && (err == NMBS_ERROR_NONE || !first_byte_received))
+        adaptive_after_recv(nmbs, device, err == NMBS_ERROR_NONE, tids == 1);
+#else
+    nmbs_error err = recv_msg_header(nmbs, &first_byte_received);
+#endif
+    // A server reading the response to a request it ignored does not count it as addressed to itself
+    nmbs->msg.ignored = req_ignored;
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (nmbs->transport == NMBS_TRANSPORT_TCP) {
+        if (nmbs->msg.transaction_id == 0 || tid_distance(nmbs->msg.transaction_id, req_transaction_id) >= tids)
+            return NMBS_ERROR_INVALID_TCP_MBAP;
+    }
+
+    if (nmbs->transport == NMBS_TRANSPORT_RTU && nmbs->msg.unit_id != req_unit_id)
+        return NMBS_ERROR_INVALID_UNIT_ID;
+
+    if (nmbs->msg.fc != req_fc) {
+        if (nmbs->msg.fc - 0x80 == req_fc) {
+            err = recv(nmbs, 1);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+
+            uint8_t exception = get_1(nmbs);
+            err = recv_msg_footer(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+
+            if (exception < 1 || exception > 4)
+                return NMBS_ERROR_INVALID_RESPONSE;
+
+            NMBS_DEBUG_PRINT("%d NMBS res <- address_rtu %d\texception %d\n", nmbs->address_rtu, nmbs->msg.unit_id,
+                             exception);
+            return (nmbs_error) exception;
+        }
+
+        return NMBS_ERROR_INVALID_RESPONSE;
+    }
+
+    NMBS_DEBUG_PRINT("%d NMBS res <- address_rtu %d\tfc %d\t", nmbs->address_rtu, nmbs->msg.unit_id, nmbs->msg.fc);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error recv_res_header(nmbs_t* nmbs) {
+    return recv_res_header_tids(nmbs, 1);
+}
+
+
+#ifndef NMBS_CLIENT_DISABLED
+static void put_req_header(nmbs_t* nmbs, uint16_t data_length) {
+    put_msg_header(nmbs, data_length);
+#ifdef NMBS_DEBUG
+    printf("%d ", nmbs->address_rtu);
+    printf("NMBS req -> ");
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        if (nmbs->msg.broadcast)
+            printf("broadcast\t");
+        else
+            printf("address_rtu %d\t", nmbs->dest_address_rtu);
+    }
+
+    printf("fc %d\t", nmbs->msg.fc);
+#endif
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) &&                                                                             \
+         (!defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED)))
+static nmbs_error recv_read_discrete_res(nmbs_t* nmbs, nmbs_bitfield values) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t coils_bytes = get_1(nmbs);
+    NMBS_DEBUG_PRINT("b %d\t", coils_bytes);
+
+    if (coils_bytes > 250) {
+        return NMBS_ERROR_INVALID_RESPONSE;
+    }
+
+    err = recv(nmbs, coils_bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    NMBS_DEBUG_PRINT("coils ");
+    for (int i = 0; i < coils_bytes; i++) {
+        uint8_t coil = get_1(nmbs);
+        if (values)
+            values[i] = coil;
+        NMBS_DEBUG_PRINT("%d ", coil);
+    }
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && (!defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) ||                   \
+                                            !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED)))
+static nmbs_error recv_read_registers_res(nmbs_t* nmbs, uint16_t quantity, uint16_t* registers) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t registers_bytes = get_1(nmbs);
+    NMBS_DEBUG_PRINT("b %d\t", registers_bytes);
+
+    if (registers_bytes > 250)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    err = recv(nmbs, registers_bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    NMBS_DEBUG_PRINT("regs ");
+    for (int i = 0; i < registers_bytes / 2; i++) {
+        uint16_t reg = get_2(nmbs);
+        if (registers)
+            registers[i] = reg;
+        NMBS_DEBUG_PRINT("%d ", reg);
+    }
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (registers_bytes != quantity * 2)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_READ_FIFO_QUEUE_DISABLED))
+static nmbs_error recv_read_fifo_queue_res(nmbs_t* nmbs, uint16_t* values_out, uint8_t* count_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t byte_count = get_2(nmbs);
+    uint16_t fifo_count = get_2(nmbs);
+    NMBS_DEBUG_PRINT("b %d\tc %d\tvalues ", byte_count, fifo_count);
+
+    if (fifo_count > NMBS_FIFO_COUNT_MAX || byte_count != 2 + fifo_count * 2)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    err = recv(nmbs, fifo_count * 2);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    for (int i = 0; i < fifo_count; i++) {
+        uint16_t value = get_2(nmbs);
+        if (values_out)
+            values_out[i] = value;
+        NMBS_DEBUG_PRINT("%d ", value);
+    }
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (count_out)
+        *count_out = (uint8_t) fifo_count;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_READ_EXCEPTION_STATUS_DISABLED))
+static nmbs_error recv_read_exception_status_res(nmbs_t* nmbs, uint8_t* status_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t status = get_1(nmbs);
+    NMBS_DEBUG_PRINT("status %d", status);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (status_out)
+        *status_out = status;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_DIAGNOSTICS_DISABLED))
+static nmbs_error recv_diagnostics_res(nmbs_t* nmbs, uint16_t sub_function, uint16_t* data_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t sub_function_res = get_2(nmbs);
+    uint16_t data = get_2(nmbs);
+    NMBS_DEBUG_PRINT("sf %d\tdata %d", sub_function_res, data);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (sub_function_res != sub_function)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (data_out)
+        *data_out = data;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED))
+static nmbs_error recv_get_comm_event_counter_res(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t status = get_2(nmbs);
+    uint16_t event_count = get_2(nmbs);
+    NMBS_DEBUG_PRINT("status %d\tevents %d", status, event_count);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (status_out)
+        *status_out = status;
+
+    if (event_count_out)
+        *event_count_out = event_count;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_CLIENT_DISABLED) ||                                                                                  \
+        (!defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED))
+static nmbs_error recv_get_comm_event_log_res(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out,
+                                              uint16_t* message_count_out, uint8_t* events_out,
+                                              uint8_t* events_count_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t byte_count = get_1(nmbs);
+    if (byte_count < 6 || byte_count > 6 + NMBS_COMM_EVENT_LOG_SIZE)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    err = recv(nmbs, byte_count);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t status = get_2(nmbs);
+    uint16_t event_count = get_2(nmbs);
+    uint16_t message_count = get_2(nmbs);
+    uint8_t events_count = byte_count - 6;
+    const uint8_t* events = get_n(nmbs, events_count);
+    NMBS_DEBUG_PRINT("status %d\tevents %d\tmessages %d\tlog %d", status, event_count, message_count, events_count);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (status_out)
+        *status_out = status;
+
+    if (event_count_out)
+        *event_count_out = event_count;
+
+    if (message_count_out)
+        *message_count_out = message_count;
+
+    if (events_out)
+        memcpy(events_out, events, events_count);
+
+    if (events_count_out)
+        *events_count_out = events_count;
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+nmbs_error recv_write_single_coil_res(nmbs_t* nmbs, uint16_t address, uint16_t value_req) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address_res = get_2(nmbs);
+    uint16_t value_res = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value_res);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (address_res != address)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (value_res != value_req)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_write_single_register_res(nmbs_t* nmbs, uint16_t address, uint16_t value_req) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address_res = get_2(nmbs);
+    uint16_t value_res = get_2(nmbs);
+    NMBS_DEBUG_PRINT("a %d\tvalue %d ", address, value_res);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (address_res != address)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (value_res != value_req)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_mask_write_register_res(nmbs_t* nmbs, uint16_t address, uint16_t and_mask, uint16_t or_mask) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 6);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address_res = get_2(nmbs);
+    uint16_t and_mask_res = get_2(nmbs);
+    uint16_t or_mask_res = get_2(nmbs);
+    NMBS_DEBUG_PRINT("a %d\tand %d\tor %d", address_res, and_mask_res, or_mask_res);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (address_res != address)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (and_mask_res != and_mask || or_mask_res != or_mask)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_write_multiple_coils_res(nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address_res = get_2(nmbs);
+    uint16_t quantity_res = get_2(nmbs);
+    NMBS_DEBUG_PRINT("a %d\tq %d", address_res, quantity_res);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (address_res != address)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (quantity_res != quantity)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_write_multiple_registers_res(nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address_res = get_2(nmbs);
+    uint16_t quantity_res = get_2(nmbs);
+    NMBS_DEBUG_PRINT("a %d\tq %d", address_res, quantity_res);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (address_res != address)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (quantity_res != quantity)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_read_file_record_res(nmbs_t* nmbs, uint16_t* registers, uint16_t count) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t response_size = get_1(nmbs);
+    if (response_size > 250) {
+        return NMBS_ERROR_INVALID_RESPONSE;
+    }
+
+    err = recv(nmbs, response_size);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t subreq_data_size = get_1(nmbs) - 1;
+    uint8_t subreq_reference_type = get_1(nmbs);
+    const uint8_t* subreq_record_data = get_n(nmbs, subreq_data_size);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (registers) {
+        if (subreq_reference_type != 6)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        if (count != (subreq_data_size / 2))
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        for (uint16_t i = 0; i < count; i++)
+            registers[i] = (uint16_t) (subreq_record_data[i * 2] << 8 | subreq_record_data[i * 2 + 1]);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_write_file_record_res(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number,
+                                      const uint16_t* registers, uint16_t count) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t response_size = get_1(nmbs);
+    if (response_size > 251)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    err = recv(nmbs, response_size);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t subreq_reference_type = get_1(nmbs);
+    uint16_t subreq_file_number = get_2(nmbs);
+    uint16_t subreq_record_number = get_2(nmbs);
+    uint16_t subreq_record_length = get_2(nmbs);
+    NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", subreq_file_number, subreq_record_number, subreq_record_length);
+
+    uint16_t subreq_data_size = subreq_record_length * 2;
+    const uint8_t* subreq_record_data = get_n(nmbs, subreq_data_size);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (registers) {
+        if (subreq_reference_type != 6)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        if (subreq_file_number != file_number)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        if (subreq_record_number != record_number)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        if (subreq_record_length != count)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        for (uint16_t i = 0; i < count; i++) {
+            if (registers[i] != (uint16_t) (subreq_record_data[i * 2] << 8 | subreq_record_data[i * 2 + 1]))
+                return NMBS_ERROR_INVALID_RESPONSE;
+        }
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+static nmbs_error recv_read_device_identification_res_header(nmbs_t* nmbs, uint8_t* next_object_id_out,
+                                                             uint8_t* objects_count_out) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    err = recv(nmbs, 6);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t mei_type = get_1(nmbs);
+    if (mei_type != 0x0E)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    uint8_t read_device_id_code = get_1(nmbs);
+    if (read_device_id_code < 1 || read_device_id_code > 4)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    uint8_t conformity_level = get_1(nmbs);
+    if (conformity_level < 1 || (conformity_level > 3 && conformity_level < 0x81) || conformity_level > 0x83)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    uint8_t more_follows = get_1(nmbs);
+    if (more_follows != 0 && more_follows != 0xFF)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    *next_object_id_out = get_1(nmbs);
+    *objects_count_out = get_1(nmbs);
+
+    if (more_follows == 0)
+        *next_object_id_out = 0x7F;    // This value is reserved in the spec, we use it to signal stream is finished
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error recv_read_device_identification_res(nmbs_t* nmbs, uint8_t buffers_count, char** buffers_out,
+                                               uint8_t buffers_length, const uint8_t* order, uint8_t* ids_out,
+                                               uint8_t* next_object_id_out, uint8_t* objects_count_out) {
+    uint8_t next_object_id = 0;
+    uint8_t objects_count = 0;
+    nmbs_error err = recv_read_device_identification_res_header(nmbs, &next_object_id, &objects_count);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (objects_count_out)
+        *objects_count_out = objects_count;
+
+    if (buffers_count == 0) {
+        buffers_out = NULL;
+    }
+    else if (objects_count > buffers_count)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if (next_object_id_out)
+        *next_object_id_out = next_object_id;
+
+    uint8_t res_size_left = 253 - 7;
+    for (int i = 0; i < objects_count; i++) {
+        err = recv(nmbs, 2);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        uint8_t object_id = get_1(nmbs);
+        uint8_t object_length = get_1(nmbs);
+        res_size_left -= 2;
+
+        if (object_length > res_size_left)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        err = recv(nmbs, object_length);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        const char* str = (const char*) get_n(nmbs, object_length);
+
+        if (ids_out)
+            ids_out[i] = object_id;
+
+        uint8_t buf_index = i;
+        if (order)
+            buf_index = order[object_id];
+        if (buffers_out) {
+            strncpy(buffers_out[buf_index], str, buffers_length);
+            buffers_out[buf_index][object_length] = 0;
+        }
+    }
+
+    return recv_msg_footer(nmbs);
+}
+
+
+#ifndef NMBS_SERVER_DISABLED
+#if !defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED) ||                \
+    !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED)
+static nmbs_response_cache_entry* response_cache_find(const nmbs_t* nmbs, uint16_t address, uint16_t quantity) {
+    const nmbs_response_cache* cache = NMBS_DATA(nmbs)->response_cache;
+    if (!cache || nmbs->msg.broadcast)
+        return NULL;
+
+    for (uint16_t i = 0; i < cache->count; i++) {
+        nmbs_response_cache_entry* entry = &cache->entries[i];
+        if (entry->fc == nmbs->msg.fc && entry->unit_id == nmbs->msg.unit_id && entry->address == address &&
+            entry->quantity == quantity)
+            return entry;
+    }
+
+    return NULL;
+}
+
+
+static nmbs_error send_cached_response(nmbs_t* nmbs, const nmbs_response_cache_entry* entry) {
+    put_res_header(nmbs, entry->data_length);
+    memcpy(&nmbs->msg_buf[nmbs->msg.buf_idx], entry->data, entry->data_length);
+    nmbs->msg.buf_idx += entry->data_length;
+
+    NMBS_DEBUG_PRINT("cached\n");
+
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        memcpy(&nmbs->msg_buf[nmbs->msg.buf_idx], entry->crc, 2);
+        nmbs->msg.buf_idx += 2;
+    }
+
+    return send(nmbs, nmbs->msg.buf_idx);
+}
+
+
+// Save the response just sent. invalidations is the value read before reading the data, so the entry is not marked
+// as valid if it was invalidated in the meantime.
+static void response_cache_store(nmbs_t* nmbs, nmbs_response_cache_entry* entry, uint32_t invalidations,
+                                 uint8_t data_length) {
+    uint16_t end = nmbs->msg.buf_idx;
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        end -= 2;
+        memcpy(entry->crc, &nmbs->msg_buf[end], 2);
+    }
+
+    memcpy(entry->data, &nmbs->msg_buf[end - data_length], data_length);
+    entry->data_length = data_length;
+    entry->filled_at = invalidations;
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_READ_COILS_DISABLED) || !defined(NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED)
+static nmbs_error read_bits_data(const nmbs_t* nmbs, const uint8_t* bits, uint16_t address, uint16_t quantity,
+                                 nmbs_bitfield bits_out) {
+    if (!NMBS_DATA(nmbs)->bits_sequence)
+        return nmbs_bitfield_65536_read_range(bits, address, quantity, bits_out);
+
+    nmbs_error err;
+    uint32_t begin;
+    do {
+        begin = seqlock_read_begin(NMBS_DATA(nmbs)->bits_sequence);
+        err = nmbs_bitfield_65536_read_range(bits, address, quantity, bits_out);
+    } while (seqlock_read_retry(NMBS_DATA(nmbs)->bits_sequence, begin));
+
+    return err;
+}
+
+
+static nmbs_error handle_read_discrete(nmbs_t* nmbs,
+                                       nmbs_error (*callback)(uint16_t, uint16_t, nmbs_bitfield, uint8_t, void*),
+                                       const uint8_t* bits) {
+    nmbs_error err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t quantity = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (quantity < 1 || quantity > 2000)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if (callback || bits) {
+            nmbs_response_cache_entry* cached = response_cache_find(nmbs, address, quantity);
+            uint32_t invalidations = 0;
+            if (cached) {
+                invalidations = NMBS_ATOMIC_LOAD(&cached->invalidations);
+                if (cached->filled_at == invalidations)
+                    return send_cached_response(nmbs, cached);
+            }
+
+            // The bits are read straight into the response, the buffer has room for a whole nmbs_bitfield after it
+            uint8_t discrete_bytes = (quantity + 7) / 8;
+            put_res_header(nmbs, 1 + discrete_bytes);
+            put_1(nmbs, discrete_bytes);
+
+            uint8_t* bitfield = &nmbs->msg_buf[nmbs->msg.buf_idx];
+            memset(bitfield, 0, discrete_bytes);
+            if (callback)
+                err = callback(address, quantity, bitfield, nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = read_bits_data(nmbs, bits, address, quantity, bitfield);
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, quantity);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            if (!nmbs->msg.broadcast) {
+                NMBS_DEBUG_PRINT("b %d\t", discrete_bytes);
+
+                NMBS_DEBUG_PRINT("coils ");
+                for (int i = 0; i < discrete_bytes; i++) {
+                    NMBS_DEBUG_PRINT("%d ", bitfield[i]);
+                }
+
+                nmbs->msg.buf_idx += discrete_bytes;
+
+                err = send_msg(nmbs);
+
+                if (cached)
+                    response_cache_store(nmbs, cached, invalidations, 1 + discrete_bytes);
+
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_read_discrete_res(nmbs, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED) || !defined(NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED) ||        \
+    !defined(NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED) || !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED) ||  \
+    !defined(NMBS_SERVER_WRITE_FILE_RECORD_DISABLED) || !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED) ||         \
+    !defined(NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED)
+static void data_changed(nmbs_t* nmbs, nmbs_change_type type, uint16_t file_number, uint16_t address,
+                         uint16_t quantity) {
+    if (NMBS_DATA(nmbs)->response_cache) {
+        if (type == NMBS_CHANGE_COILS)
+            nmbs_response_cache_invalidate(NMBS_DATA(nmbs)->response_cache, 1, address, quantity);
+        else if (type == NMBS_CHANGE_HOLDING_REGISTERS)
+            nmbs_response_cache_invalidate(NMBS_DATA(nmbs)->response_cache, 3, address, quantity);
+    }
+
+    nmbs_change_log* log = NMBS_DATA(nmbs)->change_log;
+    if (!log)
+        return;
+
+    uint32_t head = log->head;
+    uint32_t next = (head + 1) % log->size;
+    if (next == NMBS_ATOMIC_LOAD(&log->tail)) {
+        // Log full, the consumer will be told to consider everything changed
+        log->dropped = log->dropped + 1;
+    }
+    else {
+        nmbs_change* change = &log->entries[head];
+        change->type = (uint8_t) type;
+        change->unit_id = nmbs->msg.unit_id;
+        change->file_number = file_number;
+        change->address = address;
+        change->quantity = quantity;
+
+        NMBS_FENCE_RELEASE();
+        log->head = next;
+    }
+
+    if (log->notify)
+        log->notify(log->notify_arg);
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED) ||    \
+    !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED)
+static nmbs_error read_registers_data(const nmbs_register_store* store, nmbs_snapshot_store* snapshot,
+                                      uint16_t address, uint16_t quantity, uint16_t* registers_out) {
+    if (snapshot)
+        return nmbs_snapshot_store_read(snapshot, address, quantity, registers_out);
+
+    return nmbs_register_store_read(store, address, quantity, registers_out);
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED) || !defined(NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED)
+static nmbs_error write_coils_data(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const uint8_t* coils) {
+    if (NMBS_DATA(nmbs)->bits_sequence)
+        seqlock_write_begin(NMBS_DATA(nmbs)->bits_sequence);
+
+    nmbs_error err = nmbs_bitfield_65536_write_range(NMBS_DATA(nmbs)->coils, address, quantity, coils);
+
+    if (NMBS_DATA(nmbs)->bits_sequence)
+        seqlock_write_end(NMBS_DATA(nmbs)->bits_sequence);
+
+    return err;
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED) || !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED) || \
+    !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED)
+static nmbs_error write_holding_registers_data(nmbs_t* nmbs, uint16_t address, uint16_t quantity,
+                                              const uint16_t* registers) {
+    if (NMBS_DATA(nmbs)->holding_registers_snapshot)
+        return nmbs_snapshot_store_write(NMBS_DATA(nmbs)->holding_registers_snapshot, address, quantity, registers);
+
+    return nmbs_register_store_write(NMBS_DATA(nmbs)->holding_registers, address, quantity, registers);
+}
+#endif
+
+
+#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED)
+static nmbs_error handle_read_registers(nmbs_t* nmbs,
+                                        nmbs_error (*callback)(uint16_t, uint16_t, uint16_t*, uint8_t, void*),
+                                        const nmbs_register_store* store, nmbs_snapshot_store* snapshot) {
+    nmbs_error err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t quantity = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (quantity < 1 || quantity > 125)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if (callback || store || snapshot) {
+            nmbs_response_cache_entry* cached = response_cache_find(nmbs, address, quantity);
+            uint32_t invalidations = 0;
+            if (cached) {
+                invalidations = NMBS_ATOMIC_LOAD(&cached->invalidations);
+                if (cached->filled_at == invalidations)
+                    return send_cached_response(nmbs, cached);
+            }
+
+            uint8_t regs_bytes = quantity * 2;
+            put_res_header(nmbs, 1 + regs_bytes);
+            put_1(nmbs, regs_bytes);
+
+            uint16_t* regs = regs_in_place(nmbs);
+            if (callback)
+                err = callback(address, quantity, regs, nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = read_registers_data(store, snapshot, address, quantity, regs);
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, quantity);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            // TODO check all these read request broadcast use cases
+            if (!nmbs->msg.broadcast) {
+                NMBS_DEBUG_PRINT("b %d\t", regs_bytes);
+
+                NMBS_DEBUG_PRINT("regs ");
+                for (int i = 0; i < quantity; i++) {
+                    NMBS_DEBUG_PRINT("%d ", regs[i]);
+                }
+
+                put_regs_in_place(nmbs, quantity);
+
+                err = send_msg(nmbs);
+
+                if (cached)
+                    response_cache_store(nmbs, cached, invalidations, 1 + regs_bytes);
+
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_read_registers_res(nmbs, quantity, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_READ_COILS_DISABLED
+static nmbs_error handle_read_coils(nmbs_t* nmbs) {
+    return handle_read_discrete(nmbs, NMBS_CALLBACKS(nmbs)->read_coils, NMBS_DATA(nmbs)->coils);
+}
+#endif
+
+
+#ifndef NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED
+static nmbs_error handle_read_discrete_inputs(nmbs_t* nmbs) {
+    return handle_read_discrete(nmbs, NMBS_CALLBACKS(nmbs)->read_discrete_inputs, NMBS_DATA(nmbs)->discrete_inputs);
+}
+#endif
+
+
+#ifndef NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED
+static nmbs_error handle_read_holding_registers(nmbs_t* nmbs) {
+    return handle_read_registers(nmbs, NMBS_CALLBACKS(nmbs)->read_holding_registers, NMBS_DATA(nmbs)->holding_registers,
+                                 NMBS_DATA(nmbs)->holding_registers_snapshot);
+}
+#endif
+
+
+#ifndef NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED
+static nmbs_error handle_read_input_registers(nmbs_t* nmbs) {
+    return handle_read_registers(nmbs, NMBS_CALLBACKS(nmbs)->read_input_registers, NMBS_DATA(nmbs)->input_registers,
+                                 NMBS_DATA(nmbs)->input_registers_snapshot);
+}
+#endif
+
+
+#ifndef NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED
+static nmbs_error handle_write_single_coil(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t value = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (NMBS_CALLBACKS(nmbs)->write_single_coil || NMBS_DATA(nmbs)->coils) {
+            if (value != 0 && value != 0xFF00)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+            if (NMBS_CALLBACKS(nmbs)->write_single_coil)
+                err = NMBS_CALLBACKS(nmbs)->write_single_coil(address, value == 0 ? false : true, nmbs->msg.unit_id,
+                                                              NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = write_coils_data(nmbs, address, 1, (uint8_t[]){value != 0});
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, value);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            data_changed(nmbs, NMBS_CHANGE_COILS, 0, address, 1);
+
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 4);
+
+                put_2(nmbs, address);
+                put_2(nmbs, value);
+                NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_write_single_coil_res(nmbs, address, value);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED
+static nmbs_error handle_write_single_register(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t value = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (NMBS_CALLBACKS(nmbs)->write_single_register || NMBS_DATA(nmbs)->holding_registers ||
+            NMBS_DATA(nmbs)->holding_registers_snapshot) {
+            if (NMBS_CALLBACKS(nmbs)->write_single_register)
+                err = NMBS_CALLBACKS(nmbs)->write_single_register(address, value, nmbs->msg.unit_id,
+                                                                  NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = write_holding_registers_data(nmbs, address, 1, &value);
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, value);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            data_changed(nmbs, NMBS_CHANGE_HOLDING_REGISTERS, 0, address, 1);
+
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 4);
+
+                put_2(nmbs, address);
+                put_2(nmbs, value);
+                NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_write_single_register_res(nmbs, address, value);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_READ_EXCEPTION_STATUS_DISABLED
+static nmbs_error handle_read_exception_status(nmbs_t* nmbs) {
+    nmbs_error err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (NMBS_CALLBACKS(nmbs)->read_exception_status) {
+            uint8_t status = 0;
+            err = NMBS_CALLBACKS(nmbs)->read_exception_status(&status, nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 1);
+
+                put_1(nmbs, status);
+                NMBS_DEBUG_PRINT("status %d", status);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_read_exception_status_res(nmbs, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_DIAGNOSTICS_DISABLED
+static nmbs_error handle_diagnostics(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 4);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t sub_function = get_2(nmbs);
+    uint16_t data = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("sf %d\tdata %d", sub_function, data);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        nmbs_diagnostic_counters* counters = &nmbs->diagnostics;
+        switch (sub_function) {
+            case NMBS_DIAGNOSTICS_RETURN_QUERY_DATA:
+                break;
+            case NMBS_DIAGNOSTICS_CLEAR_COUNTERS:
+                memset(counters, 0, sizeof(nmbs_diagnostic_counters));
+#ifdef NMBS_COMM_EVENT_LOG_ENABLED
+                if (nmbs->comm_event_log) {
+                    nmbs->comm_event_log->event_count = 0;
+                    nmbs->comm_event_log->message_count = 0;
+                }
+#endif
+                break;
+            case NMBS_DIAGNOSTICS_BUS_MESSAGE_COUNT:
+                data = counters->bus_messages;
+                break;
+            case NMBS_DIAGNOSTICS_BUS_COMMUNICATION_ERROR_COUNT:
+                data = counters->bus_errors;
+                break;
+            case NMBS_DIAGNOSTICS_BUS_EXCEPTION_ERROR_COUNT:
+                data = counters->exceptions;
+                break;
+            case NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT:
+                data = counters->server_messages;
+                break;
+            case NMBS_DIAGNOSTICS_SERVER_NO_RESPONSE_COUNT:
+                data = counters->no_responses;
+                break;
+            case NMBS_DIAGNOSTICS_BUS_CHARACTER_OVERRUN_COUNT:
+                data = counters->overruns;
+                break;
+            case NMBS_DIAGNOSTICS_CLEAR_OVERRUN_COUNTER:
+                counters->overruns = 0;
+                break;
+            default:
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+
+        if (!nmbs->msg.broadcast) {
+            put_res_header(nmbs, 4);
+
+            put_2(nmbs, sub_function);
+            put_2(nmbs, data);
+            NMBS_DEBUG_PRINT("sf %d\tdata %d", sub_function, data);
+
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_diagnostics_res(nmbs, sub_function, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED
+static nmbs_error handle_get_comm_event_counter(nmbs_t* nmbs) {
+    nmbs_error err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        const nmbs_comm_event_log* log = nmbs->comm_event_log;
+        if (log) {
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 4);
+
+                // The status word is never busy, since requests are always processed to completion
+                put_2(nmbs, 0);
+                put_2(nmbs, log->event_count);
+                NMBS_DEBUG_PRINT("status %d\tevents %d", 0, log->event_count);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_get_comm_event_counter_res(nmbs, NULL, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED
+static nmbs_error handle_get_comm_event_log(nmbs_t* nmbs) {
+    nmbs_error err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        const nmbs_comm_event_log* log = nmbs->comm_event_log;
+        if (log) {
+            if (!nmbs->msg.broadcast) {
+                uint8_t byte_count = (uint8_t) (6 + log->count);
+                put_res_header(nmbs, 1 + byte_count);
+
+                put_1(nmbs, byte_count);
+                put_2(nmbs, 0);
+                put_2(nmbs, log->event_count);
+                put_2(nmbs, log->message_count);
+                NMBS_DEBUG_PRINT("status %d\tevents %d\tmessages %d\tlog %d", 0, log->event_count, log->message_count,
+                                 log->count);
+
+                // Most recent event first
+                for (uint8_t i = 0; i < log->count; i++)
+                    put_1(nmbs, log->events[(log->head + NMBS_COMM_EVENT_LOG_SIZE - 1 - i) % NMBS_COMM_EVENT_LOG_SIZE]);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_get_comm_event_log_res(nmbs, NULL, NULL, NULL, NULL, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED
+static nmbs_error handle_write_multiple_coils(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 5);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t quantity = get_2(nmbs);
+    uint8_t coils_bytes = get_1(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\tcoils ", address, quantity, coils_bytes);
+
+    if (coils_bytes > 246)
+        return NMBS_ERROR_INVALID_REQUEST;
+
+    err = recv(nmbs, coils_bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    const uint8_t* coils = get_n(nmbs, coils_bytes);
+    for (int i = 0; i < coils_bytes; i++) {
+        NMBS_DEBUG_PRINT("%d ", coils[i]);
+    }
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (quantity < 1 || quantity > 0x07B0)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if (coils_bytes == 0)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((quantity + 7) / 8 != coils_bytes)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (NMBS_CALLBACKS(nmbs)->write_multiple_coils || NMBS_DATA(nmbs)->coils) {
+            if (NMBS_CALLBACKS(nmbs)->write_multiple_coils)
+                err = NMBS_CALLBACKS(nmbs)->write_multiple_coils(address, quantity, coils, nmbs->msg.unit_id,
+                                                                 NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = write_coils_data(nmbs, address, quantity, coils);
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, quantity);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            data_changed(nmbs, NMBS_CHANGE_COILS, 0, address, quantity);
+
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 4);
+
+                put_2(nmbs, address);
+                put_2(nmbs, quantity);
+                NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_write_multiple_coils_res(nmbs, address, quantity);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED
+static nmbs_error handle_write_multiple_registers(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 5);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t quantity = get_2(nmbs);
+    uint8_t registers_bytes = get_1(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\tregs ", address, quantity, registers_bytes);
+
+    if (registers_bytes > 246)
+        return NMBS_ERROR_INVALID_REQUEST;
+
+    err = recv(nmbs, registers_bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    // Registers are converted in place after the CRC has been checked
+    uint16_t registers_idx = nmbs->msg.buf_idx;
+    discard_n(nmbs, registers_bytes);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (quantity < 1 || quantity > 0x007B)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if (registers_bytes == 0)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (registers_bytes != quantity * 2)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (NMBS_CALLBACKS(nmbs)->write_multiple_registers || NMBS_DATA(nmbs)->holding_registers ||
+            NMBS_DATA(nmbs)->holding_registers_snapshot) {
+            nmbs->msg.buf_idx = registers_idx;
+            const uint16_t* registers = get_regs(nmbs, quantity);
+            for (int i = 0; i < quantity; i++) {
+                NMBS_DEBUG_PRINT("%d ", registers[i]);
+            }
+
+            if (NMBS_CALLBACKS(nmbs)->write_multiple_registers)
+                err = NMBS_CALLBACKS(nmbs)->write_multiple_registers(address, quantity, registers, nmbs->msg.unit_id,
+                                                                     NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = write_holding_registers_data(nmbs, address, quantity, registers);
+
+            if (err == NMBS_ERROR_RESPONSE_DEFERRED)
+                return defer_response(nmbs, address, quantity);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            data_changed(nmbs, NMBS_CHANGE_HOLDING_REGISTERS, 0, address, quantity);
+
+            if (!nmbs->msg.broadcast) {
+                put_res_header(nmbs, 4);
+
+                put_2(nmbs, address);
+                put_2(nmbs, quantity);
+                NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+
+                err = send_msg(nmbs);
+                if (err != NMBS_ERROR_NONE)
+                    return err;
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+    else {
+        return recv_write_multiple_registers_res(nmbs, address, quantity);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_READ_FILE_RECORD_DISABLED
+static nmbs_error handle_read_file_record(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t request_size = get_1(nmbs);
+    if (request_size > 245)
+        return NMBS_ERROR_INVALID_REQUEST;
+
+    err = recv(nmbs, request_size);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    const uint8_t subreq_header_size = 7;
+    const uint8_t subreq_count = request_size / subreq_header_size;
+
+    struct {
+        uint8_t reference_type;
+        uint16_t file_number;
+        uint16_t record_number;
+        uint16_t record_length;
+    }
+#ifdef __STDC_NO_VLA__
+    subreq[35];    // 245 / subreq_header_size
+#else
+    subreq[subreq_count];
+#endif
+
+    uint32_t response_data_size = 0;
+
+    for (uint8_t i = 0; i < subreq_count; i++) {
+        subreq[i].reference_type = get_1(nmbs);
+        subreq[i].file_number = get_2(nmbs);
+        subreq[i].record_number = get_2(nmbs);
+        subreq[i].record_length = get_2(nmbs);
+
+        response_data_size += 2 + (uint32_t) subreq[i].record_length * 2;
+    }
+
+    discard_n(nmbs, request_size % subreq_header_size);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (request_size % subreq_header_size)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (request_size < 0x07 || request_size > 0xF5)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        for (uint8_t i = 0; i < subreq_count; i++) {
+            if (subreq[i].reference_type != 0x06)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq[i].file_number == 0x0000)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq[i].record_number > 0x270F)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq[i].record_length > 124)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fread ", subreq[i].file_number, subreq[i].record_number,
+                             subreq[i].record_length);
+        }
+
+        // The sub-responses must fit in a single response PDU
+        if (response_data_size > 250)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        put_res_header(nmbs, (uint16_t) (1 + response_data_size));
+        put_1(nmbs, (uint8_t) response_data_size);
+
+        if (NMBS_CALLBACKS(nmbs)->read_file_record) {
+            for (uint8_t i = 0; i < subreq_count; i++) {
+                uint16_t subreq_data_size = subreq[i].record_length * 2;
+                put_1(nmbs, subreq_data_size + 1);
+                put_1(nmbs, 0x06);    // add Reference Type const
+                uint16_t* subreq_data = regs_in_place(nmbs);
+
+                err = NMBS_CALLBACKS(nmbs)->read_file_record(subreq[i].file_number, subreq[i].record_number,
+                                                             subreq_data, subreq[i].record_length, nmbs->msg.unit_id,
+                                                             NMBS_CALLBACKS_ARG(nmbs));
+                if (err != NMBS_ERROR_NONE) {
+                    if (nmbs_error_is_exception(err))
+                        return send_exception_msg(nmbs, err);
+
+                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+                }
+
+                put_regs_in_place(nmbs, subreq[i].record_length);
+            }
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+
+        if (!nmbs->msg.broadcast) {
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_read_file_record_res(nmbs, NULL, 0);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_WRITE_FILE_RECORD_DISABLED
+static nmbs_error handle_write_file_record(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t request_size = get_1(nmbs);
+    if (request_size > 251) {
+        return NMBS_ERROR_INVALID_REQUEST;
+    }
+
+    err = recv(nmbs, request_size);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    // We can save msg_buf index and use it later for context recovery.
+    uint16_t msg_buf_idx = nmbs->msg.buf_idx;
+    discard_n(nmbs, request_size);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        const uint8_t subreq_header_size = 7;
+        uint16_t size = request_size;
+        nmbs->msg.buf_idx = msg_buf_idx;    // restore context
+
+        if (request_size < 0x07 || request_size > 0xFB)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        do {
+            uint8_t subreq_reference_type = get_1(nmbs);
+            uint16_t subreq_file_number_c = get_2(nmbs);
+            uint16_t subreq_record_number_c = get_2(nmbs);
+            uint16_t subreq_record_length_c = get_2(nmbs);
+
+            // A sub-request longer than the rest of the request would make the parsing overrun it
+            if (subreq_header_size + subreq_record_length_c * 2 > size)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+            discard_n(nmbs, subreq_record_length_c * 2);
+
+            if (subreq_reference_type != 0x06)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq_file_number_c == 0x0000)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq_record_number_c > 0x270F)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            if (subreq_record_length_c > 122)
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+            NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", subreq_file_number_c, subreq_record_number_c,
+                             subreq_record_length_c);
+            size -= (subreq_header_size + subreq_record_length_c * 2);
+        } while (size >= subreq_header_size);
+
+        if (size)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        // checks completed
+
+        size = request_size;
+        nmbs->msg.buf_idx = msg_buf_idx;    // restore context
+
+        do {
+            discard_1(nmbs);
+            uint16_t subreq_file_number = get_2(nmbs);
+            uint16_t subreq_record_number = get_2(nmbs);
+            uint16_t subreq_record_length = get_2(nmbs);
+            uint8_t* subreq_record = nmbs->msg_buf + nmbs->msg.buf_idx;
+            uint16_t* subreq_data = get_regs(nmbs, subreq_record_length);
+
+            if (NMBS_CALLBACKS(nmbs)->write_file_record) {
+                err = NMBS_CALLBACKS(nmbs)->write_file_record(subreq_file_number, subreq_record_number, subreq_data,
+                                                              subreq_record_length, nmbs->msg.unit_id,
+                                                              NMBS_CALLBACKS_ARG(nmbs));
+                if (err != NMBS_ERROR_NONE) {
+                    if (nmbs_error_is_exception(err))
+                        return send_exception_msg(nmbs, err);
+
+                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+                }
+
+                // Restore the request for the echo response, with the record length byte get_regs() may overwrite
+                put_regs_at(subreq_record, subreq_data, subreq_record_length);
+                subreq_record[-1] = (uint8_t) subreq_record_length;
+
+                data_changed(nmbs, NMBS_CHANGE_FILE_RECORD, subreq_file_number, subreq_record_number,
+                             subreq_record_length);
+            }
+            else {
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+            }
+
+            size -= (subreq_header_size + subreq_record_length * 2);
+        } while (size >= subreq_header_size);
+
+        if (!nmbs->msg.broadcast) {
+            // The normal response to 'Write File' is an echo of the request.
+            // We can restore buffer index and response msg.
+            nmbs->msg.buf_idx = msg_buf_idx;
+            discard_n(nmbs, request_size);
+
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_write_file_record_res(nmbs, 0, 0, NULL, 0);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED
+static uint16_t mask_register(uint16_t value, uint16_t and_mask, uint16_t or_mask) {
+    return (value & and_mask) | (or_mask & ~and_mask);
+}
+
+
+// The register is read and written back while holding the write lock of the store, so concurrent writers can't
+// interleave with the modification
+static nmbs_error mask_write_holding_register_data(nmbs_t* nmbs, uint16_t address, uint16_t and_mask,
+                                                   uint16_t or_mask) {
+    nmbs_snapshot_store* snapshot = NMBS_DATA(nmbs)->holding_registers_snapshot;
+    if (snapshot) {
+        uint16_t value;
+        nmbs_snapshot_store_begin(snapshot);
+        nmbs_error err = nmbs_snapshot_store_read(snapshot, address, 1, &value);
+        if (err == NMBS_ERROR_NONE) {
+            value = mask_register(value, and_mask, or_mask);
+            err = nmbs_snapshot_store_stage(snapshot, address, 1, &value);
+        }
+        nmbs_snapshot_store_publish(snapshot);
+
+        return err;
+    }
+
+    nmbs_register_store* store = NMBS_DATA(nmbs)->holding_registers;
+    if (!register_store_contains(store, address, 1))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    uint16_t* reg = nmbs_register_store_write_begin(store) + (address - store->address);
+    *reg = mask_register(*reg, and_mask, or_mask);
+    nmbs_register_store_write_end(store);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error handle_mask_write_register(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 6);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+    uint16_t and_mask = get_2(nmbs);
+    uint16_t or_mask = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d\tand %d\tor %d", address, and_mask, or_mask);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        const nmbs_callbacks* callbacks = NMBS_CALLBACKS(nmbs);
+        bool has_callbacks = callbacks->read_holding_registers && callbacks->write_single_register;
+        bool has_data = NMBS_DATA(nmbs)->holding_registers || NMBS_DATA(nmbs)->holding_registers_snapshot;
+
+        if (callbacks->mask_write_register) {
+            err = callbacks->mask_write_register(address, and_mask, or_mask, nmbs->msg.unit_id,
+                                                 NMBS_CALLBACKS_ARG(nmbs));
+        }
+        else if (has_callbacks) {
+            // Not atomic, the register can change between the two callbacks
+            uint16_t value;
+            err = callbacks->read_holding_registers(address, 1, &value, nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+            if (err == NMBS_ERROR_NONE)
+                err = callbacks->write_single_register(address, mask_register(value, and_mask, or_mask),
+                                                       nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+        }
+        else if (has_data) {
+            err = mask_write_holding_register_data(nmbs, address, and_mask, or_mask);
+        }
+        else {
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+
+        if (err != NMBS_ERROR_NONE) {
+            if (nmbs_error_is_exception(err))
+                return send_exception_msg(nmbs, err);
+
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+        }
+
+        data_changed(nmbs, NMBS_CHANGE_HOLDING_REGISTERS, 0, address, 1);
+
+        if (!nmbs->msg.broadcast) {
+            put_res_header(nmbs, 6);
+
+            put_2(nmbs, address);
+            put_2(nmbs, and_mask);
+            put_2(nmbs, or_mask);
+            NMBS_DEBUG_PRINT("a %d\tand %d\tor %d", address, and_mask, or_mask);
+
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_mask_write_register_res(nmbs, address, and_mask, or_mask);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED
+static nmbs_error handle_read_write_registers(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 9);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t read_address = get_2(nmbs);
+    uint16_t read_quantity = get_2(nmbs);
+    uint16_t write_address = get_2(nmbs);
+    uint16_t write_quantity = get_2(nmbs);
+
+    uint8_t byte_count_write = get_1(nmbs);
+
+    NMBS_DEBUG_PRINT("ra %d\trq %d\t wa %d\t wq %d\t b %d\tregs ", read_address, read_quantity, write_address,
+                     write_quantity, byte_count_write);
+
+    if (byte_count_write > 242)
+        return NMBS_ERROR_INVALID_REQUEST;
+
+    err = recv(nmbs, byte_count_write);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    // Registers are converted in place after the CRC has been checked
+    uint16_t registers_idx = nmbs->msg.buf_idx;
+    discard_n(nmbs, byte_count_write);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (read_quantity < 1 || read_quantity > 0x007D)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (write_quantity < 1 || write_quantity > 0x007B)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (byte_count_write != write_quantity * 2)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if ((uint32_t) read_address + (uint32_t) read_quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if ((uint32_t) write_address + (uint32_t) write_quantity > ((uint32_t) 0xFFFF) + 1)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        bool has_data = NMBS_DATA(nmbs)->holding_registers || NMBS_DATA(nmbs)->holding_registers_snapshot;
+        bool has_callbacks =
+                NMBS_CALLBACKS(nmbs)->write_multiple_registers && NMBS_CALLBACKS(nmbs)->read_holding_registers;
+        if (!has_callbacks && !has_data)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+        nmbs->msg.buf_idx = registers_idx;
+        const uint16_t* registers = get_regs(nmbs, write_quantity);
+        for (int i = 0; i < write_quantity; i++) {
+            NMBS_DEBUG_PRINT("%d ", registers[i]);
+        }
+
+        if (NMBS_CALLBACKS(nmbs)->write_multiple_registers)
+            err = NMBS_CALLBACKS(nmbs)->write_multiple_registers(write_address, write_quantity, registers,
+                                                                 nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+        else
+            err = write_holding_registers_data(nmbs, write_address, write_quantity, registers);
+
+        if (err != NMBS_ERROR_NONE) {
+            if (nmbs_error_is_exception(err))
+                return send_exception_msg(nmbs, err);
+
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+        }
+
+        data_changed(nmbs, NMBS_CHANGE_HOLDING_REGISTERS, 0, write_address, write_quantity);
+
+        if (!nmbs->msg.broadcast) {
+            // The written registers have been consumed, the read ones take their place in the buffer
+            uint8_t regs_bytes = read_quantity * 2;
+            put_res_header(nmbs, 1 + regs_bytes);
+            put_1(nmbs, regs_bytes);
+
+            uint16_t* regs = regs_in_place(nmbs);
+            if (NMBS_CALLBACKS(nmbs)->read_holding_registers)
+                err = NMBS_CALLBACKS(nmbs)->read_holding_registers(read_address, read_quantity, regs, nmbs->msg.unit_id,
+                                                                   NMBS_CALLBACKS_ARG(nmbs));
+            else
+                err = read_registers_data(NMBS_DATA(nmbs)->holding_registers,
+                                          NMBS_DATA(nmbs)->holding_registers_snapshot, read_address, read_quantity,
+                                          regs);
+
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            NMBS_DEBUG_PRINT("b %d\t", regs_bytes);
+
+            NMBS_DEBUG_PRINT("regs ");
+            for (int i = 0; i < read_quantity; i++) {
+                NMBS_DEBUG_PRINT("%d ", regs[i]);
+            }
+
+            put_regs_in_place(nmbs, read_quantity);
+
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_write_multiple_registers_res(nmbs, write_address, write_quantity);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_READ_FIFO_QUEUE_DISABLED
+static nmbs_error handle_read_fifo_queue(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 2);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint16_t address = get_2(nmbs);
+
+    NMBS_DEBUG_PRINT("a %d", address);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        if (!NMBS_CALLBACKS(nmbs)->read_fifo_queue)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+        uint16_t values[NMBS_FIFO_COUNT_MAX];
+        uint8_t count = 0;
+        err = NMBS_CALLBACKS(nmbs)->read_fifo_queue(address, values, &count, nmbs->msg.unit_id,
+                                                    NMBS_CALLBACKS_ARG(nmbs));
+        if (err != NMBS_ERROR_NONE) {
+            if (nmbs_error_is_exception(err))
+                return send_exception_msg(nmbs, err);
+
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+        }
+
+        if (count > NMBS_FIFO_COUNT_MAX)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (!nmbs->msg.broadcast) {
+            put_res_header(nmbs, 4 + count * 2);
+            put_2(nmbs, 2 + count * 2);
+            put_2(nmbs, count);
+            NMBS_DEBUG_PRINT("c %d\tvalues ", count);
+
+            for (int i = 0; i < count; i++) {
+                put_2(nmbs, values[i]);
+                NMBS_DEBUG_PRINT("%d ", values[i]);
+            }
+
+            err = send_msg(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+    }
+    else {
+        return recv_read_fifo_queue_res(nmbs, NULL, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
+// Read device ID code whose stream contains the object
+static uint8_t device_identification_code(uint8_t object_id) {
+    if (object_id <= 0x02)
+        return 1;
+
+    if (object_id < 0x80)
+        return 2;
+
+    return 3;
+}
+
+
+nmbs_error nmbs_device_identification_create(nmbs_device_identification* devid,
+                                             const nmbs_device_identification_value* values, uint16_t count,
+                                             nmbs_device_identification_object* objects, uint8_t* buf,
+                                             uint16_t buf_size) {
+    if (!devid || !values || !objects || !buf || count < 3)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    uint16_t offset = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t id = values[i].id;
+        if (i < 3 && id != i)
+            return NMBS_ERROR_INVALID_ARGUMENT;    // Missing basic object
+
+        if ((id > 6 && id < 0x80) || (i > 0 && id <= values[i - 1].id) || !values[i].value)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+
+        size_t length = strlen(values[i].value);
+        if (length >= NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH || (uint32_t) offset + 2 + length > buf_size)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+
+        objects[i].id = id;
+        objects[i].offset = offset;
+        buf[offset] = id;
+        buf[offset + 1] = (uint8_t) length;
+        memcpy(&buf[offset + 2], values[i].value, length);
+        offset = (uint16_t) (offset + 2 + length);
+    }
+
+    // The segment starting from each object holds the following objects of the same stream fitting in a response
+    for (uint16_t i = 0; i < count; i++) {
+        uint8_t code = device_identification_code(objects[i].id);
+        uint16_t length = 0;
+        uint16_t j = i;
+        while (j < count && device_identification_code(objects[j].id) == code) {
+            uint16_t end = j + 1 < count ? objects[j + 1].offset : offset;
+            uint16_t object_length = end - objects[j].offset;
+            if (length + object_length > 253 - 7)
+                break;
+
+            length += object_length;
+            j++;
+        }
+
+        objects[i].segment_length = length;
+        objects[i].segment_count = (uint8_t) (j - i);
+        bool more_follows = j < count && device_identification_code(objects[j].id) == code;
+        objects[i].next_object_id = more_follows ? objects[j].id : 0;
+    }
+
+    devid->objects = objects;
+    devid->buf = buf;
+    devid->count = count;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error send_device_identification(nmbs_t* nmbs, uint8_t read_device_id_code, uint8_t object_id) {
+    const nmbs_device_identification* devid = nmbs->device_identification;
+
+    // First object with ID >= object_id
+    uint16_t i = 0;
+    while (i < devid->count && devid->objects[i].id < object_id)
+        i++;
+
+    const nmbs_device_identification_object* object = i < devid->count ? &devid->objects[i] : NULL;
+    uint8_t more_follows = 0;
+    uint8_t next_object_id = 0;
+    uint8_t number_of_objects = 0;
+    uint16_t offset = 0;
+    uint16_t length = 0;
+
+    if (read_device_id_code == 4) {
+        if (!object || object->id != object_id)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        uint16_t end = i + 1 < devid->count ? devid->objects[i + 1].offset : object->offset + object->segment_length;
+        offset = object->offset;
+        length = end - object->offset;
+        number_of_objects = 1;
+    }
+    else {
+        if ((read_device_id_code == 1 && object_id > 0x02) ||
+            (read_device_id_code == 2 && (object_id < 0x03 || object_id > 0x07)) ||
+            (read_device_id_code == 3 && object_id < 0x80))
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        // The stream may have no objects left
+        if (object && device_identification_code(object->id) == read_device_id_code) {
+            offset = object->offset;
+            length = object->segment_length;
+            number_of_objects = object->segment_count;
+            next_object_id = object->next_object_id;
+            more_follows = next_object_id ? 0xFF : 0;
+        }
+    }
+
+    put_res_header(nmbs, 6 + length);
+    put_1(nmbs, 0x0E);
+    put_1(nmbs, read_device_id_code);
+    put_1(nmbs, 0x83);
+    put_1(nmbs, more_follows);
+    put_1(nmbs, next_object_id);
+    put_1(nmbs, number_of_objects);
+    put_n(nmbs, &devid->buf[offset], (uint8_t) length);
+
+    return send_msg(nmbs);
+}
+
+
+static nmbs_error handle_read_device_identification(nmbs_t* nmbs) {
+    nmbs_error err = recv(nmbs, 3);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t mei_type = get_1(nmbs);
+    uint8_t read_device_id_code = get_1(nmbs);
+    uint8_t object_id = get_1(nmbs);
+
+    NMBS_DEBUG_PRINT("c %d\to %d", read_device_id_code, object_id);
+
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.ignored) {
+        bool has_callbacks = NMBS_CALLBACKS(nmbs)->read_device_identification_map &&
+                             NMBS_CALLBACKS(nmbs)->read_device_identification;
+        if (!has_callbacks && !nmbs->device_identification)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+        if (mei_type != 0x0E)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+        if (read_device_id_code < 1 || read_device_id_code > 4)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+        if (object_id > 6 && object_id < 0x80)
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+        if (!has_callbacks && !nmbs->msg.broadcast)
+            return send_device_identification(nmbs, read_device_id_code, object_id);
+
+        if (!nmbs->msg.broadcast) {
+            nmbs_bitfield_256 map;
+            nmbs_bitfield_reset(map);
+
+            err = NMBS_CALLBACKS(nmbs)->read_device_identification_map(map);
+            if (err != NMBS_ERROR_NONE) {
+                if (nmbs_error_is_exception(err))
+                    return send_exception_msg(nmbs, err);
+
+                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+            }
+
+            put_res_header(nmbs, 0);    // Length will be set later
+            put_1(nmbs, 0x0E);
+            put_1(nmbs, read_device_id_code);
+            put_1(nmbs, 0x83);
+
+            if (read_device_id_code == 4) {
+                if (!nmbs_bitfield_read(map, object_id))
+                    return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+                put_1(nmbs, 0);    // More follows
+                put_1(nmbs, 0);    // Next Object Id
+                put_1(nmbs, 1);    // Number of objects
+
+                // The object value is read straight into the response
+                char* str = (char*) &nmbs->msg_buf[nmbs->msg.buf_idx + 2];
+                str[0] = 0;
+                err = NMBS_CALLBACKS(nmbs)->read_device_identification(object_id, str);
+                if (err != NMBS_ERROR_NONE) {
+                    if (nmbs_error_is_exception(err))
+                        return send_exception_msg(nmbs, err);
+
+                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+                }
+
+                size_t str_len = strlen(str);
+
+                put_1(nmbs, object_id);    // Object id
+                put_1(nmbs, str_len);      // Object length
+                discard_n(nmbs, str_len);
+
+                set_msg_header_size(nmbs, 6 + 2 + str_len);
+
+                return send_msg(nmbs);
+            }
+
+            uint8_t more_follows_idx = nmbs->msg.buf_idx;
+            put_1(nmbs, 0);
+            uint8_t next_object_id_idx = nmbs->msg.buf_idx;
+            put_1(nmbs, 0);
+            uint8_t number_of_objects_idx = nmbs->msg.buf_idx;
+            put_1(nmbs, 0);
+
+            int16_t res_size_left = 253 - 7;
+
+            uint8_t last_id = 0;
+            uint8_t msg_size = 6;
+            uint8_t res_more_follows = 0;
+            uint8_t res_next_object_id = 0;
+            uint8_t res_number_of_objects = 0;
+
+            switch (read_device_id_code) {
+                case 1:
+                    if (object_id > 0x02)
+                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                    last_id = 0x02;
+                    break;
+                case 2:
+                    if (object_id < 0x03 || object_id > 0x07)
+                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                    last_id = 0x07;
+                    break;
+                case 3:
+                    if (object_id < 0x80)
+                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                    last_id = 0xFF;
+                    break;
+                default:
+                    // Unreachable
+                    break;
+            }
+
+            for (uint16_t id = object_id; id <= last_id; id++) {
+                if (!nmbs_bitfield_read(map, id)) {
+                    if (id < 0x03)
+                        return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+                    continue;
+                }
+
+                // The object value is read straight into the response. When the buffer has no room left for a whole
+                // string, the object is left for the next request
+                if ((size_t) nmbs->msg.buf_idx + 2 + NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH > NMBS_MSG_BUF_SIZE) {
+                    res_more_follows = 0xFF;
+                    res_next_object_id = id;
+                    break;
+                }
+
+                char* str = (char*) &nmbs->msg_buf[nmbs->msg.buf_idx + 2];
+                str[0] = 0;
+                err = NMBS_CALLBACKS(nmbs)->read_device_identification((uint8_t) id, str);
+                if (err != NMBS_ERROR_NONE) {
+                    if (nmbs_error_is_exception(err))
+                        return send_exception_msg(nmbs, err);
+
+                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+                }
+
+                int16_t str_len = (int16_t) strlen(str);
+
+                res_size_left = (int16_t) (res_size_left - 2 - str_len);
+                if (res_size_left < 0) {
+                    res_more_follows = 0xFF;
+                    res_next_object_id = id;
+                    break;
+                }
+
+                put_1(nmbs, (uint8_t) id);    // Object id
+                put_1(nmbs, str_len);         // Object length
+                discard_n(nmbs, str_len);
+
+                msg_size += (2 + str_len);
+
+                res_number_of_objects++;
+            }
+
+            set_1(nmbs, res_more_follows, more_follows_idx);
+            set_1(nmbs, res_next_object_id, next_object_id_idx);
+            set_1(nmbs, res_number_of_objects, number_of_objects_idx);
+
+            set_msg_header_size(nmbs, msg_size);
+
+            return send_msg(nmbs);
+        }
+    }
+    else {
+        return recv_read_device_identification_res(nmbs, 0, NULL, 0, NULL, NULL, NULL, NULL);
+    }
+
+    return NMBS_ERROR_NONE;
+}
+#endif
+
+
+// The largest PDU data following the function code, on both transports
+#define NMBS_PDU_DATA_MAX 252
+
+static nmbs_error handle_custom_fc(nmbs_t* nmbs, nmbs_fc_handler handler) {
+    uint16_t length = 0;
+    if (nmbs->transport == NMBS_TRANSPORT_TCP) {
+        // The MBAP length field counts the unit ID and the function code too
+        uint16_t mbap_length = (uint16_t) (nmbs->msg_buf[4] << 8 | nmbs->msg_buf[5]);
+        if (mbap_length < 2)
+            return NMBS_ERROR_INVALID_TCP_MBAP;
+
+        // Requests larger than a PDU are read in chunks to stay in sync with the stream, then rejected
+        length = (uint16_t) (mbap_length - 2);
+        uint16_t data_idx = nmbs->msg.buf_idx;
+        uint16_t remaining = length;
+        while (remaining > 0) {
+            uint16_t chunk = remaining > NMBS_PDU_DATA_MAX ? NMBS_PDU_DATA_MAX : remaining;
+            nmbs->msg.buf_idx = data_idx;
+            nmbs_error err = recv(nmbs, chunk);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+
+            remaining = (uint16_t) (remaining - chunk);
+        }
+
+        nmbs_error err = recv_msg_footer(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+    }
+    else {
+        // The request ends when the line goes silent, which cannot be detected without a byte timeout
+        uint16_t room = (uint16_t) (NMBS_MSG_BUF_SIZE - nmbs->msg.buf_idx);
+        if (nmbs->byte_timeout_ms < 0) {
+            NMBS_PLATFORM(nmbs)->read(nmbs->msg_buf + nmbs->msg.buf_idx, room, 0, NMBS_PLATFORM_ARG(nmbs));
+            if (nmbs->msg.ignored)
+                return NMBS_ERROR_NONE;
+
+            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+
+        int32_t ret = NMBS_PLATFORM(nmbs)->read(nmbs->msg_buf + nmbs->msg.buf_idx, room, nmbs->byte_timeout_ms,
+                                                NMBS_PLATFORM_ARG(nmbs));
+        if (ret < 0 || ret > room)
+            return NMBS_ERROR_TRANSPORT;
+
+        if (ret < 2)
+            return NMBS_ERROR_TIMEOUT;
+
+        length = (uint16_t) (ret - 2);
+        uint16_t crc_idx = (uint16_t) (nmbs->msg.buf_idx + length);
+        uint16_t crc = NMBS_PLATFORM(nmbs)->crc_calc(nmbs->msg_buf, crc_idx, NMBS_PLATFORM_ARG(nmbs));
+        uint16_t recv_crc = (uint16_t) (nmbs->msg_buf[crc_idx] << 8 | nmbs->msg_buf[crc_idx + 1]);
+        nmbs_error err = count_msg(nmbs, recv_crc == crc);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+    }
+
+    NMBS_DEBUG_PRINT("custom l %d", length);
+
+    if (nmbs->msg.ignored)
+        return NMBS_ERROR_NONE;
+
+    // Unregistered function codes are answered after the whole request has been received
+    if (!handler)
+        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    if (length > NMBS_PDU_DATA_MAX)
+        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+    // The response is written in place of the request, after a header of the same size
+    nmbs_error err = handler(nmbs->msg.fc, nmbs->msg_buf + nmbs->msg.buf_idx, &length, NMBS_PDU_DATA_MAX,
+                             nmbs->msg.unit_id, NMBS_CALLBACKS_ARG(nmbs));
+    if (err != NMBS_ERROR_NONE) {
+        if (nmbs_error_is_exception(err))
+            return send_exception_msg(nmbs, err);
+
+        return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+    }
+
+    if (length > NMBS_PDU_DATA_MAX)
+        return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+
+    if (!nmbs->msg.broadcast) {
+        put_res_header(nmbs, length);
+        nmbs->msg.buf_idx += length;
+
+        err = send_msg(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error handle_req_fc(nmbs_t* nmbs) {
+    NMBS_DEBUG_PRINT("fc %d\t", nmbs->msg.fc);
+
+    nmbs_error err = NMBS_ERROR_NONE;
+    switch (nmbs->msg.fc) {
+#ifndef NMBS_SERVER_READ_COILS_DISABLED
+        case 1:
+            err = handle_read_coils(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED
+        case 2:
+            err = handle_read_discrete_inputs(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED
+        case 3:
+            err = handle_read_holding_registers(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED
+        case 4:
+            err = handle_read_input_registers(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED
+        case 5:
+            err = handle_write_single_coil(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED
+        case 6:
+            err = handle_write_single_register(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_EXCEPTION_STATUS_DISABLED
+        case 7:
+            err = handle_read_exception_status(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_DIAGNOSTICS_DISABLED
+        case 8:
+            err = handle_diagnostics(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED
+        case 11:
+            err = handle_get_comm_event_counter(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED
+        case 12:
+            err = handle_get_comm_event_log(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED
+        case 15:
+            err = handle_write_multiple_coils(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED
+        case 16:
+            err = handle_write_multiple_registers(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_FILE_RECORD_DISABLED
+        case 20:
+            err = handle_read_file_record(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_WRITE_FILE_RECORD_DISABLED
+        case 21:
+            err = handle_write_file_record(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED
+        case 22:
+            err = handle_mask_write_register(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED
+        case 23:
+            err = handle_read_write_registers(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_FIFO_QUEUE_DISABLED
+        case 24:
+            err = handle_read_fifo_queue(nmbs);
+            break;
+#endif
+
+#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
+        case 43:
+            err = handle_read_device_identification(nmbs);
+            break;
+#endif
+        default: {
+            // Custom function codes are only looked up once the ones implemented here have been excluded
+            const nmbs_fc_table* table = NMBS_CALLBACKS(nmbs)->fc_table;
+            if (table)
+                err = handle_custom_fc(nmbs, nmbs->msg.fc < 128 ? table->handlers[nmbs->msg.fc] : NULL);
+            else
+                err = send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        }
+    }
+
+    return err;
+}
+
+
+void nmbs_callbacks_create(nmbs_callbacks* callbacks) {
+    memset(callbacks, 0, sizeof(nmbs_callbacks));
+    callbacks->initialized = 0xFFFFDEBE;
+}
+
+
+nmbs_error nmbs_server_create(nmbs_t* nmbs, uint8_t address_rtu, const nmbs_platform_conf* platform_conf,
+                              const nmbs_callbacks* callbacks) {
+    if (platform_conf->transport == NMBS_TRANSPORT_RTU && address_rtu == 0)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if (!callbacks || callbacks->initialized != 0xFFFFDEBE)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    nmbs_error ret = nmbs_create(nmbs, platform_conf);
+    if (ret != NMBS_ERROR_NONE)
+        return ret;
+
+    nmbs->address_rtu = address_rtu;
+#ifdef NMBS_COMPACT
+    nmbs->callbacks = callbacks;
+#else
+    nmbs->callbacks = *callbacks;
+#endif
+    NMBS_CALLBACKS_ARG(nmbs) = callbacks->arg;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error server_poll(nmbs_t* nmbs) {
+    msg_state_reset(nmbs);
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+    nmbs->deferred = NULL;
+#endif
+
+    bool first_byte_received = false;
+    nmbs_error err = recv_req_header(nmbs, &first_byte_received);
+    if (err != NMBS_ERROR_NONE) {
+        if (!first_byte_received && err == NMBS_ERROR_TIMEOUT)
+            return NMBS_ERROR_NONE;
+
+        return err;
+    }
+
+#ifdef NMBS_DEBUG
+    printf("%d ", nmbs->address_rtu);
+    printf("NMBS req <- ");
+    if (nmbs->transport == NMBS_TRANSPORT_RTU) {
+        if (nmbs->msg.broadcast)
+            printf("broadcast\t");
+        else
+            printf("address_rtu %d\t", nmbs->msg.unit_id);
+    }
+#endif
+
+    err = handle_req_fc(nmbs);
+    if (err == NMBS_ERROR_NONE && nmbs->msg.broadcast)
+        NMBS_DIAGNOSTICS_COUNT(nmbs, no_responses);
+
+#ifdef NMBS_COMM_EVENT_LOG_ENABLED
+    // Exception responses have already been logged, and are not counted as completed. Deferred responses are logged
+    // when they are sent
+    nmbs_comm_event_log* log = nmbs->comm_event_log;
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+    bool deferred = nmbs->deferred && nmbs->deferred->pending;
+#else
+    bool deferred = false;
+#endif
+    if (log && err == NMBS_ERROR_NONE && !nmbs->msg.ignored && !(nmbs->msg.fc & 0x80) && !deferred) {
+        if (!nmbs->msg.broadcast)
+            comm_event(nmbs, NMBS_COMM_EVENT_SEND);
+
+        if (nmbs->msg.fc != 11)
+            log->event_count++;
+    }
+#endif
+
+    if (err != NMBS_ERROR_NONE && !nmbs_error_is_exception(err)) {
+        if (nmbs->transport == NMBS_TRANSPORT_RTU && err != NMBS_ERROR_TIMEOUT && nmbs->msg.ignored) {
+            // Flush the remaining data on the line
+            NMBS_PLATFORM(nmbs)->read(nmbs->msg_buf, NMBS_MSG_BUF_SIZE, 0, NMBS_PLATFORM_ARG(nmbs));
+        }
+
+        return err;
+    }
+
+    return NMBS_ERROR_NONE;
+}
+
+
+// Gives the message buffer back to the pool, if it was taken from one
+static void release_msg_buf(nmbs_t* nmbs) {
+#ifdef NMBS_COMPACT
+    if (nmbs->buffer_pool && nmbs->msg_buf) {
+        nmbs_buffer_pool_release(nmbs->buffer_pool, nmbs->msg_buf);
+        nmbs->msg_buf = NULL;
+    }
+#else
+    NMBS_UNUSED_PARAM(nmbs);
+#endif
+}
+
+
+#ifndef NMBS_PIPELINING_DISABLED
+// Whether the receive buffer holds a whole TCP ADU, according to the length field of its MBAP header
+static bool rx_has_adu(const nmbs_t* nmbs) {
+    uint16_t buffered = (uint16_t) (nmbs->rx_end - nmbs->rx_start);
+    if (buffered < 6)
+        return false;
+
+    const uint8_t* mbap = nmbs->rx_buf + nmbs->rx_start;
+    uint16_t length = (uint16_t) ((mbap[4] << 8) | mbap[5]);
+    return buffered >= 6 + (uint32_t) length;
+}
+#endif
+
+
+nmbs_error nmbs_server_poll(nmbs_t* nmbs) {
+#ifdef NMBS_COMPACT
+    bool overrun = nmbs->first_byte_pending;
+#endif
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+    nmbs->polling = true;
+#endif
+
+    nmbs_error err = server_poll(nmbs);
+
+#ifdef NMBS_COMPACT
+    // A request waiting for a pool buffer is counted once, not at every poll
+    if (err == NMBS_ERROR_BUFFER_POOL_EXHAUSTED && !overrun) {
+        NMBS_DIAGNOSTICS_COUNT(nmbs, overruns);
+        NMBS_COMM_EVENT(nmbs, NMBS_COMM_EVENT_RECEIVE | NMBS_COMM_EVENT_RECEIVE_OVERRUN);
+    }
+#endif
+
+#ifndef NMBS_PIPELINING_DISABLED
+    if (nmbs->transport == NMBS_TRANSPORT_TCP && nmbs->rx_buf) {
+        // Handle the pipelined requests already received, which the transport will not signal again. With a transmit
+        // buffer, all their responses are then sent at once.
+        while (err == NMBS_ERROR_NONE && rx_has_adu(nmbs))
+            err = server_poll(nmbs);
+
+        nmbs_error flush_err = tx_flush(nmbs);
+        if (err == NMBS_ERROR_NONE)
+            err = flush_err;
+    }
+#endif
+
+    release_msg_buf(nmbs);
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+    nmbs->polling = false;
+#endif
+
+    return err;
+}
+
+
+#ifndef NMBS_SERVER_DIAGNOSTICS_DISABLED
+void nmbs_server_get_diagnostics(const nmbs_t* nmbs, nmbs_diagnostic_counters* counters_out) {
+    *counters_out = nmbs->diagnostics;
+}
+#endif
+
+
+#ifndef NMBS_PIPELINING_DISABLED
+void nmbs_set_tx_buffer(nmbs_t* nmbs, uint8_t* buf, uint16_t size) {
+    nmbs->tx_buf = size >= NMBS_MSG_BUF_SIZE ? buf : NULL;
+    nmbs->tx_size = size;
+    nmbs->tx_len = 0;
+}
+#endif
+
+
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+nmbs_error nmbs_server_defer(nmbs_t* nmbs, nmbs_deferred* token) {
+    token->pending = false;
+    nmbs->deferred = token;
+    return NMBS_ERROR_RESPONSE_DEFERRED;
+}
+
+
+bool nmbs_deferred_is_pending(const nmbs_deferred* token) {
+    return token->pending;
+}
+
+
+// Restores the state of a deferred request, to build its response in the message buffer
+static nmbs_error deferred_begin(nmbs_t* nmbs, nmbs_deferred* token) {
+    // The message buffer and the transmit buffer are in use by the request being handled
+    if (nmbs->polling)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+#ifdef NMBS_COMPACT
+    if (nmbs->buffer_pool && !nmbs->msg_buf) {
+        nmbs->msg_buf = nmbs_buffer_pool_acquire(nmbs->buffer_pool);
+        if (!nmbs->msg_buf)
+            return NMBS_ERROR_BUFFER_POOL_EXHAUSTED;
+    }
+#endif
+
+    msg_state_reset(nmbs);
+    nmbs->msg.transaction_id = token->transaction_id;
+    nmbs->msg.unit_id = token->unit_id;
+    nmbs->msg.fc = token->fc;
+    nmbs->msg.broadcast = token->broadcast;
+    token->pending = false;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+static nmbs_error deferred_send(nmbs_t* nmbs) {
+    nmbs_error err = NMBS_ERROR_NONE;
+    if (!nmbs->msg.broadcast) {
+        err = send_msg(nmbs);
+#ifndef NMBS_PIPELINING_DISABLED
+        if (err == NMBS_ERROR_NONE)
+            err = tx_flush(nmbs);
+#endif
+    }
+
+#ifdef NMBS_COMM_EVENT_LOG_ENABLED
+    nmbs_comm_event_log* log = nmbs->comm_event_log;
+    if (log && err == NMBS_ERROR_NONE && !(nmbs->msg.fc & 0x80)) {
+        if (!nmbs->msg.broadcast)
+            comm_event(nmbs, NMBS_COMM_EVENT_SEND);
+
+        log->event_count++;
+    }
+#endif
+
+    release_msg_buf(nmbs);
+
+    return err;
+}
+
+
+nmbs_error nmbs_server_complete_bits(nmbs_t* nmbs, nmbs_deferred* token, const nmbs_bitfield bits) {
+    if (!token || !token->pending || (token->fc != 1 && token->fc != 2) || !bits)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    nmbs_error err = deferred_begin(nmbs, token);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t discrete_bytes = (uint8_t) ((token->quantity + 7) / 8);
+    put_res_header(nmbs, 1 + discrete_bytes);
+    put_1(nmbs, discrete_bytes);
+
+    uint8_t* bitfield = &nmbs->msg_buf[nmbs->msg.buf_idx];
+    memcpy(bitfield, bits, discrete_bytes);
+    if (token->quantity % 8)
+        bitfield[discrete_bytes - 1] &= (uint8_t) ((1 << (token->quantity % 8)) - 1);
+
+    nmbs->msg.buf_idx += discrete_bytes;
+
+    return deferred_send(nmbs);
+}
+
+
+nmbs_error nmbs_server_complete_registers(nmbs_t* nmbs, nmbs_deferred* token, const uint16_t* registers) {
+    if (!token || !token->pending || (token->fc != 3 && token->fc != 4) || !registers)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    nmbs_error err = deferred_begin(nmbs, token);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    uint8_t regs_bytes = (uint8_t) (token->quantity * 2);
+    put_res_header(nmbs, 1 + regs_bytes);
+    put_1(nmbs, regs_bytes);
+    for (uint16_t i = 0; i < token->quantity; i++)
+        put_2(nmbs, registers[i]);
+
+    return deferred_send(nmbs);
+}
+
+
+nmbs_error nmbs_server_complete_write(nmbs_t* nmbs, nmbs_deferred* token) {
+    if (!token || !token->pending || (token->fc != 5 && token->fc != 6 && token->fc != 15 && token->fc != 16))
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    nmbs_error err = deferred_begin(nmbs, token);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+#if !defined(NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED) || !defined(NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED) ||        \
+    !defined(NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED) || !defined(NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED)
+    if (token->fc == 5 || token->fc == 15)
+        data_changed(nmbs, NMBS_CHANGE_COILS, 0, token->address, token->fc == 5 ? 1 : token->quantity);
+    else
+        data_changed(nmbs, NMBS_CHANGE_HOLDING_REGISTERS, 0, token->address, token->fc == 6 ? 1 : token->quantity);
+#endif
+
+    // Write responses echo the address and the quantity, or the value for FC 05 and 06
+    put_res_header(nmbs, 4);
+    put_2(nmbs, token->address);
+    put_2(nmbs, token->quantity);
+
+    return deferred_send(nmbs);
+}
+
+
+nmbs_error nmbs_server_complete_exception(nmbs_t* nmbs, nmbs_deferred* token, nmbs_error exception) {
+    if (!token || !token->pending || !nmbs_error_is_exception(exception))
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    nmbs_error err = deferred_begin(nmbs, token);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    NMBS_DIAGNOSTICS_COUNT(nmbs, exceptions);
+    NMBS_COMM_EVENT(nmbs, NMBS_COMM_EVENT_SEND | comm_event_exception((uint8_t) exception));
+
+    nmbs->msg.fc += 0x80;
+    put_msg_header(nmbs, 1);
+    put_1(nmbs, (uint8_t) exception);
+
+    return deferred_send(nmbs);
+}
+#endif
 
-    err = recv(nmbs, request_size);
+
+#ifdef NMBS_COMPACT
+void nmbs_set_buffer_pool(nmbs_t* nmbs, nmbs_buffer_pool* pool) {
+    nmbs->buffer_pool = pool;
+    nmbs->msg_buf = NULL;
+    nmbs->first_byte_pending = false;
+}
+#endif
+
+
+void nmbs_set_callbacks_arg(nmbs_t* nmbs, void* arg) {
+    NMBS_CALLBACKS_ARG(nmbs) = arg;
+}
+
+
+#ifndef NMBS_SERVER_DATA_STORES_DISABLED
+void nmbs_set_coils_bitfield(nmbs_t* nmbs, nmbs_bitfield_65536 coils) {
+    nmbs->data.coils = coils;
+}
+
+
+void nmbs_set_discrete_inputs_bitfield(nmbs_t* nmbs, nmbs_bitfield_65536 discrete_inputs) {
+    nmbs->data.discrete_inputs = discrete_inputs;
+}
+
+
+void nmbs_set_holding_registers_store(nmbs_t* nmbs, nmbs_register_store* store) {
+    nmbs->data.holding_registers = store;
+}
+
+
+void nmbs_set_input_registers_store(nmbs_t* nmbs, nmbs_register_store* store) {
+    nmbs->data.input_registers = store;
+}
+
+
+void nmbs_set_holding_registers_snapshot_store(nmbs_t* nmbs, nmbs_snapshot_store* store) {
+    nmbs->data.holding_registers_snapshot = store;
+}
+
+
+void nmbs_set_input_registers_snapshot_store(nmbs_t* nmbs, nmbs_snapshot_store* store) {
+    nmbs->data.input_registers_snapshot = store;
+}
+
+
+void nmbs_set_image(nmbs_t* nmbs, nmbs_image* image) {
+    if (!image) {
+        nmbs->data.coils = NULL;
+        nmbs->data.discrete_inputs = NULL;
+        nmbs->data.holding_registers = NULL;
+        nmbs->data.input_registers = NULL;
+        nmbs->data.bits_sequence = NULL;
+        return;
+    }
+
+    nmbs->data.coils = image->coils;
+    nmbs->data.discrete_inputs = image->discrete_inputs;
+    nmbs->data.holding_registers = image->header->holding_registers_count ? &image->holding_registers : NULL;
+    nmbs->data.input_registers = image->header->input_registers_count ? &image->input_registers : NULL;
+    nmbs->data.bits_sequence = &image->header->sequence;
+}
+
+
+void nmbs_set_response_cache(nmbs_t* nmbs, nmbs_response_cache* cache) {
+    nmbs->data.response_cache = cache;
+}
+
+
+void nmbs_set_change_log(nmbs_t* nmbs, nmbs_change_log* log) {
+    nmbs->data.change_log = log;
+}
+#endif
+
+
+#ifdef NMBS_COMM_EVENT_LOG_ENABLED
+void nmbs_set_comm_event_log(nmbs_t* nmbs, nmbs_comm_event_log* log) {
+    nmbs->comm_event_log = log;
+}
+#endif
+
+
+void nmbs_fc_table_create(nmbs_fc_table* table) {
+    memset(table, 0, sizeof(nmbs_fc_table));
+}
+
+
+nmbs_error nmbs_fc_table_set(nmbs_fc_table* table, uint8_t fc, nmbs_fc_handler handler) {
+    if (!table || fc == 0 || fc > 127)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    table->handlers[fc] = handler;
+    return NMBS_ERROR_NONE;
+}
+
+
+#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
+void nmbs_set_device_identification(nmbs_t* nmbs, const nmbs_device_identification* devid) {
+    nmbs->device_identification = devid;
+}
+#endif
+#endif
+
+
+#ifndef NMBS_CLIENT_DISABLED
+nmbs_error nmbs_client_create(nmbs_t* nmbs, const nmbs_platform_conf* platform_conf) {
+    return nmbs_create(nmbs, platform_conf);
+}
+
+
+#ifndef NMBS_PIPELINING_DISABLED
+void nmbs_set_pipeline_depth(nmbs_t* nmbs, uint8_t depth) {
+    nmbs->pipeline_depth = depth;
+}
+#endif
+
+
+#ifndef NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED
+nmbs_error nmbs_adaptive_timeouts_create(nmbs_adaptive_timeouts* at, nmbs_device_timing* devices,
+                                         uint16_t devices_count, uint32_t (*clock_ms)(void* arg), void* arg) {
+    if (!at || !devices || devices_count < 1 || devices_count > 256 || !clock_ms)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    memset(at, 0, sizeof(nmbs_adaptive_timeouts));
+    at->min_timeout_ms = 10;
+    at->max_timeout_ms = 1000;
+    at->failures_to_open = 3;
+    at->open_ms = 5000;
+    at->devices = devices;
+    at->devices_count = devices_count;
+    at->clock_ms = clock_ms;
+    at->arg = arg;
+
+    memset(devices, 0, devices_count * sizeof(nmbs_device_timing));
+    for (uint16_t i = 0; i < devices_count; i++)
+        devices[i].timeout_ms = at->max_timeout_ms;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void nmbs_set_adaptive_timeouts(nmbs_t* nmbs, nmbs_adaptive_timeouts* at) {
+    nmbs->adaptive_timeouts = at;
+}
+
+
+int32_t nmbs_adaptive_timeouts_get_timeout(const nmbs_adaptive_timeouts* at, uint8_t unit_id) {
+    if (unit_id >= at->devices_count)
+        return -1;
+
+    return at->devices[unit_id].timeout_ms;
+}
+#endif
+
+
+static nmbs_error read_discrete(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint16_t quantity, nmbs_bitfield values) {
+    if (quantity < 1 || quantity > 2000)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    msg_state_req(nmbs, fc);
+    put_req_header(nmbs, 4);
+
+    put_2(nmbs, address);
+    put_2(nmbs, quantity);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    // We can save msg.buf index and use it later for context recovery.
-    uint16_t msg_buf_idx = nmbs->msg.buf_idx;
-    discard_n(nmbs, request_size);
+    return recv_read_discrete_res(nmbs, values);
+}
 
-    err = recv_msg_footer(nmbs);
+
+nmbs_error nmbs_read_coils(nmbs_t* nmbs, uint16_t address, uint16_t quantity, nmbs_bitfield coils_out) {
+    return read_discrete(nmbs, 1, address, quantity, coils_out);
+}
+
+
+nmbs_error nmbs_read_discrete_inputs(nmbs_t* nmbs, uint16_t address, uint16_t quantity, nmbs_bitfield inputs_out) {
+    return read_discrete(nmbs, 2, address, quantity, inputs_out);
+}
+
+static nmbs_error read_registers(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint16_t quantity, uint16_t* registers) {
+    if (quantity < 1 || quantity > 125)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    msg_state_req(nmbs, fc);
+    put_req_header(nmbs, 4);
+
+    put_2(nmbs, address);
+    put_2(nmbs, quantity);
+
+    NMBS_DEBUG_PRINT("a %d\tq %d ", address, quantity);
+
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    if (!nmbs->msg.ignored) {
-        const uint8_t subreq_header_size = 7;
-        uint16_t size = request_size;
-        nmbs->msg.buf_idx = msg_buf_idx;    // restore context
+    return recv_read_registers_res(nmbs, quantity, registers);
+}
 
-        if (request_size < 0x07 || request_size > 0xFB)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        do {
-            uint8_t subreq_reference_type = get_1(nmbs);
-            uint16_t subreq_file_number_c = get_2(nmbs);
-            uint16_t subreq_record_number_c = get_2(nmbs);
-            uint16_t subreq_record_length_c = get_2(nmbs);
-            discard_n(nmbs, subreq_record_length_c * 2);
+nmbs_error nmbs_read_holding_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, uint16_t* registers_out) {
+    return read_registers(nmbs, 3, address, quantity, registers_out);
+}
 
-            if (subreq_reference_type != 0x06)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
 
-            if (subreq_file_number_c == 0x0000)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+nmbs_error nmbs_read_input_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, uint16_t* registers_out) {
+    return read_registers(nmbs, 4, address, quantity, registers_out);
+}
 
-            if (subreq_record_number_c > 0x270F)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
 
-            if (subreq_record_length_c > 122)
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+nmbs_error nmbs_write_single_coil(nmbs_t* nmbs, uint16_t address, bool value) {
+    msg_state_req(nmbs, 5);
+    put_req_header(nmbs, 4);
 
-            NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", subreq_file_number_c, subreq_record_number_c,
-                             subreq_record_length_c);
-            size -= (subreq_header_size + subreq_record_length_c * 2);
-        } while (size >= subreq_header_size);
+    uint16_t value_req = value ? 0xFF00 : 0;
 
-        if (size)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    put_2(nmbs, address);
+    put_2(nmbs, value_req);
 
-        // checks completed
+    NMBS_DEBUG_PRINT("a %d\tvalue %d ", address, value_req);
 
-        size = request_size;
-        nmbs->msg.buf_idx = msg_buf_idx;    // restore context
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-        do {
-            discard_1(nmbs);
-            uint16_t subreq_file_number = get_2(nmbs);
-            uint16_t subreq_record_number = get_2(nmbs);
-            uint16_t subreq_record_length = get_2(nmbs);
-            uint16_t* subreq_data = get_regs(nmbs, subreq_record_length);
+    if (!nmbs->msg.broadcast)
+        return recv_write_single_coil_res(nmbs, address, value_req);
 
-            if (nmbs->callbacks.write_file_record) {
-                err = nmbs->callbacks.write_file_record(subreq_file_number, subreq_record_number, subreq_data,
-                                                        subreq_record_length, nmbs->msg.unit_id, nmbs->callbacks.arg);
-                if (err != NMBS_ERROR_NONE) {
-                    if (nmbs_error_is_exception(err))
-                        return send_exception_msg(nmbs, err);
+    return NMBS_ERROR_NONE;
+}
 
-                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-                }
 
-                swap_regs(subreq_data, subreq_record_length);    // restore swapping
-            }
-            else {
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-            }
+nmbs_error nmbs_write_single_register(nmbs_t* nmbs, uint16_t address, uint16_t value) {
+    msg_state_req(nmbs, 6);
+    put_req_header(nmbs, 4);
+
+    put_2(nmbs, address);
+    put_2(nmbs, value);
+
+    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.broadcast)
+        return recv_write_single_register_res(nmbs, address, value);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error nmbs_read_exception_status(nmbs_t* nmbs, uint8_t* status_out) {
+    msg_state_req(nmbs, 7);
+    put_req_header(nmbs, 0);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    return recv_read_exception_status_res(nmbs, status_out);
+}
+
+
+nmbs_error nmbs_diagnostics(nmbs_t* nmbs, uint16_t sub_function, uint16_t data, uint16_t* data_out) {
+    msg_state_req(nmbs, 8);
+    put_req_header(nmbs, 4);
+
+    put_2(nmbs, sub_function);
+    put_2(nmbs, data);
+
+    NMBS_DEBUG_PRINT("sf %d\tdata %d ", sub_function, data);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.broadcast)
+        return recv_diagnostics_res(nmbs, sub_function, data_out);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error nmbs_get_comm_event_counter(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out) {
+    msg_state_req(nmbs, 11);
+    put_req_header(nmbs, 0);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    return recv_get_comm_event_counter_res(nmbs, status_out, event_count_out);
+}
+
+
+nmbs_error nmbs_get_comm_event_log(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out,
+                                   uint16_t* message_count_out, uint8_t* events_out, uint8_t* events_count_out) {
+    msg_state_req(nmbs, 12);
+    put_req_header(nmbs, 0);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    return recv_get_comm_event_log_res(nmbs, status_out, event_count_out, message_count_out, events_out,
+                                       events_count_out);
+}
+
+
+nmbs_error nmbs_write_multiple_coils(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const nmbs_bitfield coils) {
+    if (quantity < 1 || quantity > 0x07B0)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    uint8_t coils_bytes = (quantity + 7) / 8;
 
-            size -= (subreq_header_size + subreq_record_length * 2);
-        } while (size >= subreq_header_size);
+    msg_state_req(nmbs, 15);
+    put_req_header(nmbs, 5 + coils_bytes);
 
-        if (!nmbs->msg.broadcast) {
-            // The normal response to 'Write File' is an echo of the request.
-            // We can restore buffer index and response msg.
-            nmbs->msg.buf_idx = msg_buf_idx;
-            discard_n(nmbs, request_size);
+    put_2(nmbs, address);
+    put_2(nmbs, quantity);
+    put_1(nmbs, coils_bytes);
+    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\t", address, quantity, coils_bytes);
 
-            err = send_msg(nmbs);
-            if (err != NMBS_ERROR_NONE)
-                return err;
-        }
-    }
-    else {
-        return recv_write_file_record_res(nmbs, 0, 0, NULL, 0);
+    NMBS_DEBUG_PRINT("coils ");
+    for (int i = 0; i < coils_bytes; i++) {
+        put_1(nmbs, coils[i]);
+        NMBS_DEBUG_PRINT("%d ", coils[i]);
     }
 
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.broadcast)
+        return recv_write_multiple_coils_res(nmbs, address, quantity);
+
     return NMBS_ERROR_NONE;
 }
-#endif
 
-#ifndef NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED
-static nmbs_error handle_read_write_registers(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 9);
-    if (err != NMBS_ERROR_NONE)
-        return err;
 
-    uint16_t read_address = get_2(nmbs);
-    uint16_t read_quantity = get_2(nmbs);
-    uint16_t write_address = get_2(nmbs);
-    uint16_t write_quantity = get_2(nmbs);
+nmbs_error nmbs_write_multiple_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const uint16_t* registers) {
+    if (quantity < 1 || quantity > 0x007B)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    uint8_t byte_count_write = get_1(nmbs);
+    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    NMBS_DEBUG_PRINT("ra %d\trq %d\t wa %d\t wq %d\t b %d\tregs ", read_address, read_quantity, write_address,
-                     write_quantity, byte_count_write);
+    uint8_t registers_bytes = quantity * 2;
 
-    if (byte_count_write > 242)
-        return NMBS_ERROR_INVALID_REQUEST;
+    msg_state_req(nmbs, 16);
+    put_req_header(nmbs, 5 + registers_bytes);
 
-    err = recv(nmbs, byte_count_write);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    put_2(nmbs, address);
+    put_2(nmbs, quantity);
+    put_1(nmbs, registers_bytes);
+    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\t", address, quantity, registers_bytes);
 
-#ifdef __STDC_NO_VLA__
-    uint16_t registers[0x007B];
-#else
-    uint16_t registers[byte_count_write / 2];
-#endif
-    for (int i = 0; i < byte_count_write / 2; i++) {
-        registers[i] = get_2(nmbs);
+    NMBS_DEBUG_PRINT("regs ");
+    for (int i = 0; i < quantity; i++) {
+        put_2(nmbs, registers[i]);
         NMBS_DEBUG_PRINT("%d ", registers[i]);
     }
 
-    err = recv_msg_footer(nmbs);
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    if (!nmbs->msg.ignored) {
-        if (read_quantity < 1 || read_quantity > 0x007D)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    if (!nmbs->msg.broadcast)
+        return recv_write_single_register_res(nmbs, address, quantity);
 
-        if (write_quantity < 1 || write_quantity > 0x007B)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+    return NMBS_ERROR_NONE;
+}
 
-        if (byte_count_write != write_quantity * 2)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
 
-        if ((uint32_t) read_address + (uint32_t) read_quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+// Receives the rest of the response to a chunk of a range request, after its header
+static nmbs_error recv_range_res(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint16_t quantity, uint8_t* bits_out,
+                                 uint16_t* registers_out) {
+    if (fc == 15 || fc == 16) {
+        nmbs_error err = recv(nmbs, 4);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-        if ((uint32_t) write_address + (uint32_t) write_quantity > ((uint32_t) 0xFFFF) + 1)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        uint16_t address_res = get_2(nmbs);
+        uint16_t quantity_res = get_2(nmbs);
+        NMBS_DEBUG_PRINT("a %d\tq %d", address_res, quantity_res);
 
-        if (!nmbs->callbacks.write_multiple_registers || !nmbs->callbacks.read_holding_registers)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        err = recv_msg_footer(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-        err = nmbs->callbacks.write_multiple_registers(write_address, write_quantity, registers, nmbs->msg.unit_id,
-                                                       nmbs->callbacks.arg);
-        if (err != NMBS_ERROR_NONE) {
-            if (nmbs_error_is_exception(err))
-                return send_exception_msg(nmbs, err);
+        if (address_res != address || quantity_res != quantity)
+            return NMBS_ERROR_INVALID_RESPONSE;
 
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-        }
+        return NMBS_ERROR_NONE;
+    }
 
-        if (!nmbs->msg.broadcast) {
-#ifdef __STDC_NO_VLA__
-            uint16_t regs[125];
-#else
-            uint16_t regs[read_quantity];
-#endif
-            err = nmbs->callbacks.read_holding_registers(read_address, read_quantity, regs, nmbs->msg.unit_id,
-                                                         nmbs->callbacks.arg);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+    nmbs_error err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+    uint8_t bytes = get_1(nmbs);
+    if (bytes > 250)
+        return NMBS_ERROR_INVALID_RESPONSE;
 
-            uint8_t regs_bytes = read_quantity * 2;
-            put_res_header(nmbs, 1 + regs_bytes);
+    err = recv(nmbs, bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-            put_1(nmbs, regs_bytes);
+    const uint8_t* data = get_n(nmbs, bytes);
+    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d", address, quantity, bytes);
 
-            NMBS_DEBUG_PRINT("b %d\t", regs_bytes);
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-            NMBS_DEBUG_PRINT("regs ");
-            for (int i = 0; i < read_quantity; i++) {
-                put_2(nmbs, regs[i]);
-                NMBS_DEBUG_PRINT("%d ", regs[i]);
-            }
+    if (fc == 1 || fc == 2) {
+        if (bytes != (quantity + 7) / 8)
+            return NMBS_ERROR_INVALID_RESPONSE;
 
-            err = send_msg(nmbs);
-            if (err != NMBS_ERROR_NONE)
-                return err;
+        if (bits_out) {
+            memcpy(bits_out, data, bytes);
+            if (quantity % 8)
+                bits_out[bytes - 1] &= (uint8_t) ((1 << (quantity % 8)) - 1);
         }
     }
     else {
-        return recv_write_multiple_registers_res(nmbs, write_address, write_quantity);
+        if (bytes != quantity * 2)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        if (registers_out) {
+            for (uint16_t i = 0; i < quantity; i++)
+                registers_out[i] = (uint16_t) ((uint16_t) data[i * 2] << 8 | data[i * 2 + 1]);
+        }
     }
 
     return NMBS_ERROR_NONE;
 }
+
+
+// Splits a range of coils or registers into requests of up to chunk_max each. On TCP, up to pipeline_depth of them are
+// kept in flight, and their responses are matched to them by transaction ID. chunk_max is a multiple of 8 for coils, so
+// that every chunk starts on a byte of the bit arrays.
+static nmbs_error range_request(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint32_t quantity, uint16_t chunk_max,
+                                uint8_t* bits_out, uint16_t* registers_out, const uint8_t* bits,
+                                const uint16_t* registers) {
+    if (quantity < 1 || (uint32_t) address + quantity > ((uint32_t) 0xFFFF) + 1)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    uint16_t chunks = (uint16_t) ((quantity + chunk_max - 1) / chunk_max);
+    uint16_t depth = 1;
+#ifndef NMBS_PIPELINING_DISABLED
+    if (nmbs->transport == NMBS_TRANSPORT_TCP && nmbs->pipeline_depth > 1)
+        depth = nmbs->pipeline_depth;
 #endif
 
-#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
-static nmbs_error handle_read_device_identification(nmbs_t* nmbs) {
-    nmbs_error err = recv(nmbs, 3);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    // One bit per chunk, set when its response has been received. Registers make the most chunks.
+    uint8_t done[(0x10000 / 123 + 8) / 8];
+    memset(done, 0, sizeof(done));
+
+    // After an exception, the responses to the requests in flight are still received, so that the next request starts
+    // in sync
+    nmbs_error result = NMBS_ERROR_NONE;
+    uint16_t sent = 0;
+    uint16_t completed = 0;
+    uint16_t last_tid = 0;
+    while (completed < chunks) {
+        while (result == NMBS_ERROR_NONE && sent < chunks && sent - completed < depth) {
+            uint32_t offset = (uint32_t) sent * chunk_max;
+            uint16_t chunk_address = (uint16_t) (address + offset);
+            uint16_t chunk_quantity = (uint16_t) (quantity - offset > chunk_max ? chunk_max : quantity - offset);
+
+            if (sent == completed)
+                msg_state_req(nmbs, fc);
+            else
+                msg_state_req_pipelined(nmbs, fc);
+
+            if (fc == 15) {
+                uint8_t coils_bytes = (uint8_t) ((chunk_quantity + 7) / 8);
+                put_req_header(nmbs, 5 + coils_bytes);
+                put_2(nmbs, chunk_address);
+                put_2(nmbs, chunk_quantity);
+                put_1(nmbs, coils_bytes);
+                for (uint8_t i = 0; i < coils_bytes; i++)
+                    put_1(nmbs, bits[offset / 8 + i]);
+            }
+            else if (fc == 16) {
+                put_req_header(nmbs, 5 + chunk_quantity * 2);
+                put_2(nmbs, chunk_address);
+                put_2(nmbs, chunk_quantity);
+                put_1(nmbs, (uint8_t) (chunk_quantity * 2));
+                put_regs(nmbs, registers + offset, chunk_quantity);
+            }
+            else {
+                put_req_header(nmbs, 4);
+                put_2(nmbs, chunk_address);
+                put_2(nmbs, chunk_quantity);
+            }
 
-    uint8_t mei_type = get_1(nmbs);
-    uint8_t read_device_id_code = get_1(nmbs);
-    uint8_t object_id = get_1(nmbs);
+            NMBS_DEBUG_PRINT("a %d\tq %d", chunk_address, chunk_quantity);
 
-    NMBS_DEBUG_PRINT("c %d\to %d", read_device_id_code, object_id);
+            nmbs_error err = send_req(nmbs);
+            if (err != NMBS_ERROR_NONE)
+                return err;
 
-    err = recv_msg_footer(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+            last_tid = nmbs->msg.transaction_id;
+            sent++;
 
-    if (!nmbs->msg.ignored) {
-        if (!nmbs->callbacks.read_device_identification_map || !nmbs->callbacks.read_device_identification)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+            // Broadcast writes are not answered
+            if (nmbs->msg.broadcast && (fc == 15 || fc == 16)) {
+                done[(sent - 1) / 8] |= (uint8_t) (1 << ((sent - 1) % 8));
+                completed++;
+            }
+        }
 
-        if (mei_type != 0x0E)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        if (completed == sent)
+            break;
 
-        if (read_device_id_code < 1 || read_device_id_code > 4)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+        // The previous response may have been an exception, with its own function code
+        nmbs->msg.transaction_id = last_tid;
+        nmbs->msg.fc = fc;
+        nmbs_error err = recv_res_header_tids(nmbs, depth > 1 ? sent : 1);
+        if (err != NMBS_ERROR_NONE && !nmbs_error_is_exception(err))
+            return err;
 
-        if (object_id > 6 && object_id < 0x80)
-            return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        uint16_t chunk = completed;
+        if (depth > 1)
+            chunk = (uint16_t) (sent - 1 - tid_distance(nmbs->msg.transaction_id, last_tid));
 
-        if (!nmbs->msg.broadcast) {
-            char str[NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH];
+        if (done[chunk / 8] & (1 << (chunk % 8)))
+            return NMBS_ERROR_INVALID_TCP_MBAP;
 
-            nmbs_bitfield_256 map;
-            nmbs_bitfield_reset(map);
+        if (err != NMBS_ERROR_NONE) {
+            if (result == NMBS_ERROR_NONE)
+                result = err;
+        }
+        else {
+            uint32_t offset = (uint32_t) chunk * chunk_max;
+            uint16_t chunk_quantity = (uint16_t) (quantity - offset > chunk_max ? chunk_max : quantity - offset);
+            err = recv_range_res(nmbs, fc, (uint16_t) (address + offset), chunk_quantity,
+                                 bits_out ? bits_out + offset / 8 : NULL,
+                                 registers_out ? registers_out + offset : NULL);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
 
-            err = nmbs->callbacks.read_device_identification_map(map);
-            if (err != NMBS_ERROR_NONE) {
-                if (nmbs_error_is_exception(err))
-                    return send_exception_msg(nmbs, err);
+        done[chunk / 8] |= (uint8_t) (1 << (chunk % 8));
+        completed++;
+    }
 
-                return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-            }
+    return result;
+}
 
-            put_res_header(nmbs, 0);    // Length will be set later
-            put_1(nmbs, 0x0E);
-            put_1(nmbs, read_device_id_code);
-            put_1(nmbs, 0x83);
 
-            if (read_device_id_code == 4) {
-                if (!nmbs_bitfield_read(map, object_id))
-                    return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+nmbs_error nmbs_read_coils_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint8_t* coils_out) {
+    return range_request(nmbs, 1, address, quantity, 2000, coils_out, NULL, NULL, NULL);
+}
 
-                put_1(nmbs, 0);    // More follows
-                put_1(nmbs, 0);    // Next Object Id
-                put_1(nmbs, 1);    // Number of objects
 
-                str[0] = 0;
-                err = nmbs->callbacks.read_device_identification(object_id, str);
-                if (err != NMBS_ERROR_NONE) {
-                    if (nmbs_error_is_exception(err))
-                        return send_exception_msg(nmbs, err);
+nmbs_error nmbs_read_discrete_inputs_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint8_t* inputs_out) {
+    return range_request(nmbs, 2, address, quantity, 2000, inputs_out, NULL, NULL, NULL);
+}
 
-                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-                }
 
-                size_t str_len = strlen(str);
+nmbs_error nmbs_read_holding_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity,
+                                             uint16_t* registers_out) {
+    return range_request(nmbs, 3, address, quantity, 125, NULL, registers_out, NULL, NULL);
+}
 
-                put_1(nmbs, object_id);    // Object id
-                put_1(nmbs, str_len);      // Object length
-                put_n(nmbs, (uint8_t*) str, str_len);
 
-                set_msg_header_size(nmbs, 6 + 2 + str_len);
+nmbs_error nmbs_read_input_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint16_t* registers_out) {
+    return range_request(nmbs, 4, address, quantity, 125, NULL, registers_out, NULL, NULL);
+}
 
-                return send_msg(nmbs);
-            }
 
-            uint8_t more_follows_idx = nmbs->msg.buf_idx;
-            put_1(nmbs, 0);
-            uint8_t next_object_id_idx = nmbs->msg.buf_idx;
-            put_1(nmbs, 0);
-            uint8_t number_of_objects_idx = nmbs->msg.buf_idx;
-            put_1(nmbs, 0);
+nmbs_error nmbs_write_multiple_coils_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, const uint8_t* coils) {
+    if (!coils)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-            int16_t res_size_left = 253 - 7;
+    return range_request(nmbs, 15, address, quantity, 0x07B0, NULL, NULL, coils, NULL);
+}
 
-            uint8_t last_id = 0;
-            uint8_t msg_size = 6;
-            uint8_t res_more_follows = 0;
-            uint8_t res_next_object_id = 0;
-            uint8_t res_number_of_objects = 0;
 
-            switch (read_device_id_code) {
-                case 1:
-                    if (object_id > 0x02)
-                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
-                    last_id = 0x02;
-                    break;
-                case 2:
-                    if (object_id < 0x03 || object_id > 0x07)
-                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
-                    last_id = 0x07;
-                    break;
-                case 3:
-                    if (object_id < 0x80)
-                        return send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
-                    last_id = 0xFF;
-                    break;
-                default:
-                    // Unreachable
-                    break;
-            }
+nmbs_error nmbs_write_multiple_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity,
+                                               const uint16_t* registers) {
+    if (!registers)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-            for (uint16_t id = object_id; id <= last_id; id++) {
-                if (!nmbs_bitfield_read(map, id)) {
-                    if (id < 0x03)
-                        return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-                    continue;
-                }
+    return range_request(nmbs, 16, address, quantity, 0x007B, NULL, NULL, NULL, registers);
+}
+
+
+void nmbs_scan_options_create(nmbs_scan_options* options, nmbs_transport transport) {
+    options->max_bits = 2000;
+    options->max_registers = 125;
+
+    // Request and response header, plus the silent interval after each frame on RTU or the TCP/IP headers on TCP
+    if (transport == NMBS_TRANSPORT_RTU)
+        options->frame_cost = 8 + 5 + 2 * 4;
+    else
+        options->frame_cost = 12 + 9 + 2 * 40;
+}
 
-                str[0] = 0;
-                err = nmbs->callbacks.read_device_identification((uint8_t) id, str);
-                if (err != NMBS_ERROR_NONE) {
-                    if (nmbs_error_is_exception(err))
-                        return send_exception_msg(nmbs, err);
 
-                    return send_exception_msg(nmbs, NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
-                }
+static bool scan_point_less(const nmbs_scan_point* a, const nmbs_scan_point* b) {
+    if (a->unit_id != b->unit_id)
+        return a->unit_id < b->unit_id;
 
-                int16_t str_len = (int16_t) strlen(str);
+    if (a->fc != b->fc)
+        return a->fc < b->fc;
 
-                res_size_left = (int16_t) (res_size_left - 2 - str_len);
-                if (res_size_left < 0) {
-                    res_more_follows = 0xFF;
-                    res_next_object_id = id;
-                    break;
-                }
+    return a->address < b->address;
+}
 
-                put_1(nmbs, (uint8_t) id);    // Object id
-                put_1(nmbs, str_len);         // Object length
-                put_n(nmbs, (uint8_t*) str, str_len);
 
-                msg_size += (2 + str_len);
+// Response bytes holding quantity coils, discrete inputs or registers
+static uint32_t scan_data_size(uint8_t fc, uint32_t quantity) {
+    return fc <= 2 ? (quantity + 7) / 8 : quantity * 2;
+}
 
-                res_number_of_objects++;
-            }
 
-            set_1(nmbs, res_more_follows, more_follows_idx);
-            set_1(nmbs, res_next_object_id, next_object_id_idx);
-            set_1(nmbs, res_number_of_objects, number_of_objects_idx);
+nmbs_error nmbs_scan_plan_create(nmbs_scan_plan* plan, nmbs_scan_point* points, uint16_t points_count,
+                                 nmbs_scan_request* requests, uint16_t requests_length,
+                                 const nmbs_scan_options* options) {
+    if (!plan || (points_count && (!points || !requests)) || !options)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-            set_msg_header_size(nmbs, msg_size);
+    if (options->max_bits < 1 || options->max_bits > 2000 || options->max_registers < 1 || options->max_registers > 125)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-            return send_msg(nmbs);
+    for (uint16_t i = 0; i < points_count; i++) {
+        const nmbs_scan_point* point = &points[i];
+        uint16_t max = point->fc <= 2 ? options->max_bits : options->max_registers;
+        if (point->fc < 1 || point->fc > 4 || !point->values || point->quantity < 1 || point->quantity > max ||
+            (uint32_t) point->address + point->quantity > ((uint32_t) 0xFFFF) + 1)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Scan lists are mostly in address order already, where an insertion sort is linear
+    for (uint16_t i = 1; i < points_count; i++) {
+        nmbs_scan_point point = points[i];
+        uint16_t j = i;
+        while (j > 0 && scan_point_less(&point, &points[j - 1])) {
+            points[j] = points[j - 1];
+            j--;
         }
+
+        points[j] = point;
     }
-    else {
-        return recv_read_device_identification_res(nmbs, 0, NULL, 0, NULL, NULL, NULL, NULL);
+
+    uint16_t requests_count = 0;
+    nmbs_scan_request* request = NULL;
+    for (uint16_t i = 0; i < points_count; i++) {
+        const nmbs_scan_point* point = &points[i];
+        uint32_t point_end = (uint32_t) point->address + point->quantity;
+
+        if (request && request->unit_id == point->unit_id && request->fc == point->fc) {
+            uint32_t request_end = (uint32_t) request->address + request->quantity;
+            uint32_t end = point_end > request_end ? point_end : request_end;
+            uint16_t max = point->fc <= 2 ? options->max_bits : options->max_registers;
+
+            // Bytes added to the response by merging, compared to reading the point with its own request
+            int32_t added = (int32_t) scan_data_size(point->fc, end - request->address) -
+                            (int32_t) scan_data_size(point->fc, request->quantity) -
+                            (int32_t) scan_data_size(point->fc, point->quantity);
+
+            if (end - request->address <= max && added <= (int32_t) options->frame_cost) {
+                request->quantity = (uint16_t) (end - request->address);
+                request->points_count++;
+                continue;
+            }
+        }
+
+        if (requests_count == requests_length)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+
+        request = &requests[requests_count++];
+        request->address = point->address;
+        request->quantity = point->quantity;
+        request->first_point = i;
+        request->points_count = 1;
+        request->error = NMBS_ERROR_NONE;
+        request->unit_id = point->unit_id;
+        request->fc = point->fc;
     }
 
+    plan->points = points;
+    plan->requests = requests;
+    plan->points_count = points_count;
+    plan->requests_count = requests_count;
+
     return NMBS_ERROR_NONE;
 }
-#endif
 
 
-static nmbs_error handle_req_fc(nmbs_t* nmbs) {
-    NMBS_DEBUG_PRINT("fc %d\t", nmbs->msg.fc);
+// Receives the response to a scan request, decoding its data into the values of the points it covers
+static nmbs_error recv_scan_res(nmbs_t* nmbs, const nmbs_scan_plan* plan, const nmbs_scan_request* request) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-    nmbs_error err = NMBS_ERROR_NONE;
-    switch (nmbs->msg.fc) {
-#ifndef NMBS_SERVER_READ_COILS_DISABLED
-        case 1:
-            err = handle_read_coils(nmbs);
-            break;
-#endif
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-#ifndef NMBS_SERVER_READ_DISCRETE_INPUTS_DISABLED
-        case 2:
-            err = handle_read_discrete_inputs(nmbs);
-            break;
-#endif
+    uint8_t bytes = get_1(nmbs);
+    NMBS_DEBUG_PRINT("b %d", bytes);
 
-#ifndef NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED
-        case 3:
-            err = handle_read_holding_registers(nmbs);
-            break;
-#endif
+    if (bytes != scan_data_size(request->fc, request->quantity))
+        return NMBS_ERROR_INVALID_RESPONSE;
 
-#ifndef NMBS_SERVER_READ_INPUT_REGISTERS_DISABLED
-        case 4:
-            err = handle_read_input_registers(nmbs);
-            break;
-#endif
+    err = recv(nmbs, bytes);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-#ifndef NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED
-        case 5:
-            err = handle_write_single_coil(nmbs);
-            break;
-#endif
+    const uint8_t* data = get_n(nmbs, bytes);
 
-#ifndef NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED
-        case 6:
-            err = handle_write_single_register(nmbs);
-            break;
-#endif
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-#ifndef NMBS_SERVER_WRITE_MULTIPLE_COILS_DISABLED
-        case 15:
-            err = handle_write_multiple_coils(nmbs);
-            break;
-#endif
+    for (uint16_t p = 0; p < request->points_count; p++) {
+        const nmbs_scan_point* point = &plan->points[request->first_point + p];
+        uint16_t offset = point->address - request->address;
+        for (uint16_t i = 0; i < point->quantity; i++) {
+            uint16_t index = offset + i;
+            if (request->fc <= 2)
+                point->values[i] = (data[index / 8] >> (index % 8)) & 1;
+            else
+                point->values[i] = (uint16_t) ((uint16_t) data[index * 2] << 8 | data[index * 2 + 1]);
+        }
+    }
 
-#ifndef NMBS_SERVER_WRITE_MULTIPLE_REGISTERS_DISABLED
-        case 16:
-            err = handle_write_multiple_registers(nmbs);
-            break;
-#endif
+    return NMBS_ERROR_NONE;
+}
 
-#ifndef NMBS_SERVER_READ_FILE_RECORD_DISABLED
-        case 20:
-            err = handle_read_file_record(nmbs);
-            break;
-#endif
 
-#ifndef NMBS_SERVER_WRITE_FILE_RECORD_DISABLED
-        case 21:
-            err = handle_write_file_record(nmbs);
-            break;
-#endif
+// Sends a request of a scan plan to its unit ID, storing its result in it
+static nmbs_error scan_request(nmbs_t* nmbs, const nmbs_scan_plan* plan, nmbs_scan_request* request) {
+    nmbs->dest_address_rtu = request->unit_id;
 
-#ifndef NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED
-        case 23:
-            err = handle_read_write_registers(nmbs);
-            break;
-#endif
+    msg_state_req(nmbs, request->fc);
+    put_req_header(nmbs, 4);
+    put_2(nmbs, request->address);
+    put_2(nmbs, request->quantity);
+    NMBS_DEBUG_PRINT("a %d\tq %d", request->address, request->quantity);
 
-#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
-        case 43:
-            err = handle_read_device_identification(nmbs);
-            break;
-#endif
-        default:
-            err = send_exception_msg(nmbs, NMBS_EXCEPTION_ILLEGAL_FUNCTION);
-    }
+    // Reads can't be broadcast
+    nmbs_error err = NMBS_ERROR_INVALID_ARGUMENT;
+    if (!nmbs->msg.broadcast)
+        err = send_req(nmbs);
+
+    if (err == NMBS_ERROR_NONE)
+        err = recv_scan_res(nmbs, plan, request);
 
+    request->error = err;
     return err;
 }
 
 
-void nmbs_callbacks_create(nmbs_callbacks* callbacks) {
-    memset(callbacks, 0, sizeof(nmbs_callbacks));
-    callbacks->initialized = 0xFFFFDEBE;
+nmbs_error nmbs_scan(nmbs_t* nmbs, const nmbs_scan_plan* plan) {
+    uint8_t dest_address = nmbs->dest_address_rtu;
+    nmbs_error first_err = NMBS_ERROR_NONE;
+
+    for (uint16_t r = 0; r < plan->requests_count; r++) {
+        nmbs_error err = scan_request(nmbs, plan, &plan->requests[r]);
+        if (err != NMBS_ERROR_NONE && first_err == NMBS_ERROR_NONE)
+            first_err = err;
+    }
+
+    nmbs->dest_address_rtu = dest_address;
+    return first_err;
 }
 
 
-nmbs_error nmbs_server_create(nmbs_t* nmbs, uint8_t address_rtu, const nmbs_platform_conf* platform_conf,
-                              const nmbs_callbacks* callbacks) {
-    if (platform_conf->transport == NMBS_TRANSPORT_RTU && address_rtu == 0)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+// The groups waiting for their period to start form a heap ordered by release time at the front of the heap array.
+// The released ones form a heap ordered by deadline, growing from the back of the array.
+static nmbs_poll_group** poll_heap_slot(nmbs_poll_scheduler* sched, bool released, uint16_t i) {
+    if (released)
+        return &sched->heap[sched->count - 1 - i];
 
-    if (!callbacks || callbacks->initialized != 0xFFFFDEBE)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    return &sched->heap[i];
+}
 
-    nmbs_error ret = nmbs_create(nmbs, platform_conf);
-    if (ret != NMBS_ERROR_NONE)
-        return ret;
 
-    nmbs->address_rtu = address_rtu;
-    nmbs->callbacks = *callbacks;
+static bool poll_group_before(const nmbs_poll_group* a, const nmbs_poll_group* b, bool released) {
+    uint32_t a_time = released ? a->release_ms + a->period_ms : a->release_ms;
+    uint32_t b_time = released ? b->release_ms + b->period_ms : b->release_ms;
+    int32_t diff = (int32_t) (a_time - b_time);
+    if (diff != 0)
+        return diff < 0;
 
-    return NMBS_ERROR_NONE;
+    return a->priority < b->priority;
 }
 
 
-nmbs_error nmbs_server_poll(nmbs_t* nmbs) {
-    msg_state_reset(nmbs);
+// The group pushed was just popped from the other heap, it is not counted in any of them
+static void poll_heap_push(nmbs_poll_scheduler* sched, bool released, nmbs_poll_group* group) {
+    uint16_t i = released ? (uint16_t) (sched->count - sched->waiting - 1) : sched->waiting;
+    if (!released)
+        sched->waiting++;
 
-    bool first_byte_received = false;
-    nmbs_error err = recv_req_header(nmbs, &first_byte_received);
-    if (err != NMBS_ERROR_NONE) {
-        if (!first_byte_received && err == NMBS_ERROR_TIMEOUT)
-            return NMBS_ERROR_NONE;
+    while (i > 0) {
+        uint16_t parent = (uint16_t) ((i - 1) / 2);
+        nmbs_poll_group* p = *poll_heap_slot(sched, released, parent);
+        if (!poll_group_before(group, p, released))
+            break;
 
-        return err;
+        *poll_heap_slot(sched, released, i) = p;
+        i = parent;
     }
 
-#ifdef NMBS_DEBUG
-    printf("%d ", nmbs->address_rtu);
-    printf("NMBS req <- ");
-    if (nmbs->platform.transport == NMBS_TRANSPORT_RTU) {
-        if (nmbs->msg.broadcast)
-            printf("broadcast\t");
-        else
-            printf("address_rtu %d\t", nmbs->msg.unit_id);
-    }
-#endif
+    *poll_heap_slot(sched, released, i) = group;
+}
 
-    err = handle_req_fc(nmbs);
-    if (err != NMBS_ERROR_NONE && !nmbs_error_is_exception(err)) {
-        if (nmbs->platform.transport == NMBS_TRANSPORT_RTU && err != NMBS_ERROR_TIMEOUT && nmbs->msg.ignored) {
-            // Flush the remaining data on the line
-            nmbs->platform.read(nmbs->msg.buf, sizeof(nmbs->msg.buf), 0, nmbs->platform.arg);
+
+static nmbs_poll_group* poll_heap_pop(nmbs_poll_scheduler* sched, bool released) {
+    nmbs_poll_group* top = *poll_heap_slot(sched, released, 0);
+    uint16_t size = released ? (uint16_t) (sched->count - sched->waiting) : sched->waiting;
+    nmbs_poll_group* last = *poll_heap_slot(sched, released, size - 1);
+    size--;
+    if (!released)
+        sched->waiting--;
+
+    uint16_t i = 0;
+    while (true) {
+        uint16_t child = (uint16_t) (i * 2 + 1);
+        if (child >= size)
+            break;
+
+        nmbs_poll_group* c = *poll_heap_slot(sched, released, child);
+        if (child + 1 < size) {
+            nmbs_poll_group* right = *poll_heap_slot(sched, released, child + 1);
+            if (poll_group_before(right, c, released)) {
+                c = right;
+                child++;
+            }
         }
 
-        return err;
+        if (!poll_group_before(c, last, released))
+            break;
+
+        *poll_heap_slot(sched, released, i) = c;
+        i = child;
     }
 
-    return NMBS_ERROR_NONE;
+    if (size > 0)
+        *poll_heap_slot(sched, released, i) = last;
+
+    return top;
 }
 
-void nmbs_set_callbacks_arg(nmbs_t* nmbs, void* arg) {
-    nmbs->callbacks.arg = arg;
+
+nmbs_error nmbs_poll_scheduler_create(nmbs_poll_scheduler* sched, nmbs_t* nmbs, nmbs_poll_group* groups,
+                                      uint16_t groups_count, nmbs_poll_group** heap, uint32_t (*clock_ms)(void* arg),
+                                      void* arg) {
+    if (!sched || !nmbs || (groups_count && (!groups || !heap)) || !clock_ms)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    for (uint16_t i = 0; i < groups_count; i++) {
+        if (!groups[i].plan || groups[i].period_ms == 0 || groups[i].timeout_ms < 0)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+    }
+
+    sched->nmbs = nmbs;
+    sched->heap = heap;
+    sched->clock_ms = clock_ms;
+    sched->arg = arg;
+    sched->start_ms = clock_ms(arg);
+    sched->busy_ms = 0;
+    sched->count = groups_count;
+    sched->waiting = 0;
+
+    for (uint16_t i = 0; i < groups_count; i++) {
+        nmbs_poll_group* group = &groups[i];
+        group->polls = 0;
+        group->missed = 0;
+        group->timeouts = 0;
+        group->errors = 0;
+        group->max_response_ms = 0;
+        group->release_ms = sched->start_ms;
+        group->next_request = 0;
+        poll_heap_push(sched, false, group);
+    }
+
+    return NMBS_ERROR_NONE;
 }
-#endif
 
 
-#ifndef NMBS_CLIENT_DISABLED
-nmbs_error nmbs_client_create(nmbs_t* nmbs, const nmbs_platform_conf* platform_conf) {
-    return nmbs_create(nmbs, platform_conf);
+// Accounts for a completed poll and schedules the next one
+static void poll_group_complete(nmbs_poll_group* group, uint32_t now) {
+    uint32_t response_ms = now - group->release_ms;
+    group->polls++;
+    if (response_ms > group->max_response_ms)
+        group->max_response_ms = response_ms;
+
+    if (response_ms > group->period_ms)
+        group->missed++;
+
+    group->release_ms += group->period_ms;
+    group->next_request = 0;
+
+    // Periods already over are skipped, their polls are missed
+    while ((int32_t) (now - (group->release_ms + group->period_ms)) >= 0) {
+        group->release_ms += group->period_ms;
+        group->missed++;
+    }
 }
 
 
-static nmbs_error read_discrete(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint16_t quantity, nmbs_bitfield values) {
-    if (quantity < 1 || quantity > 2000)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+nmbs_error nmbs_poll_scheduler_run(nmbs_poll_scheduler* sched, uint32_t* wait_ms_out) {
+    uint32_t now = sched->clock_ms(sched->arg);
+    *wait_ms_out = 0;
 
-    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    while (sched->waiting > 0 && (int32_t) (now - sched->heap[0]->release_ms) >= 0)
+        poll_heap_push(sched, true, poll_heap_pop(sched, false));
 
-    msg_state_req(nmbs, fc);
-    put_req_header(nmbs, 4);
+    if (sched->waiting == sched->count) {
+        if (sched->waiting > 0)
+            *wait_ms_out = sched->heap[0]->release_ms - now;
 
-    put_2(nmbs, address);
-    put_2(nmbs, quantity);
+        return NMBS_ERROR_NONE;
+    }
 
-    NMBS_DEBUG_PRINT("a %d\tq %d", address, quantity);
+    nmbs_poll_group* group = *poll_heap_slot(sched, true, 0);
+    const nmbs_scan_plan* plan = group->plan;
+    nmbs_error err = NMBS_ERROR_NONE;
 
-    nmbs_error err = send_msg(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+    if (group->next_request < plan->requests_count) {
+        nmbs_t* nmbs = sched->nmbs;
+        uint8_t dest_address = nmbs->dest_address_rtu;
+        int32_t read_timeout = nmbs->read_timeout_ms;
+        if (group->timeout_ms > 0)
+            nmbs->read_timeout_ms = group->timeout_ms;
+
+#ifndef NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED
+        nmbs_adaptive_timeouts* at = nmbs->adaptive_timeouts;
+        if (at)
+            at->cap_ms = group->timeout_ms;
+#endif
 
-    return recv_read_discrete_res(nmbs, values);
-}
+        err = scan_request(nmbs, plan, &plan->requests[group->next_request]);
 
+        nmbs->dest_address_rtu = dest_address;
+        nmbs->read_timeout_ms = read_timeout;
+#ifndef NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED
+        if (at)
+            at->cap_ms = 0;
+#endif
 
-nmbs_error nmbs_read_coils(nmbs_t* nmbs, uint16_t address, uint16_t quantity, nmbs_bitfield coils_out) {
-    return read_discrete(nmbs, 1, address, quantity, coils_out);
+        if (err == NMBS_ERROR_TIMEOUT)
+            group->timeouts++;
+        else if (err != NMBS_ERROR_NONE)
+            group->errors++;
+
+        uint32_t end = sched->clock_ms(sched->arg);
+        sched->busy_ms += end - now;
+        now = end;
+        group->next_request++;
+    }
+
+    if (group->next_request >= plan->requests_count) {
+        poll_heap_pop(sched, true);
+        poll_group_complete(group, now);
+        poll_heap_push(sched, false, group);
+    }
+
+    return err;
 }
 
 
-nmbs_error nmbs_read_discrete_inputs(nmbs_t* nmbs, uint16_t address, uint16_t quantity, nmbs_bitfield inputs_out) {
-    return read_discrete(nmbs, 2, address, quantity, inputs_out);
+void nmbs_poll_scheduler_get_utilization(const nmbs_poll_scheduler* sched, uint32_t* busy_ms_out,
+                                         uint32_t* elapsed_ms_out) {
+    *busy_ms_out = sched->busy_ms;
+    *elapsed_ms_out = sched->clock_ms(sched->arg) - sched->start_ms;
 }
 
-static nmbs_error read_registers(nmbs_t* nmbs, uint8_t fc, uint16_t address, uint16_t quantity, uint16_t* registers) {
-    if (quantity < 1 || quantity > 125)
+
+nmbs_error nmbs_read_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number, uint16_t* registers,
+                                 uint16_t count) {
+    if (file_number == 0x0000)
         return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
+    if (record_number > 0x270F)
         return NMBS_ERROR_INVALID_ARGUMENT;
 
-    msg_state_req(nmbs, fc);
-    put_req_header(nmbs, 4);
+    // In expected response: max PDU length = 253, assuming a single file request, (253 - 1 - 1 - 1 - 1) / 2 = 124
+    if (count > 124)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    put_2(nmbs, address);
-    put_2(nmbs, quantity);
+    msg_state_req(nmbs, 20);
+    put_req_header(nmbs, 8);
 
-    NMBS_DEBUG_PRINT("a %d\tq %d ", address, quantity);
+    put_1(nmbs, 7);    // add Byte Count
+    put_1(nmbs, 6);    // add Reference Type const
+    put_2(nmbs, file_number);
+    put_2(nmbs, record_number);
+    put_2(nmbs, count);
+    NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fread ", file_number, record_number, count);
 
-    nmbs_error err = send_msg(nmbs);
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    return recv_read_registers_res(nmbs, quantity, registers);
-}
-
-
-nmbs_error nmbs_read_holding_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, uint16_t* registers_out) {
-    return read_registers(nmbs, 3, address, quantity, registers_out);
-}
-
-
-nmbs_error nmbs_read_input_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, uint16_t* registers_out) {
-    return read_registers(nmbs, 4, address, quantity, registers_out);
+    return recv_read_file_record_res(nmbs, registers, count);
 }
 
 
-nmbs_error nmbs_write_single_coil(nmbs_t* nmbs, uint16_t address, bool value) {
-    msg_state_req(nmbs, 5);
-    put_req_header(nmbs, 4);
+// Moves the cursor of a file records batch forward by count records, skipping the empty ranges
+static void file_records_advance(const nmbs_file_record* records, uint16_t records_count, uint16_t* r, uint16_t* offset,
+                                 uint16_t count) {
+    *offset += count;
+    while (*r < records_count && *offset >= records[*r].count) {
+        (*r)++;
+        *offset = 0;
+    }
+}
 
-    uint16_t value_req = value ? 0xFF00 : 0;
 
-    put_2(nmbs, address);
-    put_2(nmbs, value_req);
+static nmbs_error file_records_check(const nmbs_file_record* records, uint16_t records_count) {
+    if (records_count && !records)
+        return NMBS_ERROR_INVALID_ARGUMENT;
 
-    NMBS_DEBUG_PRINT("a %d\tvalue %d ", address, value_req);
+    for (uint16_t i = 0; i < records_count; i++) {
+        if (records[i].file_number == 0x0000)
+            return NMBS_ERROR_INVALID_ARGUMENT;
 
-    nmbs_error err = send_msg(nmbs);
-    if (err != NMBS_ERROR_NONE)
-        return err;
+        if (records[i].record_number > 0x270F || (uint32_t) records[i].record_number + records[i].count > 0x2710)
+            return NMBS_ERROR_INVALID_ARGUMENT;
 
-    if (!nmbs->msg.broadcast)
-        return recv_write_single_coil_res(nmbs, address, value_req);
+        if (records[i].count && !records[i].registers)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+    }
 
     return NMBS_ERROR_NONE;
 }
 
 
-nmbs_error nmbs_write_single_register(nmbs_t* nmbs, uint16_t address, uint16_t value) {
-    msg_state_req(nmbs, 6);
-    put_req_header(nmbs, 4);
+// Plans the sub-requests of the next request of a FC 20 / 21 batch, starting at the cursor, and moves the cursor past
+// them. Each sub-request takes overhead bytes plus its records, and all of them must fit in size_max bytes.
+static uint8_t file_records_plan(const nmbs_file_record* records, uint16_t records_count, uint16_t* r, uint16_t* offset,
+                                 uint8_t overhead, uint8_t size_max, uint8_t lengths[35], uint8_t* size_out) {
+    uint8_t subreq_count = 0;
+    uint8_t size = 0;
+    while (*r < records_count && subreq_count < 35 && size + overhead + 2 <= size_max) {
+        uint16_t length = records[*r].count - *offset;
+        uint16_t length_max = (uint16_t) ((size_max - size - overhead) / 2);
+        if (length > length_max)
+            length = length_max;
+
+        lengths[subreq_count++] = (uint8_t) length;
+        size += (uint8_t) (overhead + length * 2);
+        file_records_advance(records, records_count, r, offset, length);
+    }
 
-    put_2(nmbs, address);
-    put_2(nmbs, value);
+    *size_out = size;
+    return subreq_count;
+}
 
-    NMBS_DEBUG_PRINT("a %d\tvalue %d", address, value);
 
-    nmbs_error err = send_msg(nmbs);
+static nmbs_error recv_read_file_records_res(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count,
+                                             uint16_t r, uint16_t offset, const uint8_t* lengths, uint8_t subreq_count,
+                                             uint8_t response_size_req) {
+    nmbs_error err = recv_res_header(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    if (!nmbs->msg.broadcast)
-        return recv_write_single_register_res(nmbs, address, value);
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-    return NMBS_ERROR_NONE;
-}
+    uint8_t response_size = get_1(nmbs);
+    if (response_size > 250)
+        return NMBS_ERROR_INVALID_RESPONSE;
 
+    err = recv(nmbs, response_size);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-nmbs_error nmbs_write_multiple_coils(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const nmbs_bitfield coils) {
-    if (quantity < 1 || quantity > 0x07B0)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    const uint8_t* data = get_n(nmbs, response_size);
 
-    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-    uint8_t coils_bytes = (quantity + 7) / 8;
+    if (response_size != response_size_req)
+        return NMBS_ERROR_INVALID_RESPONSE;
 
-    msg_state_req(nmbs, 15);
-    put_req_header(nmbs, 5 + coils_bytes);
+    // Every sub-response is checked before writing to the caller's registers
+    const uint8_t* subres = data;
+    for (uint8_t i = 0; i < subreq_count; i++) {
+        if (subres[0] != 1 + lengths[i] * 2 || subres[1] != 6)
+            return NMBS_ERROR_INVALID_RESPONSE;
 
-    put_2(nmbs, address);
-    put_2(nmbs, quantity);
-    put_1(nmbs, coils_bytes);
-    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\t", address, quantity, coils_bytes);
+        subres += 2 + lengths[i] * 2;
+    }
 
-    NMBS_DEBUG_PRINT("coils ");
-    for (int i = 0; i < coils_bytes; i++) {
-        put_1(nmbs, coils[i]);
-        NMBS_DEBUG_PRINT("%d ", coils[i]);
+    subres = data;
+    for (uint8_t i = 0; i < subreq_count; i++) {
+        uint16_t* registers = records[r].registers + offset;
+        for (uint16_t j = 0; j < lengths[i]; j++)
+            registers[j] = (uint16_t) ((uint16_t) subres[2 + j * 2] << 8 | subres[3 + j * 2]);
+
+        NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fread ", records[r].file_number, records[r].record_number + offset,
+                         lengths[i]);
+        subres += 2 + lengths[i] * 2;
+        file_records_advance(records, records_count, &r, &offset, lengths[i]);
     }
 
-    nmbs_error err = send_msg(nmbs);
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error nmbs_read_file_records(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count) {
+    nmbs_error err = file_records_check(records, records_count);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    if (!nmbs->msg.broadcast)
-        return recv_write_multiple_coils_res(nmbs, address, quantity);
+    uint16_t r = 0;
+    uint16_t offset = 0;
+    file_records_advance(records, records_count, &r, &offset, 0);
+
+    while (r < records_count) {
+        // Each sub-request takes 7 bytes of the request, 35 of them fill the 245 bytes allowed. Its sub-response takes
+        // 2 bytes plus the records, and all of them must fit in the 250 bytes left in the response PDU.
+        uint8_t lengths[35];
+        uint8_t response_size = 0;
+        uint16_t next_r = r;
+        uint16_t next_offset = offset;
+        uint8_t subreq_count =
+                file_records_plan(records, records_count, &next_r, &next_offset, 2, 250, lengths, &response_size);
+
+        msg_state_req(nmbs, 20);
+        put_req_header(nmbs, 1 + subreq_count * 7);
+
+        put_1(nmbs, (uint8_t) (subreq_count * 7));    // add Byte Count
+        uint16_t put_r = r;
+        uint16_t put_offset = offset;
+        for (uint8_t i = 0; i < subreq_count; i++) {
+            put_1(nmbs, 6);    // add Reference Type const
+            put_2(nmbs, records[put_r].file_number);
+            put_2(nmbs, records[put_r].record_number + put_offset);
+            put_2(nmbs, lengths[i]);
+            file_records_advance(records, records_count, &put_r, &put_offset, lengths[i]);
+        }
 
-    return NMBS_ERROR_NONE;
-}
+        err = send_req(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
+        err = recv_read_file_records_res(nmbs, records, records_count, r, offset, lengths, subreq_count, response_size);
+        if (err != NMBS_ERROR_NONE)
+            return err;
 
-nmbs_error nmbs_write_multiple_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const uint16_t* registers) {
-    if (quantity < 1 || quantity > 0x007B)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+        r = next_r;
+        offset = next_offset;
+    }
 
-    if ((uint32_t) address + (uint32_t) quantity > ((uint32_t) 0xFFFF) + 1)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    return NMBS_ERROR_NONE;
+}
 
-    uint8_t registers_bytes = quantity * 2;
 
-    msg_state_req(nmbs, 16);
-    put_req_header(nmbs, 5 + registers_bytes);
+// The response is an echo of the request, checked against the records in a single pass
+static nmbs_error recv_write_file_records_res(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count,
+                                              uint16_t r, uint16_t offset, const uint8_t* lengths,
+                                              uint8_t subreq_count, uint8_t request_size) {
+    nmbs_error err = recv_res_header(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-    put_2(nmbs, address);
-    put_2(nmbs, quantity);
-    put_1(nmbs, registers_bytes);
-    NMBS_DEBUG_PRINT("a %d\tq %d\tb %d\t", address, quantity, registers_bytes);
+    err = recv(nmbs, 1);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
-    NMBS_DEBUG_PRINT("regs ");
-    for (int i = 0; i < quantity; i++) {
-        put_2(nmbs, registers[i]);
-        NMBS_DEBUG_PRINT("%d ", registers[i]);
-    }
+    uint8_t response_size = get_1(nmbs);
+    if (response_size > 251)
+        return NMBS_ERROR_INVALID_RESPONSE;
 
-    nmbs_error err = send_msg(nmbs);
+    err = recv(nmbs, response_size);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    if (!nmbs->msg.broadcast)
-        return recv_write_single_register_res(nmbs, address, quantity);
+    const uint8_t* subres = get_n(nmbs, response_size);
 
-    return NMBS_ERROR_NONE;
-}
+    err = recv_msg_footer(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
 
+    if (response_size != request_size)
+        return NMBS_ERROR_INVALID_RESPONSE;
 
-nmbs_error nmbs_read_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number, uint16_t* registers,
-                                 uint16_t count) {
-    if (file_number == 0x0000)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+    for (uint8_t i = 0; i < subreq_count; i++) {
+        const nmbs_file_record* record = &records[r];
+        uint16_t record_number = (uint16_t) (record->record_number + offset);
+        if (subres[0] != 6 || subres[1] != (uint8_t) (record->file_number >> 8) ||
+            subres[2] != (uint8_t) record->file_number || subres[3] != (uint8_t) (record_number >> 8) ||
+            subres[4] != (uint8_t) record_number || subres[5] != 0 || subres[6] != lengths[i])
+            return NMBS_ERROR_INVALID_RESPONSE;
 
-    if (record_number > 0x270F)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+        subres += 7;
+        for (uint16_t j = 0; j < lengths[i]; j++) {
+            if (subres[0] != (uint8_t) (record->registers[offset + j] >> 8) ||
+                subres[1] != (uint8_t) record->registers[offset + j])
+                return NMBS_ERROR_INVALID_RESPONSE;
 
-    // In expected response: max PDU length = 253, assuming a single file request, (253 - 1 - 1 - 1 - 1) / 2 = 124
-    if (count > 124)
-        return NMBS_ERROR_INVALID_ARGUMENT;
+            subres += 2;
+        }
 
-    msg_state_req(nmbs, 20);
-    put_req_header(nmbs, 8);
+        NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", record->file_number, record_number, lengths[i]);
+        file_records_advance(records, records_count, &r, &offset, lengths[i]);
+    }
 
-    put_1(nmbs, 7);    // add Byte Count
-    put_1(nmbs, 6);    // add Reference Type const
-    put_2(nmbs, file_number);
-    put_2(nmbs, record_number);
-    put_2(nmbs, count);
-    NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fread ", file_number, record_number, count);
+    return NMBS_ERROR_NONE;
+}
 
-    nmbs_error err = send_msg(nmbs);
+
+nmbs_error nmbs_write_file_records(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count) {
+    nmbs_error err = file_records_check(records, records_count);
     if (err != NMBS_ERROR_NONE)
         return err;
 
-    return recv_read_file_record_res(nmbs, registers, count);
+    uint16_t r = 0;
+    uint16_t offset = 0;
+    file_records_advance(records, records_count, &r, &offset, 0);
+
+    while (r < records_count) {
+        // Each sub-request takes 7 bytes plus its records, and all of them must fit in the 251 bytes left in the
+        // request PDU. The response is an echo of the request.
+        uint8_t lengths[35];
+        uint8_t request_size = 0;
+        uint16_t next_r = r;
+        uint16_t next_offset = offset;
+        uint8_t subreq_count =
+                file_records_plan(records, records_count, &next_r, &next_offset, 7, 251, lengths, &request_size);
+
+        msg_state_req(nmbs, 21);
+        put_req_header(nmbs, 1 + request_size);
+
+        put_1(nmbs, request_size);    // add Byte Count
+        uint16_t put_r = r;
+        uint16_t put_offset = offset;
+        for (uint8_t i = 0; i < subreq_count; i++) {
+            put_1(nmbs, 6);    // add Reference Type const
+            put_2(nmbs, records[put_r].file_number);
+            put_2(nmbs, records[put_r].record_number + put_offset);
+            put_2(nmbs, lengths[i]);
+            put_regs(nmbs, records[put_r].registers + put_offset, lengths[i]);
+            file_records_advance(records, records_count, &put_r, &put_offset, lengths[i]);
+        }
+
+        err = send_req(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        if (!nmbs->msg.broadcast) {
+            err = recv_write_file_records_res(nmbs, records, records_count, r, offset, lengths, subreq_count,
+                                              request_size);
+            if (err != NMBS_ERROR_NONE)
+                return err;
+        }
+
+        r = next_r;
+        offset = next_offset;
+    }
+
+    return NMBS_ERROR_NONE;
 }
 
 
@@ -2170,7 +6051,7 @@ nmbs_error nmbs_write_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t r
     put_regs(nmbs, registers, count);
     NMBS_DEBUG_PRINT("a %d\tr %d\tl %d\t fwrite ", file_number, record_number, count);
 
-    nmbs_error err = send_msg(nmbs);
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
@@ -2181,6 +6062,27 @@ nmbs_error nmbs_write_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t r
 }
 
 
+nmbs_error nmbs_mask_write_register(nmbs_t* nmbs, uint16_t address, uint16_t and_mask, uint16_t or_mask) {
+    msg_state_req(nmbs, 22);
+    put_req_header(nmbs, 6);
+
+    put_2(nmbs, address);
+    put_2(nmbs, and_mask);
+    put_2(nmbs, or_mask);
+
+    NMBS_DEBUG_PRINT("a %d\tand %d\tor %d", address, and_mask, or_mask);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    if (!nmbs->msg.broadcast)
+        return recv_mask_write_register_res(nmbs, address, and_mask, or_mask);
+
+    return NMBS_ERROR_NONE;
+}
+
+
 nmbs_error nmbs_read_write_registers(nmbs_t* nmbs, uint16_t read_address, uint16_t read_quantity,
                                      uint16_t* registers_out, uint16_t write_address, uint16_t write_quantity,
                                      const uint16_t* registers) {
@@ -2216,7 +6118,7 @@ nmbs_error nmbs_read_write_registers(nmbs_t* nmbs, uint16_t read_address, uint16
         NMBS_DEBUG_PRINT("%d ", registers[i]);
     }
 
-    nmbs_error err = send_msg(nmbs);
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
@@ -2228,6 +6130,50 @@ nmbs_error nmbs_read_write_registers(nmbs_t* nmbs, uint16_t read_address, uint16
 }
 
 
+nmbs_error nmbs_read_fifo_queue(nmbs_t* nmbs, uint16_t address, uint16_t values_out[NMBS_FIFO_COUNT_MAX],
+                                uint8_t* count_out) {
+    msg_state_req(nmbs, 24);
+    put_req_header(nmbs, 2);
+
+    put_2(nmbs, address);
+
+    NMBS_DEBUG_PRINT("a %d ", address);
+
+    nmbs_error err = send_req(nmbs);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    return recv_read_fifo_queue_res(nmbs, values_out, count_out);
+}
+
+
+nmbs_error nmbs_drain_fifo_queue(nmbs_t* nmbs, uint16_t address, uint16_t* values_out, uint32_t count,
+                                 uint32_t* count_out) {
+    uint32_t total = 0;
+    nmbs_error err = NMBS_ERROR_NONE;
+
+    // Values are read straight into values_out, so every request needs room for a full response
+    if (count < NMBS_FIFO_COUNT_MAX)
+        err = NMBS_ERROR_INVALID_ARGUMENT;
+
+    while (err == NMBS_ERROR_NONE && count - total >= NMBS_FIFO_COUNT_MAX) {
+        uint8_t read = 0;
+        err = nmbs_read_fifo_queue(nmbs, address, values_out + total, &read);
+        if (err != NMBS_ERROR_NONE)
+            break;
+
+        total += read;
+        if (read < NMBS_FIFO_COUNT_MAX)
+            break;
+    }
+
+    if (count_out)
+        *count_out = total;
+
+    return err;
+}
+
+
 nmbs_error nmbs_read_device_identification_basic(nmbs_t* nmbs, char* vendor_name, char* product_code,
                                                  char* major_minor_revision, uint8_t buffers_length) {
     const uint8_t order[3] = {0, 1, 2};
@@ -2242,7 +6188,7 @@ nmbs_error nmbs_read_device_identification_basic(nmbs_t* nmbs, char* vendor_name
         put_1(nmbs, 1);
         put_1(nmbs, next_object_id);
 
-        nmbs_error err = send_msg(nmbs);
+        nmbs_error err = send_req(nmbs);
         if (err != NMBS_ERROR_NONE)
             return err;
 
@@ -2278,7 +6224,7 @@ nmbs_error nmbs_read_device_identification_regular(nmbs_t* nmbs, char* vendor_ur
         put_1(nmbs, 2);
         put_1(nmbs, next_object_id);
 
-        nmbs_error err = send_msg(nmbs);
+        nmbs_error err = send_req(nmbs);
         if (err != NMBS_ERROR_NONE)
             return err;
 
@@ -2316,7 +6262,7 @@ nmbs_error nmbs_read_device_identification_extended(nmbs_t* nmbs, uint8_t object
         put_1(nmbs, 3);
         put_1(nmbs, next_object_id);
 
-        nmbs_error err = send_msg(nmbs);
+        nmbs_error err = send_req(nmbs);
         if (err != NMBS_ERROR_NONE)
             return err;
 
@@ -2336,6 +6282,101 @@ nmbs_error nmbs_read_device_identification_extended(nmbs_t* nmbs, uint8_t object
 }
 
 
+static nmbs_error recv_read_device_identification_objects_res(nmbs_t* nmbs, nmbs_device_identification_entry* entries,
+                                                              uint16_t entries_length, char* arena,
+                                                              uint16_t arena_size, uint16_t* entries_count,
+                                                              uint16_t* arena_used, uint8_t* next_object_id_out) {
+    uint8_t objects_count = 0;
+    nmbs_error err = recv_read_device_identification_res_header(nmbs, next_object_id_out, &objects_count);
+    if (err != NMBS_ERROR_NONE)
+        return err;
+
+    // A response announcing more objects must carry at least one, or the stream would never end
+    if (objects_count == 0 && *next_object_id_out != 0x7F)
+        return NMBS_ERROR_INVALID_RESPONSE;
+
+    if (objects_count > entries_length - *entries_count)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    uint8_t res_size_left = 253 - 7;
+    for (int i = 0; i < objects_count; i++) {
+        if (res_size_left < 2)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        err = recv(nmbs, 2);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        uint8_t object_id = get_1(nmbs);
+        uint8_t object_length = get_1(nmbs);
+        res_size_left -= 2;
+
+        if (object_length > res_size_left)
+            return NMBS_ERROR_INVALID_RESPONSE;
+
+        res_size_left -= object_length;
+
+        if (object_length + 1 > arena_size - *arena_used)
+            return NMBS_ERROR_INVALID_ARGUMENT;
+
+        err = recv(nmbs, object_length);
+        if (err != NMBS_ERROR_NONE)
+            return err;
+
+        char* value = arena + *arena_used;
+        memcpy(value, get_n(nmbs, object_length), object_length);
+        value[object_length] = 0;
+        *arena_used += object_length + 1;
+
+        nmbs_device_identification_entry* entry = &entries[*entries_count];
+        entry->value = value;
+        entry->length = object_length;
+        entry->id = object_id;
+        (*entries_count)++;
+    }
+
+    return recv_msg_footer(nmbs);
+}
+
+
+nmbs_error nmbs_read_device_identification_objects(nmbs_t* nmbs, uint8_t read_device_id_code, uint8_t object_id_start,
+                                                   nmbs_device_identification_entry* entries, uint16_t entries_length,
+                                                   char* arena, uint16_t arena_size, uint16_t* entries_count_out) {
+    if (read_device_id_code < 1 || read_device_id_code > 3 || !entries || !arena)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    if (object_id_start > 0x06 && object_id_start < 0x80)
+        return NMBS_ERROR_INVALID_ARGUMENT;
+
+    uint16_t entries_count = 0;
+    uint16_t arena_used = 0;
+    uint8_t next_object_id = object_id_start;
+    nmbs_error err = NMBS_ERROR_NONE;
+
+    while (next_object_id != 0x7F) {
+        msg_state_req(nmbs, 43);
+        put_req_header(nmbs, 3);
+        put_1(nmbs, 0x0E);
+        put_1(nmbs, read_device_id_code);
+        put_1(nmbs, next_object_id);
+
+        err = send_req(nmbs);
+        if (err != NMBS_ERROR_NONE)
+            break;
+
+        err = recv_read_device_identification_objects_res(nmbs, entries, entries_length, arena, arena_size,
+                                                          &entries_count, &arena_used, &next_object_id);
+        if (err != NMBS_ERROR_NONE)
+            break;
+    }
+
+    if (entries_count_out)
+        *entries_count_out = entries_count;
+
+    return err;
+}
+
+
 nmbs_error nmbs_read_device_identification(nmbs_t* nmbs, uint8_t object_id, char* buffer, uint8_t buffer_length) {
     if (object_id > 0x06 && object_id < 0x80)
         return NMBS_ERROR_INVALID_ARGUMENT;
@@ -2346,7 +6387,7 @@ nmbs_error nmbs_read_device_identification(nmbs_t* nmbs, uint8_t object_id, char
     put_1(nmbs, 4);
     put_1(nmbs, object_id);
 
-    nmbs_error err = send_msg(nmbs);
+    nmbs_error err = send_req(nmbs);
     if (err != NMBS_ERROR_NONE)
         return err;
 
@@ -2365,7 +6406,7 @@ nmbs_error nmbs_send_raw_pdu(nmbs_t* nmbs, uint8_t fc, const uint8_t* data, uint
         NMBS_DEBUG_PRINT("%d ", data[i]);
     }
 
-    return send_msg(nmbs);
+    return send_req(nmbs);
 }
 
 
@@ -2399,6 +6440,18 @@ nmbs_error nmbs_receive_raw_pdu_response(nmbs_t* nmbs, uint8_t* data_out, uint8_
 #ifndef NMBS_STRERROR_DISABLED
 const char* nmbs_strerror(nmbs_error error) {
     switch (error) {
+        case NMBS_ERROR_WOULD_BLOCK:
+            return "operation would block";
+
+        case NMBS_ERROR_CIRCUIT_OPEN:
+            return "device skipped by its circuit breaker";
+
+        case NMBS_ERROR_RESPONSE_DEFERRED:
+            return "response deferred";
+
+        case NMBS_ERROR_BUFFER_POOL_EXHAUSTED:
+            return "no message buffer available";
+
         case NMBS_ERROR_INVALID_REQUEST:
             return "invalid request received";
 
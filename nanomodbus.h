@@ -54,15 +54,19 @@ extern "C" {
  */
 typedef enum nmbs_error {
     // Library errors
-    NMBS_ERROR_INVALID_REQUEST = -8,  /**< Received invalid request from client */
-    NMBS_ERROR_INVALID_UNIT_ID = -7,  /**< Received invalid unit ID in response from server */
-    NMBS_ERROR_INVALID_TCP_MBAP = -6, /**< Received invalid TCP MBAP */
-    NMBS_ERROR_CRC = -5,              /**< Received invalid CRC */
-    NMBS_ERROR_TRANSPORT = -4,        /**< Transport error */
-    NMBS_ERROR_TIMEOUT = -3,          /**< Read/write timeout occurred */
-    NMBS_ERROR_INVALID_RESPONSE = -2, /**< Received invalid response from server */
-    NMBS_ERROR_INVALID_ARGUMENT = -1, /**< Invalid argument provided */
-    NMBS_ERROR_NONE = 0,              /**< No error */
+    NMBS_ERROR_WOULD_BLOCK = -12,          /**< Not done, it would have waited for other readers or writers */
+    NMBS_ERROR_CIRCUIT_OPEN = -11,         /**< Request not sent, the device failed repeatedly and awaits a probe */
+    NMBS_ERROR_RESPONSE_DEFERRED = -10,    /**< Returned by server callbacks whose response will be sent later */
+    NMBS_ERROR_BUFFER_POOL_EXHAUSTED = -9, /**< No message buffer available in the pool, try again later */
+    NMBS_ERROR_INVALID_REQUEST = -8,       /**< Received invalid request from client */
+    NMBS_ERROR_INVALID_UNIT_ID = -7,       /**< Received invalid unit ID in response from server */
+    NMBS_ERROR_INVALID_TCP_MBAP = -6,      /**< Received invalid TCP MBAP */
+    NMBS_ERROR_CRC = -5,                   /**< Received invalid CRC */
+    NMBS_ERROR_TRANSPORT = -4,             /**< Transport error */
+    NMBS_ERROR_TIMEOUT = -3,               /**< Read/write timeout occurred */
+    NMBS_ERROR_INVALID_RESPONSE = -2,      /**< Received invalid response from server */
+    NMBS_ERROR_INVALID_ARGUMENT = -1,      /**< Invalid argument provided */
+    NMBS_ERROR_NONE = 0,                   /**< No error */
 
     // Modbus exceptions
     NMBS_EXCEPTION_ILLEGAL_FUNCTION = 1,      /**< Modbus exception 1 */
@@ -89,6 +93,12 @@ typedef uint8_t nmbs_bitfield[250];
  */
 typedef uint8_t nmbs_bitfield_256[32];
 
+/**
+ * Bitfield consisting of 65536 coils/discrete inputs, covering the whole Modbus address space.
+ * It has the same bit layout of nmbs_bitfield, so all the nmbs_bitfield_* macros can be used on it.
+ */
+typedef uint8_t nmbs_bitfield_65536[8192];
+
 /**
  * Read a bit from the nmbs_bitfield bf at position b
  */
@@ -115,6 +125,490 @@ typedef uint8_t nmbs_bitfield_256[32];
  */
 #define nmbs_bitfield_reset(bf) memset(bf, 0, sizeof(bf))
 
+/**
+ * Register store protected by a sequence lock.
+ * Registers can be written by any thread with nmbs_register_store_write(), while other threads read consistent
+ * snapshots of them with nmbs_register_store_read(). Readers never block writers: a read overlapping a write is
+ * simply retried. Multiple registers written in a single call, like 32-bit or float values, are always read together.
+ *
+ * Create it with nmbs_register_store_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_register_store {
+    uint16_t* registers;
+    uint32_t count;
+    uint16_t address;
+    volatile uint32_t sequence;
+    volatile uint32_t* shared_sequence;
+} nmbs_register_store;
+
+/**
+ * Count of registers in a page of a nmbs_snapshot_store. Can be overridden by defining it before including this file.
+ */
+#ifndef NMBS_SNAPSHOT_PAGE_SIZE
+#define NMBS_SNAPSHOT_PAGE_SIZE 16
+#endif
+
+/**
+ * Count of pages needed by a nmbs_snapshot_store of count registers
+ */
+#define NMBS_SNAPSHOT_PAGES(count) (((count) + NMBS_SNAPSHOT_PAGE_SIZE - 1) / NMBS_SNAPSHOT_PAGE_SIZE)
+
+/**
+ * Size, in uint32_t elements, of the memory needed by a nmbs_snapshot_store of count registers, with the specified
+ * count of versions and readers. Use it to declare the memory array passed to nmbs_snapshot_store_create().
+ */
+#define NMBS_SNAPSHOT_STORE_MEMORY(count, versions, readers)                                                           \
+    ((readers) + (versions) * NMBS_SNAPSHOT_PAGES(count) +                                                             \
+     ((versions) * NMBS_SNAPSHOT_PAGES(count) * (1 + NMBS_SNAPSHOT_PAGE_SIZE) + 1) / 2)
+
+/**
+ * Register store with copy-on-write snapshots.
+ * Registers are kept in pages of NMBS_SNAPSHOT_PAGE_SIZE registers. A writer publishes a new version of the store by
+ * copying only the pages it changes, while a reader pins the latest published version for the whole duration of its
+ * reads. Blocks of registers read from a pinned nmbs_snapshot always come from the same publication, no matter how many
+ * publications happen in the meantime. Pages and versions no longer visible to any reader are reclaimed with
+ * epoch-based reclamation.
+ *
+ * Create it with nmbs_snapshot_store_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_snapshot_store {
+    volatile uint32_t* readers;
+    uint32_t* page_states;
+    uint16_t* tables;
+    uint16_t* pages;
+    uint32_t count;
+    uint16_t address;
+    uint16_t table_size;
+    uint16_t page_count;
+    uint8_t versions;
+    uint8_t readers_count;
+    volatile uint32_t epoch;
+    volatile uint32_t writer;
+} nmbs_snapshot_store;
+
+/**
+ * Version of a nmbs_snapshot_store pinned by a reader.
+ * Obtain it with nmbs_snapshot_store_pin(). All struct members are to be considered private.
+ */
+typedef struct nmbs_snapshot {
+    const nmbs_snapshot_store* store;
+    const uint16_t* table;
+    uint8_t reader;
+} nmbs_snapshot;
+
+/**
+ * Magic number identifying a register image, "NMBI" in little endian byte order
+ */
+#define NMBS_IMAGE_MAGIC 0x49424D4E
+
+/**
+ * Version of the register image layout
+ */
+#define NMBS_IMAGE_VERSION 1
+
+/**
+ * Size of the nmbs_image_header area at the start of a register image
+ */
+#define NMBS_IMAGE_HEADER_SIZE 64
+
+/**
+ * Header of a register image.
+ * A register image is a self-describing memory region holding the data of a server, meant to be placed in memory
+ * shared between processes, like a memfd or file-backed mmap region. Its layout is, with all values in the native byte
+ * order and alignment of the host:
+ * - offset 0: this header, padded to NMBS_IMAGE_HEADER_SIZE bytes
+ * - coils_offset: coils, as a nmbs_bitfield_65536
+ * - discrete_inputs_offset: discrete inputs, as a nmbs_bitfield_65536
+ * - holding_registers_offset: holding_registers_count holding registers, as uint16_t, starting from address 0
+ * - input_registers_offset: input_registers_count input registers, as uint16_t, starting from address 0
+ *
+ * The whole data is protected by the sequence lock in sequence: writers atomically make it odd before writing and
+ * increment it back to even after, readers retry until they read the data between two equal even values.
+ */
+typedef struct nmbs_image_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    volatile uint32_t sequence;
+    uint32_t holding_registers_count;
+    uint32_t input_registers_count;
+    uint32_t coils_offset;
+    uint32_t discrete_inputs_offset;
+    uint32_t holding_registers_offset;
+    uint32_t input_registers_offset;
+} nmbs_image_header;
+
+/**
+ * Register image attached with nmbs_image_attach().
+ * The data pointers reference the image memory. Registers can be accessed through the register stores, which use the
+ * sequence lock of the image, while coils and discrete inputs must be accessed between nmbs_image_write_begin() and
+ * nmbs_image_write_end(), or nmbs_image_read_begin() and nmbs_image_read_retry().
+ */
+typedef struct nmbs_image {
+    nmbs_image_header* header;
+    uint8_t* coils;
+    uint8_t* discrete_inputs;
+    nmbs_register_store holding_registers;
+    nmbs_register_store input_registers;
+} nmbs_image;
+
+/**
+ * Entry of a nmbs_response_cache, holding the encoded response to a read request.
+ * All struct members are to be considered private.
+ */
+typedef struct nmbs_response_cache_entry {
+    volatile uint32_t invalidations;
+    uint32_t filled_at;
+    uint16_t address;
+    uint16_t quantity;
+    uint8_t unit_id;
+    uint8_t fc;
+    uint8_t data_length;
+    uint8_t crc[2];
+    uint8_t data[251];
+} nmbs_response_cache_entry;
+
+/**
+ * Cache of encoded responses to read requests (FC 01, 02, 03 and 04), for data that rarely changes.
+ * Only the requests added with nmbs_response_cache_add() are cached. The first matching request is served normally
+ * and its response, including the RTU CRC, is saved, then the following ones are answered by copying it. Entries are
+ * invalidated by the write requests to overlapping ranges handled by the server, and must be invalidated with
+ * nmbs_response_cache_invalidate() when the application changes the data.
+ *
+ * Create it with nmbs_response_cache_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_response_cache {
+    nmbs_response_cache_entry* entries;
+    uint16_t size;
+    uint16_t count;
+} nmbs_response_cache;
+
+/**
+ * Type of data changed by a write request, as reported by a nmbs_change_log
+ */
+typedef enum nmbs_change_type {
+    NMBS_CHANGE_COILS = 1,             /**< Coils written by FC 05 or 15 */
+    NMBS_CHANGE_HOLDING_REGISTERS = 2, /**< Holding registers written by FC 06, 16, 22 or 23 */
+    NMBS_CHANGE_FILE_RECORD = 3,       /**< File records written by FC 21 */
+} nmbs_change_type;
+
+/**
+ * Range of data changed by a write request
+ */
+typedef struct nmbs_change {
+    uint8_t type;         /**< nmbs_change_type of the change */
+    uint8_t unit_id;      /**< Unit ID of the request */
+    uint16_t file_number; /**< File number, for NMBS_CHANGE_FILE_RECORD changes only */
+    uint16_t address;     /**< Address of the first changed coil/register, or first changed record number */
+    uint16_t quantity;    /**< Quantity of changed coils/registers/records */
+} nmbs_change;
+
+/**
+ * Log of the data ranges changed by the write requests successfully handled by a server.
+ * The server thread appends to it and a single consumer thread drains it with nmbs_change_log_drain(), without locks.
+ * Each server needs its own log.
+ *
+ * Create it with nmbs_change_log_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_change_log {
+    nmbs_change* entries;
+    uint32_t size;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    uint32_t dropped_reported;
+    void (*notify)(void* arg);
+    void* notify_arg;
+} nmbs_change_log;
+
+/**
+ * Maximum count of values returned by a FC 24 Read FIFO Queue request
+ */
+#define NMBS_FIFO_COUNT_MAX 31
+
+/**
+ * Ring buffer of register values, to back the read_fifo_queue server callback.
+ * A single producer, e.g. a sampling interrupt, pushes values with nmbs_fifo_queue_push() and a single consumer pops
+ * them with nmbs_fifo_queue_pop(), without locks.
+ *
+ * Create it with nmbs_fifo_queue_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_fifo_queue {
+    uint16_t* values;
+    uint32_t size;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+} nmbs_fifo_queue;
+
+/**
+ * Sub-functions of FC 08 Diagnostics supported by servers and nmbs_diagnostics()
+ */
+typedef enum nmbs_diagnostics_code {
+    NMBS_DIAGNOSTICS_RETURN_QUERY_DATA = 0x00,             /**< Echo the data word of the request */
+    NMBS_DIAGNOSTICS_CLEAR_COUNTERS = 0x0A,                /**< Clear all the counters */
+    NMBS_DIAGNOSTICS_BUS_MESSAGE_COUNT = 0x0B,             /**< Return the bus_messages counter */
+    NMBS_DIAGNOSTICS_BUS_COMMUNICATION_ERROR_COUNT = 0x0C, /**< Return the bus_errors counter */
+    NMBS_DIAGNOSTICS_BUS_EXCEPTION_ERROR_COUNT = 0x0D,     /**< Return the exceptions counter */
+    NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT = 0x0E,          /**< Return the server_messages counter */
+    NMBS_DIAGNOSTICS_SERVER_NO_RESPONSE_COUNT = 0x0F,      /**< Return the no_responses counter */
+    NMBS_DIAGNOSTICS_BUS_CHARACTER_OVERRUN_COUNT = 0x12,   /**< Return the overruns counter */
+    NMBS_DIAGNOSTICS_CLEAR_OVERRUN_COUNTER = 0x14,         /**< Clear the overruns counter */
+} nmbs_diagnostics_code;
+
+/**
+ * Communication counters of a server, as returned by nmbs_server_get_diagnostics(). They wrap around at 65535.
+ */
+typedef struct nmbs_diagnostic_counters {
+    uint16_t bus_messages;    /**< Messages received with a valid CRC, addressed to any device */
+    uint16_t bus_errors;      /**< Messages received with a CRC error */
+    uint16_t exceptions;      /**< Exception responses sent */
+    uint16_t server_messages; /**< Messages addressed to the server, broadcasts included */
+    uint16_t no_responses;    /**< Messages addressed to the server that were not answered, i.e. broadcasts */
+    uint16_t overruns;        /**< Requests left in the transport because no message buffer was available */
+} nmbs_diagnostic_counters;
+
+/**
+ * Maximum count of events returned by a FC 12 Get Comm Event Log request
+ */
+#define NMBS_COMM_EVENT_LOG_SIZE 64
+
+/**
+ * Bits of the events of a nmbs_comm_event_log, as returned by nmbs_get_comm_event_log()
+ */
+#define NMBS_COMM_EVENT_RECEIVE 0x80              /**< Receive event, the other bits below are set on receive events */
+#define NMBS_COMM_EVENT_RECEIVE_ERROR 0x02        /**< Request received with a communication error */
+#define NMBS_COMM_EVENT_RECEIVE_OVERRUN 0x10      /**< Request not handled because no message buffer was available */
+#define NMBS_COMM_EVENT_RECEIVE_BROADCAST 0x40    /**< Broadcast request received */
+#define NMBS_COMM_EVENT_SEND 0x40                 /**< Send event, the other bits below are set on send events */
+#define NMBS_COMM_EVENT_SEND_READ_EXCEPTION 0x01  /**< Exception response with code 1 to 3 sent */
+#define NMBS_COMM_EVENT_SEND_ABORT_EXCEPTION 0x02 /**< Exception response with code 4 sent */
+#define NMBS_COMM_EVENT_SEND_BUSY_EXCEPTION 0x04  /**< Exception response with code 5 or 6 sent */
+#define NMBS_COMM_EVENT_SEND_NAK_EXCEPTION 0x08   /**< Exception response with code 7 sent */
+
+/**
+ * Communication event log of a server, read by FC 11 Get Comm Event Counter and FC 12 Get Comm Event Log requests.
+ * The server stores a receive event for each request addressed to it and a send event for each response, in the
+ * format defined by the Modbus serial line specification.
+ *
+ * Create it with nmbs_comm_event_log_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_comm_event_log {
+    uint8_t events[NMBS_COMM_EVENT_LOG_SIZE];
+    uint8_t head;
+    uint8_t count;
+    uint16_t event_count;
+    uint16_t message_count;
+} nmbs_comm_event_log;
+
+/**
+ * Range of consecutive records of a file, read by nmbs_read_file_records() or written by nmbs_write_file_records()
+ */
+typedef struct nmbs_file_record {
+    uint16_t file_number;   /**< File number (1 to 65535) */
+    uint16_t record_number; /**< Number of the first record (0000 to 9999) */
+    uint16_t* registers;    /**< Array of count registers, read into or written from */
+    uint16_t count;         /**< Count of records, record_number + count must not exceed 10000 */
+} nmbs_file_record;
+
+/**
+ * Point of a scan list, such as a 32-bit value held in 2 consecutive holding registers of a device.
+ * Points are read by nmbs_scan() according to a plan made by nmbs_scan_plan_create().
+ */
+typedef struct nmbs_scan_point {
+    uint16_t* values;  /**< Array of quantity values read into. Coils and discrete inputs are stored as 0 or 1 */
+    uint16_t address;  /**< Address of the first coil, discrete input or register of the point */
+    uint16_t quantity; /**< Count of coils, discrete inputs or registers of the point */
+    uint8_t unit_id;   /**< Unit ID of the device holding the point */
+    uint8_t fc;        /**< Table of the point, as its read function code: 1, 2, 3 or 4 */
+} nmbs_scan_point;
+
+/**
+ * Read request of a scan plan, covering consecutive points of the plan
+ */
+typedef struct nmbs_scan_request {
+    uint16_t address;      /**< Starting address of the request */
+    uint16_t quantity;     /**< Quantity of coils, discrete inputs or registers of the request */
+    uint16_t first_point;  /**< Index of the first point covered by the request */
+    uint16_t points_count; /**< Count of points covered by the request */
+    nmbs_error error;      /**< Result of the request in the last nmbs_scan() */
+    uint8_t unit_id;       /**< Unit ID of the request */
+    uint8_t fc;            /**< Function code of the request */
+} nmbs_scan_request;
+
+/**
+ * Limits and cost model used by nmbs_scan_plan_create(). Initialize it with nmbs_scan_options_create().
+ */
+typedef struct nmbs_scan_options {
+    uint16_t max_bits;      /**< Max coils or discrete inputs per request, up to 2000 */
+    uint16_t max_registers; /**< Max registers per request, up to 125 */
+    uint16_t frame_cost;    /**< Cost of an additional request and its response, in bytes on the wire. A gap between
+                                 points is read through when it adds fewer response bytes, 0 only merges adjacent or
+                                 overlapping points */
+} nmbs_scan_options;
+
+/**
+ * Plan of the requests reading a scan list. Create it with nmbs_scan_plan_create().
+ */
+typedef struct nmbs_scan_plan {
+    const nmbs_scan_point* points;
+    nmbs_scan_request* requests;
+    uint16_t points_count;
+    uint16_t requests_count;
+} nmbs_scan_plan;
+
+/**
+ * Scan plan polled periodically by a nmbs_poll_scheduler, such as the alarm points of a device.
+ * Set the configuration members, the statistics members are updated by the scheduler and can be read at any time.
+ */
+typedef struct nmbs_poll_group {
+    const nmbs_scan_plan* plan; /**< Requests of a poll of the group */
+    uint32_t period_ms;         /**< Polling period. Each poll is due by the start of the next period */
+    int32_t timeout_ms;         /**< Read timeout of the requests of the group, or 0 to keep the one of the instance.
+                                     With adaptive timeouts, it caps the timeout of each device */
+    uint8_t priority;           /**< Tie-breaker between polls due at the same time, lower values are polled first */
+
+    uint32_t polls;           /**< Polls completed */
+    uint32_t missed;          /**< Polls completed after their deadline, or skipped because the next one was due */
+    uint32_t timeouts;        /**< Requests that timed out */
+    uint32_t errors;          /**< Requests that failed with any other error or exception */
+    uint32_t max_response_ms; /**< Longest time between the start of a period and the completion of its poll */
+
+    uint32_t release_ms;
+    uint16_t next_request;
+} nmbs_poll_group;
+
+/**
+ * Response time estimate and circuit breaker state of a device, kept by a nmbs_adaptive_timeouts.
+ * All struct members are to be considered private.
+ */
+typedef struct nmbs_device_timing {
+    int32_t srtt;   // Smoothed response time, in 1/8 ms
+    int32_t rttvar; // Response time variation, in 1/4 ms
+    int32_t timeout_ms;
+    uint32_t open_until_ms;
+    uint8_t failures;
+    bool measured;
+    bool open;
+} nmbs_device_timing;
+
+/**
+ * Read timeouts of a client instance adapted to each device, from its measured response times, like TCP
+ * retransmission timeouts (RFC 6298). The timeout of a device doubles with every timeout, and its circuit breaker opens
+ * after repeated timeouts: its requests fail immediately, without using the bus, until a probe request is let through.
+ *
+ * Create it with nmbs_adaptive_timeouts_create() and set it with nmbs_set_adaptive_timeouts(). The configuration
+ * members can be changed at any time, the other ones are to be considered private.
+ */
+typedef struct nmbs_adaptive_timeouts {
+    int32_t min_timeout_ms;   /**< Lower bound of the timeouts. Default 10 ms */
+    int32_t max_timeout_ms;   /**< Upper bound of the timeouts, and timeout of unmeasured devices. Default 1 s */
+    uint8_t failures_to_open; /**< Consecutive timeouts opening the breaker of a device, 0 to never open. Default 3 */
+    uint32_t open_ms;         /**< Time an open breaker fails requests before letting a probe through. Default 5 s */
+
+    nmbs_device_timing* devices;
+    uint32_t (*clock_ms)(void* arg);
+    void* arg;
+    uint32_t sent_ms;
+    int32_t cap_ms;
+    uint16_t devices_count;
+} nmbs_adaptive_timeouts;
+
+/**
+ * Size of the message buffer of a nmbs_t instance
+ */
+#define NMBS_MSG_BUF_SIZE 260
+
+/**
+ * Message buffer of a nmbs_buffer_pool
+ */
+typedef struct nmbs_pool_buffer {
+    uint8_t buf[NMBS_MSG_BUF_SIZE]; /**< Message buffer */
+    volatile uint16_t next;         /**< Reserved, index + 1 of the next free buffer */
+} nmbs_pool_buffer;
+
+/**
+ * nmbs_buffer_pool counters, as returned by nmbs_buffer_pool_get_stats()
+ */
+typedef struct nmbs_buffer_pool_stats {
+    uint32_t acquired;    /**< Buffers handed out */
+    uint32_t exhausted;   /**< Acquisitions failed because all the buffers were in use */
+    uint32_t in_use;      /**< Buffers currently in use */
+    uint32_t peak_in_use; /**< Maximum count of buffers in use at the same time */
+} nmbs_buffer_pool_stats;
+
+/**
+ * Lock-free pool of message buffers, shared by many nmbs_t instances and threads.
+ * Buffers are kept in a stack whose head is tagged with a counter, so it is safe from ABA problems.
+ *
+ * Create it with nmbs_buffer_pool_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_buffer_pool {
+    nmbs_pool_buffer* buffers;
+    uint16_t count;
+    volatile uint32_t head;
+    volatile uint32_t acquired;
+    volatile uint32_t exhausted;
+    volatile uint32_t in_use;
+    volatile uint32_t peak_in_use;
+} nmbs_buffer_pool;
+
+/**
+ * Server request whose response is sent later, see nmbs_server_defer().
+ * All struct members are to be considered private.
+ */
+typedef struct nmbs_deferred {
+    uint16_t transaction_id;
+    uint16_t address;
+    uint16_t quantity;
+    uint8_t unit_id;
+    uint8_t fc;
+    bool broadcast;
+    bool pending;
+} nmbs_deferred;
+
+/**
+ * Device identification object, as passed to nmbs_device_identification_create()
+ */
+typedef struct nmbs_device_identification_value {
+    uint8_t id;        /**< Object ID */
+    const char* value; /**< Null-terminated object value */
+} nmbs_device_identification_value;
+
+/**
+ * Device identification object read by nmbs_read_device_identification_objects()
+ */
+typedef struct nmbs_device_identification_entry {
+    const char* value; /**< Null-terminated object value, stored in the caller's arena */
+    uint8_t length;    /**< Value length, not counting the null terminator */
+    uint8_t id;        /**< Object ID */
+} nmbs_device_identification_entry;
+
+/**
+ * Encoded device identification object of a nmbs_device_identification.
+ * All struct members are to be considered private.
+ */
+typedef struct nmbs_device_identification_object {
+    uint16_t offset;
+    uint16_t segment_length;
+    uint8_t id;
+    uint8_t segment_count;
+    uint8_t next_object_id;
+} nmbs_device_identification_object;
+
+/**
+ * Device identification objects pre-encoded for FC 43 / 14 responses.
+ * The objects are encoded once, together with the response segment starting from each of them, so a request is
+ * served by looking up its starting object and copying its segment.
+ *
+ * Create it with nmbs_device_identification_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_device_identification {
+    const nmbs_device_identification_object* objects;
+    const uint8_t* buf;
+    uint16_t count;
+} nmbs_device_identification;
+
 /**
  * Modbus transport type.
  */
@@ -158,6 +652,33 @@ typedef struct nmbs_platform_conf {
 } nmbs_platform_conf;
 
 
+/**
+ * Handler of a custom function code, registered in a nmbs_fc_table.
+ *
+ * `pdu` points to the request data following the function code, `*length` bytes long. The response data following the
+ * function code is written in its place, up to `max_length` bytes, and its length is returned in `*length`. Since the
+ * request is overwritten by the response, it has to be read first.
+ *
+ * Return NMBS_ERROR_NONE to send the response, or a Modbus exception to send an exception response.
+ * `arg` is the arg member of the nmbs_callbacks the table is set in.
+ */
+typedef nmbs_error (*nmbs_fc_handler)(uint8_t fc, uint8_t* pdu, uint16_t* length, uint16_t max_length, uint8_t unit_id,
+                                      void* arg);
+
+/**
+ * Table of custom function code handlers, indexed by function code. Set it in the fc_table member of nmbs_callbacks,
+ * it can be shared by many servers. Create it with nmbs_fc_table_create().
+ *
+ * On TCP the request length is given by the MBAP header. On RTU the request ends when the line stays silent for the
+ * byte timeout, which therefore has to be set with nmbs_set_byte_timeout(). Without it, the bytes already received are
+ * discarded and custom function codes are answered with NMBS_EXCEPTION_ILLEGAL_FUNCTION. When a table is set, requests
+ * with a function code missing from it are also received in full before responding with
+ * NMBS_EXCEPTION_ILLEGAL_FUNCTION.
+ */
+typedef struct nmbs_fc_table {
+    nmbs_fc_handler handlers[128];
+} nmbs_fc_table;
+
 /**
  * Modbus server request callbacks. Passed to nmbs_server_create().
  *
@@ -165,6 +686,10 @@ typedef struct nmbs_platform_conf {
  * to nmbs_server_create together with this struct.
  *
  * `unit_id` is the RTU unit ID of the request sender. It is always 0 on TCP.
+ *
+ * Bitfield and register arguments point directly into the message buffer of the nmbs_t instance. Coils and discrete
+ * inputs bitfields are zeroed up to the requested quantity, output registers are not initialized and have to be
+ * written in full. Register arrays are always 2-byte aligned, in host byte order.
  */
 typedef struct nmbs_callbacks {
 #ifndef NMBS_SERVER_DISABLED
@@ -177,7 +702,8 @@ typedef struct nmbs_callbacks {
                                        void* arg);
 #endif
 
-#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED)
+#if !defined(NMBS_SERVER_READ_HOLDING_REGISTERS_DISABLED) || !defined(NMBS_SERVER_READ_WRITE_REGISTERS_DISABLED) ||    \
+    !defined(NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED)
     nmbs_error (*read_holding_registers)(uint16_t address, uint16_t quantity, uint16_t* registers_out, uint8_t unit_id,
                                          void* arg);
 #endif
@@ -187,11 +713,15 @@ typedef struct nmbs_callbacks {
                                        void* arg);
 #endif
 
+#ifndef NMBS_SERVER_READ_EXCEPTION_STATUS_DISABLED
+    nmbs_error (*read_exception_status)(uint8_t* status_out, uint8_t unit_id, void* arg);
+#endif
+
 #ifndef NMBS_SERVER_WRITE_SINGLE_COIL_DISABLED
     nmbs_error (*write_single_coil)(uint16_t address, bool value, uint8_t unit_id, void* arg);
 #endif
 
-#ifndef NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED
+#if !defined(NMBS_SERVER_WRITE_SINGLE_REGISTER_DISABLED) || !defined(NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED)
     nmbs_error (*write_single_register)(uint16_t address, uint16_t value, uint8_t unit_id, void* arg);
 #endif
 
@@ -205,6 +735,11 @@ typedef struct nmbs_callbacks {
                                            uint8_t unit_id, void* arg);
 #endif
 
+#ifndef NMBS_SERVER_MASK_WRITE_REGISTER_DISABLED
+    nmbs_error (*mask_write_register)(uint16_t address, uint16_t and_mask, uint16_t or_mask, uint8_t unit_id,
+                                      void* arg);
+#endif
+
 #ifndef NMBS_SERVER_READ_FILE_RECORD_DISABLED
     nmbs_error (*read_file_record)(uint16_t file_number, uint16_t record_number, uint16_t* registers, uint16_t count,
                                    uint8_t unit_id, void* arg);
@@ -215,11 +750,18 @@ typedef struct nmbs_callbacks {
                                     uint16_t count, uint8_t unit_id, void* arg);
 #endif
 
+#ifndef NMBS_SERVER_READ_FIFO_QUEUE_DISABLED
+    nmbs_error (*read_fifo_queue)(uint16_t address, uint16_t values_out[NMBS_FIFO_COUNT_MAX], uint8_t* count_out,
+                                  uint8_t unit_id, void* arg);
+#endif
+
 #ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
 #define NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH 128
     nmbs_error (*read_device_identification)(uint8_t object_id, char buffer[NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH]);
     nmbs_error (*read_device_identification_map)(nmbs_bitfield_256 map);
 #endif
+
+    const nmbs_fc_table* fc_table; // Custom function code handlers, see nmbs_fc_table. Optional
 #endif
 
     void* arg;               // User data, will be passed to functions above
@@ -227,64 +769,609 @@ typedef struct nmbs_callbacks {
 } nmbs_callbacks;
 
 
-/**
- * nanoMODBUS client/server instance type. All struct members are to be considered private,
- * it is not advisable to read/write them directly.
+/**
+ * Cache line size nmbs_t instances are aligned to when NMBS_COMPACT is defined
+ */
+#ifndef NMBS_CACHE_LINE_SIZE
+#define NMBS_CACHE_LINE_SIZE 64
+#endif
+
+#ifdef NMBS_COMPACT
+#if defined(__GNUC__) || defined(__clang__)
+#define NMBS_INSTANCE_ALIGNMENT __attribute__((aligned(NMBS_CACHE_LINE_SIZE)))
+#elif defined(_MSC_VER)
+#define NMBS_INSTANCE_ALIGNMENT __declspec(align(NMBS_CACHE_LINE_SIZE))
+#endif
+#endif
+
+#ifndef NMBS_INSTANCE_ALIGNMENT
+#define NMBS_INSTANCE_ALIGNMENT
+#endif
+
+/**
+ * Data stores a server answers requests from, set with nmbs_set_coils_bitfield() and the other nmbs_set_*() functions.
+ * All struct members are to be considered private. Removed from nmbs_t when NMBS_SERVER_DATA_STORES_DISABLED is
+ * defined.
+ */
+typedef struct nmbs_server_data {
+    uint8_t* coils;
+    uint8_t* discrete_inputs;
+    nmbs_register_store* holding_registers;
+    nmbs_register_store* input_registers;
+    nmbs_snapshot_store* holding_registers_snapshot;
+    nmbs_snapshot_store* input_registers_snapshot;
+    nmbs_change_log* change_log;
+    nmbs_response_cache* response_cache;
+    volatile uint32_t* bits_sequence;
+} nmbs_server_data;
+
+/**
+ * nanoMODBUS client/server instance type. All struct members are to be considered private,
+ * it is not advisable to read/write them directly.
+ *
+ * The fields accessed while parsing every frame come first. When NMBS_COMPACT is defined, the instance holds the
+ * nmbs_platform_conf and nmbs_callbacks by pointer, so a single const table can be shared by many instances, and the
+ * message buffer is provided with nmbs_set_buffer().
+ * The fields of optional features are removed by their NMBS_*_DISABLED defines.
+ */
+typedef struct NMBS_INSTANCE_ALIGNMENT nmbs_t {
+    struct {
+        uint16_t buf_idx;
+        uint8_t unit_id;
+        uint8_t fc;
+        uint16_t transaction_id;
+        bool broadcast;
+        bool ignored;
+    } msg;
+
+    uint8_t transport;
+    uint8_t address_rtu;
+    uint8_t dest_address_rtu;
+#if !defined(NMBS_CLIENT_DISABLED) && !defined(NMBS_PIPELINING_DISABLED)
+    uint8_t pipeline_depth;
+#endif
+    uint16_t current_tid;
+#if !defined(NMBS_SERVER_DISABLED) && !defined(NMBS_SERVER_DEFERRED_DISABLED)
+    bool polling;
+#endif
+
+    int32_t byte_timeout_ms;
+    int32_t read_timeout_ms;
+#if !defined(NMBS_CLIENT_DISABLED) && !defined(NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED)
+    nmbs_adaptive_timeouts* adaptive_timeouts;
+#endif
+
+#ifndef NMBS_PIPELINING_DISABLED
+    uint8_t* rx_buf;
+    uint16_t rx_size;
+    uint16_t rx_start;
+    uint16_t rx_end;
+#endif
+
+#ifndef NMBS_SERVER_DISABLED
+#ifndef NMBS_PIPELINING_DISABLED
+    uint16_t tx_size;
+    uint16_t tx_len;
+#endif
+#ifdef NMBS_COMPACT
+    uint8_t first_byte;
+    bool first_byte_pending;
+#endif
+#ifndef NMBS_SERVER_DIAGNOSTICS_DISABLED
+    nmbs_diagnostic_counters diagnostics;
+#endif
+#ifndef NMBS_PIPELINING_DISABLED
+    uint8_t* tx_buf;
+#endif
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+    nmbs_deferred* deferred;
+#endif
+#endif
+
+#ifdef NMBS_COMPACT
+    uint8_t* msg_buf;
+#ifndef NMBS_SERVER_DISABLED
+    nmbs_buffer_pool* buffer_pool;
+#endif
+#endif
+
+#ifdef NMBS_COMPACT
+    const nmbs_platform_conf* platform;
+    const nmbs_callbacks* callbacks;
+    void* platform_arg;
+    void* callbacks_arg;
+#else
+    nmbs_platform_conf platform;
+    nmbs_callbacks callbacks;
+#endif
+
+#ifndef NMBS_SERVER_DISABLED
+#ifndef NMBS_SERVER_DATA_STORES_DISABLED
+    nmbs_server_data data;
+#endif
+#if !defined(NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED) || !defined(NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED)
+    nmbs_comm_event_log* comm_event_log;
+#endif
+#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
+    const nmbs_device_identification* device_identification;
+#endif
+#endif
+
+#ifndef NMBS_COMPACT
+    uint8_t msg_buf[NMBS_MSG_BUF_SIZE];
+#endif
+} nmbs_t;
+
+/**
+ * Non-preemptive earliest-deadline-first scheduler of poll groups sharing a client instance, such as the devices of an
+ * RS-485 line. The requests of a poll are sent one per nmbs_poll_scheduler_run() call, so a long poll is interleaved
+ * with the more urgent polls due meanwhile.
+ *
+ * Create it with nmbs_poll_scheduler_create(). All struct members are to be considered private.
+ */
+typedef struct nmbs_poll_scheduler {
+    nmbs_t* nmbs;
+    nmbs_poll_group** heap;
+    uint32_t (*clock_ms)(void* arg);
+    void* arg;
+    uint32_t start_ms;
+    uint32_t busy_ms;
+    uint16_t count;
+    uint16_t waiting;
+} nmbs_poll_scheduler;
+
+/**
+ * Modbus broadcast address. Can be passed to nmbs_set_destination_rtu_address().
+ */
+static const uint8_t NMBS_BROADCAST_ADDRESS = 0;
+
+/** Set the request/response timeout.
+ * If the target instance is a server, sets the timeout of the nmbs_server_poll() function.
+ * If the target instance is a client, sets the response timeout after sending a request. In case of timeout,
+ * the called method will return NMBS_ERROR_TIMEOUT.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param timeout_ms timeout in milliseconds. If < 0, the timeout is disabled.
+ */
+void nmbs_set_read_timeout(nmbs_t* nmbs, int32_t timeout_ms);
+
+/** Set the timeout between the reception/transmission of two consecutive bytes.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param timeout_ms timeout in milliseconds. If < 0, the timeout is disabled.
+ */
+void nmbs_set_byte_timeout(nmbs_t* nmbs, int32_t timeout_ms);
+
+/** Create a new nmbs_platform_conf struct.
+ * @param platform_conf pointer to the nmbs_platform_conf instance
+ */
+void nmbs_platform_conf_create(nmbs_platform_conf* platform_conf);
+
+#ifdef NMBS_COMPACT
+/** Set the message buffer of a nmbs_t instance. Only available when NMBS_COMPACT is defined.
+ * It has to be set before using the instance, and can be changed between requests.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param buf buffer of NMBS_MSG_BUF_SIZE bytes
+ */
+void nmbs_set_buffer(nmbs_t* nmbs, uint8_t* buf);
+#endif
+
+#ifndef NMBS_PIPELINING_DISABLED
+/** Set a receive buffer, separate from the message buffer, used to read ahead on TCP.
+ * Whenever more bytes are needed, the instance also reads, without waiting, all the bytes already available from the
+ * transport up to the size of this buffer. Pipelined requests or responses are kept here while the message buffer is
+ * used to build and send the current response, and are then parsed without calling the platform read function again.
+ * nmbs_server_poll() handles all the complete requests in this buffer before returning.
+ * Read-ahead is not used on RTU, where messages are delimited by silence on the line.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param buf receive buffer, or NULL to read directly into the message buffer
+ * @param size size of the receive buffer in bytes
+ */
+void nmbs_set_rx_buffer(nmbs_t* nmbs, uint8_t* buf, uint16_t size);
+#endif
+
+/** Set the pointer to user data argument passed to platform functions.
+ * The bytes read ahead in the receive buffer set with nmbs_set_rx_buffer() are discarded, since they were read from the
+ * previous connection.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param arg user data argument
+ */
+void nmbs_set_platform_arg(nmbs_t* nmbs, void* arg);
+
+/** Copy a range of bits from a nmbs_bitfield_65536 to the beginning of a nmbs_bitfield.
+ * Bits of the last destination byte exceeding quantity are set to 0.
+ * @param bf source bitfield
+ * @param address address of the first bit to copy
+ * @param quantity quantity of bits to copy (1 to 2000)
+ * @param bits_out nmbs_bitfield where the bits will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_bitfield_65536_read_range(const nmbs_bitfield_65536 bf, uint16_t address, uint16_t quantity,
+                                          nmbs_bitfield bits_out);
+
+/** Copy the first bits of a nmbs_bitfield to a range of a nmbs_bitfield_65536.
+ * @param bf destination bitfield
+ * @param address address of the first bit to write
+ * @param quantity quantity of bits to write (1 to 2000)
+ * @param bits nmbs_bitfield with the values to write
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_bitfield_65536_write_range(nmbs_bitfield_65536 bf, uint16_t address, uint16_t quantity,
+                                           const nmbs_bitfield bits);
+
+/** Count the bits set in a range of a nmbs_bitfield_65536.
+ * @param bf bitfield
+ * @param address address of the first bit of the range
+ * @param quantity quantity of bits in the range. Ranges exceeding address 0xFFFF are truncated.
+ *
+ * @return number of bits set.
+ */
+uint32_t nmbs_bitfield_65536_count(const nmbs_bitfield_65536 bf, uint16_t address, uint32_t quantity);
+
+/** Find the next range of consecutive bits that differ between two nmbs_bitfield_65536.
+ * Useful to compare the current state of the coils/discrete inputs with a previous copy of it.
+ * @param bf bitfield
+ * @param previous bitfield to compare bf with
+ * @param from address to start the search from. Values > 0xFFFF return false.
+ * @param address_out address of the first changed bit of the range
+ * @param quantity_out quantity of consecutive changed bits
+ *
+ * @return true if a changed range was found, false otherwise.
+ */
+bool nmbs_bitfield_65536_next_changed(const nmbs_bitfield_65536 bf, const nmbs_bitfield_65536 previous, uint32_t from,
+                                      uint16_t* address_out, uint32_t* quantity_out);
+
+/** Create a new nmbs_register_store.
+ * @param store pointer to the nmbs_register_store instance
+ * @param registers array holding the registers values. It must outlive the store
+ * @param address address of the first register of the array
+ * @param count count of registers in the array
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_register_store_create(nmbs_register_store* store, uint16_t* registers, uint16_t address,
+                                      uint32_t count);
+
+/** Read a consistent snapshot of a range of registers from a nmbs_register_store.
+ * Never blocks the writers: if a write happens while reading, the read is retried.
+ * @param store pointer to the nmbs_register_store instance
+ * @param address address of the first register to read
+ * @param quantity quantity of registers to read
+ * @param registers_out array where the registers values will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_register_store_read(const nmbs_register_store* store, uint16_t address, uint16_t quantity,
+                                    uint16_t* registers_out);
+
+/** Write a range of registers to a nmbs_register_store.
+ * Readers will either see all the registers of the range updated, or none of them.
+ * @param store pointer to the nmbs_register_store instance
+ * @param address address of the first register to write
+ * @param quantity quantity of registers to write
+ * @param registers registers values to write
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_register_store_write(nmbs_register_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers);
+
+/** Begin a batch of writes to a nmbs_register_store.
+ * Between this call and nmbs_register_store_write_end(), the registers array can be modified directly and readers
+ * will retry until the batch is ended. Other writers will wait as well, so the batch should be kept short.
+ * @param store pointer to the nmbs_register_store instance
+ *
+ * @return pointer to the registers array of the store.
+ */
+uint16_t* nmbs_register_store_write_begin(nmbs_register_store* store);
+
+/** End a batch of writes started with nmbs_register_store_write_begin().
+ * @param store pointer to the nmbs_register_store instance
+ */
+void nmbs_register_store_write_end(nmbs_register_store* store);
+
+/** Create a new nmbs_snapshot_store. All the registers are initialized to 0.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param memory memory used by the store, declared as uint32_t memory[NMBS_SNAPSHOT_STORE_MEMORY(count, versions,
+ * readers)]. It must outlive the store
+ * @param memory_size size of memory, in bytes
+ * @param address address of the first register of the store
+ * @param count count of registers in the store
+ * @param versions count of versions that can be pinned at the same time. Must be a power of 2, at least 2. With more
+ * versions, the writer waits less often for slow readers. The store keeps a page pool of versions times its pages
+ * @param readers maximum count of readers pinning a version at the same time
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_snapshot_store_create(nmbs_snapshot_store* store, uint32_t* memory, uint32_t memory_size,
+                                      uint16_t address, uint32_t count, uint8_t versions, uint8_t readers);
+
+/** Pin the latest published version of a nmbs_snapshot_store.
+ * The version will stay readable until nmbs_snapshot_store_unpin() is called. While it is pinned, writers can publish
+ * up to (versions - 1) newer versions, then they wait for it to be unpinned, so pins should be kept short.
+ * Waits if all the reader slots of the store are in use.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param snapshot pointer to the nmbs_snapshot that will reference the pinned version
+ */
+void nmbs_snapshot_store_pin(nmbs_snapshot_store* store, nmbs_snapshot* snapshot);
+
+/** Unpin a version pinned with nmbs_snapshot_store_pin().
+ * @param snapshot pointer to the nmbs_snapshot
+ */
+void nmbs_snapshot_store_unpin(nmbs_snapshot* snapshot);
+
+/** Read a range of registers from a pinned version of a nmbs_snapshot_store.
+ * @param snapshot pointer to the nmbs_snapshot
+ * @param address address of the first register to read
+ * @param quantity quantity of registers to read
+ * @param registers_out array where the registers values will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_snapshot_read(const nmbs_snapshot* snapshot, uint16_t address, uint16_t quantity,
+                              uint16_t* registers_out);
+
+/** Read a range of registers from the latest published version of a nmbs_snapshot_store.
+ * Equivalent to pinning, reading and unpinning.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param address address of the first register to read
+ * @param quantity quantity of registers to read
+ * @param registers_out array where the registers values will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_snapshot_store_read(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                    uint16_t* registers_out);
+
+/** Begin a new version of a nmbs_snapshot_store.
+ * Writers take turns: other writers wait until this version is published with nmbs_snapshot_store_publish().
+ * @param store pointer to the nmbs_snapshot_store instance
+ */
+void nmbs_snapshot_store_begin(nmbs_snapshot_store* store);
+
+/** Begin a new version of a nmbs_snapshot_store, unless it would wait.
+ * @param store pointer to the nmbs_snapshot_store instance
+ *
+ * @return NMBS_ERROR_NONE if the version was begun, NMBS_ERROR_WOULD_BLOCK if another writer has begun a version or if
+ * a reader still pins the version published (versions - 1) publications ago.
+ */
+nmbs_error nmbs_snapshot_store_try_begin(nmbs_snapshot_store* store);
+
+/** Write a range of registers to the version begun with nmbs_snapshot_store_begin().
+ * Only the pages touched by the range are copied. Readers will not see the change until the version is published.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param address address of the first register to write
+ * @param quantity quantity of registers to write
+ * @param registers registers values to write
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_snapshot_store_stage(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers);
+
+/** Publish the version begun with nmbs_snapshot_store_begin(), making it visible to new readers.
+ * @param store pointer to the nmbs_snapshot_store instance
+ */
+void nmbs_snapshot_store_publish(nmbs_snapshot_store* store);
+
+/** Write a range of registers to a nmbs_snapshot_store and publish them as a new version.
+ * Equivalent to beginning a version, staging the range and publishing it.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param address address of the first register to write
+ * @param quantity quantity of registers to write
+ * @param registers registers values to write
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store.
+ */
+nmbs_error nmbs_snapshot_store_write(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                     const uint16_t* registers);
+
+/** Write a range of registers to a nmbs_snapshot_store and publish them as a new version, unless it would wait.
+ * Equivalent to nmbs_snapshot_store_try_begin(), then staging the range and publishing it.
+ * @param store pointer to the nmbs_snapshot_store instance
+ * @param address address of the first register to write
+ * @param quantity quantity of registers to write
+ * @param registers registers values to write
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if the range is outside the store,
+ * NMBS_ERROR_WOULD_BLOCK if nmbs_snapshot_store_try_begin() would have waited.
+ */
+nmbs_error nmbs_snapshot_store_try_write(nmbs_snapshot_store* store, uint16_t address, uint16_t quantity,
+                                         const uint16_t* registers);
+
+/** Get the size of a register image.
+ * @param holding_registers_count count of holding registers in the image
+ * @param input_registers_count count of input registers in the image
+ *
+ * @return size of the image in bytes.
+ */
+uint32_t nmbs_image_size(uint32_t holding_registers_count, uint32_t input_registers_count);
+
+/** Format a memory region as an empty register image, with all the data set to 0.
+ * @param memory memory region, aligned to 4 bytes
+ * @param size size of the memory region. Must be at least nmbs_image_size()
+ * @param holding_registers_count count of holding registers in the image, up to 65536
+ * @param input_registers_count count of input registers in the image, up to 65536
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_image_format(void* memory, uint32_t size, uint32_t holding_registers_count,
+                             uint32_t input_registers_count);
+
+/** Attach to a register image formatted with nmbs_image_format(), possibly by another process or a previous run.
+ * @param image pointer to the nmbs_image instance
+ * @param memory memory region holding the image
+ * @param size size of the memory region
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the memory region does not hold a valid image.
+ */
+nmbs_error nmbs_image_attach(nmbs_image* image, void* memory, uint32_t size);
+
+/** Release the write lock of a register image left held by a writer that terminated while writing.
+ * Only call it when no other process is using the image, e.g. when restarting with a file-backed image.
+ * @param image pointer to the nmbs_image instance
+ */
+void nmbs_image_recover(nmbs_image* image);
+
+/** Begin a batch of writes to a register image.
+ * Until nmbs_image_write_end() is called, all of the image data can be modified directly and readers will retry.
+ * @param image pointer to the nmbs_image instance
+ */
+void nmbs_image_write_begin(nmbs_image* image);
+
+/** End a batch of writes started with nmbs_image_write_begin().
+ * @param image pointer to the nmbs_image instance
+ */
+void nmbs_image_write_end(nmbs_image* image);
+
+/** Begin reading data from a register image.
+ * @param image pointer to the nmbs_image instance
+ *
+ * @return value to pass to nmbs_image_read_retry().
+ */
+uint32_t nmbs_image_read_begin(const nmbs_image* image);
+
+/** Check whether the data read since nmbs_image_read_begin() may be inconsistent and must be read again.
+ * @param image pointer to the nmbs_image instance
+ * @param begin value returned by nmbs_image_read_begin()
+ *
+ * @return true if the read must be retried, starting from nmbs_image_read_begin().
+ */
+bool nmbs_image_read_retry(const nmbs_image* image, uint32_t begin);
+
+/** Create a new nmbs_response_cache.
+ * @param cache pointer to the nmbs_response_cache instance
+ * @param entries array of entries used by the cache. It must outlive the cache
+ * @param size count of entries in the array
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
  */
-typedef struct nmbs_t {
-    struct {
-        uint8_t buf[260];
-        uint16_t buf_idx;
+nmbs_error nmbs_response_cache_create(nmbs_response_cache* cache, nmbs_response_cache_entry* entries, uint16_t size);
+
+/** Add a read request to cache the response of.
+ * Only requests matching exactly all the parameters will be served from the cache.
+ * @param cache pointer to the nmbs_response_cache instance
+ * @param unit_id unit ID of the request
+ * @param fc function code of the request, 1 to 4
+ * @param address address of the request
+ * @param quantity quantity of the request
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the request is invalid or the cache is full.
+ */
+nmbs_error nmbs_response_cache_add(nmbs_response_cache* cache, uint8_t unit_id, uint8_t fc, uint16_t address,
+                                   uint16_t quantity);
+
+/** Invalidate the cached responses overlapping a range of data.
+ * Can be called from any thread.
+ * @param cache pointer to the nmbs_response_cache instance
+ * @param fc function code reading the changed data, 1 to 4
+ * @param address address of the first changed coil/register
+ * @param quantity quantity of changed coils/registers
+ */
+void nmbs_response_cache_invalidate(nmbs_response_cache* cache, uint8_t fc, uint16_t address, uint16_t quantity);
 
-        uint8_t unit_id;
-        uint8_t fc;
-        uint16_t transaction_id;
-        bool broadcast;
-        bool ignored;
-    } msg;
+/** Invalidate all the cached responses.
+ * Can be called from any thread.
+ * @param cache pointer to the nmbs_response_cache instance
+ */
+void nmbs_response_cache_invalidate_all(nmbs_response_cache* cache);
+
+/** Create a new nmbs_change_log.
+ * @param log pointer to the nmbs_change_log instance
+ * @param entries array of entries used by the log. It must outlive the log
+ * @param size count of entries in the array. One entry is kept free, so up to size - 1 changes can be pending
+ * @param notify optional function called by the server after a change is appended, e.g. to write to an eventfd or
+ * signal a semaphore, so the consumer can wait for changes instead of polling. Can be NULL
+ * @param notify_arg user data passed to notify
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_change_log_create(nmbs_change_log* log, nmbs_change* entries, uint32_t size,
+                                  void (*notify)(void* arg), void* notify_arg);
+
+/** Drain the pending changes of a nmbs_change_log.
+ * Consecutive changes of the same type, unit ID and file, with overlapping or adjacent ranges, are merged.
+ * @param log pointer to the nmbs_change_log instance
+ * @param changes_out array where the changes will be stored
+ * @param changes_count size of changes_out. Changes not fitting in it stay pending
+ * @param overflow_out set to true if some changes were dropped since the last call because the log was full. In that
+ * case the whole data set should be considered changed. Can be NULL
+ *
+ * @return count of changes stored in changes_out.
+ */
+uint32_t nmbs_change_log_drain(nmbs_change_log* log, nmbs_change* changes_out, uint32_t changes_count,
+                               bool* overflow_out);
 
-    nmbs_callbacks callbacks;
+/** Create a new nmbs_fifo_queue.
+ * @param queue pointer to the nmbs_fifo_queue instance
+ * @param values array of values used by the queue. It must outlive the queue
+ * @param size count of values in the array. One value is kept free, so up to size - 1 values can be queued
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_fifo_queue_create(nmbs_fifo_queue* queue, uint16_t* values, uint32_t size);
 
-    int32_t byte_timeout_ms;
-    int32_t read_timeout_ms;
+/** Append a value to a nmbs_fifo_queue. Only to be called by the producer.
+ * @param queue pointer to the nmbs_fifo_queue instance
+ * @param value value to append
+ *
+ * @return true if successful, false if the queue was full. Values not appended are counted, see
+ * nmbs_fifo_queue_dropped().
+ */
+bool nmbs_fifo_queue_push(nmbs_fifo_queue* queue, uint16_t value);
 
-    nmbs_platform_conf platform;
+/** Remove the oldest values of a nmbs_fifo_queue. Only to be called by the consumer.
+ * A read_fifo_queue server callback can pop up to NMBS_FIFO_COUNT_MAX values straight into its values_out array.
+ * @param queue pointer to the nmbs_fifo_queue instance
+ * @param values_out array where the values will be stored
+ * @param count maximum count of values to remove
+ *
+ * @return count of values stored in values_out.
+ */
+uint32_t nmbs_fifo_queue_pop(nmbs_fifo_queue* queue, uint16_t* values_out, uint32_t count);
 
-    uint8_t address_rtu;
-    uint8_t dest_address_rtu;
-    uint16_t current_tid;
-} nmbs_t;
+/** Count the values queued in a nmbs_fifo_queue.
+ * @param queue pointer to the nmbs_fifo_queue instance
+ *
+ * @return count of queued values.
+ */
+uint32_t nmbs_fifo_queue_count(const nmbs_fifo_queue* queue);
 
-/**
- * Modbus broadcast address. Can be passed to nmbs_set_destination_rtu_address().
+/** Count the values dropped by nmbs_fifo_queue_push() because the queue was full.
+ * @param queue pointer to the nmbs_fifo_queue instance
+ *
+ * @return count of dropped values since the queue was created.
  */
-static const uint8_t NMBS_BROADCAST_ADDRESS = 0;
+uint32_t nmbs_fifo_queue_dropped(const nmbs_fifo_queue* queue);
 
-/** Set the request/response timeout.
- * If the target instance is a server, sets the timeout of the nmbs_server_poll() function.
- * If the target instance is a client, sets the response timeout after sending a request. In case of timeout,
- * the called method will return NMBS_ERROR_TIMEOUT.
- * @param nmbs pointer to the nmbs_t instance
- * @param timeout_ms timeout in milliseconds. If < 0, the timeout is disabled.
+/** Create a new nmbs_buffer_pool.
+ * @param pool pointer to the nmbs_buffer_pool instance
+ * @param buffers array of buffers managed by the pool. It must outlive the pool
+ * @param count count of buffers in the array, up to 0xFFFE
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
  */
-void nmbs_set_read_timeout(nmbs_t* nmbs, int32_t timeout_ms);
+nmbs_error nmbs_buffer_pool_create(nmbs_buffer_pool* pool, nmbs_pool_buffer* buffers, uint16_t count);
 
-/** Set the timeout between the reception/transmission of two consecutive bytes.
- * @param nmbs pointer to the nmbs_t instance
- * @param timeout_ms timeout in milliseconds. If < 0, the timeout is disabled.
+/** Take a message buffer from a nmbs_buffer_pool. Can be called concurrently from multiple threads.
+ * @param pool pointer to the nmbs_buffer_pool instance
+ *
+ * @return a buffer of NMBS_MSG_BUF_SIZE bytes, or NULL if all the buffers are in use.
  */
-void nmbs_set_byte_timeout(nmbs_t* nmbs, int32_t timeout_ms);
+uint8_t* nmbs_buffer_pool_acquire(nmbs_buffer_pool* pool);
 
-/** Create a new nmbs_platform_conf struct.
- * @param platform_conf pointer to the nmbs_platform_conf instance
+/** Give back a message buffer to the nmbs_buffer_pool it was taken from. Can be called concurrently from multiple
+ * threads.
+ * @param pool pointer to the nmbs_buffer_pool instance
+ * @param buf buffer returned by nmbs_buffer_pool_acquire()
  */
-void nmbs_platform_conf_create(nmbs_platform_conf* platform_conf);
+void nmbs_buffer_pool_release(nmbs_buffer_pool* pool, uint8_t* buf);
 
-/** Set the pointer to user data argument passed to platform functions.
- * @param nmbs pointer to the nmbs_t instance
- * @param arg user data argument
+/** Read the counters of a nmbs_buffer_pool.
+ * @param pool pointer to the nmbs_buffer_pool instance
+ * @param stats_out where the counters will be stored
  */
-void nmbs_set_platform_arg(nmbs_t* nmbs, void* arg);
+void nmbs_buffer_pool_get_stats(const nmbs_buffer_pool* pool, nmbs_buffer_pool_stats* stats_out);
 
 #ifndef NMBS_SERVER_DISABLED
 /** Create a new nmbs_callbacks struct.
@@ -295,8 +1382,10 @@ void nmbs_callbacks_create(nmbs_callbacks* callbacks);
 /** Create a new Modbus server.
  * @param nmbs pointer to the nmbs_t instance where the client will be created.
  * @param address_rtu RTU address of this server. Can be 0 if transport is not RTU.
- * @param platform_conf nmbs_platform_conf struct with platform configuration. It may be discarded after calling this method.
- * @param callbacks nmbs_callbacks struct with server request callbacks. It may be discarded after calling this method.
+ * @param platform_conf nmbs_platform_conf struct with platform configuration. It may be discarded after calling this method,
+ * unless NMBS_COMPACT is defined.
+ * @param callbacks nmbs_callbacks struct with server request callbacks. It may be discarded after calling this method,
+ * unless NMBS_COMPACT is defined.
  *
  * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
  */
@@ -306,23 +1395,251 @@ nmbs_error nmbs_server_create(nmbs_t* nmbs, uint8_t address_rtu, const nmbs_plat
 /** Handle incoming requests to the server.
  * This function should be called in a loop in order to serve any incoming request. Its maximum duration, in case of no
  * received request, is the value set with nmbs_set_read_timeout() (unless set to < 0).
+ * On TCP with a receive buffer, every complete request already read ahead is handled before returning, so callers
+ * waiting on the transport with select() or epoll do not leave requests unanswered in the buffer.
  * @param nmbs pointer to the nmbs_t instance
  *
  * @return NMBS_ERROR_NONE if successful, other errors otherwise.
  */
 nmbs_error nmbs_server_poll(nmbs_t* nmbs);
 
+#ifndef NMBS_SERVER_DIAGNOSTICS_DISABLED
+/** Get the communication counters of a server, also readable by clients with FC 08 Diagnostics requests.
+ * Only available when NMBS_SERVER_DIAGNOSTICS_DISABLED is not defined.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param counters_out where the counters will be stored
+ */
+void nmbs_server_get_diagnostics(const nmbs_t* nmbs, nmbs_diagnostic_counters* counters_out);
+#endif
+
 /** Set the pointer to user data argument passed to server request callbacks.
  * @param nmbs pointer to the nmbs_t instance
  * @param arg user data argument
  */
 void nmbs_set_callbacks_arg(nmbs_t* nmbs, void* arg);
+
+#ifndef NMBS_SERVER_DATA_STORES_DISABLED
+/** Set a nmbs_bitfield_65536 the server will read/write coils from/to.
+ * It is used to serve FC 01, 05 and 15 requests when the respective callbacks are not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param coils bitfield holding the coils values. NULL to disable.
+ */
+void nmbs_set_coils_bitfield(nmbs_t* nmbs, nmbs_bitfield_65536 coils);
+
+/** Set a nmbs_bitfield_65536 the server will read discrete inputs from.
+ * It is used to serve FC 02 requests when the read_discrete_inputs callback is not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param discrete_inputs bitfield holding the discrete inputs values. NULL to disable.
+ */
+void nmbs_set_discrete_inputs_bitfield(nmbs_t* nmbs, nmbs_bitfield_65536 discrete_inputs);
+
+/** Set a nmbs_register_store the server will read/write holding registers from/to.
+ * It is used to serve FC 03, 06, 16, 22 and 23 requests when the respective callbacks are not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param store register store holding the holding registers values. NULL to disable.
+ */
+void nmbs_set_holding_registers_store(nmbs_t* nmbs, nmbs_register_store* store);
+
+/** Set a nmbs_register_store the server will read input registers from.
+ * It is used to serve FC 04 requests when the read_input_registers callback is not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param store register store holding the input registers values. NULL to disable.
+ */
+void nmbs_set_input_registers_store(nmbs_t* nmbs, nmbs_register_store* store);
+
+/** Set a nmbs_snapshot_store the server will read/write holding registers from/to.
+ * It is used to serve FC 03, 06, 16, 22 and 23 requests when the respective callbacks are not set, and takes precedence
+ * over the store set with nmbs_set_holding_registers_store(). Each request reads from a single pinned version.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param store snapshot store holding the holding registers values. NULL to disable.
+ */
+void nmbs_set_holding_registers_snapshot_store(nmbs_t* nmbs, nmbs_snapshot_store* store);
+
+/** Set a nmbs_snapshot_store the server will read input registers from.
+ * It is used to serve FC 04 requests when the read_input_registers callback is not set, and takes precedence over the
+ * store set with nmbs_set_input_registers_store(). Each request reads from a single pinned version.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param store snapshot store holding the input registers values. NULL to disable.
+ */
+void nmbs_set_input_registers_snapshot_store(nmbs_t* nmbs, nmbs_snapshot_store* store);
+
+/** Set a register image the server will serve coils, discrete inputs, holding and input registers from.
+ * Replaces the bitfields and register stores set with the other setters. The data is only used for the function codes
+ * whose callbacks are not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param image image attached with nmbs_image_attach(). NULL to disable.
+ */
+void nmbs_set_image(nmbs_t* nmbs, nmbs_image* image);
+
+/** Set a nmbs_response_cache the server will serve matching read requests from.
+ * A cache can only be used by a single server.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param cache response cache. NULL to disable.
+ */
+void nmbs_set_response_cache(nmbs_t* nmbs, nmbs_response_cache* cache);
+
+/** Set a nmbs_change_log the server will append the ranges changed by write requests to.
+ * Changes are appended after the data has been successfully written, either by callbacks or to the server data.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param log change log. NULL to disable.
+ */
+void nmbs_set_change_log(nmbs_t* nmbs, nmbs_change_log* log);
+#endif
+
+#if !defined(NMBS_SERVER_GET_COMM_EVENT_COUNTER_DISABLED) || !defined(NMBS_SERVER_GET_COMM_EVENT_LOG_DISABLED)
+/** Create a new, empty nmbs_comm_event_log.
+ * @param log pointer to the nmbs_comm_event_log instance
+ */
+void nmbs_comm_event_log_create(nmbs_comm_event_log* log);
+
+/** Set the nmbs_comm_event_log of a server, used to serve FC 11 and FC 12 requests.
+ * The event counter counts the requests handled without an exception, FC 11 requests excluded. It is cleared with the
+ * log message count by FC 08 Clear Counters requests.
+ * FC 11 also needs the log, so its pointer is only removed from nmbs_t when both FC 11 and FC 12 are disabled.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param log communication event log. NULL to disable.
+ */
+void nmbs_set_comm_event_log(nmbs_t* nmbs, nmbs_comm_event_log* log);
+#endif
+
+/** Create a new nmbs_fc_table, with no handlers.
+ * @param table pointer to the nmbs_fc_table instance
+ */
+void nmbs_fc_table_create(nmbs_fc_table* table);
+
+/** Register the handler of a custom function code in a nmbs_fc_table.
+ * Function codes implemented by the library are always handled by it, their handlers in the table are never called.
+ * @param table pointer to the nmbs_fc_table instance
+ * @param fc function code, from 1 to 127
+ * @param handler function code handler, or NULL to remove it
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_fc_table_set(nmbs_fc_table* table, uint8_t fc, nmbs_fc_handler handler);
+
+#ifndef NMBS_SERVER_READ_DEVICE_IDENTIFICATION_DISABLED
+/** Create a new nmbs_device_identification, encoding the objects and the FC 43 / 14 response segments.
+ * @param devid pointer to the nmbs_device_identification instance
+ * @param values objects, sorted by increasing ID. Basic objects 0x00 - 0x02 are mandatory, regular objects can have
+ * IDs 0x03 - 0x06 and extended objects 0x80 - 0xFF. Values can be up to NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH - 1
+ * characters long. They can be discarded after calling this method
+ * @param count count of objects in values
+ * @param objects array of count nmbs_device_identification_object. It must outlive devid
+ * @param buf buffer where the objects will be encoded. It needs 2 bytes more than the length of each value. It must
+ * outlive devid
+ * @param buf_size size of buf
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_device_identification_create(nmbs_device_identification* devid,
+                                             const nmbs_device_identification_value* values, uint16_t count,
+                                             nmbs_device_identification_object* objects, uint8_t* buf,
+                                             uint16_t buf_size);
+
+/** Set the device identification objects the server will serve FC 43 / 14 requests from.
+ * It is used when the read_device_identification and read_device_identification_map callbacks are not set.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param devid device identification objects. NULL to disable.
+ */
+void nmbs_set_device_identification(nmbs_t* nmbs, const nmbs_device_identification* devid);
+#endif
+
+#ifndef NMBS_PIPELINING_DISABLED
+/** Set a transmit buffer to process pipelined requests and coalesce their responses. Only used on TCP, together with a
+ * receive buffer set with nmbs_set_rx_buffer().
+ * nmbs_server_poll() then handles every complete request already in the receive buffer, in order, and sends all their
+ * responses with a single call to the platform write function. Responses are written as soon as the next one would not
+ * fit in the buffer.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param buf transmit buffer of at least NMBS_MSG_BUF_SIZE bytes, or NULL to send every response on its own
+ * @param size size of the transmit buffer in bytes
+ */
+void nmbs_set_tx_buffer(nmbs_t* nmbs, uint8_t* buf, uint16_t size);
+#endif
+
+#ifndef NMBS_SERVER_DEFERRED_DISABLED
+/** Defer the response to the request being handled. To be called from a server callback, whose return value it is:
+ * `return nmbs_server_defer(nmbs, &token);`
+ * nmbs_server_poll() then moves on without responding, and the response is sent when the token is completed with one of
+ * the nmbs_server_complete_*() functions, with the transaction ID of the request. Responses of requests deferred on
+ * a TCP connection can be completed in any order.
+ * Supported by the read and write callbacks of FC 01, 02, 03, 04, 05, 06, 15 and 16. Other callbacks returning
+ * NMBS_ERROR_RESPONSE_DEFERRED respond with NMBS_EXCEPTION_SERVER_DEVICE_FAILURE.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param token where the request is saved. It has to stay valid until completed.
+ *
+ * @return NMBS_ERROR_RESPONSE_DEFERRED
+ */
+nmbs_error nmbs_server_defer(nmbs_t* nmbs, nmbs_deferred* token);
+
+/** Whether a deferred request is still waiting for its response.
+ * @param token deferred request
+ *
+ * @return true if the token has not been completed yet
+ */
+bool nmbs_deferred_is_pending(const nmbs_deferred* token);
+
+/** Send the response to a deferred FC 01 or 02 request. Not thread-safe with nmbs_server_poll() on the same instance.
+ * The nmbs_server_complete_*() functions build the response in the message buffer of the instance, so they have to be
+ * called outside of nmbs_server_poll(), and not from server callbacks.
+ * @param nmbs pointer to the nmbs_t instance the request was received on
+ * @param token deferred request
+ * @param bits coils or discrete inputs read, starting from the address of the request
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the token is not a pending FC 01 or 02
+ * request or if called from a server callback, other errors on transport failures
+ */
+nmbs_error nmbs_server_complete_bits(nmbs_t* nmbs, nmbs_deferred* token, const nmbs_bitfield bits);
+
+/** Send the response to a deferred FC 03 or 04 request. Not thread-safe with nmbs_server_poll() on the same instance.
+ * @param nmbs pointer to the nmbs_t instance the request was received on
+ * @param token deferred request
+ * @param registers registers read, starting from the address of the request
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the token is not a pending FC 03 or 04
+ * request or if called from a server callback, other errors on transport failures
+ */
+nmbs_error nmbs_server_complete_registers(nmbs_t* nmbs, nmbs_deferred* token, const uint16_t* registers);
+
+/** Send the response to a deferred FC 05, 06, 15 or 16 request, once the write has been carried out. Not thread-safe
+ * with nmbs_server_poll() on the same instance.
+ * @param nmbs pointer to the nmbs_t instance the request was received on
+ * @param token deferred request
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the token is not a pending write request or
+ * if called from a server callback, other errors on transport failures
+ */
+nmbs_error nmbs_server_complete_write(nmbs_t* nmbs, nmbs_deferred* token);
+
+/** Send an exception response to a deferred request. Not thread-safe with nmbs_server_poll() on the same instance.
+ * @param nmbs pointer to the nmbs_t instance the request was received on
+ * @param token deferred request
+ * @param exception Modbus exception
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the token is not pending or if called from a
+ * server callback, other errors on transport failures
+ */
+nmbs_error nmbs_server_complete_exception(nmbs_t* nmbs, nmbs_deferred* token, nmbs_error exception);
+#endif
+
+#ifdef NMBS_COMPACT
+/** Set the nmbs_buffer_pool the server borrows its message buffer from. Only available when NMBS_COMPACT is defined.
+ * nmbs_server_poll() takes a buffer when the first byte of a request arrives, and gives it back once the response has
+ * been sent, so idle instances don't hold one.
+ * When the pool is exhausted, nmbs_server_poll() returns NMBS_ERROR_BUFFER_POOL_EXHAUSTED and stops reading from the
+ * transport. The byte already received is kept, and the request is handled by a later call.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param pool buffer pool. NULL to stop using a pool, nmbs_set_buffer() has to be called again afterwards.
+ */
+void nmbs_set_buffer_pool(nmbs_t* nmbs, nmbs_buffer_pool* pool);
+#endif
 #endif
 
 #ifndef NMBS_CLIENT_DISABLED
 /** Create a new Modbus client.
  * @param nmbs pointer to the nmbs_t instance where the client will be created.
- * @param platform_conf nmbs_platform_conf struct with platform configuration. It may be discarded after calling this method.
+ * @param platform_conf nmbs_platform_conf struct with platform configuration. It may be discarded after calling this method,
+ * unless NMBS_COMPACT is defined.
  *
 * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
  */
@@ -334,6 +1651,49 @@ nmbs_error nmbs_client_create(nmbs_t* nmbs, const nmbs_platform_conf* platform_c
  */
 void nmbs_set_destination_rtu_address(nmbs_t* nmbs, uint8_t address);
 
+#ifndef NMBS_PIPELINING_DISABLED
+/** Set the maximum count of requests the range functions, like nmbs_read_holding_registers_range(), keep in flight on
+ * TCP. Responses are matched to their requests by transaction ID, in any order, so a range split into depth chunks
+ * takes about a single round trip. The server must accept pipelined requests.
+ * When a request gets an exception, no more requests are sent, and the responses to the requests in flight are received
+ * before the exception is returned.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param depth maximum count of requests in flight. 0 and 1, the default, send the requests one at a time.
+ */
+void nmbs_set_pipeline_depth(nmbs_t* nmbs, uint8_t depth);
+#endif
+
+#ifndef NMBS_CLIENT_ADAPTIVE_TIMEOUTS_DISABLED
+/** Create adaptive timeouts, tracking the devices with unit IDs lower than devices_count.
+ * @param at pointer to the nmbs_adaptive_timeouts to create
+ * @param devices array of devices_count nmbs_device_timing, indexed by unit ID. It must outlive at
+ * @param devices_count count of devices, up to 256. Requests to other unit IDs use the read timeout of the instance
+ * @param clock_ms function returning a monotonic time in milliseconds. Its value may wrap around
+ * @param arg user data passed to clock_ms
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT otherwise.
+ */
+nmbs_error nmbs_adaptive_timeouts_create(nmbs_adaptive_timeouts* at, nmbs_device_timing* devices,
+                                         uint16_t devices_count, uint32_t (*clock_ms)(void* arg), void* arg);
+
+/** Set the adaptive timeouts of a client instance. Each request then waits for its response for the timeout of its
+ * destination unit ID, instead of the read timeout of the instance, and is not sent while its breaker is open.
+ * Requests sent by a nmbs_poll_scheduler wait for the shorter of this timeout and the timeout of their poll group.
+ * Response times are only measured for requests sent one at a time.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param at pointer to the nmbs_adaptive_timeouts, or NULL to use the read timeout of the instance again
+ */
+void nmbs_set_adaptive_timeouts(nmbs_t* nmbs, nmbs_adaptive_timeouts* at);
+
+/** Get the current timeout of a device.
+ * @param at pointer to the nmbs_adaptive_timeouts
+ * @param unit_id unit ID of the device
+ *
+ * @return the timeout of the device in milliseconds, -1 if its unit ID is not tracked.
+ */
+int32_t nmbs_adaptive_timeouts_get_timeout(const nmbs_adaptive_timeouts* at, uint8_t unit_id);
+#endif
+
 /** Send a FC 01 (0x01) Read Coils request
  * @param nmbs pointer to the nmbs_t instance
  * @param address starting address
@@ -392,6 +1752,46 @@ nmbs_error nmbs_write_single_coil(nmbs_t* nmbs, uint16_t address, bool value);
  */
 nmbs_error nmbs_write_single_register(nmbs_t* nmbs, uint16_t address, uint16_t value);
 
+/** Send a FC 07 (0x07) Read Exception Status
+ * @param nmbs pointer to the nmbs_t instance
+ * @param status_out the 8 exception status outputs of the server
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_read_exception_status(nmbs_t* nmbs, uint8_t* status_out);
+
+/** Send a FC 08 (0x08) Diagnostics request with a single data word
+ * @param nmbs pointer to the nmbs_t instance
+ * @param sub_function sub-function code, see nmbs_diagnostics_code
+ * @param data data word of the request, 0 for the counters sub-functions
+ * @param data_out data word of the response, e.g. the value of a counter. Can be NULL
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_diagnostics(nmbs_t* nmbs, uint16_t sub_function, uint16_t data, uint16_t* data_out);
+
+/** Send a FC 11 (0x0B) Get Comm Event Counter
+ * @param nmbs pointer to the nmbs_t instance
+ * @param status_out 0xFFFF if the server is still processing a previous command, 0 otherwise. Can be NULL
+ * @param event_count_out event counter of the server
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_get_comm_event_counter(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out);
+
+/** Send a FC 12 (0x0C) Get Comm Event Log
+ * @param nmbs pointer to the nmbs_t instance
+ * @param status_out 0xFFFF if the server is still processing a previous command, 0 otherwise. Can be NULL
+ * @param event_count_out event counter of the server. Can be NULL
+ * @param message_count_out count of messages received by the server. Can be NULL
+ * @param events_out array of NMBS_COMM_EVENT_LOG_SIZE bytes where the events will be stored, most recent first
+ * @param events_count_out count of events stored in events_out
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_get_comm_event_log(nmbs_t* nmbs, uint16_t* status_out, uint16_t* event_count_out,
+                                   uint16_t* message_count_out, uint8_t* events_out, uint8_t* events_count_out);
+
 /** Send a FC 15 (0x0F) Write Multiple Coils
  * @param nmbs pointer to the nmbs_t instance
  * @param address starting address
@@ -412,6 +1812,154 @@ nmbs_error nmbs_write_multiple_coils(nmbs_t* nmbs, uint16_t address, uint16_t qu
  */
 nmbs_error nmbs_write_multiple_registers(nmbs_t* nmbs, uint16_t address, uint16_t quantity, const uint16_t* registers);
 
+/** Read any range of coils with FC 01 (0x01) Read Coils requests of up to 2000 coils each.
+ * On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of coils (1 to 65536)
+ * @param coils_out bit array of (quantity + 7) / 8 bytes where the coils will be stored, in the nmbs_bitfield format.
+ * The bits past quantity in the last byte are cleared.
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, responses to the requests in flight may
+ * still arrive and fail the next request.
+ */
+nmbs_error nmbs_read_coils_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint8_t* coils_out);
+
+/** Read any range of discrete inputs with FC 02 (0x02) Read Discrete Inputs requests of up to 2000 inputs each.
+ * On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of inputs (1 to 65536)
+ * @param inputs_out bit array of (quantity + 7) / 8 bytes where the inputs will be stored, in the nmbs_bitfield
+ * format. The bits past quantity in the last byte are cleared.
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, responses to the requests in flight may
+ * still arrive and fail the next request.
+ */
+nmbs_error nmbs_read_discrete_inputs_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint8_t* inputs_out);
+
+/** Read any range of holding registers with FC 03 (0x03) Read Holding Registers requests of up to 125 registers each.
+ * On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of registers (1 to 65536)
+ * @param registers_out array where the registers will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, responses to the requests in flight may
+ * still arrive and fail the next request.
+ */
+nmbs_error nmbs_read_holding_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity,
+                                             uint16_t* registers_out);
+
+/** Read any range of input registers with FC 04 (0x04) Read Input Registers requests of up to 125 registers each.
+ * On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of registers (1 to 65536)
+ * @param registers_out array where the registers will be stored
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, responses to the requests in flight may
+ * still arrive and fail the next request.
+ */
+nmbs_error nmbs_read_input_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, uint16_t* registers_out);
+
+/** Write any range of coils with FC 15 (0x0F) Write Multiple Coils requests of up to 1968 coils each.
+ * On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of coils (1 to 65536)
+ * @param coils bit array of (quantity + 7) / 8 bytes with the coils to write, in the nmbs_bitfield format
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, the chunks not yet acknowledged may or may
+ * not have been written.
+ */
+nmbs_error nmbs_write_multiple_coils_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity, const uint8_t* coils);
+
+/** Write any range of holding registers with FC 16 (0x10) Write Multiple Registers requests of up to 123 registers
+ * each. On TCP, up to the depth set with nmbs_set_pipeline_depth() requests are kept in flight.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address starting address
+ * @param quantity quantity of registers (1 to 65536)
+ * @param registers array of registers to write
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, the chunks not yet acknowledged may or may
+ * not have been written.
+ */
+nmbs_error nmbs_write_multiple_registers_range(nmbs_t* nmbs, uint16_t address, uint32_t quantity,
+                                               const uint16_t* registers);
+
+/** Set the default scan options for a transport: the largest quantities allowed by the protocol, and the frame cost of
+ * a request and response header, plus the silent intervals on RTU or the TCP/IP headers on TCP.
+ * Raise frame_cost to account for slow devices, by about (baud rate / 10000) bytes per millisecond of turnaround time.
+ * @param options pointer to the nmbs_scan_options to initialize
+ * @param transport transport the scan will be done on
+ */
+void nmbs_scan_options_create(nmbs_scan_options* options, nmbs_transport transport);
+
+/** Plan the requests reading a scan list.
+ * Points are sorted in place by unit ID, table and address. Then points of the same unit ID and table are merged
+ * into a single request, as long as it respects the max quantities of the options and each gap read through costs
+ * less than the frame cost of a separate request.
+ * Planning is meant to be done once, when the scan list is loaded. Plan the points of each device separately to use
+ * different options for them.
+ * @param plan pointer to the nmbs_scan_plan to create
+ * @param points array of points. It is sorted in place, and must outlive plan
+ * @param points_count count of points
+ * @param requests array where the requests of the plan are stored. It must outlive plan
+ * @param requests_length length of the requests array. points_count is always enough
+ * @param options limits and cost model of the plan
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if a point is invalid or exceeds the max
+ * quantities, or if the requests array is too short.
+ */
+nmbs_error nmbs_scan_plan_create(nmbs_scan_plan* plan, nmbs_scan_point* points, uint16_t points_count,
+                                 nmbs_scan_request* requests, uint16_t requests_length,
+                                 const nmbs_scan_options* options);
+
+/** Send the requests of a scan plan, decoding each response straight into the values of its points.
+ * Every request is sent, even after a failed one, and its result is stored in its error member. The destination
+ * address of the instance is restored when the scan is done.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param plan pointer to the nmbs_scan_plan
+ *
+ * @return NMBS_ERROR_NONE if every request succeeded, the error of the first failed request otherwise.
+ */
+nmbs_error nmbs_scan(nmbs_t* nmbs, const nmbs_scan_plan* plan);
+
+/** Create a poll scheduler. The first poll of every group is due in its first period, starting now.
+ * @param sched pointer to the nmbs_poll_scheduler to create
+ * @param nmbs pointer to the client nmbs_t instance the groups are polled with
+ * @param groups array of groups to poll. It must outlive sched
+ * @param groups_count count of groups
+ * @param heap array of groups_count pointers, where the scheduler keeps the groups ordered by due time. It must outlive
+ * sched
+ * @param clock_ms function returning a monotonic time in milliseconds. Its value may wrap around
+ * @param arg user data passed to clock_ms
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if a group has no plan or a period of 0.
+ */
+nmbs_error nmbs_poll_scheduler_create(nmbs_poll_scheduler* sched, nmbs_t* nmbs, nmbs_poll_group* groups,
+                                      uint16_t groups_count, nmbs_poll_group** heap, uint32_t (*clock_ms)(void* arg),
+                                      void* arg);
+
+/** Send the next request of the poll with the earliest deadline among the ones whose period started.
+ * Call it in a loop, waiting wait_ms_out milliseconds between calls when it's not 0.
+ * @param sched pointer to the nmbs_poll_scheduler
+ * @param wait_ms_out time until the next period start, when no poll is due. 0 when a request was sent
+ *
+ * @return the result of the request sent, NMBS_ERROR_NONE if no request was sent. Errors are also counted in the
+ * statistics of the group.
+ */
+nmbs_error nmbs_poll_scheduler_run(nmbs_poll_scheduler* sched, uint32_t* wait_ms_out);
+
+/** Get the bus utilization achieved by a poll scheduler, as the time spent in requests since it was created.
+ * @param sched pointer to the nmbs_poll_scheduler
+ * @param busy_ms_out time spent sending requests and waiting for their responses
+ * @param elapsed_ms_out time elapsed since the scheduler was created
+ */
+void nmbs_poll_scheduler_get_utilization(const nmbs_poll_scheduler* sched, uint32_t* busy_ms_out,
+                                         uint32_t* elapsed_ms_out);
+
 /** Send a FC 20 (0x14) Read File Record
  * @param nmbs pointer to the nmbs_t instance
  * @param file_number file number (1 to 65535)
@@ -424,6 +1972,18 @@ nmbs_error nmbs_write_multiple_registers(nmbs_t* nmbs, uint16_t address, uint16_
 nmbs_error nmbs_read_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number, uint16_t* registers,
                                  uint16_t count);
 
+/** Read many record ranges with as few FC 20 (0x14) Read File Record requests as possible.
+ * The ranges are packed as sub-requests into each request until its response would exceed the maximum PDU size.
+ * Ranges longer than a single sub-request are split over consecutive sub-requests, and over several requests if needed.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param records array of record ranges to read, each into its registers array
+ * @param records_count count of record ranges
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, the ranges of the requests sent before the
+ * failed one have been read.
+ */
+nmbs_error nmbs_read_file_records(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count);
+
 /** Send a FC 21 (0x15) Write File Record
  * @param nmbs pointer to the nmbs_t instance
  * @param file_number file number (1 to 65535)
@@ -436,6 +1996,30 @@ nmbs_error nmbs_read_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t re
 nmbs_error nmbs_write_file_record(nmbs_t* nmbs, uint16_t file_number, uint16_t record_number, const uint16_t* registers,
                                   uint16_t count);
 
+/** Write many record ranges with as few FC 21 (0x15) Write File Record requests as possible.
+ * The ranges are packed as sub-requests into each request until it would exceed the maximum PDU size, and every
+ * response is checked to echo its request. Ranges are split over several sub-requests and requests if needed.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param records array of record ranges to write, each from its registers array
+ * @param records_count count of record ranges
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise. On error, the ranges of the requests sent before the
+ * failed one have been written.
+ */
+nmbs_error nmbs_write_file_records(nmbs_t* nmbs, const nmbs_file_record* records, uint16_t records_count);
+
+/** Send a FC 22 (0x16) Mask Write Register
+ * The server sets the register to (current AND and_mask) OR (or_mask AND NOT and_mask), changing single bits in one
+ * request instead of a read followed by a write.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address register address
+ * @param and_mask bits to keep from the current value
+ * @param or_mask bits to set among the ones not kept
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_mask_write_register(nmbs_t* nmbs, uint16_t address, uint16_t and_mask, uint16_t or_mask);
+
 /** Send a FC 23 (0x17) Read Write Multiple registers
  * @param nmbs pointer to the nmbs_t instance
  * @param read_address starting read address
@@ -451,6 +2035,32 @@ nmbs_error nmbs_read_write_registers(nmbs_t* nmbs, uint16_t read_address, uint16
                                      uint16_t* registers_out, uint16_t write_address, uint16_t write_quantity,
                                      const uint16_t* registers);
 
+/** Send a FC 24 (0x18) Read FIFO Queue
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address FIFO pointer address
+ * @param values_out array where the queued values will be stored, up to NMBS_FIFO_COUNT_MAX
+ * @param count_out count of values stored in values_out
+ *
+ * @return NMBS_ERROR_NONE if successful, other errors otherwise.
+ */
+nmbs_error nmbs_read_fifo_queue(nmbs_t* nmbs, uint16_t address, uint16_t values_out[NMBS_FIFO_COUNT_MAX],
+                                uint8_t* count_out);
+
+/** Drain a FIFO queue with consecutive FC 24 (0x18) Read FIFO Queue requests.
+ * Requests are sent until one returns less than NMBS_FIFO_COUNT_MAX values, meaning the server has emptied the
+ * queue, or until less than NMBS_FIFO_COUNT_MAX values would fit in values_out.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param address FIFO pointer address
+ * @param values_out array where the queued values will be stored, in order
+ * @param count size of values_out, at least NMBS_FIFO_COUNT_MAX
+ * @param count_out count of values stored in values_out, also set when an error is returned
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if count is less than NMBS_FIFO_COUNT_MAX, other
+ * errors otherwise.
+ */
+nmbs_error nmbs_drain_fifo_queue(nmbs_t* nmbs, uint16_t address, uint16_t* values_out, uint32_t count,
+                                 uint32_t* count_out);
+
 /** Send a FC 43 / 14 (0x2B / 0x0E) Read Device Identification to read all Basic Object Id values (Read Device ID code 1)
  * @param nmbs pointer to the nmbs_t instance
  * @param vendor_name char array where the read VendorName value will be stored
@@ -492,6 +2102,26 @@ nmbs_error nmbs_read_device_identification_extended(nmbs_t* nmbs, uint8_t object
                                                     uint8_t ids_length, uint8_t buffer_length,
                                                     uint8_t* objects_count_out);
 
+/** Read all the device identification objects of a stream access category, starting from object_id_start.
+ * FC 43 / 14 (0x2B / 0x0E) requests are sent until the server reports no more objects follow. Every value is copied
+ * straight from the response into the arena, null-terminated, so the memory used is bounded by the caller.
+ * Continuation requests depend on the next Object Id of the previous response, so they are never pipelined.
+ * @param nmbs pointer to the nmbs_t instance
+ * @param read_device_id_code stream access category: 1 for basic, 2 for regular, 3 for extended objects
+ * @param object_id_start Object Id to start reading from
+ * @param entries array where the read objects will be stored, in the order they were received
+ * @param entries_length length of the entries array
+ * @param arena buffer where the object values will be stored
+ * @param arena_size size of the arena buffer
+ * @param entries_count_out retrieved objects count. Can be NULL
+ *
+ * @return NMBS_ERROR_NONE if successful, NMBS_ERROR_INVALID_ARGUMENT if the entries or the arena can't hold all the
+ * retrieved objects, other errors otherwise.
+ */
+nmbs_error nmbs_read_device_identification_objects(nmbs_t* nmbs, uint8_t read_device_id_code, uint8_t object_id_start,
+                                                   nmbs_device_identification_entry* entries, uint16_t entries_length,
+                                                   char* arena, uint16_t arena_size, uint16_t* entries_count_out);
+
 /** Send a FC 43 / 14 (0x2B / 0x0E) Read Device Identification to retrieve a single Object Id value (Read Device ID code 4)
  * @param nmbs pointer to the nmbs_t instance
  * @param object_id requested Object Id
@@ -130,6 +130,10 @@ void test_server_receive_base(nmbs_transport transport) {
     err = nmbs_server_create(&server, TEST_SERVER_ADDR, &platform_conf, &callbacks_empty);
     check(err);
 
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&server, server_buf);
+#endif
+
     nmbs_set_read_timeout(&server, read_timeout_ms);
     nmbs_set_byte_timeout(&server, -1);
 
@@ -156,6 +160,10 @@ void test_server_receive_base(nmbs_transport transport) {
     err = nmbs_server_create(&server, TEST_SERVER_ADDR, &platform_conf, &callbacks_empty);
     check(err);
 
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&server, server_buf);
+#endif
+
     nmbs_set_read_timeout(&server, 1000);
     nmbs_set_byte_timeout(&server, byte_timeout_ms);
 
@@ -355,6 +363,8 @@ nmbs_error read_registers(uint16_t address, uint16_t quantity, uint16_t* registe
     if (check_user_data(arg) != 1)
         return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
 
+    expect(((uintptr_t) registers_out & 1) == 0);
+
     if (address == 1)
         return -1;
 
@@ -651,6 +661,263 @@ void test_fc6(nmbs_transport transport) {
 }
 
 
+nmbs_error read_exception_status(uint8_t* status_out, uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(unit_id);
+
+    if (check_user_data(arg) != 1)
+        return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
+
+    *status_out = 0x6D;
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_fc7(nmbs_transport transport) {
+    uint8_t status = 0;
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION when callback is not registered server-side");
+    expect(nmbs_read_exception_status(&CLIENT, &status) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    stop_client_and_server();
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_exception_status = read_exception_status;
+
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_callbacks_arg(&SERVER, (void*) &callbacks_user_data);
+
+    should("read the exception status");
+    check(nmbs_read_exception_status(&CLIENT, &status));
+    expect(status == 0x6D);
+
+    should("accept a NULL status");
+    check(nmbs_read_exception_status(&CLIENT, NULL));
+
+    stop_client_and_server();
+}
+
+
+void test_fc8(nmbs_transport transport) {
+    uint16_t data = 0;
+    uint16_t regs[1];
+    nmbs_diagnostic_counters counters;
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("echo the query data");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0xA537, &data));
+    expect(data == 0xA537);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION for unsupported sub-functions");
+    expect(nmbs_diagnostics(&CLIENT, 0x01, 0, NULL) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    should("clear the counters");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_CLEAR_COUNTERS, 0, NULL));
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_BUS_EXCEPTION_ERROR_COUNT, 0, &data));
+    expect(data == 0);
+
+    should("count the messages received");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_BUS_MESSAGE_COUNT, 0, &data));
+    expect(data == 2);
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT, 0, &data));
+    expect(data == 3);
+
+    should("count the exception responses sent");
+    expect(nmbs_read_holding_registers(&CLIENT, 0, 1, regs) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_BUS_EXCEPTION_ERROR_COUNT, 0, &data));
+    expect(data == 1);
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("count the broadcast requests as not answered");
+        nmbs_set_destination_rtu_address(&CLIENT, NMBS_BROADCAST_ADDRESS);
+        check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+        nmbs_set_destination_rtu_address(&CLIENT, TEST_SERVER_ADDR);
+
+        check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_NO_RESPONSE_COUNT, 0, &data));
+        expect(data == 1);
+    }
+
+    should("return the same counters locally");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT, 0, &data));
+    stop_client_and_server();
+
+    nmbs_server_get_diagnostics(&SERVER, &counters);
+    expect(counters.server_messages == data);
+    expect(counters.exceptions == 1);
+    expect(counters.overruns == 0);
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("count the messages received with a CRC error");
+        uint8_t frame[] = {TEST_SERVER_ADDR, 3, 0, 0, 0, 1, 0, 0};
+        uint16_t crc = nmbs_crc_calc(frame, 6, NULL);
+        frame[6] = (uint8_t) (crc >> 8);
+        frame[7] = (uint8_t) ~crc;
+        expect(write_fd(sockets[1], frame, sizeof(frame), 1000) == sizeof(frame));
+
+        expect(nmbs_server_poll(&SERVER) == NMBS_ERROR_CRC);
+        nmbs_server_get_diagnostics(&SERVER, &counters);
+        expect(counters.bus_errors == 1);
+        expect(counters.server_messages == data);
+
+        should("count the requests to other devices and their responses only as bus messages");
+        uint8_t other[] = {TEST_SERVER_ADDR + 1, 3, 0, 0, 0, 1, 0, 0, TEST_SERVER_ADDR + 1, 3, 2, 0x12, 0x34, 0, 0};
+        crc = nmbs_crc_calc(other, 6, NULL);
+        other[6] = (uint8_t) (crc >> 8);
+        other[7] = (uint8_t) crc;
+        crc = nmbs_crc_calc(other + 8, 5, NULL);
+        other[13] = (uint8_t) (crc >> 8);
+        other[14] = (uint8_t) crc;
+        expect(write_fd(sockets[1], other, sizeof(other), 1000) == sizeof(other));
+
+        uint16_t bus_messages = counters.bus_messages;
+        check(nmbs_server_poll(&SERVER));
+        nmbs_server_get_diagnostics(&SERVER, &counters);
+        expect(counters.bus_messages == bus_messages + 2);
+        expect(counters.server_messages == data);
+    }
+}
+
+
+void test_fc11(nmbs_transport transport) {
+    uint16_t status = 0xFFFF;
+    uint16_t event_count = 0xFFFF;
+    uint16_t regs[1];
+    nmbs_comm_event_log log;
+    nmbs_comm_event_log_create(&log);
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION when no comm event log is set server-side");
+    expect(nmbs_get_comm_event_counter(&CLIENT, &status, &event_count) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    nmbs_set_comm_event_log(&SERVER, &log);
+
+    should("not count its own requests");
+    check(nmbs_get_comm_event_counter(&CLIENT, &status, &event_count));
+    expect(status == 0);
+    expect(event_count == 0);
+
+    should("count the successfully completed requests");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+    check(nmbs_get_comm_event_counter(&CLIENT, NULL, &event_count));
+    expect(event_count == 2);
+
+    should("not count the requests answered with an exception");
+    expect(nmbs_read_holding_registers(&CLIENT, 0, 1, regs) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+    check(nmbs_get_comm_event_counter(&CLIENT, NULL, &event_count));
+    expect(event_count == 2);
+
+    should("be reset by a Diagnostics Clear Counters request");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_CLEAR_COUNTERS, 0, NULL));
+    check(nmbs_get_comm_event_counter(&CLIENT, NULL, &event_count));
+    expect(event_count == 1);
+
+    stop_client_and_server();
+}
+
+
+void test_fc12(nmbs_transport transport) {
+    uint16_t status = 0xFFFF;
+    uint16_t event_count = 0xFFFF;
+    uint16_t message_count = 0xFFFF;
+    uint8_t events[NMBS_COMM_EVENT_LOG_SIZE];
+    uint8_t events_count = 0;
+    uint16_t regs[1];
+    nmbs_comm_event_log log;
+    nmbs_comm_event_log_create(&log);
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION when no comm event log is set server-side");
+    expect(nmbs_get_comm_event_log(&CLIENT, NULL, NULL, NULL, events, &events_count) ==
+           NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    nmbs_set_comm_event_log(&SERVER, &log);
+
+    should("return the events most recent first");
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+    expect(nmbs_read_holding_registers(&CLIENT, 0, 1, regs) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+    check(nmbs_get_comm_event_log(&CLIENT, &status, &event_count, &message_count, events, &events_count));
+    expect(status == 0);
+    expect(event_count == 1);
+    expect(message_count == 3);
+    expect(events_count == 5);
+    expect(events[0] == NMBS_COMM_EVENT_RECEIVE);
+    expect(events[1] == (NMBS_COMM_EVENT_SEND | NMBS_COMM_EVENT_SEND_READ_EXCEPTION));
+    expect(events[2] == NMBS_COMM_EVENT_RECEIVE);
+    expect(events[3] == NMBS_COMM_EVENT_SEND);
+    expect(events[4] == NMBS_COMM_EVENT_RECEIVE);
+
+    should("keep only the most recent events");
+    for (int i = 0; i < NMBS_COMM_EVENT_LOG_SIZE; i++)
+        check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+
+    check(nmbs_get_comm_event_log(&CLIENT, NULL, &event_count, &message_count, events, &events_count));
+    expect(events_count == NMBS_COMM_EVENT_LOG_SIZE);
+    expect(event_count == 2 + NMBS_COMM_EVENT_LOG_SIZE);
+    expect(message_count == 4 + NMBS_COMM_EVENT_LOG_SIZE);
+    expect(events[0] == NMBS_COMM_EVENT_RECEIVE);
+    expect(events[1] == NMBS_COMM_EVENT_SEND);
+    expect(events[NMBS_COMM_EVENT_LOG_SIZE - 1] == NMBS_COMM_EVENT_SEND);
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("log the broadcast requests without a send event");
+        nmbs_set_destination_rtu_address(&CLIENT, NMBS_BROADCAST_ADDRESS);
+        check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_RETURN_QUERY_DATA, 0, NULL));
+        nmbs_set_destination_rtu_address(&CLIENT, TEST_SERVER_ADDR);
+
+        check(nmbs_get_comm_event_log(&CLIENT, NULL, NULL, NULL, events, &events_count));
+        expect(events[0] == NMBS_COMM_EVENT_RECEIVE);
+        expect(events[1] == (NMBS_COMM_EVENT_RECEIVE | NMBS_COMM_EVENT_RECEIVE_BROADCAST));
+        expect(events[2] == NMBS_COMM_EVENT_SEND);
+    }
+
+    stop_client_and_server();
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("log the messages received with a CRC error");
+        uint8_t frame[] = {TEST_SERVER_ADDR, 3, 0, 0, 0, 1, 0, 0};
+        uint16_t crc = nmbs_crc_calc(frame, 6, NULL);
+        frame[6] = (uint8_t) (crc >> 8);
+        frame[7] = (uint8_t) ~crc;
+        expect(write_fd(sockets[1], frame, sizeof(frame), 1000) == sizeof(frame));
+
+        message_count = log.message_count;
+        expect(nmbs_server_poll(&SERVER) == NMBS_ERROR_CRC);
+        expect(log.message_count == message_count);
+        expect(log.events[(log.head + NMBS_COMM_EVENT_LOG_SIZE - 1) % NMBS_COMM_EVENT_LOG_SIZE] ==
+               (NMBS_COMM_EVENT_RECEIVE | NMBS_COMM_EVENT_RECEIVE_ERROR));
+
+        should("not log the requests to other devices and their responses");
+        uint8_t other[] = {TEST_SERVER_ADDR + 1, 3, 0, 0, 0, 1, 0, 0, TEST_SERVER_ADDR + 1, 3, 2, 0x12, 0x34, 0, 0};
+        crc = nmbs_crc_calc(other, 6, NULL);
+        other[6] = (uint8_t) (crc >> 8);
+        other[7] = (uint8_t) crc;
+        crc = nmbs_crc_calc(other + 8, 5, NULL);
+        other[13] = (uint8_t) (crc >> 8);
+        other[14] = (uint8_t) crc;
+        expect(write_fd(sockets[1], other, sizeof(other), 1000) == sizeof(other));
+
+        nmbs_comm_event_log_create(&log);
+        check(nmbs_server_poll(&SERVER));
+        expect(log.count == 0);
+        expect(log.message_count == 0 && log.event_count == 0);
+    }
+}
+
+
 nmbs_error write_coils(uint16_t address, uint16_t quantity, const nmbs_bitfield coils, uint8_t unit_id, void* arg) {
     UNUSED_PARAM(arg);
     UNUSED_PARAM(unit_id);
@@ -783,6 +1050,8 @@ nmbs_error write_registers(uint16_t address, uint16_t quantity, const uint16_t*
     if (check_user_data(arg) != 1)
         return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
 
+    expect(((uintptr_t) registers & 1) == 0);
+
     if (address == 1)
         return -1;
 
@@ -909,6 +1178,8 @@ nmbs_error read_file(uint16_t file_number, uint16_t record_number, uint16_t* reg
     if (check_user_data(arg) != 1)
         return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
 
+    expect(((uintptr_t) registers & 1) == 0);
+
     if (file_number == 1)
         return -1;
 
@@ -982,6 +1253,104 @@ void test_fc20(nmbs_transport transport) {
 }
 
 
+nmbs_error read_file_pattern(uint16_t file_number, uint16_t record_number, uint16_t* registers, uint16_t count,
+                             uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(arg);
+    UNUSED_PARAM(unit_id);
+
+    if (file_number == 9)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    for (uint16_t i = 0; i < count; i++)
+        registers[i] = (uint16_t) (file_number * 1000 + record_number + i);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+// Count of requests handled by the server since the last call, not counting the FC 08 requests used to count them
+uint16_t server_requests(void) {
+    static uint16_t last = 0;
+    uint16_t count = 0;
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT, 0, &count));
+
+    uint16_t requests = (uint16_t) (count - last - 1);
+    last = count;
+    return requests;
+}
+
+
+bool file_record_matches(const nmbs_file_record* record) {
+    for (uint16_t i = 0; i < record->count; i++) {
+        if (record->registers[i] != (uint16_t) (record->file_number * 1000 + record->record_number + i))
+            return false;
+    }
+
+    return true;
+}
+
+
+void test_fc20_batch(nmbs_transport transport) {
+    uint16_t registers[512];
+    nmbs_file_record records[40];
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_file_record = read_file_pattern;
+    start_client_and_server(transport, &callbacks);
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_CLEAR_COUNTERS, 0, NULL));
+    server_requests();
+
+    should("immediately return NMBS_ERROR_INVALID_ARGUMENT when calling with file_number 0");
+    records[0] = (nmbs_file_record){0, 0, registers, 1};
+    expect(nmbs_read_file_records(&CLIENT, records, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("immediately return NMBS_ERROR_INVALID_ARGUMENT when reading past record 9999");
+    records[0] = (nmbs_file_record){1, 9990, registers, 11};
+    expect(nmbs_read_file_records(&CLIENT, records, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(server_requests() == 0);
+
+    should("send no request for empty ranges");
+    records[0] = (nmbs_file_record){1, 0, NULL, 0};
+    check(nmbs_read_file_records(&CLIENT, records, 1));
+    check(nmbs_read_file_records(&CLIENT, NULL, 0));
+    expect(server_requests() == 0);
+
+    should("read scattered ranges with a single request");
+    for (uint16_t i = 0; i < 8; i++)
+        records[i] = (nmbs_file_record){(uint16_t) (1 + i % 3), (uint16_t) (i * 500), &registers[i * 12], 12};
+
+    memset(registers, 0, sizeof(registers));
+    check(nmbs_read_file_records(&CLIENT, records, 8));
+    expect(server_requests() == 1);
+    for (uint16_t i = 0; i < 8; i++)
+        expect(file_record_matches(&records[i]));
+
+    should("split ranges longer than a sub-request over several requests");
+    records[0] = (nmbs_file_record){4, 9000, registers, 300};
+    memset(registers, 0, sizeof(registers));
+    check(nmbs_read_file_records(&CLIENT, records, 1));
+    expect(server_requests() == 3);
+    expect(file_record_matches(&records[0]));
+
+    should("split the sub-requests over several requests when they don't fit in one");
+    for (uint16_t i = 0; i < 40; i++)
+        records[i] = (nmbs_file_record){(uint16_t) (1 + i % 5), (uint16_t) (i * 100), &registers[i * 2], 2};
+
+    memset(registers, 0, sizeof(registers));
+    check(nmbs_read_file_records(&CLIENT, records, 40));
+    expect(server_requests() == 2);
+    for (uint16_t i = 0; i < 40; i++)
+        expect(file_record_matches(&records[i]));
+
+    should("return the exception of the server");
+    records[0] = (nmbs_file_record){1, 0, registers, 4};
+    records[1] = (nmbs_file_record){9, 0, &registers[4], 4};
+    expect(nmbs_read_file_records(&CLIENT, records, 2) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    stop_client_and_server();
+}
+
+
 nmbs_error write_file(uint16_t file_number, uint16_t record_number, const uint16_t* registers, uint16_t count,
                       uint8_t unit_id, void* arg) {
     UNUSED_PARAM(arg);
@@ -990,6 +1359,8 @@ nmbs_error write_file(uint16_t file_number, uint16_t record_number, const uint16
     if (check_user_data(arg) != 1)
         return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
 
+    expect(((uintptr_t) registers & 1) == 0);
+
     if (file_number == 1)
         return -1;
 
@@ -1064,6 +1435,217 @@ void test_fc21(nmbs_transport transport) {
     stop_client_and_server();
 }
 
+
+uint32_t file_pattern_written = 0;
+
+
+nmbs_error write_file_pattern(uint16_t file_number, uint16_t record_number, const uint16_t* registers, uint16_t count,
+                              uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(arg);
+    UNUSED_PARAM(unit_id);
+
+    if (file_number == 9)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (registers[i] != (uint16_t) (file_number * 1000 + record_number + i))
+            return NMBS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    file_pattern_written += count;
+    return NMBS_ERROR_NONE;
+}
+
+
+void file_record_fill(const nmbs_file_record* record) {
+    for (uint16_t i = 0; i < record->count; i++)
+        record->registers[i] = (uint16_t) (record->file_number * 1000 + record->record_number + i);
+}
+
+
+void test_fc21_batch(nmbs_transport transport) {
+    uint16_t registers[512];
+    nmbs_file_record records[40];
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.write_file_record = write_file_pattern;
+    start_client_and_server(transport, &callbacks);
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_CLEAR_COUNTERS, 0, NULL));
+    server_requests();
+    file_pattern_written = 0;
+
+    should("immediately return NMBS_ERROR_INVALID_ARGUMENT when calling with file_number 0");
+    records[0] = (nmbs_file_record){0, 0, registers, 1};
+    expect(nmbs_write_file_records(&CLIENT, records, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("immediately return NMBS_ERROR_INVALID_ARGUMENT when writing past record 9999");
+    records[0] = (nmbs_file_record){1, 9999, registers, 2};
+    expect(nmbs_write_file_records(&CLIENT, records, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(server_requests() == 0);
+
+    should("write scattered ranges with a single request");
+    for (uint16_t i = 0; i < 8; i++) {
+        records[i] = (nmbs_file_record){(uint16_t) (1 + i % 3), (uint16_t) (i * 500), &registers[i * 12], 12};
+        file_record_fill(&records[i]);
+    }
+
+    check(nmbs_write_file_records(&CLIENT, records, 8));
+    expect(server_requests() == 1);
+    expect(file_pattern_written == 8 * 12);
+
+    should("split ranges longer than a sub-request over several requests");
+    records[0] = (nmbs_file_record){4, 9000, registers, 300};
+    file_record_fill(&records[0]);
+    file_pattern_written = 0;
+    check(nmbs_write_file_records(&CLIENT, records, 1));
+    expect(server_requests() == 3);
+    expect(file_pattern_written == 300);
+
+    should("split the sub-requests over several requests when they don't fit in one");
+    for (uint16_t i = 0; i < 40; i++) {
+        records[i] = (nmbs_file_record){(uint16_t) (1 + i % 5), (uint16_t) (i * 100), &registers[i * 2], 2};
+        file_record_fill(&records[i]);
+    }
+
+    file_pattern_written = 0;
+    check(nmbs_write_file_records(&CLIENT, records, 40));
+    expect(server_requests() == 2);
+    expect(file_pattern_written == 80);
+
+    should("return the exception of the server");
+    records[0] = (nmbs_file_record){1, 0, registers, 4};
+    records[1] = (nmbs_file_record){9, 0, &registers[4], 4};
+    file_record_fill(&records[0]);
+    expect(nmbs_write_file_records(&CLIENT, records, 2) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    stop_client_and_server();
+}
+
+
+uint16_t mask_register_value = 0;
+
+
+nmbs_error mask_write_register(uint16_t address, uint16_t and_mask, uint16_t or_mask, uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(unit_id);
+
+    if (check_user_data(arg) != 1)
+        return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
+
+    if (address == 1)
+        return -1;
+
+    if (address == 2)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    mask_register_value = (mask_register_value & and_mask) | (or_mask & ~and_mask);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error read_mask_register(uint16_t address, uint16_t quantity, uint16_t* registers_out, uint8_t unit_id,
+                              void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (address != 4 || quantity != 1)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    registers_out[0] = mask_register_value;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+nmbs_error write_mask_register(uint16_t address, uint16_t value, uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (address != 4)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    mask_register_value = value;
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_fc22(nmbs_transport transport) {
+    const uint8_t fc = 22;
+    uint8_t raw_res[260];
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION when callback is not registered server-side");
+    expect(nmbs_mask_write_register(&CLIENT, 0, 0xFFFF, 0) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    stop_client_and_server();
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.mask_write_register = mask_write_register;
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_callbacks_arg(&SERVER, (void*) &callbacks_user_data);
+
+    should("return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE when server handler returns any non-exception error");
+    expect(nmbs_mask_write_register(&CLIENT, 1, 0xFFFF, 0) == NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if returned by server handler");
+    expect(nmbs_mask_write_register(&CLIENT, 2, 0xFFFF, 0) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("mask write with no error");
+    mask_register_value = 0x12;
+    check(nmbs_mask_write_register(&CLIENT, 4, 0xF2, 0x25));
+    expect(mask_register_value == 0x17);
+
+    should("echo request's address and masks");
+    check(nmbs_send_raw_pdu(&CLIENT, fc, (uint8_t*) (uint16_t[]){htons(4), htons(0xF2), htons(0x25)}, 6));
+    check(nmbs_receive_raw_pdu_response(&CLIENT, raw_res, 6));
+
+    expect(((uint16_t*) raw_res)[0] == ntohs(4));
+    expect(((uint16_t*) raw_res)[1] == ntohs(0xF2));
+    expect(((uint16_t*) raw_res)[2] == ntohs(0x25));
+
+    stop_client_and_server();
+
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_holding_registers = read_mask_register;
+    callbacks.write_single_register = write_mask_register;
+    start_client_and_server(transport, &callbacks);
+
+    should("read-modify-write through the register callbacks when the mask_write_register callback is not set");
+    mask_register_value = 0x12;
+    check(nmbs_mask_write_register(&CLIENT, 4, 0xF2, 0x25));
+    expect(mask_register_value == 0x17);
+
+    check(nmbs_mask_write_register(&CLIENT, 4, 0x0000, 0xA5A5));
+    expect(mask_register_value == 0xA5A5);
+
+    expect(nmbs_mask_write_register(&CLIENT, 5, 0xFFFF, 0) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    stop_client_and_server();
+
+    uint16_t registers[4] = {0, 0, 0x12, 0};
+    nmbs_register_store mask_store;
+    check(nmbs_register_store_create(&mask_store, registers, 10, 4));
+
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_holding_registers_store(&SERVER, &mask_store);
+
+    should("mask write a register of a register store");
+    check(nmbs_mask_write_register(&CLIENT, 12, 0xF2, 0x25));
+    expect(registers[2] == 0x17);
+
+    check(nmbs_mask_write_register(&CLIENT, 10, 0xFF00, 0x00FF));
+    expect(registers[0] == 0x00FF && registers[1] == 0 && registers[3] == 0);
+
+    expect(nmbs_mask_write_register(&CLIENT, 14, 0xFFFF, 0) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    stop_client_and_server();
+}
+
 void test_fc23(nmbs_transport transport) {
     uint16_t registers[125];
     uint16_t registers_write[125];
@@ -1118,36 +1700,179 @@ void test_fc23(nmbs_transport transport) {
     stop_client_and_server();
 }
 
-nmbs_error read_device_identification_map(nmbs_bitfield_256 map) {
-    nmbs_bitfield_set(map, 0x00);
-    nmbs_bitfield_set(map, 0x01);
-    nmbs_bitfield_set(map, 0x02);
-    nmbs_bitfield_set(map, 0x03);
-    nmbs_bitfield_set(map, 0x04);
-    nmbs_bitfield_set(map, 0x05);
-    nmbs_bitfield_set(map, 0x06);
-    nmbs_bitfield_set(map, 0x80);
-    nmbs_bitfield_set(map, 0x91);
-    nmbs_bitfield_set(map, 0xA2);
-    nmbs_bitfield_set(map, 0xB3);
-    return NMBS_ERROR_NONE;
-}
+uint16_t fifo_values[64];
+nmbs_fifo_queue fifo;
 
-nmbs_error read_device_identification_map_incomplete(nmbs_bitfield_256 map) {
-    nmbs_bitfield_set(map, 0x00);
-    nmbs_bitfield_set(map, 0x02);
-    return NMBS_ERROR_NONE;
+
+void test_fifo_queue(void) {
+    uint16_t values[8];
+
+    should("check parameters and fail to create a FIFO queue");
+    expect(nmbs_fifo_queue_create(&fifo, NULL, 8) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_fifo_queue_create(&fifo, fifo_values, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("pop values in the order they were pushed");
+    check(nmbs_fifo_queue_create(&fifo, fifo_values, 8));
+    for (uint16_t i = 0; i < 5; i++)
+        expect(nmbs_fifo_queue_push(&fifo, 100 + i));
+
+    expect(nmbs_fifo_queue_count(&fifo) == 5);
+    expect(nmbs_fifo_queue_pop(&fifo, values, 3) == 3);
+    expect(values[0] == 100 && values[1] == 101 && values[2] == 102);
+    expect(nmbs_fifo_queue_count(&fifo) == 2);
+
+    should("wrap around the end of the values array");
+    for (uint16_t i = 5; i < 10; i++)
+        expect(nmbs_fifo_queue_push(&fifo, 100 + i));
+
+    expect(nmbs_fifo_queue_pop(&fifo, values, 8) == 7);
+    for (int i = 0; i < 7; i++)
+        expect(values[i] == 103 + i);
+
+    expect(nmbs_fifo_queue_pop(&fifo, values, 8) == 0);
+
+    should("drop and count the values pushed when the queue is full");
+    for (uint16_t i = 0; i < 7; i++)
+        expect(nmbs_fifo_queue_push(&fifo, i));
+
+    expect(!nmbs_fifo_queue_push(&fifo, 7));
+    expect(nmbs_fifo_queue_dropped(&fifo) == 1);
+    expect(nmbs_fifo_queue_count(&fifo) == 7);
 }
 
-nmbs_error read_device_identification(uint8_t object_id, char buffer[NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH]) {
-    switch (object_id) {
-        case 0x00:
-            strcpy(buffer, "VendorName");
-            break;
-        case 0x01:
-            strcpy(buffer, "ProductCode");
-            break;
-        case 0x02:
+
+nmbs_error read_fifo_queue(uint16_t address, uint16_t values_out[NMBS_FIFO_COUNT_MAX], uint8_t* count_out,
+                           uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(unit_id);
+
+    if (check_user_data(arg) != 1)
+        return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE;
+
+    if (address == 1)
+        return -1;
+
+    if (address == 2)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    if (address == 3) {
+        *count_out = NMBS_FIFO_COUNT_MAX + 1;
+        return NMBS_ERROR_NONE;
+    }
+
+    if (address != 0x100)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    *count_out = (uint8_t) nmbs_fifo_queue_pop(&fifo, values_out, NMBS_FIFO_COUNT_MAX);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_fc24(nmbs_transport transport) {
+    uint16_t values[100];
+    uint8_t count = 0;
+    uint32_t drained = 0;
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION when callback is not registered server-side");
+    expect(nmbs_read_fifo_queue(&CLIENT, 0x100, values, &count) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    stop_client_and_server();
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_fifo_queue = read_fifo_queue;
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_callbacks_arg(&SERVER, (void*) &callbacks_user_data);
+
+    should("return NMBS_EXCEPTION_SERVER_DEVICE_FAILURE when server handler returns any non-exception error");
+    expect(nmbs_read_fifo_queue(&CLIENT, 1, values, &count) == NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS if returned by server handler");
+    expect(nmbs_read_fifo_queue(&CLIENT, 2, values, &count) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_VALUE when the server handler returns more than 31 values");
+    expect(nmbs_read_fifo_queue(&CLIENT, 3, values, &count) == NMBS_EXCEPTION_ILLEGAL_DATA_VALUE);
+
+    should("read the queued values");
+    check(nmbs_fifo_queue_create(&fifo, fifo_values, 64));
+    for (uint16_t i = 0; i < 10; i++)
+        nmbs_fifo_queue_push(&fifo, 0xA500 + i);
+
+    check(nmbs_read_fifo_queue(&CLIENT, 0x100, values, &count));
+    expect(count == 10);
+    for (int i = 0; i < 10; i++)
+        expect(values[i] == 0xA500 + i);
+
+    should("read an empty queue");
+    check(nmbs_read_fifo_queue(&CLIENT, 0x100, values, &count));
+    expect(count == 0);
+
+    should("drain a queue holding more than 31 values");
+    for (uint16_t i = 0; i < 63; i++)
+        nmbs_fifo_queue_push(&fifo, i);
+
+    check(nmbs_drain_fifo_queue(&CLIENT, 0x100, values, 100, &drained));
+    expect(drained == 63);
+    for (int i = 0; i < 63; i++)
+        expect(values[i] == i);
+
+    should("stop draining when a full response would not fit");
+    for (uint16_t i = 0; i < 40; i++)
+        nmbs_fifo_queue_push(&fifo, i);
+
+    check(nmbs_drain_fifo_queue(&CLIENT, 0x100, values, 40, &drained));
+    expect(drained == 31);
+    expect(nmbs_fifo_queue_count(&fifo) == 9);
+
+    check(nmbs_drain_fifo_queue(&CLIENT, 0x100, values, 40, &drained));
+    expect(drained == 9);
+    expect(values[0] == 31 && values[8] == 39);
+
+    should("refuse draining into less than a full response");
+    nmbs_fifo_queue_push(&fifo, 1);
+    drained = 1;
+    expect(nmbs_drain_fifo_queue(&CLIENT, 0x100, values, NMBS_FIFO_COUNT_MAX - 1, &drained) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(drained == 0);
+    expect(nmbs_fifo_queue_count(&fifo) == 1);
+
+    stop_client_and_server();
+}
+
+nmbs_error read_device_identification_map(nmbs_bitfield_256 map) {
+    nmbs_bitfield_set(map, 0x00);
+    nmbs_bitfield_set(map, 0x01);
+    nmbs_bitfield_set(map, 0x02);
+    nmbs_bitfield_set(map, 0x03);
+    nmbs_bitfield_set(map, 0x04);
+    nmbs_bitfield_set(map, 0x05);
+    nmbs_bitfield_set(map, 0x06);
+    nmbs_bitfield_set(map, 0x80);
+    nmbs_bitfield_set(map, 0x91);
+    nmbs_bitfield_set(map, 0xA2);
+    nmbs_bitfield_set(map, 0xB3);
+    return NMBS_ERROR_NONE;
+}
+
+nmbs_error read_device_identification_map_incomplete(nmbs_bitfield_256 map) {
+    nmbs_bitfield_set(map, 0x00);
+    nmbs_bitfield_set(map, 0x02);
+    return NMBS_ERROR_NONE;
+}
+
+nmbs_error read_device_identification(uint8_t object_id, char buffer[NMBS_DEVICE_IDENTIFICATION_STRING_LENGTH]) {
+    switch (object_id) {
+        case 0x00:
+            strcpy(buffer, "VendorName");
+            break;
+        case 0x01:
+            strcpy(buffer, "ProductCode");
+            break;
+        case 0x02:
             strcpy(buffer, "MajorMinorRevision");
             break;
         case 0x03:
@@ -1304,47 +2029,2212 @@ void test_fc43_14(nmbs_transport transport) {
     stop_client_and_server();
 }
 
-nmbs_transport transports[2] = {NMBS_TRANSPORT_RTU, NMBS_TRANSPORT_TCP};
-const char* transports_str[2] = {"RTU", "TCP"};
+void test_server_device_identification(nmbs_transport transport) {
+    const uint8_t fc = 43;
+    const uint8_t mei = 14;
+    const uint8_t buf_size = 128;
+    const char* long_value = "90byteslongextendedobjectthatcombinedwithotheronesisdefinitelygonnaexceedthepdusize0123456";
+    const char* vendor_url =
+            "VendorUrl90byteslongextendedobjectthatcombinedwithotheronesisdefinitelygonnaexceedthepdusize0123456";
+
+    nmbs_device_identification_value values[] = {
+            {0x00, "VendorName"}, {0x01, "ProductCode"}, {0x02, "MajorMinorRevision"},
+            {0x03, vendor_url},   {0x06, "UserApplicationName"},
+            {0x80, long_value},   {0x91, long_value},    {0xA2, long_value}, {0xB3, long_value},
+    };
+    nmbs_device_identification_object objects[9];
+    uint8_t encoded[1024];
+    nmbs_device_identification devid;
 
-void for_transports(void (*test_fn)(nmbs_transport), const char* should_str) {
-    for (unsigned long t = 0; t < sizeof(transports) / sizeof(nmbs_transport); t++) {
-        printf("Should %s on %s:\n", should_str, transports_str[t]);
-        test(test_fn(transports[t]));
+    char mem[7 * buf_size];
+    char* buffers[7];
+    for (int i = 0; i < 7; i++) {
+        buffers[i] = &mem[i * buf_size];
+    }
+
+    should("check parameters and fail to create a nmbs_device_identification");
+    expect(nmbs_device_identification_create(&devid, values, 2, objects, encoded, sizeof(encoded)) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_device_identification_create(&devid, &values[1], 3, objects, encoded, sizeof(encoded)) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_device_identification_create(&devid, values, 9, objects, encoded, 100) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    nmbs_device_identification_value unsorted[] = {{0x00, "a"}, {0x01, "b"}, {0x02, "c"}, {0x80, "d"}, {0x06, "e"}};
+    expect(nmbs_device_identification_create(&devid, unsorted, 5, objects, encoded, sizeof(encoded)) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+
+    nmbs_device_identification_value reserved[] = {{0x00, "a"}, {0x01, "b"}, {0x02, "c"}, {0x07, "d"}};
+    expect(nmbs_device_identification_create(&devid, reserved, 4, objects, encoded, sizeof(encoded)) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_device_identification_create(&devid, values, 9, objects, encoded, sizeof(encoded)));
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_device_identification(&SERVER, &devid);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS with out of range Object ID");
+    nmbs_send_raw_pdu(&CLIENT, fc, (uint8_t[]){mei, 2, 0x01}, 3);
+    expect(nmbs_receive_raw_pdu_response(&CLIENT, NULL, 2) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS when reading a missing individual object");
+    expect(nmbs_read_device_identification(&CLIENT, 0x04, buffers[0], buf_size) ==
+           NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("read an individual object from nmbs_device_identification");
+    uint8_t res[6 + 2 + 10];
+    nmbs_send_raw_pdu(&CLIENT, fc, (uint8_t[]){mei, 4, 0x00}, 3);
+    check(nmbs_receive_raw_pdu_response(&CLIENT, res, sizeof(res)));
+    expect(memcmp(res, (uint8_t[]){mei, 4, 0x83, 0, 0, 1, 0x00, 10}, 8) == 0);
+    expect(memcmp(&res[8], "VendorName", 10) == 0);
+
+    check(nmbs_read_device_identification(&CLIENT, 0x06, buffers[0], buf_size));
+    expect(strcmp(buffers[0], "UserApplicationName") == 0);
+
+    should("read basic object ids from nmbs_device_identification");
+    check(nmbs_read_device_identification_basic(&CLIENT, buffers[0], buffers[1], buffers[2], buf_size));
+    expect(strcmp(buffers[0], "VendorName") == 0);
+    expect(strcmp(buffers[1], "ProductCode") == 0);
+    expect(strcmp(buffers[2], "MajorMinorRevision") == 0);
+
+    should("read regular object ids from nmbs_device_identification");
+    buffers[1][0] = 'x';
+    check(nmbs_read_device_identification_regular(&CLIENT, buffers[0], buffers[1], buffers[2], buffers[3], buf_size));
+    expect(strcmp(buffers[0], vendor_url) == 0);
+    expect(buffers[1][0] == 'x');
+    expect(strcmp(buffers[3], "UserApplicationName") == 0);
+
+    should("split the extended object ids over multiple responses");
+    uint8_t split[6 + 2 * (2 + 90)];
+    nmbs_send_raw_pdu(&CLIENT, fc, (uint8_t[]){mei, 3, 0x80}, 3);
+    check(nmbs_receive_raw_pdu_response(&CLIENT, split, sizeof(split)));
+    expect(memcmp(split, (uint8_t[]){mei, 3, 0x83, 0xFF, 0xA2, 2, 0x80, 90}, 8) == 0);
+    expect(split[6 + 92] == 0x91);
+
+    uint8_t ids[7];
+    uint8_t objects_count = 0;
+    check(nmbs_read_device_identification_extended(&CLIENT, 0x80, ids, buffers, 7, buf_size, &objects_count));
+    expect(objects_count == 4);
+    expect(ids[0] == 0x80 && ids[1] == 0x91 && ids[2] == 0xA2 && ids[3] == 0xB3);
+    for (int i = 0; i < 4; i++)
+        expect(strcmp(buffers[i], long_value) == 0);
+
+    should("read every object of a category into an arena, following more_follows");
+    nmbs_device_identification_entry entries[9];
+    char arena[512];
+    uint16_t entries_count = 0;
+    check(nmbs_read_device_identification_objects(&CLIENT, 3, 0x80, entries, 9, arena, sizeof(arena),
+                                                  &entries_count));
+    expect(entries_count == 4);
+    for (int i = 0; i < 4; i++) {
+        expect(entries[i].id == values[5 + i].id);
+        expect(entries[i].length == 90);
+        expect(strcmp(entries[i].value, long_value) == 0);
+        expect(entries[i].value == &arena[i * 91]);
+    }
+
+    check(nmbs_read_device_identification_objects(&CLIENT, 1, 0x00, entries, 9, arena, sizeof(arena),
+                                                  &entries_count));
+    expect(entries_count == 3);
+    expect(strcmp(entries[2].value, "MajorMinorRevision") == 0);
+
+    check(nmbs_read_device_identification_objects(&CLIENT, 2, 0x03, entries, 9, arena, sizeof(arena),
+                                                  &entries_count));
+    expect(entries_count == 2);
+    expect(entries[0].id == 0x03 && entries[1].id == 0x06);
+    expect(strcmp(entries[0].value, vendor_url) == 0);
+
+    should("return NMBS_ERROR_INVALID_ARGUMENT when the entries or the arena are too small");
+    expect(nmbs_read_device_identification_objects(&CLIENT, 4, 0x00, entries, 9, arena, sizeof(arena), NULL) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_read_device_identification_objects(&CLIENT, 3, 0x07, entries, 9, arena, sizeof(arena), NULL) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_read_device_identification_objects(&CLIENT, 3, 0x80, entries, 3, arena, sizeof(arena),
+                                                   &entries_count) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(entries_count == 2);
+    expect(nmbs_read_device_identification_objects(&CLIENT, 3, 0x80, entries, 9, arena, 4 * 91 - 1,
+                                                   &entries_count) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(entries_count == 3);
+
+    should("prefer read_device_identification callbacks over nmbs_device_identification");
+    stop_client_and_server();
+
+    callbacks.read_device_identification = read_device_identification;
+    callbacks.read_device_identification_map = read_device_identification_map;
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_device_identification(&SERVER, &devid);
+
+    check(nmbs_read_device_identification(&CLIENT, 0x04, buffers[0], buf_size));
+    expect(strncmp(buffers[0], "ProductName", 11) == 0);
+
+    stop_client_and_server();
+}
+
+void test_bitfield_65536(void) {
+    static nmbs_bitfield_65536 bf;
+    static nmbs_bitfield_65536 previous;
+    nmbs_bitfield bits = {0};
+
+    should("read a range of bits at any offset");
+    nmbs_bitfield_reset(bf);
+    for (uint32_t i = 0; i < 0x10000; i += 3)
+        nmbs_bitfield_set(bf, i);
+
+    for (uint16_t address = 0; address < 17; address++) {
+        memset(bits, 0xFF, sizeof(bits));
+        check(nmbs_bitfield_65536_read_range(bf, address, 13, bits));
+        for (uint16_t i = 0; i < 13; i++)
+            expect(nmbs_bitfield_read(bits, i) == ((address + i) % 3 == 0));
+
+        expect(nmbs_bitfield_read(bits, 13) == 0);
+        expect(nmbs_bitfield_read(bits, 14) == 0);
+        expect(nmbs_bitfield_read(bits, 15) == 0);
     }
+
+    check(nmbs_bitfield_65536_read_range(bf, 65536 - 2000, 2000, bits));
+    for (uint16_t i = 0; i < 2000; i++)
+        expect(nmbs_bitfield_read(bits, i) == ((65536 - 2000 + i) % 3 == 0));
+
+    should("return NMBS_ERROR_INVALID_ARGUMENT when reading an invalid range");
+    expect(nmbs_bitfield_65536_read_range(bf, 0, 0, bits) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_bitfield_65536_read_range(bf, 0, 2001, bits) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_bitfield_65536_read_range(bf, 65530, 7, bits) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("write a range of bits at any offset without touching the surrounding ones");
+    for (uint16_t address = 100; address < 117; address++) {
+        nmbs_bitfield_reset(bf);
+        memset(bits, 0xFF, sizeof(bits));
+        check(nmbs_bitfield_65536_write_range(bf, address, 11, bits));
+        for (uint16_t i = 90; i < 140; i++)
+            expect(nmbs_bitfield_read(bf, i) == (i >= address && i < address + 11));
+    }
+
+    memset(bf, 0xFF, sizeof(bf));
+    memset(bits, 0, sizeof(bits));
+    check(nmbs_bitfield_65536_write_range(bf, 65535, 1, bits));
+    expect(nmbs_bitfield_read(bf, 65535) == 0);
+    expect(nmbs_bitfield_read(bf, 65534) == 1);
+
+    should("count the bits set in a range");
+    nmbs_bitfield_reset(bf);
+    for (uint32_t i = 0; i < 0x10000; i += 3)
+        nmbs_bitfield_set(bf, i);
+
+    expect(nmbs_bitfield_65536_count(bf, 0, 0x10000) == 21846);
+    expect(nmbs_bitfield_65536_count(bf, 1, 2) == 0);
+    expect(nmbs_bitfield_65536_count(bf, 5, 100) == 33);
+    expect(nmbs_bitfield_65536_count(bf, 65535, 10) == 1);
+
+    should("find the ranges of changed bits");
+    nmbs_bitfield_reset(bf);
+    nmbs_bitfield_reset(previous);
+    uint16_t address = 0;
+    uint32_t quantity = 0;
+    expect(nmbs_bitfield_65536_next_changed(bf, previous, 0, &address, &quantity) == false);
+
+    for (uint16_t i = 10; i < 30; i++)
+        nmbs_bitfield_set(bf, i);
+    nmbs_bitfield_set(previous, 500);
+    nmbs_bitfield_set(bf, 65535);
+
+    expect(nmbs_bitfield_65536_next_changed(bf, previous, 0, &address, &quantity));
+    expect(address == 10 && quantity == 20);
+    expect(nmbs_bitfield_65536_next_changed(bf, previous, address + quantity, &address, &quantity));
+    expect(address == 500 && quantity == 1);
+    expect(nmbs_bitfield_65536_next_changed(bf, previous, address + quantity, &address, &quantity));
+    expect(address == 65535 && quantity == 1);
+    expect(nmbs_bitfield_65536_next_changed(bf, previous, address + quantity, &address, &quantity) == false);
 }
 
-int main(int argc, char* argv[]) {
-    UNUSED_PARAM(argc);
-    UNUSED_PARAM(argv);
 
-    for_transports(test_server_create, "create a modbus server");
+void test_server_bitfield_65536(nmbs_transport transport) {
+    static nmbs_bitfield_65536 coils;
+    static nmbs_bitfield_65536 inputs;
+    nmbs_bitfield bf = {0};
 
-    for_transports(test_server_receive_base, "receive no messages without failing");
+    nmbs_bitfield_reset(coils);
+    nmbs_bitfield_reset(inputs);
+    for (uint32_t i = 0; i < 0x10000; i += 2)
+        nmbs_bitfield_set(inputs, i);
 
-    for_transports(test_fc1, "send and receive FC 01 (0x01) Read Coils");
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_coils_bitfield(&SERVER, coils);
+    nmbs_set_discrete_inputs_bitfield(&SERVER, inputs);
+
+    should("serve discrete inputs from a nmbs_bitfield_65536");
+    check(nmbs_read_discrete_inputs(&CLIENT, 65535 - 1999, 2000, bf));
+    for (uint16_t i = 0; i < 2000; i++)
+        expect(nmbs_bitfield_read(bf, i) == ((65535 - 1999 + i) % 2 == 0));
+
+    should("write coils to a nmbs_bitfield_65536");
+    check(nmbs_write_single_coil(&CLIENT, 40000, true));
+    expect(nmbs_bitfield_read(coils, 40000) == 1);
+
+    nmbs_bitfield_reset(bf);
+    nmbs_bitfield_set(bf, 0);
+    nmbs_bitfield_set(bf, 9);
+    check(nmbs_write_multiple_coils(&CLIENT, 50003, 10, bf));
+    expect(nmbs_bitfield_65536_count(coils, 0, 0x10000) == 3);
+    expect(nmbs_bitfield_read(coils, 50003) == 1);
+    expect(nmbs_bitfield_read(coils, 50012) == 1);
+
+    should("read coils from a nmbs_bitfield_65536");
+    check(nmbs_read_coils(&CLIENT, 50003, 10, bf));
+    expect(nmbs_bitfield_read(bf, 0) == 1);
+    expect(nmbs_bitfield_read(bf, 5) == 0);
+    expect(nmbs_bitfield_read(bf, 9) == 1);
 
-    for_transports(test_fc2, "send and receive FC 02 (0x02) Read Discrete Inputs");
+    stop_client_and_server();
+}
 
-    for_transports(test_fc3, "send and receive FC 03 (0x03) Read Holding Registers");
+uint16_t store_registers[200];
+nmbs_register_store store;
+bool store_writer_stopped = false;
 
-    for_transports(test_fc4, "send and receive FC 04 (0x04) Read Input Registers");
+void* store_writer_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint16_t values[200];
+    uint16_t generation = 0;
+    while (!__atomic_load_n(&store_writer_stopped, __ATOMIC_ACQUIRE)) {
+        generation++;
+        for (int i = 0; i < 200; i++)
+            values[i] = generation;
+
+        check(nmbs_register_store_write(&store, 100, 200, values));
+        sched_yield();
+    }
 
-    for_transports(test_fc5, "send and receive FC 05 (0x05) Write Single Coil");
+    return NULL;
+}
 
-    for_transports(test_fc6, "send and receive FC 06 (0x06) Write Single Register");
 
-    for_transports(test_fc15, "send and receive FC 15 (0x0F) Write Multiple Coils");
+void test_server_register_store(nmbs_transport transport) {
+    uint16_t input_registers[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    nmbs_register_store input_store;
+    uint16_t regs[125];
 
-    for_transports(test_fc16, "send and receive FC 16 (0x10) Write Multiple registers");
+    should("check parameters and fail to create a register store");
+    expect(nmbs_register_store_create(&store, NULL, 0, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_register_store_create(&store, store_registers, 0, 0) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_register_store_create(&store, store_registers, 65500, 200) == NMBS_ERROR_INVALID_ARGUMENT);
 
-    for_transports(test_fc20, "send and receive FC 20 (0x14) Read File Record");
+    memset(store_registers, 0, sizeof(store_registers));
+    check(nmbs_register_store_create(&store, store_registers, 100, 200));
+    check(nmbs_register_store_create(&input_store, input_registers, 0, 10));
 
-    for_transports(test_fc21, "send and receive FC 21 (0x15) Write File Record");
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_holding_registers_store(&SERVER, &store);
+    nmbs_set_input_registers_store(&SERVER, &input_store);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS when reading outside the store");
+    expect(nmbs_read_holding_registers(&CLIENT, 99, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_read_holding_registers(&CLIENT, 299, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_read_input_registers(&CLIENT, 5, 6, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("serve input registers from a register store");
+    check(nmbs_read_input_registers(&CLIENT, 2, 8, regs));
+    for (int i = 0; i < 8; i++)
+        expect(regs[i] == 2 + i);
+
+    should("write holding registers to a register store");
+    check(nmbs_write_single_register(&CLIENT, 100, 0xAA55));
+    expect(store_registers[0] == 0xAA55);
+
+    uint16_t values[3] = {1, 2, 3};
+    check(nmbs_write_multiple_registers(&CLIENT, 297, 3, values));
+    expect(store_registers[197] == 1 && store_registers[198] == 2 && store_registers[199] == 3);
+
+    check(nmbs_read_write_registers(&CLIENT, 297, 3, regs, 100, 1, (uint16_t[]){0x1234}));
+    expect(regs[0] == 1 && regs[1] == 2 && regs[2] == 3);
+    expect(store_registers[0] == 0x1234);
+
+    should("read consistent snapshots while another thread is writing");
+    pthread_t writer;
+    __atomic_store_n(&store_writer_stopped, false, __ATOMIC_RELEASE);
+    expect(pthread_create(&writer, NULL, store_writer_thread, NULL) == 0);
+
+    for (int r = 0; r < 200; r++) {
+        check(nmbs_read_holding_registers(&CLIENT, 150, 125, regs));
+        for (int i = 1; i < 125; i++)
+            expect(regs[i] == regs[0]);
+    }
 
-    for_transports(test_fc23, "send and receive FC 23 (0x17) Read/Write Multiple Registers");
+    __atomic_store_n(&store_writer_stopped, true, __ATOMIC_RELEASE);
+    expect(pthread_join(writer, NULL) == 0);
 
-    for_transports(test_fc43_14, "send and receive FC 43 / 14 (0x2B / 0x0E) Read Device Identification");
+    stop_client_and_server();
+}
+
+uint32_t snapshot_memory[NMBS_SNAPSHOT_STORE_MEMORY(300, 2, 4)];
+uint32_t snapshot_memory_4[NMBS_SNAPSHOT_STORE_MEMORY(300, 4, 4)];
+nmbs_snapshot_store snapshot_store;
+bool snapshot_writer_stopped = false;
+
+void* snapshot_writer_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint16_t generation = 0;
+    while (!__atomic_load_n(&snapshot_writer_stopped, __ATOMIC_ACQUIRE)) {
+        generation++;
+
+        // Every register of the store changes in a single version, one register at a time
+        nmbs_snapshot_store_begin(&snapshot_store);
+        for (uint16_t a = 0; a < 300; a++)
+            check(nmbs_snapshot_store_stage(&snapshot_store, a, 1, &generation));
+        nmbs_snapshot_store_publish(&snapshot_store);
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+
+void test_snapshot_store(void) {
+    uint16_t regs[300];
+    uint16_t values[300];
+
+    should("check parameters and fail to create a snapshot store");
+    expect(nmbs_snapshot_store_create(&snapshot_store, NULL, sizeof(snapshot_memory), 0, 300, 2, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 0, 2, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 65500, 300, 2, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 300, 3, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 300, 2, 0) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 300, 4, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 305, 2, 4) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 1000, 300, 2, 4));
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS when accessing outside the store");
+    expect(nmbs_snapshot_store_read(&snapshot_store, 999, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_snapshot_store_read(&snapshot_store, 1299, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_snapshot_store_write(&snapshot_store, 1299, 2, values) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("initialize the store to 0");
+    check(nmbs_snapshot_store_read(&snapshot_store, 1000, 300, regs));
+    for (int i = 0; i < 300; i++)
+        expect(regs[i] == 0);
+
+    should("write and read ranges spanning multiple pages");
+    for (int i = 0; i < 300; i++)
+        values[i] = (uint16_t) i;
+
+    check(nmbs_snapshot_store_write(&snapshot_store, 1000, 300, values));
+    check(nmbs_snapshot_store_write(&snapshot_store, 1010, 3, (uint16_t[]){0xAAAA, 0xBBBB, 0xCCCC}));
+    check(nmbs_snapshot_store_read(&snapshot_store, 1005, 40, regs));
+    for (int i = 0; i < 40; i++) {
+        if (i >= 5 && i < 8)
+            expect(regs[i] == 0xAAAA + (i - 5) * 0x1111);
+        else
+            expect(regs[i] == 5 + i);
+    }
+
+    should("keep reading a pinned version while newer ones are published");
+    nmbs_snapshot pinned;
+    nmbs_snapshot_store_pin(&snapshot_store, &pinned);
+
+    // With 2 versions, a single version can be published while the oldest one is pinned
+    nmbs_snapshot_store_begin(&snapshot_store);
+    for (int v = 0; v < 10; v++) {
+        uint16_t value = (uint16_t) (0x100 + v);
+        check(nmbs_snapshot_store_stage(&snapshot_store, 1100 + v, 1, &value));
+    }
+    nmbs_snapshot_store_publish(&snapshot_store);
+
+    check(nmbs_snapshot_read(&pinned, 1100, 10, regs));
+    for (int i = 0; i < 10; i++)
+        expect(regs[i] == 100 + i);
+
+    nmbs_snapshot latest;
+    nmbs_snapshot_store_pin(&snapshot_store, &latest);
+    check(nmbs_snapshot_read(&latest, 1100, 10, regs));
+    for (int i = 0; i < 10; i++)
+        expect(regs[i] == 0x100 + i);
+
+    nmbs_snapshot_store_unpin(&latest);
+    nmbs_snapshot_store_unpin(&pinned);
+
+    should("reclaim pages of unpinned versions");
+    for (int v = 0; v < 1000; v++) {
+        for (int i = 0; i < 300; i++)
+            values[i] = (uint16_t) v;
+
+        check(nmbs_snapshot_store_write(&snapshot_store, 1000, 300, values));
+    }
+
+    check(nmbs_snapshot_store_read(&snapshot_store, 1000, 300, regs));
+    for (int i = 0; i < 300; i++)
+        expect(regs[i] == 999);
+
+    should("publish (versions - 1) versions rewriting every page while the oldest one is pinned");
+    check(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory_4, sizeof(snapshot_memory_4), 0, 300, 4, 4));
+    nmbs_snapshot_store_pin(&snapshot_store, &pinned);
+    for (int v = 1; v <= 3; v++) {
+        for (int i = 0; i < 300; i++)
+            values[i] = (uint16_t) v;
+
+        check(nmbs_snapshot_store_try_write(&snapshot_store, 0, 300, values));
+    }
+
+    should("return NMBS_ERROR_WOULD_BLOCK instead of waiting for a pinned version");
+    expect(nmbs_snapshot_store_try_write(&snapshot_store, 0, 300, values) == NMBS_ERROR_WOULD_BLOCK);
+    check(nmbs_snapshot_read(&pinned, 0, 300, regs));
+    for (int i = 0; i < 300; i++)
+        expect(regs[i] == 0);
+
+    nmbs_snapshot_store_unpin(&pinned);
+    check(nmbs_snapshot_store_try_write(&snapshot_store, 0, 300, values));
+
+    should("return NMBS_ERROR_WOULD_BLOCK while another writer has begun a version");
+    nmbs_snapshot_store_begin(&snapshot_store);
+    expect(nmbs_snapshot_store_try_begin(&snapshot_store) == NMBS_ERROR_WOULD_BLOCK);
+    expect(nmbs_snapshot_store_try_write(&snapshot_store, 0, 1, values) == NMBS_ERROR_WOULD_BLOCK);
+    nmbs_snapshot_store_publish(&snapshot_store);
+    check(nmbs_snapshot_store_try_begin(&snapshot_store));
+    nmbs_snapshot_store_publish(&snapshot_store);
+
+    check(nmbs_snapshot_store_read(&snapshot_store, 0, 300, regs));
+    for (int i = 0; i < 300; i++)
+        expect(regs[i] == 3);
+}
+
+
+void test_server_snapshot_store(nmbs_transport transport) {
+    uint16_t regs[125];
+
+    check(nmbs_snapshot_store_create(&snapshot_store, snapshot_memory, sizeof(snapshot_memory), 0, 300, 2, 4));
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_holding_registers_snapshot_store(&SERVER, &snapshot_store);
+    nmbs_set_input_registers_snapshot_store(&SERVER, &snapshot_store);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS when reading outside the snapshot store");
+    expect(nmbs_read_holding_registers(&CLIENT, 299, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_read_input_registers(&CLIENT, 299, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("write holding registers to a snapshot store");
+    check(nmbs_write_single_register(&CLIENT, 0, 0xAA55));
+    check(nmbs_write_multiple_registers(&CLIENT, 14, 4, (uint16_t[]){1, 2, 3, 4}));
+    check(nmbs_read_input_registers(&CLIENT, 0, 1, regs));
+    expect(regs[0] == 0xAA55);
+
+    check(nmbs_read_write_registers(&CLIENT, 14, 4, regs, 200, 1, (uint16_t[]){0x1234}));
+    expect(regs[0] == 1 && regs[1] == 2 && regs[2] == 3 && regs[3] == 4);
+    check(nmbs_read_holding_registers(&CLIENT, 200, 1, regs));
+    expect(regs[0] == 0x1234);
+
+    should("mask write a register of a snapshot store");
+    check(nmbs_mask_write_register(&CLIENT, 200, 0xFF00, 0x0021));
+    check(nmbs_read_holding_registers(&CLIENT, 200, 1, regs));
+    expect(regs[0] == 0x1221);
+
+    should("read blocks from a single version while another thread is publishing");
+    uint16_t zeros[300] = {0};
+    check(nmbs_snapshot_store_write(&snapshot_store, 0, 300, zeros));
+
+    pthread_t writer;
+    __atomic_store_n(&snapshot_writer_stopped, false, __ATOMIC_RELEASE);
+    expect(pthread_create(&writer, NULL, snapshot_writer_thread, NULL) == 0);
+
+    for (int r = 0; r < 200; r++) {
+        check(nmbs_read_holding_registers(&CLIENT, 100, 125, regs));
+        for (int i = 1; i < 125; i++)
+            expect(regs[i] == regs[0]);
+    }
+
+    __atomic_store_n(&snapshot_writer_stopped, true, __ATOMIC_RELEASE);
+    expect(pthread_join(writer, NULL) == 0);
+
+    stop_client_and_server();
+}
+
+int change_notifications = 0;
+
+void change_notify(void* arg) {
+    UNUSED_PARAM(arg);
+    __atomic_add_fetch(&change_notifications, 1, __ATOMIC_RELEASE);
+}
+
+nmbs_error write_file_record_ok(uint16_t file_number, uint16_t record_number, const uint16_t* registers,
+                                uint16_t count, uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(file_number);
+    UNUSED_PARAM(record_number);
+    UNUSED_PARAM(registers);
+    UNUSED_PARAM(count);
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_server_change_log(nmbs_transport transport) {
+    nmbs_bitfield_65536 coils = {0};
+    uint16_t registers[100] = {0};
+    nmbs_register_store registers_store;
+    nmbs_change entries[8];
+    nmbs_change_log log;
+    nmbs_change changes[8];
+    bool overflow = true;
+
+    should("check parameters and fail to create a change log");
+    expect(nmbs_change_log_create(&log, NULL, 8, NULL, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_change_log_create(&log, entries, 1, NULL, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_change_log_create(&log, entries, 8, change_notify, NULL));
+    check(nmbs_register_store_create(&registers_store, registers, 0, 100));
+    change_notifications = 0;
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.write_file_record = write_file_record_ok;
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_coils_bitfield(&SERVER, coils);
+    nmbs_set_holding_registers_store(&SERVER, &registers_store);
+    nmbs_set_change_log(&SERVER, &log);
+
+    should("drain nothing when no writes happened");
+    expect(nmbs_change_log_drain(&log, changes, 8, &overflow) == 0);
+    expect(!overflow);
+
+    should("record the ranges changed by write requests");
+    nmbs_bitfield bf = {0};
+    check(nmbs_write_single_coil(&CLIENT, 10, true));
+    check(nmbs_write_single_register(&CLIENT, 20, 1));
+    check(nmbs_write_multiple_coils(&CLIENT, 100, 16, bf));
+    check(nmbs_write_multiple_registers(&CLIENT, 30, 5, (uint16_t[]){1, 2, 3, 4, 5}));
+    check(nmbs_write_file_record(&CLIENT, 1, 7, (uint16_t[]){1, 2}, 2));
+    check(nmbs_read_write_registers(&CLIENT, 0, 1, registers, 50, 2, (uint16_t[]){1, 2}));
+    expect(__atomic_load_n(&change_notifications, __ATOMIC_ACQUIRE) == 6);
+
+    expect(nmbs_change_log_drain(&log, changes, 8, &overflow) == 6);
+    expect(!overflow);
+    expect(changes[0].type == NMBS_CHANGE_COILS && changes[0].address == 10 && changes[0].quantity == 1);
+    expect(changes[1].type == NMBS_CHANGE_HOLDING_REGISTERS && changes[1].address == 20 && changes[1].quantity == 1);
+    expect(changes[2].type == NMBS_CHANGE_COILS && changes[2].address == 100 && changes[2].quantity == 16);
+    expect(changes[3].type == NMBS_CHANGE_HOLDING_REGISTERS && changes[3].address == 30 && changes[3].quantity == 5);
+    expect(changes[4].type == NMBS_CHANGE_FILE_RECORD && changes[4].file_number == 1 && changes[4].address == 7 &&
+           changes[4].quantity == 2);
+    expect(changes[5].type == NMBS_CHANGE_HOLDING_REGISTERS && changes[5].address == 50 && changes[5].quantity == 2);
+    expect(changes[0].unit_id == changes[5].unit_id);
+
+    should("not record failed writes");
+    expect(nmbs_write_single_register(&CLIENT, 100, 1) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+    expect(nmbs_change_log_drain(&log, changes, 8, NULL) == 0);
+
+    should("merge adjacent and overlapping changes");
+    check(nmbs_write_single_register(&CLIENT, 60, 1));
+    check(nmbs_write_single_register(&CLIENT, 61, 1));
+    check(nmbs_write_multiple_registers(&CLIENT, 58, 3, (uint16_t[]){1, 2, 3}));
+    check(nmbs_write_single_register(&CLIENT, 70, 1));
+    expect(nmbs_change_log_drain(&log, changes, 8, NULL) == 2);
+    expect(changes[0].address == 58 && changes[0].quantity == 4);
+    expect(changes[1].address == 70 && changes[1].quantity == 1);
+
+    should("keep the changes not fitting in the output array pending");
+    check(nmbs_write_single_register(&CLIENT, 1, 1));
+    check(nmbs_write_single_register(&CLIENT, 3, 1));
+    expect(nmbs_change_log_drain(&log, changes, 1, NULL) == 1);
+    expect(changes[0].address == 1);
+    expect(nmbs_change_log_drain(&log, changes, 8, NULL) == 1);
+    expect(changes[0].address == 3);
+
+    should("report an overflow when the log is full");
+    for (int i = 0; i < 9; i++)
+        check(nmbs_write_single_register(&CLIENT, (uint16_t) (i * 2), 1));
+
+    expect(nmbs_change_log_drain(&log, changes, 8, &overflow) == 7);
+    expect(overflow);
+    expect(nmbs_change_log_drain(&log, changes, 8, &overflow) == 0);
+    expect(!overflow);
+
+    stop_client_and_server();
+}
+
+void test_server_image(nmbs_transport transport) {
+    static uint32_t memory[(NMBS_IMAGE_HEADER_SIZE + 2 * sizeof(nmbs_bitfield_65536) + 200 + 20) / 4];
+    nmbs_image image;
+    nmbs_image producer;
+    uint16_t regs[125];
+    nmbs_bitfield bf;
+
+    should("check parameters and fail to format and attach an image");
+    expect(nmbs_image_size(100, 10) == sizeof(memory));
+    expect(nmbs_image_format(NULL, sizeof(memory), 100, 10) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_image_format(memory, sizeof(memory) - 1, 100, 10) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_image_format(memory, sizeof(memory), 0x10001, 0) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    memset(memory, 0, sizeof(memory));
+    expect(nmbs_image_attach(&image, memory, sizeof(memory)) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_image_format(memory, sizeof(memory), 100, 10));
+    expect(nmbs_image_attach(&image, memory, sizeof(memory) - 1) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("attach to a formatted image with the documented layout");
+    check(nmbs_image_attach(&image, memory, sizeof(memory)));
+    check(nmbs_image_attach(&producer, memory, sizeof(memory)));
+    expect(memory[0] == NMBS_IMAGE_MAGIC);
+    expect((uint8_t*) image.coils == (uint8_t*) memory + NMBS_IMAGE_HEADER_SIZE);
+    expect(image.discrete_inputs == image.coils + sizeof(nmbs_bitfield_65536));
+    expect((uint8_t*) image.holding_registers.registers == image.discrete_inputs + sizeof(nmbs_bitfield_65536));
+    expect(image.input_registers.registers == image.holding_registers.registers + 100);
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_image(&SERVER, &image);
+
+    should("serve data written to the image by a producer");
+    nmbs_image_write_begin(&producer);
+    nmbs_bitfield_set(producer.coils, 65535);
+    nmbs_bitfield_set(producer.discrete_inputs, 3);
+    nmbs_image_write_end(&producer);
+    check(nmbs_register_store_write(&producer.input_registers, 8, 2, (uint16_t[]){0x1234, 0x5678}));
+
+    check(nmbs_read_coils(&CLIENT, 65534, 2, bf));
+    expect(!nmbs_bitfield_read(bf, 0) && nmbs_bitfield_read(bf, 1));
+    check(nmbs_read_discrete_inputs(&CLIENT, 0, 4, bf));
+    expect(nmbs_bitfield_read(bf, 3));
+    check(nmbs_read_input_registers(&CLIENT, 8, 2, regs));
+    expect(regs[0] == 0x1234 && regs[1] == 0x5678);
+    expect(nmbs_read_input_registers(&CLIENT, 9, 2, regs) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("make data written by clients visible to the producer");
+    check(nmbs_write_single_coil(&CLIENT, 7, true));
+    check(nmbs_write_multiple_registers(&CLIENT, 98, 2, (uint16_t[]){1, 2}));
+
+    uint32_t begin;
+    bool coil;
+    do {
+        begin = nmbs_image_read_begin(&producer);
+        coil = nmbs_bitfield_read(producer.coils, 7);
+    } while (nmbs_image_read_retry(&producer, begin));
+    expect(coil);
+
+    check(nmbs_register_store_read(&producer.holding_registers, 98, 2, regs));
+    expect(regs[0] == 1 && regs[1] == 2);
+
+    stop_client_and_server();
+
+    should("recover an image left locked by a terminated writer");
+    nmbs_image_write_begin(&producer);
+    nmbs_image_recover(&image);
+    check(nmbs_register_store_read(&image.holding_registers, 98, 2, regs));
+    expect(regs[0] == 1 && regs[1] == 2);
+}
+
+int cached_reads = 0;
+
+nmbs_error read_registers_counted(uint16_t address, uint16_t quantity, uint16_t* registers_out, uint8_t unit_id,
+                                  void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (address + quantity > 200)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    for (int i = 0; i < quantity; i++)
+        registers_out[i] = store_registers[address + i];
+
+    cached_reads++;
+    return NMBS_ERROR_NONE;
+}
+
+nmbs_error read_coils_counted(uint16_t address, uint16_t quantity, nmbs_bitfield coils_out, uint8_t unit_id,
+                              void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    for (int i = 0; i < quantity; i++)
+        nmbs_bitfield_write(coils_out, i, (address + i) % 3 == 0);
+
+    cached_reads++;
+    return NMBS_ERROR_NONE;
+}
+
+nmbs_error write_registers_plain(uint16_t address, uint16_t quantity, const uint16_t* registers, uint8_t unit_id,
+                                 void* arg) {
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    for (int i = 0; i < quantity; i++)
+        store_registers[address + i] = registers[i];
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_server_response_cache(nmbs_transport transport) {
+    nmbs_response_cache_entry entries[3];
+    nmbs_response_cache cache;
+    uint16_t regs[125];
+    nmbs_bitfield bf;
+
+    should("check parameters and fail to create a response cache");
+    expect(nmbs_response_cache_create(&cache, NULL, 3) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_response_cache_create(&cache, entries, 0) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_response_cache_create(&cache, entries, 3));
+    expect(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 5, 0, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 3, 0, 126) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 1, 0, 2001) == NMBS_ERROR_INVALID_ARGUMENT);
+    check(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 3, 10, 100));
+    check(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 3, 150, 2));
+    check(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 1, 0, 2000));
+    expect(nmbs_response_cache_add(&cache, TEST_SERVER_ADDR, 3, 0, 1) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    for (int i = 0; i < 200; i++)
+        store_registers[i] = (uint16_t) i;
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_holding_registers = read_registers_counted;
+    callbacks.read_coils = read_coils_counted;
+    callbacks.write_multiple_registers = write_registers_plain;
+    start_client_and_server(transport, &callbacks);
+    nmbs_set_response_cache(&SERVER, &cache);
+    cached_reads = 0;
+
+    should("serve repeated requests from the cache");
+    for (int r = 0; r < 3; r++) {
+        memset(regs, 0, sizeof(regs));
+        check(nmbs_read_holding_registers(&CLIENT, 10, 100, regs));
+        for (int i = 0; i < 100; i++)
+            expect(regs[i] == 10 + i);
+
+        check(nmbs_read_coils(&CLIENT, 0, 2000, bf));
+        for (int i = 0; i < 2000; i++)
+            expect(nmbs_bitfield_read(bf, i) == (i % 3 == 0));
+    }
+    expect(cached_reads == 2);
+
+    should("not cache requests not added to the cache");
+    check(nmbs_read_holding_registers(&CLIENT, 10, 99, regs));
+    check(nmbs_read_holding_registers(&CLIENT, 10, 99, regs));
+    expect(cached_reads == 4);
+
+    should("invalidate entries overlapping a write request");
+    check(nmbs_read_holding_registers(&CLIENT, 150, 2, regs));
+    expect(cached_reads == 5);
+
+    check(nmbs_write_multiple_registers(&CLIENT, 109, 2, (uint16_t[]){0xAAAA, 0xBBBB}));
+    check(nmbs_read_holding_registers(&CLIENT, 10, 100, regs));
+    expect(regs[99] == 0xAAAA);
+    check(nmbs_read_holding_registers(&CLIENT, 150, 2, regs));
+    expect(cached_reads == 6);
+
+    should("invalidate entries explicitly");
+    store_registers[150] = 0x1234;
+    check(nmbs_read_holding_registers(&CLIENT, 150, 2, regs));
+    expect(regs[0] == 150);
+
+    nmbs_response_cache_invalidate(&cache, 1, 150, 1);
+    nmbs_response_cache_invalidate(&cache, 3, 149, 1);
+    check(nmbs_read_holding_registers(&CLIENT, 150, 2, regs));
+    expect(regs[0] == 150);
+
+    nmbs_response_cache_invalidate(&cache, 3, 151, 10);
+    check(nmbs_read_holding_registers(&CLIENT, 150, 2, regs));
+    expect(regs[0] == 0x1234);
+    expect(cached_reads == 7);
+
+    nmbs_response_cache_invalidate_all(&cache);
+    check(nmbs_read_holding_registers(&CLIENT, 10, 100, regs));
+    check(nmbs_read_coils(&CLIENT, 0, 2000, bf));
+    expect(cached_reads == 9);
+
+    stop_client_and_server();
+}
+
+nmbs_pool_buffer pool_buffers[4];
+nmbs_buffer_pool buffer_pool;
+
+void* buffer_pool_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    for (int i = 0; i < 10000; i++) {
+        uint8_t* buf = nmbs_buffer_pool_acquire(&buffer_pool);
+        if (!buf) {
+            sched_yield();
+            continue;
+        }
+
+        // A buffer must never be handed out twice
+        memset(buf, 0xAA, NMBS_MSG_BUF_SIZE);
+        for (int b = 0; b < NMBS_MSG_BUF_SIZE; b++)
+            expect(buf[b] == 0xAA);
+        memset(buf, 0x55, NMBS_MSG_BUF_SIZE);
+
+        nmbs_buffer_pool_release(&buffer_pool, buf);
+    }
+
+    return NULL;
+}
+
+
+void test_buffer_pool(void) {
+    uint8_t* bufs[4];
+    nmbs_buffer_pool_stats stats;
+
+    should("check parameters and fail to create a buffer pool");
+    expect(nmbs_buffer_pool_create(&buffer_pool, NULL, 4) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_buffer_pool_create(&buffer_pool, pool_buffers, 0) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_buffer_pool_create(&buffer_pool, pool_buffers, 0xFFFF) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    check(nmbs_buffer_pool_create(&buffer_pool, pool_buffers, 4));
+
+    should("hand out every buffer once, then report exhaustion");
+    for (int i = 0; i < 4; i++) {
+        bufs[i] = nmbs_buffer_pool_acquire(&buffer_pool);
+        expect(bufs[i] != NULL);
+        for (int j = 0; j < i; j++)
+            expect(bufs[i] != bufs[j]);
+    }
+
+    expect(nmbs_buffer_pool_acquire(&buffer_pool) == NULL);
+
+    nmbs_buffer_pool_get_stats(&buffer_pool, &stats);
+    expect(stats.acquired == 4 && stats.exhausted == 1 && stats.in_use == 4 && stats.peak_in_use == 4);
+
+    should("reuse released buffers");
+    nmbs_buffer_pool_release(&buffer_pool, bufs[2]);
+    nmbs_buffer_pool_release(&buffer_pool, bufs[0]);
+    expect(nmbs_buffer_pool_acquire(&buffer_pool) == bufs[0]);
+    expect(nmbs_buffer_pool_acquire(&buffer_pool) == bufs[2]);
+
+    for (int i = 0; i < 4; i++)
+        nmbs_buffer_pool_release(&buffer_pool, bufs[i]);
+
+    nmbs_buffer_pool_get_stats(&buffer_pool, &stats);
+    expect(stats.acquired == 6 && stats.in_use == 0 && stats.peak_in_use == 4);
+
+    should("be shared by multiple threads");
+    check(nmbs_buffer_pool_create(&buffer_pool, pool_buffers, 2));
+
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++)
+        expect(pthread_create(&threads[t], NULL, buffer_pool_thread, NULL) == 0);
+
+    for (int t = 0; t < 4; t++)
+        expect(pthread_join(threads[t], NULL) == 0);
+
+    nmbs_buffer_pool_get_stats(&buffer_pool, &stats);
+    expect(stats.acquired + stats.exhausted == 40000);
+    expect(stats.in_use == 0 && stats.peak_in_use >= 1);
+
+    // Both buffers are back in the pool
+    bufs[0] = nmbs_buffer_pool_acquire(&buffer_pool);
+    bufs[1] = nmbs_buffer_pool_acquire(&buffer_pool);
+    expect(bufs[0] && bufs[1] && bufs[0] != bufs[1]);
+    expect(nmbs_buffer_pool_acquire(&buffer_pool) == NULL);
+}
+
+
+#ifdef NMBS_COMPACT
+uint16_t pool_client_regs[10];
+nmbs_error pool_client_err;
+
+void* buffer_pool_client_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    pool_client_err = nmbs_read_holding_registers(&CLIENT, 0, 10, pool_client_regs);
+    return NULL;
+}
+
+
+void test_server_buffer_pool(nmbs_transport transport) {
+    uint16_t registers[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    nmbs_register_store registers_store;
+    nmbs_buffer_pool_stats stats;
+
+    check(nmbs_register_store_create(&registers_store, registers, 0, 10));
+    check(nmbs_buffer_pool_create(&buffer_pool, pool_buffers, 1));
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    // The server is polled from this thread, so the client runs in its own
+    reset_sockets();
+    reset(SERVER);
+    reset(CLIENT);
+    check(nmbs_server_create(&SERVER, TEST_SERVER_ADDR, platform_conf_socket_server(transport), &callbacks_empty));
+    check(nmbs_client_create(&CLIENT, platform_conf_socket_client(transport)));
+    nmbs_set_buffer_pool(&SERVER, &buffer_pool);
+    nmbs_set_buffer(&CLIENT, client_buf);
+    nmbs_set_holding_registers_store(&SERVER, &registers_store);
+    nmbs_set_destination_rtu_address(&CLIENT, TEST_SERVER_ADDR);
+    nmbs_set_read_timeout(&SERVER, 500);
+    nmbs_set_byte_timeout(&SERVER, 100);
+    nmbs_set_read_timeout(&CLIENT, 5000);
+    nmbs_set_byte_timeout(&CLIENT, 100);
+
+    should("not hold a buffer while idle");
+    check(nmbs_server_poll(&SERVER));
+    nmbs_buffer_pool_get_stats(&buffer_pool, &stats);
+    expect(stats.acquired == 0 && stats.in_use == 0);
+
+    should("return NMBS_ERROR_BUFFER_POOL_EXHAUSTED and keep the request when the pool is empty");
+    uint8_t* held = nmbs_buffer_pool_acquire(&buffer_pool);
+    expect(held != NULL);
+
+    pthread_t client;
+    expect(pthread_create(&client, NULL, buffer_pool_client_thread, NULL) == 0);
+
+    expect(nmbs_server_poll(&SERVER) == NMBS_ERROR_BUFFER_POOL_EXHAUSTED);
+    expect(nmbs_server_poll(&SERVER) == NMBS_ERROR_BUFFER_POOL_EXHAUSTED);
+
+    should("serve the request once a buffer is available, then give it back");
+    nmbs_buffer_pool_release(&buffer_pool, held);
+    check(nmbs_server_poll(&SERVER));
+    expect(pthread_join(client, NULL) == 0);
+
+    check(pool_client_err);
+    for (int i = 0; i < 10; i++)
+        expect(pool_client_regs[i] == i);
+
+    nmbs_buffer_pool_get_stats(&buffer_pool, &stats);
+    expect(stats.acquired == 2 && stats.exhausted == 2 && stats.in_use == 0 && stats.peak_in_use == 1);
+
+    should("count the request left in the transport once as an overrun");
+    nmbs_diagnostic_counters counters;
+    nmbs_server_get_diagnostics(&SERVER, &counters);
+    expect(counters.overruns == 1);
+}
+#endif
+
+uint8_t* split_frame;
+uint16_t split_frame_len;
+
+void* split_frame_writer_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    usleep(20000);
+    expect(write_fd(sockets[1], split_frame, split_frame_len, 1000) == split_frame_len);
+    return NULL;
+}
+
+
+int rx_reads = 0;
+
+int32_t read_socket_server_counted(uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    rx_reads++;
+    return read_socket_server(buf, count, timeout_ms, arg);
+}
+
+
+// Builds a request frame for FCs taking an address and a quantity or value, returns its length
+uint16_t request_frame(nmbs_transport transport, uint16_t tid, uint8_t fc, uint16_t address, uint16_t quantity,
+                       uint8_t* frame) {
+    uint16_t len = 0;
+    if (transport == NMBS_TRANSPORT_TCP) {
+        const uint8_t mbap[] = {(uint8_t) (tid >> 8), (uint8_t) tid, 0, 0, 0, 6};
+        memcpy(frame, mbap, sizeof(mbap));
+        len = sizeof(mbap);
+    }
+
+    const uint8_t pdu[] = {TEST_SERVER_ADDR,          fc, (uint8_t) (address >> 8), (uint8_t) address,
+                           (uint8_t) (quantity >> 8), (uint8_t) quantity};
+    memcpy(frame + len, pdu, sizeof(pdu));
+    len += sizeof(pdu);
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        uint16_t crc = nmbs_crc_calc(frame, len, NULL);
+        frame[len++] = (uint8_t) (crc >> 8);
+        frame[len++] = (uint8_t) crc;
+    }
+
+    return len;
+}
+
+
+void test_server_rx_buffer(nmbs_transport transport) {
+    uint16_t registers[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+    nmbs_register_store registers_store;
+    uint8_t rx_buf[512];
+    uint8_t frames[64];
+    uint8_t res[64];
+
+    check(nmbs_register_store_create(&registers_store, registers, 0, 10));
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    reset_sockets();
+    reset(SERVER);
+    nmbs_platform_conf* conf = platform_conf_socket_server(transport);
+    conf->read = read_socket_server_counted;
+    check(nmbs_server_create(&SERVER, TEST_SERVER_ADDR, conf, &callbacks_empty));
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&SERVER, server_buf);
+#endif
+    nmbs_set_holding_registers_store(&SERVER, &registers_store);
+    nmbs_set_rx_buffer(&SERVER, rx_buf, sizeof(rx_buf));
+    nmbs_set_read_timeout(&SERVER, 500);
+    nmbs_set_byte_timeout(&SERVER, 100);
+
+    should("serve pipelined requests kept in the receive buffer");
+    uint16_t len = request_frame(transport, 1, 3, 0, 2, frames);
+    len = (uint16_t) (len + request_frame(transport, 2, 3, 5, 3, frames + len));
+    expect(write_fd(sockets[1], frames, len, 1000) == len);
+
+    rx_reads = 0;
+    check(nmbs_server_poll(&SERVER));
+    if (transport == NMBS_TRANSPORT_RTU)
+        check(nmbs_server_poll(&SERVER));
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        // A single read, without waiting, received both requests, handled by a single poll
+        expect(rx_reads == 1);
+
+        const uint8_t expected[] = {0, 1, 0, 0, 0, 7,  TEST_SERVER_ADDR, 3, 4, 0, 0, 0, 1, 0, 2, 0, 0, 0,
+                                    9, TEST_SERVER_ADDR, 3, 6, 0, 5, 0, 6, 0, 7};
+        expect(read_fd(sockets[1], res, sizeof(expected), 1000) == sizeof(expected));
+        expect(memcmp(res, expected, sizeof(expected)) == 0);
+    }
+    else {
+        // RTU frames are delimited by silence, so they are read one at a time
+        expect(rx_reads > 2);
+        expect(read_fd(sockets[1], res, 9 + 11, 1000) == 9 + 11);
+        expect(res[2] == 4 && res[6] == 1);
+        expect(res[9 + 2] == 6 && res[9 + 4] == 5 && res[9 + 8] == 7);
+    }
+
+    should("complete a request split between the receive buffer and the transport");
+    len = request_frame(transport, 3, 3, 9, 1, frames);
+    expect(write_fd(sockets[1], frames, 4, 1000) == 4);
+
+    pthread_t writer;
+    split_frame = frames + 4;
+    split_frame_len = (uint16_t) (len - 4);
+    expect(pthread_create(&writer, NULL, split_frame_writer_thread, NULL) == 0);
+    check(nmbs_server_poll(&SERVER));
+    expect(pthread_join(writer, NULL) == 0);
+
+    uint16_t res_len = transport == NMBS_TRANSPORT_TCP ? 11 : 7;
+    expect(read_fd(sockets[1], res, res_len, 1000) == res_len);
+    expect(res[transport == NMBS_TRANSPORT_TCP ? 10 : 4] == 9);
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        should("discard the bytes read ahead from the previous connection when the platform arg changes");
+        len = request_frame(transport, 5, 3, 0, 1, frames);
+        len = (uint16_t) (len + request_frame(transport, 6, 3, 1, 1, frames + len));
+        expect(write_fd(sockets[1], frames, len - 4, 1000) == len - 4);
+        check(nmbs_server_poll(&SERVER));
+        expect(read_fd(sockets[1], res, 11, 1000) == 11);
+        expect(res[1] == 5);
+
+        // Part of the request with transaction ID 6 was read ahead from the old connection
+        nmbs_set_platform_arg(&SERVER, NULL);
+        len = request_frame(transport, 7, 3, 2, 1, frames);
+        expect(write_fd(sockets[1], frames, len, 1000) == len);
+        check(nmbs_server_poll(&SERVER));
+        expect(read_fd(sockets[1], res, 11, 1000) == 11);
+        expect(res[1] == 7 && res[10] == 2);
+        expect(read_fd(sockets[1], res, 1, 100) == 0);
+    }
+
+    should("not read ahead after the receive buffer is removed");
+    nmbs_set_rx_buffer(&SERVER, NULL, 0);
+    len = request_frame(transport, 4, 3, 0, 1, frames);
+    expect(write_fd(sockets[1], frames, len, 1000) == len);
+    rx_reads = 0;
+    check(nmbs_server_poll(&SERVER));
+    expect(rx_reads > 1);
+}
+
+int tx_writes = 0;
+
+int32_t write_socket_server_counted(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    tx_writes++;
+    return write_socket_server(buf, count, timeout_ms, arg);
+}
+
+
+void test_server_pipelining(nmbs_transport transport) {
+    uint16_t registers[200];
+    nmbs_register_store registers_store;
+    uint8_t rx_buf[512];
+    uint8_t tx_buf[1024];
+    uint8_t frames[128];
+    uint8_t res[1024];
+
+    for (int i = 0; i < 200; i++)
+        registers[i] = (uint16_t) i;
+
+    check(nmbs_register_store_create(&registers_store, registers, 0, 200));
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    reset_sockets();
+    reset(SERVER);
+    nmbs_platform_conf* conf = platform_conf_socket_server(transport);
+    conf->write = write_socket_server_counted;
+    check(nmbs_server_create(&SERVER, TEST_SERVER_ADDR, conf, &callbacks_empty));
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&SERVER, server_buf);
+#endif
+    nmbs_set_holding_registers_store(&SERVER, &registers_store);
+    nmbs_set_rx_buffer(&SERVER, rx_buf, sizeof(rx_buf));
+    nmbs_set_tx_buffer(&SERVER, tx_buf, sizeof(tx_buf));
+    nmbs_set_read_timeout(&SERVER, 500);
+    nmbs_set_byte_timeout(&SERVER, 100);
+
+    uint16_t len = 0;
+    for (uint16_t r = 0; r < 4; r++)
+        len = (uint16_t) (len + request_frame(transport, r, 3, r, 2, frames + len));
+
+    expect(write_fd(sockets[1], frames, len, 1000) == len);
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        should("handle all the buffered requests and send their responses with a single write");
+        tx_writes = 0;
+        check(nmbs_server_poll(&SERVER));
+        expect(tx_writes == 1);
+
+        expect(read_fd(sockets[1], res, 4 * 13, 1000) == 4 * 13);
+        for (int r = 0; r < 4; r++) {
+            const uint8_t* adu = res + r * 13;
+            expect(adu[1] == r && adu[5] == 7 && adu[8] == 4);
+            expect(adu[10] == r && adu[12] == r + 1);
+        }
+
+        should("write the responses as soon as the transmit buffer is full");
+        nmbs_set_tx_buffer(&SERVER, tx_buf, NMBS_MSG_BUF_SIZE);
+        len = 0;
+        for (uint16_t r = 0; r < 3; r++)
+            len = (uint16_t) (len + request_frame(transport, r, 3, 0, 100, frames + len));
+
+        expect(write_fd(sockets[1], frames, len, 1000) == len);
+        tx_writes = 0;
+        check(nmbs_server_poll(&SERVER));
+        expect(tx_writes == 3);
+        expect(read_fd(sockets[1], res, 3 * 209, 1000) == 3 * 209);
+        expect(res[208] == 99 && res[209 + 1] == 1 && res[2 * 209 + 1] == 2);
+    }
+    else {
+        should("handle RTU requests one at a time");
+        for (int r = 0; r < 4; r++) {
+            tx_writes = 0;
+            check(nmbs_server_poll(&SERVER));
+            expect(tx_writes == 1);
+            expect(read_fd(sockets[1], res, 9, 1000) == 9);
+            expect(res[4] == r && res[6] == r + 1);
+        }
+    }
+}
+
+// Reads 3 pipelined FC 03 requests and answers them in reverse order, with registers valued as their address
+void* reorder_server_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint8_t reqs[3 * 12];
+    if (read_fd(sockets[0], reqs, sizeof(reqs), 2000) != sizeof(reqs))
+        return NULL;
+
+    for (int r = 2; r >= 0; r--) {
+        const uint8_t* req = reqs + r * 12;
+        uint16_t address = (uint16_t) (req[8] << 8 | req[9]);
+        uint16_t quantity = (uint16_t) (req[10] << 8 | req[11]);
+        uint16_t length = (uint16_t) (3 + quantity * 2);
+        uint8_t res[9 + 250] = {req[0], req[1], 0, 0, (uint8_t) (length >> 8), (uint8_t) length, req[6], 3,
+                                (uint8_t) (quantity * 2)};
+        for (uint16_t i = 0; i < quantity; i++) {
+            res[9 + i * 2] = (uint8_t) ((address + i) >> 8);
+            res[10 + i * 2] = (uint8_t) (address + i);
+        }
+
+        expect(write_fd(sockets[0], res, (uint16_t) (6 + length), 1000) == 6 + length);
+    }
+
+    return NULL;
+}
+
+
+// Reads 5 pipelined FC 03 requests and answers them in order, with an exception to the second one, then answers a
+// single request
+void* exception_server_thread(void* arg) {
+    UNUSED_PARAM(arg);
+    uint8_t reqs[5 * 12];
+    if (read_fd(sockets[0], reqs, sizeof(reqs), 2000) != sizeof(reqs))
+        return NULL;
+
+    for (int r = 0; r < 6; r++) {
+        const uint8_t* req = reqs + r * 12;
+        if (r == 5) {
+            if (read_fd(sockets[0], reqs, 12, 2000) != 12)
+                return NULL;
+
+            req = reqs;
+        }
+
+        uint16_t quantity = (uint16_t) (req[10] << 8 | req[11]);
+        uint16_t length = (uint16_t) (3 + quantity * 2);
+        uint8_t res[9 + 250] = {req[0], req[1], 0, 0, (uint8_t) (length >> 8), (uint8_t) length, req[6], 3,
+                                (uint8_t) (quantity * 2)};
+        if (r == 1) {
+            length = 3;
+            res[5] = 3;
+            res[7] = 0x83;
+            res[8] = NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        }
+        else {
+            for (uint16_t i = 0; i < quantity * 2; i++)
+                res[9 + i] = (uint8_t) r;
+        }
+
+        expect(write_fd(sockets[0], res, (uint16_t) (6 + length), 1000) == 6 + length);
+    }
+
+    return NULL;
+}
+
+
+void test_client_ranges(nmbs_transport transport) {
+    static uint16_t registers[0x10000];
+    static uint16_t registers_out[0x10000];
+    static nmbs_bitfield_65536 coils;
+    static uint8_t coils_out[0x10000 / 8];
+    nmbs_register_store holding_store;
+    nmbs_register_store input_store;
+
+    for (uint32_t i = 0; i < 0x10000; i++)
+        registers[i] = (uint16_t) (i * 7);
+
+    for (uint32_t i = 0; i < sizeof(coils); i++)
+        coils[i] = (uint8_t) (i * 37);
+
+    check(nmbs_register_store_create(&holding_store, registers, 0, 0x10000));
+    check(nmbs_register_store_create(&input_store, registers, 0, 1000));
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_holding_registers_store(&SERVER, &holding_store);
+    nmbs_set_input_registers_store(&SERVER, &input_store);
+    nmbs_set_coils_bitfield(&SERVER, coils);
+    nmbs_set_discrete_inputs_bitfield(&SERVER, coils);
+    nmbs_set_pipeline_depth(&CLIENT, 80);
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_CLEAR_COUNTERS, 0, NULL));
+    server_requests();
+
+    should("immediately return NMBS_ERROR_INVALID_ARGUMENT for empty ranges or ranges past address 65535");
+    expect(nmbs_read_holding_registers_range(&CLIENT, 0, 0, registers_out) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_read_holding_registers_range(&CLIENT, 1, 0x10000, registers_out) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_write_multiple_coils_range(&CLIENT, 0, 8, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(server_requests() == 0);
+
+    should("read 10000 registers with 80 requests");
+    memset(registers_out, 0, sizeof(registers_out));
+    check(nmbs_read_holding_registers_range(&CLIENT, 100, 10000, registers_out));
+    expect(server_requests() == 80);
+    expect(memcmp(registers_out, &registers[100], 10000 * 2) == 0);
+
+    should("read the whole address space");
+    memset(registers_out, 0, sizeof(registers_out));
+    check(nmbs_read_holding_registers_range(&CLIENT, 0, 0x10000, registers_out));
+    expect(memcmp(registers_out, registers, sizeof(registers)) == 0);
+
+    should("read ranges of coils and discrete inputs, clearing the bits past the range");
+    memset(coils_out, 0xFF, sizeof(coils_out));
+    check(nmbs_read_coils_range(&CLIENT, 16, 5003, coils_out));
+    expect(memcmp(coils_out, &coils[2], 625) == 0);
+    expect(coils_out[625] == (coils[627] & 0x07));
+    expect(coils_out[626] == 0xFF);
+
+    memset(coils_out, 0, sizeof(coils_out));
+    check(nmbs_read_discrete_inputs_range(&CLIENT, 0, 0x10000, coils_out));
+    expect(memcmp(coils_out, coils, sizeof(coils)) == 0);
+
+    should("write ranges of registers and coils");
+    server_requests();
+    for (uint32_t i = 0; i < 5000; i++)
+        registers_out[i] = (uint16_t) ~i;
+
+    check(nmbs_write_multiple_registers_range(&CLIENT, 1000, 5000, registers_out));
+    expect(server_requests() == 41);
+    expect(memcmp(&registers[1000], registers_out, 5000 * 2) == 0);
+
+    for (uint32_t i = 0; i < 500; i++)
+        coils_out[i] = (uint8_t) ~i;
+
+    check(nmbs_write_multiple_coils_range(&CLIENT, 800, 4000, coils_out));
+    expect(memcmp(&coils[100], coils_out, 500) == 0);
+
+    should("return the exception of the server");
+    expect(nmbs_read_input_registers_range(&CLIENT, 0, 2000, registers_out) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    stop_client_and_server();
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        should("match the pipelined responses to their requests in any order");
+        pthread_t reorder_thread;
+        nmbs_set_pipeline_depth(&CLIENT, 3);
+        memset(registers_out, 0, sizeof(registers_out));
+        expect(pthread_create(&reorder_thread, NULL, reorder_server_thread, NULL) == 0);
+        check(nmbs_read_holding_registers_range(&CLIENT, 0, 300, registers_out));
+        expect(pthread_join(reorder_thread, NULL) == 0);
+        for (uint16_t i = 0; i < 300; i++)
+            expect(registers_out[i] == i);
+
+        should("receive the pipelined responses in flight before returning an exception");
+        pthread_t exception_thread;
+        nmbs_set_pipeline_depth(&CLIENT, 5);
+        expect(pthread_create(&exception_thread, NULL, exception_server_thread, NULL) == 0);
+        expect(nmbs_read_holding_registers_range(&CLIENT, 0, 5 * 125, registers_out) ==
+               NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        check(nmbs_read_holding_registers(&CLIENT, 0, 2, registers_out));
+        expect(pthread_join(exception_thread, NULL) == 0);
+        expect(registers_out[0] == 0x0505 && registers_out[1] == 0x0505);
+    }
+}
+
+
+void test_scan_plan(void) {
+    uint16_t values[16][4];
+    nmbs_scan_point points[16];
+    nmbs_scan_request requests[16];
+    nmbs_scan_options options;
+    nmbs_scan_plan plan;
+
+    nmbs_scan_options_create(&options, NMBS_TRANSPORT_RTU);
+
+    should("fail to plan invalid points");
+    nmbs_scan_point invalid[] = {
+            {values[0], 0, 1, 1, 5}, {values[0], 0, 0, 1, 3},     {values[0], 0xFFFF, 2, 1, 3},
+            {NULL, 0, 1, 1, 3},      {values[0], 0, 126, 1, 4},
+    };
+    for (int i = 0; i < 5; i++)
+        expect(nmbs_scan_plan_create(&plan, &invalid[i], 1, requests, 16, &options) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("sort the points and merge them into requests, reading through cheap gaps");
+    nmbs_scan_point list[] = {
+            {values[0], 100, 1, 1, 3}, {values[1], 20, 1, 1, 3}, {values[2], 11, 2, 1, 3},   {values[3], 10, 1, 1, 3},
+            {values[4], 150, 1, 1, 1}, {values[5], 0, 1, 1, 1},  {values[6], 10, 2, 2, 3},   {values[7], 11, 4, 1, 3},
+            {values[8], 0, 100, 1, 4}, {values[9], 100, 30, 1, 4},
+    };
+    memcpy(points, list, sizeof(list));
+    check(nmbs_scan_plan_create(&plan, points, 10, requests, 16, &options));
+    expect(plan.points_count == 10);
+    expect(plan.requests_count == 6);
+
+    // Coils 0 and 150 cost 17 more response bytes read together than apart, less than a frame
+    expect(requests[0].fc == 1 && requests[0].address == 0 && requests[0].quantity == 151);
+    expect(requests[0].points_count == 2 && points[requests[0].first_point + 1].address == 150);
+
+    expect(requests[1].fc == 3 && requests[1].address == 10 && requests[1].quantity == 11);
+    expect(requests[1].points_count == 4);
+    expect(points[2].values == values[3] && points[3].address == 11 && points[5].address == 20);
+
+    expect(requests[2].fc == 3 && requests[2].address == 100 && requests[2].quantity == 1);
+
+    // The max registers per request are exceeded
+    expect(requests[3].fc == 4 && requests[3].address == 0 && requests[3].quantity == 100);
+    expect(requests[4].fc == 4 && requests[4].address == 100 && requests[4].quantity == 30);
+
+    expect(requests[5].unit_id == 2 && requests[5].address == 10 && requests[5].quantity == 2);
+
+    should("only merge adjacent or overlapping points with a frame cost of 0");
+    options.frame_cost = 0;
+    memcpy(points, list, sizeof(list));
+    check(nmbs_scan_plan_create(&plan, points, 10, requests, 16, &options));
+    expect(plan.requests_count == 8);
+    expect(requests[2].fc == 3 && requests[2].address == 10 && requests[2].quantity == 5);
+    expect(requests[2].points_count == 3);
+
+    should("fail to plan when the requests array is too short");
+    memcpy(points, list, sizeof(list));
+    expect(nmbs_scan_plan_create(&plan, points, 10, requests, 7, &options) == NMBS_ERROR_INVALID_ARGUMENT);
+}
+
+
+void test_scan(nmbs_transport transport) {
+    static uint16_t registers[1000];
+    static nmbs_bitfield_65536 coils;
+    uint16_t values[6][4];
+    nmbs_register_store holding_store;
+    nmbs_register_store input_store;
+    nmbs_scan_options options;
+    nmbs_scan_plan plan;
+    nmbs_scan_request requests[6];
+
+    for (uint16_t i = 0; i < 1000; i++)
+        registers[i] = (uint16_t) (i * 3);
+
+    memset(coils, 0, sizeof(coils));
+    nmbs_bitfield_set(coils, 3);
+    nmbs_bitfield_set(coils, 41);
+
+    check(nmbs_register_store_create(&holding_store, registers, 0, 1000));
+    check(nmbs_register_store_create(&input_store, registers, 0, 100));
+
+    nmbs_scan_point points[] = {
+            {values[0], 500, 2, TEST_SERVER_ADDR, 3}, {values[1], 3, 2, TEST_SERVER_ADDR, 1},
+            {values[2], 504, 4, TEST_SERVER_ADDR, 3}, {values[3], 40, 2, TEST_SERVER_ADDR, 2},
+            {values[4], 120, 1, TEST_SERVER_ADDR, 4}, {values[5], 10, 1, TEST_SERVER_ADDR, 4},
+    };
+
+    nmbs_scan_options_create(&options, transport);
+    check(nmbs_scan_plan_create(&plan, points, 6, requests, 6, &options));
+    expect(plan.requests_count == 5);
+
+    nmbs_callbacks callbacks_empty;
+    nmbs_callbacks_create(&callbacks_empty);
+
+    start_client_and_server(transport, &callbacks_empty);
+    nmbs_set_holding_registers_store(&SERVER, &holding_store);
+    nmbs_set_input_registers_store(&SERVER, &input_store);
+    nmbs_set_coils_bitfield(&SERVER, coils);
+    nmbs_set_discrete_inputs_bitfield(&SERVER, coils);
+
+    should("decode the responses into the points and store the result of each request");
+    memset(values, 0xFF, sizeof(values));
+    expect(nmbs_scan(&CLIENT, &plan) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    const nmbs_scan_point* p = plan.points;
+    expect(p[0].address == 3 && p[0].values[0] == 1 && p[0].values[1] == 0);
+    expect(p[1].address == 40 && p[1].values[0] == 0 && p[1].values[1] == 1);
+    expect(p[2].address == 500 && p[2].values[0] == 1500 && p[2].values[1] == 1503);
+    expect(p[3].address == 504 && p[3].values[0] == 1512 && p[3].values[3] == 1521);
+    expect(p[4].address == 10 && p[4].values[0] == 30);
+    expect(p[5].address == 120 && p[5].values[0] == 0xFFFF);
+
+    expect(requests[2].points_count == 2 && requests[2].quantity == 8 && requests[2].error == NMBS_ERROR_NONE);
+    expect(requests[3].error == NMBS_ERROR_NONE);
+    expect(requests[4].error == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("scan again with fresh values");
+    registers[505] = 7;
+    check(nmbs_scan_plan_create(&plan, points, 4, requests, 6, &options));
+    check(nmbs_scan(&CLIENT, &plan));
+    expect(p[3].values[1] == 7);
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("not broadcast reads and restore the destination address");
+        nmbs_scan_point broadcast[] = {
+                {values[0], 10, 1, NMBS_BROADCAST_ADDRESS, 3},
+                {values[1], 10, 1, TEST_SERVER_ADDR, 3},
+        };
+        check(nmbs_scan_plan_create(&plan, broadcast, 2, requests, 6, &options));
+        expect(nmbs_scan(&CLIENT, &plan) == NMBS_ERROR_INVALID_ARGUMENT);
+        expect(requests[0].error == NMBS_ERROR_INVALID_ARGUMENT);
+        expect(requests[1].error == NMBS_ERROR_NONE && values[1][0] == 30);
+        check(nmbs_read_holding_registers(&CLIENT, 10, 1, values[0]));
+    }
+
+    stop_client_and_server();
+}
+
+
+// Simulated RS-485 line with a simulated clock. Servers answer synchronously when the client reads, and time advances
+// by the duration of every frame on the line, of the server turnaround and of the timeouts.
+#define SIM_DEVICES 2
+#define SIM_CHAR_US 95
+#define SIM_TURNAROUND_US 2000
+
+typedef struct sim_buf {
+    uint8_t data[512];
+    uint16_t len;
+} sim_buf;
+
+nmbs_t sim_servers[SIM_DEVICES];
+sim_buf sim_servers_rx[SIM_DEVICES];
+bool sim_servers_down[SIM_DEVICES];
+uint16_t sim_registers[2000];
+sim_buf sim_client_rx;
+uint64_t sim_time_us = 0;
+
+void sim_buf_append(sim_buf* b, const uint8_t* buf, uint16_t count) {
+    expect(b->len + count <= (int) sizeof(b->data));
+    memcpy(b->data + b->len, buf, count);
+    b->len += count;
+}
+
+int32_t sim_buf_take(sim_buf* b, uint8_t* buf, uint16_t count) {
+    uint16_t n = count < b->len ? count : b->len;
+    memcpy(buf, b->data, n);
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+    return n;
+}
+
+int32_t sim_client_write(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    UNUSED_PARAM(timeout_ms);
+    UNUSED_PARAM(arg);
+    sim_time_us += (uint64_t) (count + 4) * SIM_CHAR_US;
+    for (int d = 0; d < SIM_DEVICES; d++) {
+        if (!sim_servers_down[d])
+            sim_buf_append(&sim_servers_rx[d], buf, count);
+    }
+
+    return count;
+}
+
+int32_t sim_client_read(uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    UNUSED_PARAM(arg);
+    for (int d = 0; d < SIM_DEVICES; d++) {
+        for (int i = 0; i < 4 && sim_servers_rx[d].len > 0; i++)
+            nmbs_server_poll(&sim_servers[d]);
+    }
+
+    int32_t n = sim_buf_take(&sim_client_rx, buf, count);
+    if (n < count && timeout_ms > 0)
+        sim_time_us += (uint64_t) timeout_ms * 1000;
+
+    return n;
+}
+
+int32_t sim_server_read(uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    UNUSED_PARAM(timeout_ms);
+    return sim_buf_take(arg, buf, count);
+}
+
+int32_t sim_server_write(const uint8_t* buf, uint16_t count, int32_t timeout_ms, void* arg) {
+    UNUSED_PARAM(timeout_ms);
+    UNUSED_PARAM(arg);
+    sim_time_us += SIM_TURNAROUND_US + (uint64_t) (count + 4) * SIM_CHAR_US;
+    sim_buf_append(&sim_client_rx, buf, count);
+    return count;
+}
+
+uint32_t sim_clock_ms(void* arg) {
+    UNUSED_PARAM(arg);
+    return (uint32_t) (sim_time_us / 1000);
+}
+
+// Creates the servers of units 1 and 2 on the simulated line, and a client with a read timeout of 200 ms
+void sim_bus_create(nmbs_t* client) {
+    static nmbs_bitfield_65536 coils;
+    static nmbs_register_store store;
+    static nmbs_callbacks callbacks;
+    static nmbs_platform_conf confs[SIM_DEVICES + 1];
+
+    for (uint16_t i = 0; i < 2000; i++)
+        sim_registers[i] = (uint16_t) (i ^ 0x5A5A);
+
+    nmbs_bitfield_set(coils, 5);
+    check(nmbs_register_store_create(&store, sim_registers, 0, 2000));
+    nmbs_callbacks_create(&callbacks);
+
+    // Reset to a clock that wraps around during the test
+    sim_time_us = (uint64_t) (UINT32_MAX - 10000) * 1000;
+    sim_client_rx.len = 0;
+    for (int d = 0; d < SIM_DEVICES; d++) {
+        nmbs_platform_conf_create(&confs[d]);
+        confs[d].transport = NMBS_TRANSPORT_RTU;
+        confs[d].read = sim_server_read;
+        confs[d].write = sim_server_write;
+        confs[d].arg = &sim_servers_rx[d];
+        check(nmbs_server_create(&sim_servers[d], (uint8_t) (d + 1), &confs[d], &callbacks));
+        nmbs_set_read_timeout(&sim_servers[d], 0);
+        nmbs_set_byte_timeout(&sim_servers[d], 0);
+        nmbs_set_holding_registers_store(&sim_servers[d], &store);
+        nmbs_set_coils_bitfield(&sim_servers[d], coils);
+        sim_servers_rx[d].len = 0;
+        sim_servers_down[d] = false;
+#ifdef NMBS_COMPACT
+        static uint8_t servers_buf[SIM_DEVICES][NMBS_MSG_BUF_SIZE];
+        nmbs_set_buffer(&sim_servers[d], servers_buf[d]);
+#endif
+    }
+
+    nmbs_platform_conf* client_conf = &confs[SIM_DEVICES];
+    nmbs_platform_conf_create(client_conf);
+    client_conf->transport = NMBS_TRANSPORT_RTU;
+    client_conf->read = sim_client_read;
+    client_conf->write = sim_client_write;
+    check(nmbs_client_create(client, client_conf));
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(client, client_buf);
+#endif
+    nmbs_set_read_timeout(client, 200);
+    nmbs_set_byte_timeout(client, 10);
+}
+
+// Polls 2 devices at mixed rates, and a missing device, for 65 simulated seconds
+void sim_poll(uint32_t alarm_period_ms, nmbs_poll_group* groups, uint32_t* busy_ms, uint32_t* elapsed_ms) {
+    static uint16_t values[32][100];
+    nmbs_scan_options options;
+    nmbs_t client;
+    sim_bus_create(&client);
+
+    static nmbs_scan_point alarm_points[2][2];
+    static nmbs_scan_point process_points[10];
+    static nmbs_scan_point config_points[20];
+    static nmbs_scan_point missing_point;
+    static nmbs_scan_request requests[40];
+    static nmbs_scan_plan plans[5];
+
+    nmbs_scan_options_create(&options, NMBS_TRANSPORT_RTU);
+    for (uint8_t d = 0; d < 2; d++) {
+        alarm_points[d][0] = (nmbs_scan_point){values[d], 0, 8, (uint8_t) (d + 1), 1};
+        alarm_points[d][1] = (nmbs_scan_point){values[d] + 8, 12, 4, (uint8_t) (d + 1), 1};
+        check(nmbs_scan_plan_create(&plans[d], alarm_points[d], 2, &requests[d], 1, &options));
+    }
+
+    for (uint16_t i = 0; i < 10; i++)
+        process_points[i] = (nmbs_scan_point){values[2 + i], (uint16_t) (i * 150), 2, 2, 3};
+
+    check(nmbs_scan_plan_create(&plans[2], process_points, 10, &requests[2], 10, &options));
+
+    for (uint16_t i = 0; i < 20; i++)
+        config_points[i] = (nmbs_scan_point){values[12 + i], (uint16_t) (i * 100), 100, 1, 3};
+
+    check(nmbs_scan_plan_create(&plans[3], config_points, 20, &requests[12], 20, &options));
+
+    missing_point = (nmbs_scan_point){values[0], 0, 1, 3, 3};
+    check(nmbs_scan_plan_create(&plans[4], &missing_point, 1, &requests[39], 1, &options));
+
+    const uint32_t periods[5] = {alarm_period_ms, alarm_period_ms, 1000, 60000, 1000};
+    const int32_t timeouts[5] = {0, 0, 0, 0, 20};
+    const uint8_t priorities[5] = {0, 0, 1, 2, 1};
+    for (int g = 0; g < 5; g++) {
+        memset(&groups[g], 0, sizeof(nmbs_poll_group));
+        groups[g].plan = &plans[g];
+        groups[g].period_ms = periods[g];
+        groups[g].timeout_ms = timeouts[g];
+        groups[g].priority = priorities[g];
+    }
+
+    nmbs_poll_group* heap[5];
+    nmbs_poll_scheduler sched;
+    check(nmbs_poll_scheduler_create(&sched, &client, groups, 5, heap, sim_clock_ms, NULL));
+
+    uint32_t start = sim_clock_ms(NULL);
+    while ((uint32_t) (sim_clock_ms(NULL) - start) < 65000) {
+        uint32_t wait_ms = 0;
+        nmbs_poll_scheduler_run(&sched, &wait_ms);
+        sim_time_us += (uint64_t) wait_ms * 1000;
+    }
+
+    nmbs_poll_scheduler_get_utilization(&sched, busy_ms, elapsed_ms);
+
+    for (uint16_t i = 0; i < 20; i++)
+        expect(memcmp(config_points[i].values, &sim_registers[config_points[i].address], 200) == 0);
+
+    expect(values[0][5] == 1 && values[0][4] == 0);
+}
+
+void test_poll_scheduler(void) {
+    nmbs_poll_group groups[5];
+    nmbs_poll_group again[5];
+    uint32_t busy_ms = 0;
+    uint32_t elapsed_ms = 0;
+
+    should("fail to create a scheduler with invalid groups");
+    nmbs_t client;
+    nmbs_scan_plan plan = {NULL, NULL, 0, 0};
+    nmbs_poll_group invalid = {&plan, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    nmbs_poll_group* heap[1];
+    nmbs_poll_scheduler sched;
+    expect(nmbs_poll_scheduler_create(&sched, &client, &invalid, 1, heap, sim_clock_ms, NULL) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    invalid.period_ms = 10;
+    invalid.plan = NULL;
+    expect(nmbs_poll_scheduler_create(&sched, &client, &invalid, 1, heap, sim_clock_ms, NULL) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("meet the periods of every group, interleaving the long config poll");
+    sim_poll(100, groups, &busy_ms, &elapsed_ms);
+    for (int g = 0; g < 5; g++)
+        expect(groups[g].missed == 0);
+
+    expect(groups[0].polls >= 649 && groups[0].polls <= 650);
+    expect(groups[1].polls == groups[0].polls);
+    expect(groups[0].max_response_ms < 100);
+    expect(groups[2].polls == 65 && groups[2].errors == 0 && groups[2].timeouts == 0);
+    expect(groups[3].polls == 2);
+
+    should("count the timeouts of a missing device");
+    expect(groups[4].polls == 65 && groups[4].timeouts == 65 && groups[4].errors == 0);
+
+    should("report the bus utilization");
+    expect(elapsed_ms >= 65000 && elapsed_ms < 65100);
+    expect(busy_ms > 65 * 20 && busy_ms < elapsed_ms / 2);
+
+    should("run deterministically");
+    uint32_t busy_again_ms = 0;
+    uint32_t elapsed_again_ms = 0;
+    sim_poll(100, again, &busy_again_ms, &elapsed_again_ms);
+    expect(memcmp(groups, again, sizeof(groups)) == 0);
+    expect(busy_again_ms == busy_ms && elapsed_again_ms == elapsed_ms);
+
+    should("report missed deadlines when the bus is overloaded");
+    sim_poll(5, groups, &busy_ms, &elapsed_ms);
+    expect(groups[0].missed > 0 && groups[3].missed > 0);
+    expect(groups[0].polls + groups[0].missed >= 12999);
+    expect(busy_ms >= elapsed_ms - 10);
+}
+
+void test_adaptive_timeouts(void) {
+    nmbs_device_timing devices[4];
+    nmbs_adaptive_timeouts at;
+    uint16_t value = 0;
+    nmbs_t client;
+
+    should("fail to create adaptive timeouts with invalid arguments");
+    expect(nmbs_adaptive_timeouts_create(&at, NULL, 3, sim_clock_ms, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_adaptive_timeouts_create(&at, devices, 0, sim_clock_ms, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_adaptive_timeouts_create(&at, devices, 257, sim_clock_ms, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_adaptive_timeouts_create(&at, devices, 3, NULL, NULL) == NMBS_ERROR_INVALID_ARGUMENT);
+
+    should("start with the max timeout for every tracked device");
+    sim_bus_create(&client);
+    check(nmbs_adaptive_timeouts_create(&at, devices, 3, sim_clock_ms, NULL));
+    nmbs_set_adaptive_timeouts(&client, &at);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 1) == 1000);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 3) == -1);
+
+    should("adapt the timeout of a device to its response time");
+    nmbs_set_destination_rtu_address(&client, 1);
+    for (int i = 0; i < 20; i++) {
+        check(nmbs_read_holding_registers(&client, (uint16_t) i, 1, &value));
+        expect(value == sim_registers[i]);
+    }
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 1) == 10);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 1000);
+
+    should("back off the timeout of a device not responding");
+    nmbs_set_destination_rtu_address(&client, 2);
+    check(nmbs_read_holding_registers(&client, 0, 1, &value));
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 10);
+
+    sim_servers_down[1] = true;
+    uint64_t start_us = sim_time_us;
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_TIMEOUT);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 20);
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_TIMEOUT);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 40);
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_TIMEOUT);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 80);
+    expect(sim_time_us - start_us < 80000);
+
+    should("skip a device after repeated timeouts, without using the bus");
+    start_us = sim_time_us;
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_CIRCUIT_OPEN);
+    expect(nmbs_write_single_register(&client, 0, 0) == NMBS_ERROR_CIRCUIT_OPEN);
+    expect(sim_time_us == start_us);
+
+    nmbs_set_destination_rtu_address(&client, 1);
+    check(nmbs_read_holding_registers(&client, 0, 1, &value));
+
+    should("let a probe through after the open time, and keep skipping the device if it fails");
+    nmbs_set_destination_rtu_address(&client, 2);
+    sim_time_us += 5000 * 1000;
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_TIMEOUT);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 160);
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_CIRCUIT_OPEN);
+
+    should("close the breaker when the probe succeeds");
+    sim_servers_down[1] = false;
+    sim_time_us += 5000 * 1000;
+    check(nmbs_read_holding_registers(&client, 0, 1, &value));
+    expect(value == sim_registers[0]);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 2) == 10);
+    check(nmbs_read_holding_registers(&client, 1, 1, &value));
+
+    should("use the read timeout of the instance without adaptive timeouts");
+    nmbs_set_adaptive_timeouts(&client, NULL);
+    sim_servers_down[1] = true;
+    start_us = sim_time_us;
+    expect(nmbs_read_holding_registers(&client, 0, 1, &value) == NMBS_ERROR_TIMEOUT);
+    expect(sim_time_us - start_us >= 200000);
+
+    should("cap the timeout of a device with the timeout of its poll group");
+    nmbs_scan_point points[2];
+    nmbs_scan_request requests[2];
+    nmbs_scan_plan plans[2];
+    nmbs_scan_options options;
+    uint16_t values[2];
+    nmbs_poll_group groups[2];
+    nmbs_poll_group* heap[2];
+    nmbs_poll_scheduler sched;
+
+    sim_bus_create(&client);
+    check(nmbs_adaptive_timeouts_create(&at, devices, 4, sim_clock_ms, NULL));
+    nmbs_set_adaptive_timeouts(&client, &at);
+
+    nmbs_scan_options_create(&options, NMBS_TRANSPORT_RTU);
+    for (uint8_t g = 0; g < 2; g++) {
+        points[g] = (nmbs_scan_point){&values[g], 0, 1, (uint8_t) (g * 2 + 1), 3};
+        check(nmbs_scan_plan_create(&plans[g], &points[g], 1, &requests[g], 1, &options));
+        memset(&groups[g], 0, sizeof(nmbs_poll_group));
+        groups[g].plan = &plans[g];
+    }
+
+    groups[0].period_ms = 100;
+    groups[1].period_ms = 1000;
+    groups[1].timeout_ms = 20;
+    check(nmbs_poll_scheduler_create(&sched, &client, groups, 2, heap, sim_clock_ms, NULL));
+
+    uint32_t start = sim_clock_ms(NULL);
+    while ((uint32_t) (sim_clock_ms(NULL) - start) < 10000) {
+        uint32_t wait_ms = 0;
+        nmbs_poll_scheduler_run(&sched, &wait_ms);
+        sim_time_us += (uint64_t) wait_ms * 1000;
+    }
+
+    expect(groups[0].polls == 100 && groups[0].errors == 0 && groups[0].timeouts == 0);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 1) == 10);
+    expect(groups[1].max_response_ms < 30);
+    expect(nmbs_adaptive_timeouts_get_timeout(&at, 3) == 1000);
+
+    should("count the requests skipped by a circuit breaker as errors of their poll group");
+    expect(groups[1].polls == 10 && groups[1].timeouts == 4 && groups[1].errors == 6);
+}
+
+
+nmbs_deferred deferred_tokens[4];
+int deferred_count = 0;
+nmbs_error complete_in_callback = NMBS_ERROR_NONE;
+
+nmbs_error read_registers_deferred(uint16_t address, uint16_t quantity, uint16_t* registers_out, uint8_t unit_id,
+                                   void* arg) {
+    UNUSED_PARAM(address);
+    UNUSED_PARAM(quantity);
+    UNUSED_PARAM(registers_out);
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+    if (deferred_count == 1)
+        complete_in_callback = nmbs_server_complete_registers(&SERVER, &deferred_tokens[0], (uint16_t[]){0, 0});
+
+    return nmbs_server_defer(&SERVER, &deferred_tokens[deferred_count++]);
+}
+
+
+nmbs_error write_register_deferred(uint16_t address, uint16_t value, uint8_t unit_id, void* arg) {
+    UNUSED_PARAM(address);
+    UNUSED_PARAM(value);
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+    return nmbs_server_defer(&SERVER, &deferred_tokens[deferred_count++]);
+}
+
+
+void test_server_deferred(nmbs_transport transport) {
+    uint8_t frames[64];
+    uint8_t res[64];
+    uint16_t len = 0;
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.read_holding_registers = read_registers_deferred;
+    callbacks.write_single_register = write_register_deferred;
+
+    reset_sockets();
+    reset(SERVER);
+    check(nmbs_server_create(&SERVER, TEST_SERVER_ADDR, platform_conf_socket_server(transport), &callbacks));
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&SERVER, server_buf);
+#endif
+    nmbs_set_read_timeout(&SERVER, 500);
+    nmbs_set_byte_timeout(&SERVER, 100);
+    deferred_count = 0;
+    complete_in_callback = NMBS_ERROR_NONE;
+
+    nmbs_comm_event_log log;
+    nmbs_comm_event_log_create(&log);
+    nmbs_set_comm_event_log(&SERVER, &log);
+
+    should("not respond to deferred requests while polling");
+    len = request_frame(transport, 0x0101, 3, 10, 2, frames);
+    len = (uint16_t) (len + request_frame(transport, 0x0202, 3, 20, 1, frames + len));
+    len = (uint16_t) (len + request_frame(transport, 0x0303, 6, 30, 0xABCD, frames + len));
+    expect(write_fd(sockets[1], frames, len, 1000) == len);
+
+    for (int r = 0; r < 3; r++)
+        check(nmbs_server_poll(&SERVER));
+
+    expect(deferred_count == 3);
+    for (int t = 0; t < 3; t++)
+        expect(nmbs_deferred_is_pending(&deferred_tokens[t]));
+
+    expect(read_fd(sockets[1], res, 1, 100) == 0);
+    expect(log.count == 3 && log.event_count == 0);
+
+    should("refuse completing a token from a server callback");
+    expect(complete_in_callback == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_deferred_is_pending(&deferred_tokens[0]));
+
+    should("complete deferred requests out of order, with their transaction IDs");
+    check(nmbs_server_complete_write(&SERVER, &deferred_tokens[2]));
+    check(nmbs_server_complete_registers(&SERVER, &deferred_tokens[1], (uint16_t[]){0x1234}));
+    check(nmbs_server_complete_exception(&SERVER, &deferred_tokens[0], NMBS_EXCEPTION_SERVER_DEVICE_FAILURE));
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        // clang-format off
+        const uint8_t expected[] = {3, 3, 0, 0, 0, 6, TEST_SERVER_ADDR, 6, 0, 30, 0xAB, 0xCD,
+                                    2, 2, 0, 0, 0, 5, TEST_SERVER_ADDR, 3, 2, 0x12, 0x34,
+                                    1, 1, 0, 0, 0, 3, TEST_SERVER_ADDR, 0x83, 4};
+        // clang-format on
+        expect(read_fd(sockets[1], res, sizeof(expected), 1000) == sizeof(expected));
+        expect(memcmp(res, expected, sizeof(expected)) == 0);
+    }
+    else {
+        expect(read_fd(sockets[1], res, 8 + 7 + 5, 1000) == 8 + 7 + 5);
+        expect(res[1] == 6 && res[4] == 0xAB && res[5] == 0xCD);
+        expect(res[8 + 1] == 3 && res[8 + 3] == 0x12 && res[8 + 4] == 0x34);
+        expect(res[15 + 1] == 0x83 && res[15 + 2] == NMBS_EXCEPTION_SERVER_DEVICE_FAILURE);
+    }
+
+    should("log deferred responses when they are sent");
+    expect(log.count == 6 && log.event_count == 2);
+    expect(log.events[3] == NMBS_COMM_EVENT_SEND && log.events[4] == NMBS_COMM_EVENT_SEND);
+    expect(log.events[5] == (NMBS_COMM_EVENT_SEND | NMBS_COMM_EVENT_SEND_ABORT_EXCEPTION));
+
+    should("refuse completing a token twice or with data of another function code");
+    expect(!nmbs_deferred_is_pending(&deferred_tokens[1]));
+    expect(nmbs_server_complete_registers(&SERVER, &deferred_tokens[1], (uint16_t[]){0}) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+
+    len = request_frame(transport, 0x0404, 3, 0, 1, frames);
+    expect(write_fd(sockets[1], frames, len, 1000) == len);
+    check(nmbs_server_poll(&SERVER));
+    expect(nmbs_server_complete_write(&SERVER, &deferred_tokens[3]) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_server_complete_exception(&SERVER, &deferred_tokens[3], NMBS_ERROR_TIMEOUT) ==
+           NMBS_ERROR_INVALID_ARGUMENT);
+    check(nmbs_server_complete_registers(&SERVER, &deferred_tokens[3], (uint16_t[]){0}));
+}
+
+uint8_t waveform[1024];
+
+// Vendor block read: 2 bytes offset and 1 byte count in the request, count and data in the response
+nmbs_error read_waveform_block(uint8_t fc, uint8_t* pdu, uint16_t* length, uint16_t max_length, uint8_t unit_id,
+                               void* arg) {
+    UNUSED_PARAM(fc);
+    UNUSED_PARAM(unit_id);
+    UNUSED_PARAM(arg);
+
+    if (*length != 3)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    uint16_t offset = (uint16_t) (pdu[0] << 8 | pdu[1]);
+    uint8_t count = pdu[2];
+    if (count + 1 > max_length)
+        return NMBS_EXCEPTION_ILLEGAL_DATA_VALUE;
+
+    if (offset + count > (int) sizeof(waveform))
+        return NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    pdu[0] = count;
+    memcpy(pdu + 1, waveform + offset, count);
+    *length = (uint16_t) (count + 1);
+
+    return NMBS_ERROR_NONE;
+}
+
+
+void test_server_fc_table(nmbs_transport transport) {
+    nmbs_fc_table table;
+    uint8_t block[201];
+
+    for (int i = 0; i < (int) sizeof(waveform); i++)
+        waveform[i] = (uint8_t) (i * 7);
+
+    should("check parameters and fail to register a custom function code");
+    nmbs_fc_table_create(&table);
+    expect(nmbs_fc_table_set(&table, 0, read_waveform_block) == NMBS_ERROR_INVALID_ARGUMENT);
+    expect(nmbs_fc_table_set(&table, 128, read_waveform_block) == NMBS_ERROR_INVALID_ARGUMENT);
+    check(nmbs_fc_table_set(&table, 65, read_waveform_block));
+
+    nmbs_callbacks callbacks;
+    nmbs_callbacks_create(&callbacks);
+    callbacks.fc_table = &table;
+    start_client_and_server(transport, &callbacks);
+
+    should("transfer a block across several frames with a custom function code");
+    for (uint16_t offset = 0; offset < sizeof(waveform); offset += 200) {
+        uint8_t count = (uint8_t) (sizeof(waveform) - offset < 200 ? sizeof(waveform) - offset : 200);
+        check(nmbs_send_raw_pdu(&CLIENT, 65, (uint8_t[]){(uint8_t) (offset >> 8), (uint8_t) offset, count}, 3));
+        check(nmbs_receive_raw_pdu_response(&CLIENT, block, (uint8_t) (count + 1)));
+        expect(block[0] == count);
+        expect(memcmp(block + 1, waveform + offset, count) == 0);
+    }
+
+    should("return exceptions from custom function code handlers");
+    check(nmbs_send_raw_pdu(&CLIENT, 65, (uint8_t[]){0x04, 0, 1}, 3));
+    expect(nmbs_receive_raw_pdu_response(&CLIENT, block, 2) == NMBS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+    should("return NMBS_EXCEPTION_ILLEGAL_FUNCTION for unregistered function codes");
+    check(nmbs_send_raw_pdu(&CLIENT, 66, (uint8_t[]){0, 0, 1}, 3));
+    expect(nmbs_receive_raw_pdu_response(&CLIENT, block, 2) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    should("keep handling the function codes implemented by the library");
+    check(nmbs_fc_table_set(&table, 3, read_waveform_block));
+    expect(nmbs_read_holding_registers(&CLIENT, 0, 1, (uint16_t*) block) == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+
+    should("count custom function code requests in the diagnostics counters");
+    uint16_t before = 0;
+    uint16_t after = 0;
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT, 0, &before));
+    check(nmbs_send_raw_pdu(&CLIENT, 65, (uint8_t[]){0, 0, 1}, 3));
+    check(nmbs_receive_raw_pdu_response(&CLIENT, block, 2));
+    check(nmbs_diagnostics(&CLIENT, NMBS_DIAGNOSTICS_SERVER_MESSAGE_COUNT, 0, &after));
+    expect(after == before + 2);
+
+    if (transport == NMBS_TRANSPORT_TCP) {
+        should("reject a custom function code request larger than a PDU, and stay in sync with the stream");
+        uint8_t frame[6 + 255];
+        memset(frame, 0xA5, sizeof(frame));
+        const uint8_t mbap[] = {0x12, 0x34, 0, 0, 0, 255, TEST_SERVER_ADDR, 65};
+        memcpy(frame, mbap, sizeof(mbap));
+        expect(write_fd(sockets[1], frame, sizeof(frame), 1000) == sizeof(frame));
+
+        uint8_t res[9];
+        const uint8_t exception[] = {0x12, 0x34, 0, 0, 0, 3, TEST_SERVER_ADDR, 65 | 0x80, 3};
+        expect(read_fd(sockets[1], res, sizeof(res), 1000) == sizeof(res));
+        expect(memcmp(res, exception, sizeof(res)) == 0);
+
+        check(nmbs_send_raw_pdu(&CLIENT, 65, (uint8_t[]){0, 0, 1}, 3));
+        check(nmbs_receive_raw_pdu_response(&CLIENT, block, 2));
+        expect(block[0] == 1 && block[1] == waveform[0]);
+    }
+
+    stop_client_and_server();
+
+    if (transport == NMBS_TRANSPORT_RTU) {
+        should("count the custom function code requests received with a CRC error");
+        uint8_t frame[] = {TEST_SERVER_ADDR, 65, 0, 0, 1, 0, 0};
+        uint16_t crc = nmbs_crc_calc(frame, 5, NULL);
+        frame[5] = (uint8_t) (crc >> 8);
+        frame[6] = (uint8_t) ~crc;
+        expect(write_fd(sockets[1], frame, sizeof(frame), 1000) == sizeof(frame));
+
+        nmbs_diagnostic_counters counters;
+        expect(nmbs_server_poll(&SERVER) == NMBS_ERROR_CRC);
+        nmbs_server_get_diagnostics(&SERVER, &counters);
+        expect(counters.bus_errors == 1);
+
+        should("answer custom function codes with NMBS_EXCEPTION_ILLEGAL_FUNCTION without a byte timeout");
+        frame[6] = (uint8_t) crc;
+        expect(write_fd(sockets[1], frame, sizeof(frame), 1000) == sizeof(frame));
+
+        nmbs_set_byte_timeout(&SERVER, -1);
+        check(nmbs_server_poll(&SERVER));
+
+        uint8_t res[5];
+        expect(read_fd(sockets[1], res, sizeof(res), 1000) == sizeof(res));
+        expect(res[0] == TEST_SERVER_ADDR && res[1] == (65 | 0x80) && res[2] == NMBS_EXCEPTION_ILLEGAL_FUNCTION);
+        expect(read_fd(sockets[1], res, 1, 100) == 0);
+    }
+}
+
+nmbs_transport transports[2] = {NMBS_TRANSPORT_RTU, NMBS_TRANSPORT_TCP};
+const char* transports_str[2] = {"RTU", "TCP"};
+
+void for_transports(void (*test_fn)(nmbs_transport), const char* should_str) {
+    for (unsigned long t = 0; t < sizeof(transports) / sizeof(nmbs_transport); t++) {
+        printf("Should %s on %s:\n", should_str, transports_str[t]);
+        test(test_fn(transports[t]));
+    }
+}
+
+int main(int argc, char* argv[]) {
+    UNUSED_PARAM(argc);
+    UNUSED_PARAM(argv);
+
+    for_transports(test_server_create, "create a modbus server");
+
+    for_transports(test_server_receive_base, "receive no messages without failing");
+
+    for_transports(test_fc1, "send and receive FC 01 (0x01) Read Coils");
+
+    for_transports(test_fc2, "send and receive FC 02 (0x02) Read Discrete Inputs");
+
+    for_transports(test_fc3, "send and receive FC 03 (0x03) Read Holding Registers");
+
+    for_transports(test_fc4, "send and receive FC 04 (0x04) Read Input Registers");
+
+    for_transports(test_fc5, "send and receive FC 05 (0x05) Write Single Coil");
+
+    for_transports(test_fc6, "send and receive FC 06 (0x06) Write Single Register");
+
+    for_transports(test_fc7, "send and receive FC 07 (0x07) Read Exception Status");
+
+    for_transports(test_fc8, "send and receive FC 08 (0x08) Diagnostics");
+
+    for_transports(test_fc11, "send and receive FC 11 (0x0B) Get Comm Event Counter");
+
+    for_transports(test_fc12, "send and receive FC 12 (0x0C) Get Comm Event Log");
+
+    for_transports(test_fc15, "send and receive FC 15 (0x0F) Write Multiple Coils");
+
+    for_transports(test_fc16, "send and receive FC 16 (0x10) Write Multiple registers");
+
+    for_transports(test_fc20, "send and receive FC 20 (0x14) Read File Record");
+
+    for_transports(test_fc20_batch, "send and receive batched FC 20 (0x14) Read File Record requests");
+
+    for_transports(test_fc21, "send and receive FC 21 (0x15) Write File Record");
+
+    for_transports(test_fc21_batch, "send and receive batched FC 21 (0x15) Write File Record requests");
+
+    for_transports(test_fc22, "send and receive FC 22 (0x16) Mask Write Register");
+
+    for_transports(test_fc23, "send and receive FC 23 (0x17) Read/Write Multiple Registers");
+
+    printf("Should operate on nmbs_fifo_queue:\n");
+    test(test_fifo_queue());
+
+    for_transports(test_fc24, "send and receive FC 24 (0x18) Read FIFO Queue");
+
+    for_transports(test_fc43_14, "send and receive FC 43 / 14 (0x2B / 0x0E) Read Device Identification");
+
+    for_transports(test_server_device_identification, "serve FC 43 / 14 from nmbs_device_identification");
+
+    printf("Should operate on nmbs_bitfield_65536:\n");
+    test(test_bitfield_65536());
+
+    for_transports(test_server_bitfield_65536, "serve coils and discrete inputs from nmbs_bitfield_65536");
+
+    for_transports(test_server_register_store, "serve registers from nmbs_register_store");
+
+    printf("Should operate on nmbs_snapshot_store:\n");
+    test(test_snapshot_store());
+
+    for_transports(test_server_snapshot_store, "serve registers from nmbs_snapshot_store");
+
+    for_transports(test_server_change_log, "record changed ranges in nmbs_change_log");
+
+    for_transports(test_server_image, "serve data from a register image");
+
+    for_transports(test_server_response_cache, "serve read requests from nmbs_response_cache");
+
+    printf("Should operate on nmbs_buffer_pool:\n");
+    test(test_buffer_pool());
+
+#ifdef NMBS_COMPACT
+    for_transports(test_server_buffer_pool, "borrow message buffers from nmbs_buffer_pool");
+#endif
+
+    for_transports(test_server_rx_buffer, "read ahead pipelined requests into a receive buffer");
+
+    for_transports(test_server_pipelining, "process pipelined requests and coalesce their responses");
+
+    for_transports(test_client_ranges, "split range requests and pipeline them on TCP");
+
+    printf("Should plan scan lists into few requests:\n");
+    test(test_scan_plan());
+
+    for_transports(test_scan, "scan planned point lists");
+
+    printf("Should schedule poll groups on a simulated bus:\n");
+    test(test_poll_scheduler());
+
+    printf("Should adapt the timeouts to each device:\n");
+    test(test_adaptive_timeouts());
+
+    for_transports(test_server_deferred, "send deferred responses on completion");
+
+    for_transports(test_server_fc_table, "handle custom function codes from nmbs_fc_table");
 
     return 0;
 }
@@ -2,6 +2,7 @@
 #undef NDEBUG
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,6 +34,11 @@ pthread_mutex_t server_stopped_m = PTHREAD_MUTEX_INITIALIZER;
 pthread_t server_thread;
 nmbs_t CLIENT, SERVER;
 
+#ifdef NMBS_COMPACT
+uint8_t client_buf[NMBS_MSG_BUF_SIZE];
+uint8_t server_buf[NMBS_MSG_BUF_SIZE];
+#endif
+
 
 #define should(s)                                                                                                      \
     for (unsigned int i = 0; i < nesting; i++) {                                                                       \
@@ -216,6 +222,11 @@ void start_client_and_server(nmbs_transport transport, const nmbs_callbacks* ser
     check(nmbs_server_create(&SERVER, TEST_SERVER_ADDR, platform_conf_socket_server(transport), server_callbacks));
     check(nmbs_client_create(&CLIENT, platform_conf_socket_client(transport)));
 
+#ifdef NMBS_COMPACT
+    nmbs_set_buffer(&SERVER, server_buf);
+    nmbs_set_buffer(&CLIENT, client_buf);
+#endif
+
     nmbs_set_destination_rtu_address(&CLIENT, TEST_SERVER_ADDR);
     nmbs_set_read_timeout(&SERVER, 500);
     nmbs_set_byte_timeout(&SERVER, 100);